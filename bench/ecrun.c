@@ -0,0 +1,44 @@
+/*
+ * ecrun - run a command and record its wall time and peak RSS
+ *
+ * Usage: ecrun <result-file> <command> [args...]
+ * Writes "<wall_ns> <maxrss_kb> <exit_status>" to result-file.
+ *
+ * Spawning from this small process keeps the caller's memory out of the
+ * child's ru_maxrss (Linux charges the pre-exec image to the child).
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+extern char** environ;
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: ecrun <result-file> <command> [args...]\n");
+        return 2;
+    }
+    
+    struct timespec start, end;
+    pid_t pid;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (posix_spawnp(&pid, argv[2], NULL, NULL, argv + 2, environ) != 0) {
+        fprintf(stderr, "ecrun: cannot run '%s'\n", argv[2]);
+        return 2;
+    }
+    
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) return 2;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    FILE* f = fopen(argv[1], "w");
+    if (!f) return 2;
+    long long wall = (long long)(end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    fprintf(f, "%lld %ld %d\n", wall, usage.ru_maxrss, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    fclose(f);
+    return 0;
+}
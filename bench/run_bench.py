@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""
+EC benchmark harness
+
+Runs every bench/*.ec program N times through bench/ecrun and reports median
+/ p95 wall time, peak RSS and (when `perf` is available) instructions
+retired. Results are compared against a stored baseline: a benchmark fails
+when its output changed or it got slower than the threshold allows. The
+slowdown is judged on instructions when both sides have them (they are far
+less noisy than wall time), otherwise on the median. A benchmark bound by
+process start-up can allow more with a `# Threshold: N%` comment line.
+
+    python3 bench/run_bench.py                  # compare with bench/baseline.json
+    python3 bench/run_bench.py --update         # record a new baseline
+    python3 bench/run_bench.py --runs 20 numeric_loop recursion
+"""
+
+import argparse
+import glob
+import hashlib
+import json
+import math
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def run_once(runner, ec, program):
+    """Run one program; returns (wall seconds, peak RSS in KB, stdout bytes)."""
+    with tempfile.TemporaryFile() as out, tempfile.NamedTemporaryFile(mode="r") as result:
+        subprocess.run([runner, result.name, ec, program], stdout=out,
+                       stderr=subprocess.DEVNULL, stdin=subprocess.DEVNULL, check=True)
+        wall_ns, rss, code = (int(x) for x in result.read().split())
+        if code != 0:
+            raise RuntimeError("%s exited with status %d" % (program, code))
+        out.seek(0)
+        return wall_ns / 1e9, rss, out.read()
+
+
+def count_instructions(ec, program):
+    """Instructions retired in user space, or None without a usable perf."""
+    if not shutil.which("perf"):
+        return None
+    with tempfile.NamedTemporaryFile(mode="r", suffix=".txt") as report:
+        result = subprocess.run(["perf", "stat", "-x", ",", "-e", "instructions:u",
+                                 "-o", report.name, ec, program],
+                                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        if result.returncode != 0:
+            return None
+        for line in report.read().splitlines():
+            fields = line.split(",")
+            if len(fields) > 2 and fields[2].startswith("instructions") and fields[0].isdigit():
+                return int(fields[0])
+    return None
+
+
+def program_threshold(program, default):
+    """The program's own `# Threshold: N%` line, if it has one."""
+    with open(program) as f:
+        for line in f:
+            if not line.startswith("#"):
+                break
+            key, _, value = line[1:].partition(":")
+            if key.strip().lower() == "threshold":
+                return float(value.split()[0].rstrip("%"))
+    return default
+
+
+def percentile(sorted_values, pct):
+    """Nearest-rank percentile."""
+    rank = max(1, math.ceil(pct / 100.0 * len(sorted_values)))
+    return sorted_values[rank - 1]
+
+
+def measure(runner, ec, program, runs):
+    walls, rss, digest = [], 0, None
+    for _ in range(runs):
+        wall, peak, output = run_once(runner, ec, program)
+        walls.append(wall)
+        rss = max(rss, peak)
+        digest = hashlib.sha256(output).hexdigest()
+    walls.sort()
+    return {
+        "median_ms": round(percentile(walls, 50) * 1000, 3),
+        "p95_ms": round(percentile(walls, 95) * 1000, 3),
+        "instructions": count_instructions(ec, program),
+        "peak_rss_kb": rss,
+        "output_sha256": digest,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run the EC benchmark suite")
+    parser.add_argument("names", nargs="*", help="benchmarks to run (default: all)")
+    parser.add_argument("--ec", default=os.path.join(BENCH_DIR, "..", "EC"), help="interpreter binary")
+    parser.add_argument("--runner", default=os.path.join(BENCH_DIR, "ecrun"),
+                        help="process runner built from bench/ecrun.c")
+    parser.add_argument("--runs", type=int, default=5, help="runs per benchmark (default: 5)")
+    parser.add_argument("--baseline", default=os.path.join(BENCH_DIR, "baseline.json"))
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="allowed median slowdown in percent (default: 10)")
+    parser.add_argument("--update", action="store_true", help="write results as the new baseline")
+    args = parser.parse_args()
+
+    programs = sorted(glob.glob(os.path.join(BENCH_DIR, "*.ec")))
+    if args.names:
+        programs = [p for p in programs if os.path.splitext(os.path.basename(p))[0] in args.names]
+    if not programs:
+        print("No benchmarks selected", file=sys.stderr)
+        return 1
+
+    baseline = {}
+    if os.path.exists(args.baseline) and not args.update:
+        with open(args.baseline) as f:
+            baseline = json.load(f).get("benchmarks", {})
+
+    print("%-14s %11s %11s %10s %9s  %s" % ("Benchmark", "Median(ms)", "P95(ms)", "Instr(M)", "RSS(KB)", "vs baseline"))
+    results, failed = {}, False
+    for program in programs:
+        name = os.path.splitext(os.path.basename(program))[0]
+        r = measure(args.runner, args.ec, program, args.runs)
+        results[name] = r
+
+        verdict = "-"
+        base = baseline.get(name)
+        if base:
+            change = (r["median_ms"] / base["median_ms"] - 1) * 100 if base["median_ms"] else 0
+            verdict = "%+.1f%%" % change
+            if r["instructions"] and base.get("instructions"):
+                change = (r["instructions"] / base["instructions"] - 1) * 100
+                verdict += " (instr %+.1f%%)" % change
+            if base.get("output_sha256") and base["output_sha256"] != r["output_sha256"]:
+                verdict += " OUTPUT CHANGED"
+                failed = True
+            elif change > program_threshold(program, args.threshold):
+                verdict += " REGRESSION"
+                failed = True
+
+        instr = "n/a" if r["instructions"] is None else "%.1f" % (r["instructions"] / 1e6)
+        print("%-14s %11.1f %11.1f %10s %9d  %s" % (name, r["median_ms"], r["p95_ms"], instr, r["peak_rss_kb"], verdict))
+
+    if args.update:
+        with open(args.baseline, "w") as f:
+            json.dump({"runs": args.runs, "benchmarks": results}, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("Baseline written to %s" % os.path.relpath(args.baseline))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -18,7 +18,7 @@ if ! command -v gcc &> /dev/null; then
 fi
 
 echo "Building EC interpreter..."
-gcc -Wall -O2 -o EC src/ec.c -lm
+gcc -Wall -O2 -o EC src/ec.c -lm -lpthread
 
 if [ $? -eq 0 ]; then
     echo ""
@@ -18,7 +18,7 @@ if %ERRORLEVEL% neq 0 (
 )
 
 echo Building EC interpreter...
-gcc -Wall -O2 -o EC.exe src/ec.c -lm
+gcc -Wall -O2 -o EC.exe src/ec.c -lm -lpthread
 
 if %ERRORLEVEL% equ 0 (
     echo.
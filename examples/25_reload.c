@@ -0,0 +1,43 @@
+/*
+ * EC 範例 25: 重新載入 / Example 25: Reloading a Running Program
+ * Embeds the interpreter, serves a few calls, then swaps in the edited FN
+ * with ec_reload(); `served` keeps counting across the reload.
+ * Build (from examples/): gcc -I../src -DEC_LIBRARY -o reload 25_reload.c ../src/ec.c -lm -lpthread
+ */
+
+#include <stdio.h>
+#include "ec.h"
+
+static void serve(ECContext* ec, const char* arg) {
+    double result;
+    if (ec_call(ec, "handle", arg, &result) != EC_OK) {
+        printf("%s", ec_error(ec));
+        return;
+    }
+    printf("handle(%s) = %g\n", arg, result);
+}
+
+int main(void) {
+    ECContext* ec = ec_new();
+    if (ec_load(ec, "25_reload.ec") != EC_OK || ec_run(ec) != EC_OK) {
+        printf("%s", ec_error(ec));
+        return 1;
+    }
+    serve(ec, "1");
+    serve(ec, "2");
+
+    printf("--- Reload ---\n");
+    if (ec_reload(ec, "25_reload_v2.ec") != EC_OK) printf("%s", ec_error(ec));
+    serve(ec, "3");
+    ec_call(ec, "status", "", NULL);
+
+    /* A failed reload keeps the running code */
+    if (ec_reload(ec, "missing.ec") != EC_OK) printf("Reload failed: %s", ec_error(ec));
+    serve(ec, "4");
+
+    double served;
+    ec_get_number(ec, "served", &served);
+    printf("served = %g\n", served);
+    ec_free(ec);
+    return 0;
+}
@@ -13,13 +13,39 @@
 #include <ctype.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "ec.h"
 
 #ifdef _WIN32
     #include <windows.h>
     #define popen _popen
     #define pclose _pclose
+    #define strtok_r strtok_s
+    #define flockfile _lock_file
+    #define funlockfile _unlock_file
+    #include <io.h>
+    #include <direct.h>
+    #include <process.h>
+    #define isatty _isatty
+    #define mkdir(path, mode) _mkdir(path)
+    #define getpid _getpid
+    #define realpath(path, resolved) _fullpath(resolved, path, MAX_LINE)
 #else
     #include <unistd.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <spawn.h>
+    #include <sys/wait.h>
+    #include <sys/mman.h>
+    extern char** environ;
 #endif
 
 #define MAX_VARS 1024
@@ -29,6 +55,17 @@
 #define MAX_LINE 4096
 #define MAX_NAME 128
 #define MAX_ARRAYS 256
+#define MAX_FILES 64
+#define MAX_FIELDS 32
+#define MAX_REDUCTIONS 16
+#define MAX_MODULES 64
+
+// Each thread executes the context bound to it (see ECContext)
+#ifdef _MSC_VER
+    #define EC_THREAD_LOCAL __declspec(thread)
+#else
+    #define EC_THREAD_LOCAL __thread
+#endif
 
 // ============ Type Definitions ============
 
@@ -40,11 +77,22 @@ typedef enum {
     TYPE_OBJECT
 } ECType;
 
+// A number is an exact 64-bit integer until an operation overflows or
+// produces a fraction. Kept to 16 bytes so it is returned in registers.
 typedef struct {
-    char name[MAX_NAME];
+    union {
+        int64_t i;      // is_int
+        double d;       // !is_int
+    };
+    int is_int;
+} ECNum;
+
+typedef struct {
+    const char* name;   // Interned (see intern)
     ECType type;
-    double num_val;
-    char str_val[MAX_LINE];
+    ECNum num;
+    char* str_val;      // Heap string, grown on demand (never NULL)
+    size_t str_cap;
     int arr_id;
     int obj_class_id;
 } ECVar;
@@ -55,6 +103,8 @@ typedef struct {
     ECType elem_type;
     int size;
     int capacity;
+    int rows;           // MAT shape (row-major); 0 for ARR
+    int cols;
 } ECArray;
 
 typedef struct {
@@ -63,8 +113,29 @@ typedef struct {
     int end_line;
     char params[16][MAX_NAME];
     int param_count;
+    int memo;           // FN MEMO: results cached per argument tuple
+    int memo_limit;     // Max cached results (0 = unbounded)
 } ECFunc;
 
+// Cached FN MEMO result; the argument key is stored after the entry
+typedef struct MemoEntry {
+    struct MemoEntry* next;     // Bucket chain
+    struct MemoEntry* newer;    // LRU list
+    struct MemoEntry* older;
+    uint64_t hash;
+    ECNum value;
+    size_t key_len;
+    char key[];
+} MemoEntry;
+
+typedef struct {
+    MemoEntry** buckets;
+    size_t bucket_count;
+    size_t count;
+    MemoEntry* newest;
+    MemoEntry* oldest;
+} ECMemo;
+
 typedef struct {
     char name[MAX_NAME];
     int start_line;
@@ -80,38 +151,361 @@ typedef struct {
     char func_name[MAX_NAME];
 } StackFrame;
 
-// ============ Global State ============
+typedef struct ECJit ECJit;       // Compiled hot loops (see jit_enter)
+
+// A source file polled by its own thread; the run loop reloads it when
+// `changed` is set (see watch_poll)
+typedef struct {
+    char* filename;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    int changed;
+    struct stat last;
+} ECWatch;
+
+// Growable byte buffer; appends are amortized O(1) and len is tracked
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} ECBuffer;
+
+// An interned string; callers hold a pointer to its text (see intern)
+typedef struct {
+    uint64_t hash;
+    uint32_t len;
+    char text[];
+} ECSymbol;
+
+// Open-addressing set of symbols (power-of-two size, at most half full)
+typedef struct {
+    ECSymbol** slots;
+    size_t cap;
+    size_t count;
+} ECSymbols;
+
+// Active `EXEC "cmd" EACH var` stream (one per nesting level)
+typedef struct {
+    FILE* fp;
+    int body_line;      // EXEC line; ENDEXEC jumps back here
+    int end_line;       // Matching ENDEXEC
+    char var_name[MAX_NAME];
+} ExecStream;
+
+// Buffered reader behind FOREACH and OPEN: large reads into one buffer,
+// lines are NUL-terminated and handed out in place
+typedef struct {
+    FILE* fp;
+    char* buf;
+    size_t cap;
+    size_t pos;         // Start of the next line
+    size_t len;         // Bytes in buf
+    int eof;
+} LineReader;
+
+// OPEN handle; io.fp is NULL while the slot is free
+typedef struct {
+    LineReader io;      // For writes io.buf is the stdio buffer
+    int writing;
+} ECFile;
+
+typedef struct Coroutine Coroutine;
+
+// Active `FOREACH var ... IN "file"` or `IN generator(args)` loop (one per
+// nesting level)
+typedef struct ForeachStream {
+    LineReader reader;
+    Coroutine* co;      // Generator state, NULL for a file
+    int index;          // Position in foreach_streams
+    int body_line;      // FOREACH line; ENDFOREACH jumps back here
+    int end_line;       // Matching ENDFOREACH
+    int split;          // Assign fields rather than the whole line
+    char sep;           // Field separator, 0 = runs of blanks
+    int var_count;
+    char vars[MAX_FIELDS][MAX_NAME];
+} ForeachStream;
+
+// A suspended generator: where its last YIELD was, and the loops and FOREACH
+// streams of its body, which leave the shared stacks while the consumer runs
+struct Coroutine {
+    int resume_line;
+    int exec_base;      // exec_stream_top when the generator started
+    int loop_count;
+    int loop_start[MAX_STACK];
+    int loop_end[MAX_STACK];
+    int stream_count;
+    ForeachStream* streams[MAX_STACK];
+};
+
+typedef enum {
+    JOB_FREE,
+    JOB_QUEUED,     // Waiting for a free concurrency slot
+    JOB_RUNNING,
+    JOB_DONE        // Finished, output not yet collected by WAIT/WAITALL
+} JobState;
+
+// Background EXEC/PYRUN/CRUN launched with ASYNC
+typedef struct {
+    JobState state;
+    char* command;
+    char result_var[MAX_NAME];
+    int detect_number;              // PYRUN/CRUN results may be numeric
+    char temp_exe[MAX_NAME];        // CRUN binary to remove once collected
+    int pid;
+    int fd;                         // Read end of the job's stdout pipe
+    ECBuffer output;
+} ECJob;
+
+typedef enum {
+    REDUCE_SUM,
+    REDUCE_MIN,
+    REDUCE_MAX
+} ReduceOp;
+
+// One PARLOOP thread. Its remaining iterations [lo, hi) can be stolen by idle workers.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    long lo, hi;
+    ECNum partial[MAX_REDUCTIONS];
+    struct ParLoop* loop;
+    ECContext* context;             // Child context the worker executes in
+    int failed;
+} ParWorker;
+
+typedef struct ParLoop {
+    char index_var[MAX_NAME];
+    int body_line;                  // PARLOOP line
+    int end_line;                   // Matching ENDPARLOOP
+    char reduce_vars[MAX_REDUCTIONS][MAX_NAME];
+    ReduceOp reduce_ops[MAX_REDUCTIONS];
+    ECNum reduce_init[MAX_REDUCTIONS];  // Values on entry
+    int reduce_count;
+    ParWorker* workers;
+    int worker_count;
+    int failed;                     // Set when a worker hits an error; others stop
+} ParLoop;
+
+// Each source line is lowered once to an instruction (see compile_program)
+typedef enum {
+    OP_NOP,             // Blank line or comment
+    OP_EC, OP_SET, OP_ARR, OP_OUT, OP_IN,
+    OP_IF, OP_ELIF, OP_ELSE, OP_ENDIF,
+    OP_LOOP, OP_ENDLOOP, OP_BREAK, OP_CONTINUE, OP_PARLOOP, OP_ENDPARLOOP,
+    OP_FN, OP_ENDFN, OP_CALL, OP_RET,
+    OP_CLASS, OP_ENDCLASS, OP_NEW,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
+    OP_EXEC, OP_ENDEXEC, OP_PYRUN, OP_CRUN,
+    OP_ASYNC, OP_WAIT, OP_WAITALL, OP_JOBS,
+    OP_OPEN, OP_READLINE, OP_WRITE, OP_CLOSE, OP_FOREACH, OP_ENDFOREACH,
+    OP_LOADCSV, OP_SAVECSV,
+    OP_MAT, OP_MATMUL, OP_TRANSPOSE, OP_MATADD, OP_MATSUB, OP_MATEMUL, OP_MATEDIV,
+    OP_YIELD, OP_IMPORT,
+    OP_MATCH, OP_CASE, OP_DEFAULT, OP_ENDMATCH,
+    OP_SEED, OP_MAP, OP_FILLRAND,
+    OP_END,
+    OP_JUMP,            // Unconditional jump left by dead-branch elimination
+    OP_LAZY,            // First line of a FN/CLASS body not compiled yet (see compile_block)
+    OP_SET_FAST,        // Superinstructions (see fuse_program)
+    OP_ARITH_FAST,
+    OP_ARITH_LOOP,
+    OP_UNKNOWN,         // Reported when executed; args holds the command word
+    OP_COUNT
+} ECOpcode;
+
+// Fixed-size so the code section of an .ecb image can be used in place
+typedef struct {
+    int32_t op;
+    int32_t args;       // Offset of the trimmed argument text in the string pool
+    int32_t jump;       // IF/ELIF, MATCH/CASE: next branch; ELSE: ENDIF; block openers: matching end
+    int32_t end;        // IF/ELIF/ELSE, MATCH/CASE/DEFAULT: the chain's ENDIF / ENDMATCH
+    int32_t base;       // Opcode before fusion into a superinstruction
+    int32_t operands;   // First pre-decoded ECOperand, -1 if none
+    int32_t ops;        // Operator characters (low byte first), or compare 1-6 / COND_PROGRAM for IF/ELIF/LOOP
+} ECInstr;
 
-ECVar vars[MAX_VARS];
-int var_count = 0;
+typedef enum {
+    OPND_NUMBER,
+    OPND_INT,
+    OPND_VAR,
+    OPND_ELEM,          // name[index]; the index is the next operand
+    OPND_TEST,          // Condition step (see decode_program)
+    OPND_EXPR,          // Text evaluated as is; name is its pool offset
+    OPND_CASE           // MATCH table entry (see decode_match)
+} ECOperandKind;
+
+typedef struct {
+    int32_t kind;
+    int32_t name;       // Pool offset of the variable or array name
+    double num;
+    int64_t ival;
+} ECOperand;
+
+#define ECB_MAGIC "ECB\x1a"
+#define ECB_VERSION 14
 
-ECArray arrays[MAX_ARRAYS];
-int array_count = 0;
+// .ecb image: header, then the code, line map, FN and CLASS tables and the
+// string pool (arguments and source lines). Offsets are from the file start.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t instr_size;            // Layout checks: images are per build
+    uint32_t func_size;
+    uint32_t class_size;
+    uint32_t line_count;
+    uint32_t func_count;
+    uint32_t class_count;
+    uint32_t code_offset;
+    uint32_t lines_offset;          // uint32 pool offset of each source line
+    uint32_t funcs_offset;
+    uint32_t classes_offset;
+    uint32_t pool_offset;
+    uint32_t pool_size;
+    uint32_t operands_offset;
+    uint32_t operand_count;
+} ECImageHeader;
+
+#define ECM_MAGIC "ECM\x1a"
 
-ECFunc funcs[MAX_FUNCS];
-int func_count = 0;
+// Cached compiled module: header, the module's code (lines and pool offsets
+// relative to the module) and its slice of the string pool
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t instr_size;
+    uint32_t line_count;
+    uint32_t pool_size;
+} ECModuleHeader;
 
-ECClass classes[MAX_CLASSES];
-int class_count = 0;
+// A module loaded by IMPORT. Its lines follow the program between `header`
+// (a jump over them) and `tail` (a RET back to the IMPORT line).
+typedef struct {
+    char* path;             // Canonical file name; NULL when run from an image
+    char name[MAX_NAME];    // Prefix of its FN and CLASS names
+    int header;
+    int tail;
+    int ran;                // Top-level code has been executed
+} ECModule;
 
-char** lines = NULL;
-int line_count = 0;
-int current_line = 0;
+// One node of the profiler's call tree (a distinct call path)
+typedef struct {
+    int func;                       // Index into funcs, -1 for top level
+    int parent;
+    int first_child;
+    int next_sibling;
+    long long calls;
+    long long self_ns;              // Line time while this path was innermost
+} ProfNode;
 
-int call_stack[MAX_STACK];
-StackFrame debug_stack[MAX_STACK]; // For error reporting
-int call_stack_top = 0;
+typedef struct {
+    long long* line_count;
+    long long* line_ns;
+    int line_cap;
+    ProfNode* nodes;
+    int node_count;
+    int node_cap;
+    int path[MAX_STACK + 1];        // Call tree node for each call depth
+} ECProfile;
 
-int loop_start[MAX_STACK];
-int loop_end[MAX_STACK];
-int loop_depth = 0;
+// ============ Interpreter Context ============
 
-int running = 1;
-int in_function = 0;
-double return_value = 0;
-int has_return = 0;
+// All interpreter state lives in an ECContext. Each thread executes the
+// context bound to it in `ctx`, so independent contexts can run concurrently.
+// A PARLOOP worker runs a child context that shares the program, functions,
+// classes and arrays of its parent but has its own variables and stacks.
+struct ECContext {
+    char** lines;
+    int line_count;
+    int source_count;           // Lines loaded from the file; reloaded blocks follow them
+    int* line_map;              // Source line of each line once reload_file appended blocks
+    
+    ECInstr* code;              // One instruction per line
+    const char* pool;           // Instruction arguments
+    size_t pool_size;
+    ECBuffer pool_buffer;       // Owns the pool for programs compiled from source
+    int* pool_slots;            // Hash index of the pool: pool_add reuses equal strings
+    int pool_slot_cap;
+    int pool_slot_count;
+    const ECOperand* operands;  // Pre-decoded superinstruction operands
+    int operand_count;
+    ECBuffer operand_buffer;    // Owns the operands for programs compiled from source
+    const char** operand_names; // Interned name of each OPND_VAR / OPND_ELEM operand
+    void* image;                // Mapped .ecb image (owns code, pool and lines text)
+    size_t image_size;
+    
+    ECFunc* funcs;
+    int func_count;
+    ECMemo** memos;             // Per function, allocated on the first FN MEMO call
+    ECBuffer* memo_keys;        // Argument key of each call frame
+    
+    ECClass* classes;
+    int class_count;
+    
+    ECArray* arrays;
+    int array_count;
+    
+    // Variable lookups fall back to the parent's variables (PARLOOP workers)
+    ECSymbols symbols;          // Interned names; a worker only adds ones its parent lacks
+    ECVar* vars;
+    int var_count;
+    struct ECContext* parent;
+    
+    int current_line;
+    
+    int call_stack[MAX_STACK];
+    int call_loop_depth[MAX_STACK];    // loop_depth at each CALL
+    int call_exec_top[MAX_STACK];      // exec_stream_top at each CALL
+    int call_foreach_top[MAX_STACK];   // foreach_top at each CALL
+    int call_memo[MAX_STACK];          // FN MEMO entered on a miss, or -1
+    int call_result[MAX_STACK];        // CALL line names a result variable
+    ForeachStream* call_generator[MAX_STACK]; // FOREACH a generator frame yields to
+    StackFrame debug_stack[MAX_STACK]; // For error reporting
+    int call_stack_top;
+    
+    int loop_start[MAX_STACK];
+    int loop_end[MAX_STACK];
+    int loop_depth;
+    
+    int running;
+    int in_function;
+    ECNum return_value;
+    int has_return;
+    
+    ECBuffer last_exec_output;
+    ECBuffer line_buffer;
+    
+    ExecStream exec_streams[MAX_STACK];
+    int exec_stream_top;
+    ForeachStream* foreach_streams[MAX_STACK];
+    int foreach_top;
+    ECFile* files;          // Allocated on first OPEN
+    
+    ECJob* jobs;            // Grows as jobs are queued; handles are index + 1
+    int job_count;          // Slots handed out so far
+    int job_cap;
+    int job_free;           // No free slot below this index
+    int jobs_running;
+    int job_limit;          // Max concurrently running jobs (0 = number of CPUs)
+    
+    ECProfile* profile;     // NULL unless profiling (shared with PARLOOP workers)
+    ECJit* jit;             // Allocated when the first LOOP runs
+    int jit_disabled;
+    
+    ECWatch* watch;         // Source file reloaded when it changes (see ec_watch)
+    uint64_t rng[4];        // RAND state (xoshiro256**); all zero until seeded
+    
+    ECModule* modules;      // Allocated on the first IMPORT
+    int module_count;
+    char* source_dir;       // Directory relative IMPORT paths start from (NULL = current)
+    
+    jmp_buf* error_jmp;     // Set by the API entry point; runtime_error() jumps here
+    ECBuffer error;         // Last error report
+    ECBuffer scratch;       // Backing store for strings returned by the API
+};
 
-char last_exec_output[MAX_LINE * 4] = "";
+EC_THREAD_LOCAL ECContext* ctx = NULL;
 
 // ============ Utility Functions ============
 
@@ -123,35 +517,249 @@ void trim(char* str) {
     while (len > 0 && isspace((unsigned char)str[len - 1])) str[--len] = '\0';
 }
 
+void buffer_reserve(ECBuffer* buf, size_t extra) {
+    if (buf->len + extra + 1 <= buf->cap) return;
+    size_t cap = buf->cap ? buf->cap : 256;
+    while (cap < buf->len + extra + 1) cap *= 2;
+    char* data = (char*)realloc(buf->data, cap);
+    if (!data) { fprintf(stderr, "Fatal: Out of memory\n"); exit(1); }
+    buf->data = data;
+    buf->cap = cap;
+}
+
+void buffer_append(ECBuffer* buf, const char* src, size_t len) {
+    buffer_reserve(buf, len);
+    memcpy(buf->data + buf->len, src, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+void buffer_clear(ECBuffer* buf) {
+    buffer_reserve(buf, 0);
+    buf->len = 0;
+    buf->data[0] = '\0';
+}
+
+void buffer_vprintf(ECBuffer* buf, const char* format, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int n = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (n < 0) return;
+    buffer_reserve(buf, n);
+    vsnprintf(buf->data + buf->len, n + 1, format, args);
+    buf->len += n;
+}
+
+void buffer_printf(ECBuffer* buf, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    buffer_vprintf(buf, format, args);
+    va_end(args);
+}
+
+void buffer_free(ECBuffer* buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
+
+// Read one line of any length (without the trailing newline). Returns 0 at EOF.
+int read_line(FILE* fp, ECBuffer* buf) {
+    char chunk[MAX_LINE];
+    buffer_clear(buf);
+    while (fgets(chunk, sizeof(chunk), fp)) {
+        size_t n = strlen(chunk);
+        buffer_append(buf, chunk, n);
+        if (n > 0 && chunk[n - 1] == '\n') break;
+    }
+    if (buf->len == 0 && feof(fp)) return 0;
+    while (buf->len > 0 && (buf->data[buf->len - 1] == '\n' || buf->data[buf->len - 1] == '\r'))
+        buf->data[--buf->len] = '\0';
+    return 1;
+}
+
 // Error Reporting
+
+// Abandon the current API call; the report is already in ctx->error
+void raise_error(void) {
+    if (ctx->error_jmp) longjmp(*ctx->error_jmp, 1);
+    fputs(ctx->error.data, stderr);
+    exit(1);
+}
+
+// 1-based line number shown for a line of the program
+int source_line(int line) {
+    if (ctx->line_map && line >= 0 && line < ctx->line_count) return ctx->line_map[line] + 1;
+    return line + 1;
+}
+
+// Errors outside of program execution (missing file, syntax errors)
+void fatal_error(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    buffer_clear(&ctx->error);
+    buffer_vprintf(&ctx->error, format, args);
+    va_end(args);
+    raise_error();
+}
+
+const ECModule* module_at(int line);
+
 void runtime_error(const char* format, ...) {
-    fprintf(stderr, "\n\033[1;31m[RUNTIME ERROR]\033[0m at line %d:\n", current_line + 1);
+    ECBuffer* report = &ctx->error;
+    buffer_clear(report);
+    const ECModule* module = module_at(ctx->current_line);
+    buffer_printf(report, "\n\033[1;31m[RUNTIME ERROR]\033[0m at line %d", source_line(ctx->current_line));
+    if (module) buffer_printf(report, " of %s", module->path);
+    buffer_printf(report, ":\n");
     
     // Print the line content
-    if (current_line < line_count) {
+    if (ctx->current_line < ctx->line_count) {
         char temp[MAX_LINE];
-        strcpy(temp, lines[current_line]);
+        strcpy(temp, ctx->lines[ctx->current_line]);
         trim(temp);
-        fprintf(stderr, ">> %s\n", temp);
+        buffer_printf(report, ">> %s\n", temp);
     }
     
     va_list args;
     va_start(args, format);
-    fprintf(stderr, "Details: ");
-    vfprintf(stderr, format, args);
-    fprintf(stderr, "\n");
+    buffer_printf(report, "Details: ");
+    buffer_vprintf(report, format, args);
+    buffer_printf(report, "\n");
     va_end(args);
 
     // Call Stack Trace
-    if (call_stack_top > 0) {
-        fprintf(stderr, "\nStack Trace:\n");
-        for (int i = call_stack_top - 1; i >= 0; i--) {
-            fprintf(stderr, "  at line %d (in %s)\n", debug_stack[i].line_num + 1, debug_stack[i].func_name);
+    if (ctx->call_stack_top > 0) {
+        buffer_printf(report, "\nStack Trace:\n");
+        for (int i = ctx->call_stack_top - 1; i >= 0; i--) {
+            buffer_printf(report, "  at line %d (in %s)\n", source_line(ctx->debug_stack[i].line_num), ctx->debug_stack[i].func_name);
         }
     }
     
-    // Clean exit
-    exit(1);
+    raise_error();
+}
+
+// ============ Interned Strings ============
+
+// Names are interned once: equal names are the same pointer, so variable
+// lookups compare pointers, and each symbol keeps its hash so the table
+// grows without rehashing text. PARLOOP workers read their parent's symbols
+// (the spawning thread waits for them) and intern only names it lacks.
+
+uint64_t memo_hash(const char* key, size_t len);
+
+ECSymbol** symbols_slot(const ECSymbols* t, const char* text, size_t len, uint64_t hash) {
+    size_t mask = t->cap - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        ECSymbol* s = t->slots[i];
+        if (!s || (s->hash == hash && s->len == len && memcmp(s->text, text, len) == 0)) return &t->slots[i];
+    }
+}
+
+// The interned copy of text[0..len), or NULL if it was never interned
+const char* intern_find(const char* text, size_t len, uint64_t hash) {
+    for (const ECContext* c = ctx; c; c = c->parent) {
+        if (c->symbols.count == 0) continue;
+        ECSymbol* s = *symbols_slot(&c->symbols, text, len, hash);
+        if (s) return s->text;
+    }
+    return NULL;
+}
+
+const char* intern(const char* text, size_t len) {
+    uint64_t hash = memo_hash(text, len);
+    const char* found = intern_find(text, len, hash);
+    if (found) return found;
+    
+    ECSymbols* t = &ctx->symbols;
+    if ((t->count + 1) * 2 > t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 256;
+        ECSymbol** slots = (ECSymbol**)calloc(cap, sizeof(ECSymbol*));
+        if (!slots) runtime_error("Out of memory");
+        ECSymbols grown = { slots, cap, t->count };
+        for (size_t i = 0; i < t->cap; i++) {
+            ECSymbol* s = t->slots[i];
+            if (s) *symbols_slot(&grown, s->text, s->len, s->hash) = s;
+        }
+        free(t->slots);
+        *t = grown;
+    }
+    ECSymbol* s = (ECSymbol*)malloc(sizeof(ECSymbol) + len + 1);
+    if (!s) runtime_error("Out of memory");
+    s->hash = hash;
+    s->len = (uint32_t)len;
+    memcpy(s->text, text, len);
+    s->text[len] = '\0';
+    *symbols_slot(t, text, len, hash) = s;
+    t->count++;
+    return s->text;
+}
+
+void symbols_free(ECSymbols* t) {
+    for (size_t i = 0; i < t->cap; i++) free(t->slots[i]);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+// ============ Context Management ============
+
+// A child context (PARLOOP worker) shares its parent's program and global
+// tables; a root context owns them.
+ECContext* context_create(ECContext* parent) {
+    ECContext* c = (ECContext*)calloc(1, sizeof(ECContext));
+    if (!c) return NULL;
+    c->vars = (ECVar*)calloc(MAX_VARS, sizeof(ECVar));
+    c->running = 1;
+    c->parent = parent;
+    
+    if (parent) {
+        c->lines = parent->lines;
+        c->line_count = parent->line_count;
+        c->line_map = parent->line_map;
+        c->code = parent->code;
+        c->pool = parent->pool;
+        c->operands = parent->operands;
+        c->operand_count = parent->operand_count;
+        c->operand_names = parent->operand_names;
+        c->funcs = parent->funcs;
+        c->func_count = parent->func_count;
+        c->classes = parent->classes;
+        c->class_count = parent->class_count;
+        c->arrays = parent->arrays;
+        c->array_count = parent->array_count;
+        c->profile = parent->profile;
+        c->modules = parent->modules;
+        c->module_count = parent->module_count;
+    } else {
+        c->funcs = (ECFunc*)calloc(MAX_FUNCS, sizeof(ECFunc));
+        c->classes = (ECClass*)calloc(MAX_CLASSES, sizeof(ECClass));
+        c->arrays = (ECArray*)calloc(MAX_ARRAYS, sizeof(ECArray));
+        if (!c->funcs || !c->classes || !c->arrays) c->running = 0;
+    }
+    
+    if (!c->vars || !c->running) {
+        free(c->vars);
+        if (!parent) { free(c->funcs); free(c->classes); free(c->arrays); }
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+// Free everything a context owns except the tables it may share with children
+void context_free_locals(ECContext* c) {
+    for (int i = 0; i < c->var_count; i++) free(c->vars[i].str_val);
+    free(c->vars);
+    while (c->exec_stream_top > 0) pclose(c->exec_streams[--c->exec_stream_top].fp);
+    buffer_free(&c->last_exec_output);
+    buffer_free(&c->line_buffer);
+    buffer_free(&c->error);
+    buffer_free(&c->scratch);
+    buffer_free(&c->pool_buffer);
+    buffer_free(&c->operand_buffer);
+    symbols_free(&c->symbols);
+    free(c->pool_slots);
 }
 
 int is_number(const char* str) {
@@ -161,64 +769,196 @@ int is_number(const char* str) {
     return *end == '\0';
 }
 
-int find_var(const char* name) {
-    for (int i = var_count - 1; i >= 0; i--) {
-        if (strcmp(vars[i].name, name) == 0) return i;
+// Read-only lookup by interned name: this context's variables first, then its parents'
+ECVar* find_var_name(const char* name) {
+    for (ECContext* c = ctx; c; c = c->parent) {
+        for (int i = c->var_count - 1; i >= 0; i--) {
+            if (c->vars[i].name == name) return &c->vars[i];
+        }
     }
-    return -1;
+    return NULL;
+}
+
+// A name that was never interned cannot belong to a variable
+ECVar* find_var(const char* name) {
+    size_t len = strlen(name);
+    const char* key = intern_find(name, len, memo_hash(name, len));
+    return key ? find_var_name(key) : NULL;
+}
+
+int in_parallel_worker(void) {
+    return ctx->parent != NULL;
+}
+
+void require_main_thread(const char* cmd) {
+    if (in_parallel_worker()) runtime_error("%s is not allowed inside PARLOOP", cmd);
 }
 
 int find_func(const char* name) {
-    for (int i = 0; i < func_count; i++) {
-        if (strcmp(funcs[i].name, name) == 0) return i;
+    for (int i = 0; i < ctx->func_count; i++) {
+        if (strcmp(ctx->funcs[i].name, name) == 0) return i;
     }
     return -1;
 }
 
 int find_class(const char* name) {
-    for (int i = 0; i < class_count; i++) {
-        if (strcmp(classes[i].name, name) == 0) return i;
+    for (int i = 0; i < ctx->class_count; i++) {
+        if (strcmp(ctx->classes[i].name, name) == 0) return i;
     }
     return -1;
 }
 
-ECVar* get_or_create_var(const char* name) {
-    int idx = find_var(name);
-    if (idx >= 0) return &vars[idx];
-    
-    if (var_count >= MAX_VARS) {
+ECVar* new_var(const char* name) {
+    if (ctx->var_count >= MAX_VARS) {
         runtime_error("Stack Overflow: Too many variables declared (Limit: %d).", MAX_VARS);
     }
     
-    ECVar* v = &vars[var_count++];
-    strncpy(v->name, name, MAX_NAME - 1);
+    size_t len = strlen(name);
+    ECVar* v = &ctx->vars[ctx->var_count];
+    v->name = intern(name, len < MAX_NAME ? len : MAX_NAME - 1);
+    ctx->var_count++;
     v->type = TYPE_NULL;
-    v->num_val = 0;
+    v->num.i = 0;
+    v->num.is_int = 1;
+    if (!v->str_val) {
+        v->str_cap = 64;
+        v->str_val = (char*)malloc(v->str_cap);
+    }
     v->str_val[0] = '\0';
     v->arr_id = -1;
     v->obj_class_id = -1;
     return v;
 }
 
+void set_var_string(ECVar* v, const char* str, size_t len);
+
+// Lookup for writing. A PARLOOP worker never writes to the shared scope:
+// the first write to a shared variable makes a private copy.
+ECVar* writable_var_name(const char* name) {
+    for (int i = ctx->var_count - 1; i >= 0; i--) {
+        if (ctx->vars[i].name == name) return &ctx->vars[i];
+    }
+    ECVar* shared = find_var_name(name);
+    if (!shared) return NULL;
+    
+    ECVar* v = new_var(name);
+    v->type = shared->type;
+    v->num = shared->num;
+    v->arr_id = shared->arr_id;
+    v->obj_class_id = shared->obj_class_id;
+    if (shared->type == TYPE_STRING) set_var_string(v, shared->str_val, strlen(shared->str_val));
+    return v;
+}
+
+ECVar* get_writable_var(const char* name) {
+    size_t len = strlen(name);
+    const char* key = intern_find(name, len, memo_hash(name, len));
+    return key ? writable_var_name(key) : NULL;
+}
+
+ECVar* get_or_create_var(const char* name) {
+    ECVar* v = get_writable_var(name);
+    return v ? v : new_var(name);
+}
+
+void set_var_string(ECVar* v, const char* str, size_t len) {
+    if (len + 1 > v->str_cap) {
+        v->str_cap = len + 1;
+        v->str_val = (char*)realloc(v->str_val, v->str_cap);
+        if (!v->str_val) runtime_error("Out of memory storing string in '%s'", v->name);
+    }
+    memcpy(v->str_val, str, len);
+    v->str_val[len] = '\0';
+    v->type = TYPE_STRING;
+}
+
 ECVar* get_var_checked(const char* name) {
-    int idx = find_var(name);
-    if (idx < 0) {
+    ECVar* v = get_writable_var(name);
+    if (!v) {
         runtime_error("Undefined variable '%s'. Please declare it with 'EC' first.", name);
     }
-    return &vars[idx];
+    return v;
 }
 
 // ============ Expression Parser ============
 
-double evaluate_expr(const char* expr);
+ECNum num_int(int64_t i) {
+    ECNum n;
+    n.i = i;
+    n.is_int = 1;
+    return n;
+}
 
-double parse_value(const char* token) {
+ECNum num_double(double d) {
+    ECNum n;
+    n.d = d;
+    n.is_int = 0;
+    return n;
+}
+
+double num_value(ECNum n) {
+    return n.is_int ? (double)n.i : n.d;
+}
+
+// Decimal integer literals that fit in 64 bits stay exact; anything else
+// strtod accepts is a double. `text` must satisfy is_number().
+ECNum parse_number(const char* text) {
+    const char* digits = text + (*text == '-' || *text == '+');
+    if (*digits && digits[strspn(digits, "0123456789")] == '\0') {
+        errno = 0;
+        long long i = strtoll(text, NULL, 10);
+        if (errno != ERANGE) return num_int(i);
+    }
+    return num_double(strtod(text, NULL));
+}
+
+ECNum var_num(const ECVar* v) {
+    return v->num;
+}
+
+void var_set_num(ECVar* v, ECNum n) {
+    v->type = TYPE_NUMBER;
+    v->num = n;
+}
+
+// Array subscript; integers outside int range are out of bounds
+int num_index(ECNum n) {
+    if (n.is_int) return n.i >= INT_MIN && n.i <= INT_MAX ? (int)n.i : INT_MIN;
+    return (int)n.d;
+}
+
+ECNum evaluate_num(const char* expr);
+
+// Flat index of m[row][col]; `text` is the "[col]" that follows m[row]
+int matrix_index(const char* name, const ECArray* arr, int row, const char* text) {
+    const char* end = strchr(text, ']');
+    if (!end) runtime_error("Missing closing bracket ']' in array access.");
+    char idx_str[MAX_NAME];
+    int idx_len = end - text - 1;
+    if (idx_len >= MAX_NAME) idx_len = MAX_NAME - 1;
+    memcpy(idx_str, text + 1, idx_len);
+    idx_str[idx_len] = '\0';
+    
+    int col = num_index(evaluate_num(idx_str));
+    if (arr->cols == 0) runtime_error("Variable '%s' is not a matrix.", name);
+    if (row < 0 || row >= arr->rows || col < 0 || col >= arr->cols) {
+        runtime_error("Matrix Index Out of Bounds: [%d][%d], Size %dx%d.", row, col, arr->rows, arr->cols);
+    }
+    return row * arr->cols + col;
+}
+
+ECNum math_call(const char* tok, const char* paren);
+
+ECNum parse_num(const char* token) {
     char tok[MAX_LINE];
     strncpy(tok, token, MAX_LINE - 1);
     tok[MAX_LINE - 1] = '\0';
     trim(tok);
     
-    if (is_number(tok)) return strtod(tok, NULL);
+    if (is_number(tok)) return parse_number(tok);
+    
+    char* paren = strchr(tok, '(');
+    if (paren && paren > tok && tok[strlen(tok) - 1] == ')') return math_call(tok, paren);
     
     char* bracket = strchr(tok, '[');
     if (bracket) {
@@ -234,26 +974,32 @@ double parse_value(const char* token) {
             strncpy(idx_str, bracket + 1, idx_len);
             idx_str[idx_len] = '\0';
             
-            int arr_idx = (int)evaluate_expr(idx_str);
-            int var_idx = find_var(arr_name);
+            int arr_idx = num_index(evaluate_num(idx_str));
+            ECVar* av = find_var(arr_name);
             
-            if (var_idx < 0) runtime_error("Undefined array '%s'.", arr_name);
-            if (vars[var_idx].arr_id < 0) runtime_error("Variable '%s' is not an array.", arr_name);
+            if (!av) runtime_error("Undefined array '%s'.", arr_name);
+            if (av->arr_id < 0) runtime_error("Variable '%s' is not an array.", arr_name);
             
-            ECArray* arr = &arrays[vars[var_idx].arr_id];
+            ECArray* arr = &ctx->arrays[av->arr_id];
+            if (end_bracket[1] == '[') arr_idx = matrix_index(arr_name, arr, arr_idx, end_bracket + 1);
             
             if (arr_idx < 0 || arr_idx >= arr->size) {
                 runtime_error("Array Index Out of Bounds: Index %d, Size %d.", arr_idx, arr->size);
             }
-            return arr->num_data[arr_idx];
+            return num_double(arr->num_data[arr_idx]);
         } else {
              runtime_error("Missing closing bracket ']' in array access.");
         }
     }
 
-    ECVar* v = get_var_checked(tok);
-    if (v->type == TYPE_STRING) return atof(v->str_val); // Try convert string to num
-    return v->num_val;
+    ECVar* v = find_var(tok);
+    if (!v) runtime_error("Undefined variable '%s'. Please declare it with 'EC' first.", tok);
+    if (v->type == TYPE_STRING) return num_double(atof(v->str_val)); // Try convert string to num
+    return var_num(v);
+}
+
+double parse_value(const char* token) {
+    return num_value(parse_num(token));
 }
 
 int get_precedence(char op) {
@@ -279,15 +1025,94 @@ double apply_op(double a, double b, char op) {
     }
 }
 
-double evaluate_expr(const char* expr) {
+// Truncating remainder (the sign of fmod); b != 0. A 64-bit idiv costs
+// several times a 32-bit one on common x86 cores, so use that when possible.
+int64_t int_mod(int64_t a, int64_t b) {
+    if (b == -1) return 0;
+    if (a == (int32_t)a && b == (int32_t)b) return (int32_t)a % (int32_t)b;
+    return a % b;
+}
+
+// Remainder with fmod semantics (a zero divisor gives NaN, as for MOD)
+ECNum num_mod(ECNum a, ECNum b) {
+    if (a.is_int && b.is_int && b.i != 0) return num_int(int_mod(a.i, b.i));
+    return num_double(fmod(num_value(a), num_value(b)));
+}
+
+// Integer operands stay integers unless the result overflows or a division
+// is inexact; then the operation is redone in double precision
+ECNum num_apply(ECNum a, ECNum b, char op) {
+    if (a.is_int && b.is_int) {
+        int64_t r;
+        switch (op) {
+            case '+': if (!__builtin_add_overflow(a.i, b.i, &r)) return num_int(r); break;
+            case '-': if (!__builtin_sub_overflow(a.i, b.i, &r)) return num_int(r); break;
+            case '*': if (!__builtin_mul_overflow(a.i, b.i, &r)) return num_int(r); break;
+            case '/':
+                if (b.i == 0) runtime_error("Division by zero.");
+                if (b.i != -1 && a.i % b.i == 0) return num_int(a.i / b.i);
+                if (b.i == -1 && a.i != INT64_MIN) return num_int(-a.i);
+                break;
+            case '%':
+                if (b.i == 0) runtime_error("Modulo by zero.");
+                return num_mod(a, b);
+        }
+    }
+    return num_double(apply_op(num_value(a), num_value(b), op));
+}
+
+// +, - and * on two integers without a call into num_apply (hot paths)
+static inline ECNum num_arith(ECNum a, ECNum b, char op) {
+    int64_t r;
+    if (a.is_int && b.is_int) {
+        if (op == '+' && !__builtin_add_overflow(a.i, b.i, &r)) return num_int(r);
+        if (op == '-' && !__builtin_sub_overflow(a.i, b.i, &r)) return num_int(r);
+        if (op == '*' && !__builtin_mul_overflow(a.i, b.i, &r)) return num_int(r);
+    }
+    return num_apply(a, b, op);
+}
+
+// cmp: 0 ==, 1 !=, 2 >=, 3 <=, 4 >, 5 <
+int num_compare(ECNum a, ECNum b, int cmp) {
+    if (a.is_int && b.is_int) {
+        switch (cmp) {
+            case 0: return a.i == b.i;
+            case 1: return a.i != b.i;
+            case 2: return a.i >= b.i;
+            case 3: return a.i <= b.i;
+            case 4: return a.i > b.i;
+            case 5: return a.i < b.i;
+        }
+        return 0;
+    }
+    double x = num_value(a), y = num_value(b);
+    switch (cmp) {
+        case 0: return x == y;
+        case 1: return x != y;
+        case 2: return x >= y;
+        case 3: return x <= y;
+        case 4: return x > y;
+        case 5: return x < y;
+    }
+    return 0;
+}
+
+// Integral values print without a fraction, however large
+void format_number(ECNum n, char* out) {
+    if (n.is_int) sprintf(out, "%lld", (long long)n.i);
+    else if (n.d == floor(n.d) && fabs(n.d) < 9.2e18) sprintf(out, "%lld", (long long)n.d);
+    else sprintf(out, "%g", n.d);
+}
+
+ECNum evaluate_num(const char* expr) {
     char buf[MAX_LINE];
     strncpy(buf, expr, MAX_LINE - 1);
     buf[MAX_LINE - 1] = '\0';
     trim(buf);
     
-    if (strlen(buf) == 0) return 0;
+    if (strlen(buf) == 0) return num_int(0);
     
-    double values[64];
+    ECNum values[64];
     char ops[64];
     int val_top = 0, op_top = 0;
     
@@ -311,17 +1136,17 @@ double evaluate_expr(const char* expr) {
             if (token_pos > 0) {
                 if (token[0] == '(') {
                     token[strlen(token) - 1] = '\0';
-                    values[val_top++] = evaluate_expr(token + 1);
+                    values[val_top++] = evaluate_num(token + 1);
                 } else {
-                    values[val_top++] = parse_value(token);
+                    values[val_top++] = parse_num(token);
                 }
             }
             token_pos = 0;
             
             while (op_top > 0 && get_precedence(ops[op_top - 1]) >= get_precedence(c)) {
-                double b = values[--val_top];
-                double a = values[--val_top];
-                values[val_top++] = apply_op(a, b, ops[--op_top]);
+                ECNum b = values[--val_top];
+                ECNum a = values[--val_top];
+                values[val_top++] = num_apply(a, b, ops[--op_top]);
             }
             ops[op_top++] = c;
         } else {
@@ -334,798 +1159,7677 @@ double evaluate_expr(const char* expr) {
     if (token_pos > 0) {
         if (token[0] == '(') {
             token[strlen(token) - 1] = '\0';
-            values[val_top++] = evaluate_expr(token + 1);
+            values[val_top++] = evaluate_num(token + 1);
         } else {
-            values[val_top++] = parse_value(token);
+            values[val_top++] = parse_num(token);
         }
     }
     
     while (op_top > 0) {
         if (val_top < 2) runtime_error("Invalid expression syntax: '%s'", expr);
-        double b = values[--val_top];
-        double a = values[--val_top];
-        values[val_top++] = apply_op(a, b, ops[--op_top]);
+        ECNum b = values[--val_top];
+        ECNum a = values[--val_top];
+        values[val_top++] = num_apply(a, b, ops[--op_top]);
     }
     
-    if (val_top != 1) return 0; // Should ideally error 
+    if (val_top != 1) return num_int(0); // Should ideally error 
     return values[0];
 }
 
-char* get_string_value(const char* expr, char* result) {
+double evaluate_expr(const char* expr) {
+    return num_value(evaluate_num(expr));
+}
+
+// Returns either `result` or, for string variables, the variable's own storage
+// (which may be longer than MAX_LINE, e.g. captured EXEC output).
+const char* get_string_value(const char* expr, char* result) {
     char buf[MAX_LINE];
     strncpy(buf, expr, MAX_LINE - 1);
+    buf[MAX_LINE - 1] = '\0';
     trim(buf);
     
-    if (buf[0] == '"' && buf[strlen(buf) - 1] == '"') {
-        strncpy(result, buf + 1, strlen(buf) - 2);
-        result[strlen(buf) - 2] = '\0';
+    size_t len = strlen(buf);
+    if (len >= 2 && buf[0] == '"' && buf[len - 1] == '"') {
+        memcpy(result, buf + 1, len - 2);
+        result[len - 2] = '\0';
         return result;
     }
     
-    int idx = find_var(buf);
-    if (idx >= 0 && vars[idx].type == TYPE_STRING) {
-        strcpy(result, vars[idx].str_val);
-        return result;
+    ECVar* v = find_var(buf);
+    if (v && v->type == TYPE_STRING) {
+        return v->str_val;
     }
     
-    double val = evaluate_expr(buf);
-    if (val == (int)val) sprintf(result, "%d", (int)val);
-    else sprintf(result, "%g", val);
+    format_number(evaluate_num(buf), result);
     return result;
 }
 
-int evaluate_condition(const char* cond) {
-    char buf[MAX_LINE];
-    strncpy(buf, cond, MAX_LINE - 1);
-    trim(buf);
-    
-    char* ops[] = {"==", "!=", ">=", "<=", ">", "<"}; // Longest first
-    int op_lens[] = {2, 2, 2, 2, 1, 1};
-    
+// ============ Conditions ============
+// IF / ELIF / LOOP conditions: comparisons combined with AND, OR, NOT and
+// parentheses. NOT binds tighter than AND, AND tighter than OR; evaluation
+// stops as soon as the result is known.
+
+#define MAX_COND 64
+
+const char* const compare_names[] = {"==", "!=", ">=", "<=", ">", "<"};  // Longest first
+
+enum { COND_LEAF, COND_AND, COND_OR, COND_NOT };
+#define COND_TRUE -2            // Targets of a leaf (see cond_targets)
+#define COND_FALSE -1
+
+typedef struct {
+    int kind;
+    int a, b;                   // Operand nodes (NOT: a only)
+    int start, len;             // COND_LEAF: its text in the condition
+} CondNode;
+
+typedef struct {
+    const char* text;
+    int pos;
+    CondNode nodes[MAX_COND];
+    int count;
+} CondTree;
+
+// First comparison operator outside quotes, in compare_names order
+char* find_compare(char* text, int* cmp) {
     for (int i = 0; i < 6; i++) {
-        char* pos = strstr(buf, ops[i]);
-        if (pos) {
-            char left[MAX_LINE], right[MAX_LINE];
-            int left_len = pos - buf;
-            strncpy(left, buf, left_len);
-            left[left_len] = '\0';
-            strcpy(right, pos + op_lens[i]);
-            
-            trim(left); trim(right);
-            double lval = evaluate_expr(left);
-            double rval = evaluate_expr(right);
-            
-            switch (i) {
-                case 0: return lval == rval;
-                case 1: return lval != rval;
-                case 2: return lval >= rval;
-                case 3: return lval <= rval;
-                case 4: return lval > rval;
-                case 5: return lval < rval;
-            }
+        size_t len = strlen(compare_names[i]);
+        int quoted = 0;
+        for (char* p = text; *p; p++) {
+            if (*p == '"') quoted = !quoted;
+            else if (!quoted && strncmp(p, compare_names[i], len) == 0) { *cmp = i; return p; }
         }
     }
-    return evaluate_expr(buf) != 0;
+    return NULL;
 }
 
-// ============ Static Analysis ============
+// Keyword `word` (any case) as a whole word at `p`
+int cond_keyword(const char* text, const char* p, const char* word) {
+    size_t len = strlen(word);
+    if (strncasecmp(p, word, len) != 0) return 0;
+    if (p > text && !isspace((unsigned char)p[-1]) && p[-1] != '(' && p[-1] != ')') return 0;
+    return p[len] == '\0' || isspace((unsigned char)p[len]) || p[len] == '(';
+}
 
-void validate_syntax(void) {
-    int if_depth = 0;
-    int loop_depth_check = 0;
-    int fn_depth = 0;
-    int class_depth = 0;
+int cond_node(CondTree* t, int kind, int a, int b) {
+    if (t->count == MAX_COND) return -1;
+    CondNode* n = &t->nodes[t->count];
+    n->kind = kind;
+    n->a = a;
+    n->b = b;
+    n->start = n->len = 0;
+    return t->count++;
+}
 
-    for (int i = 0; i < line_count; i++) {
-        char temp[MAX_LINE];
-        strcpy(temp, lines[i]);
-        trim(temp);
-        if (strlen(temp) == 0 || temp[0] == '#') continue;
+void cond_skip(CondTree* t) {
+    while (isspace((unsigned char)t->text[t->pos])) t->pos++;
+}
 
-        char cmd[MAX_NAME];
-        sscanf(temp, "%127s", cmd);
+int cond_or(CondTree* t);
 
-        if (strcasecmp(cmd, "IF") == 0) if_depth++;
-        else if (strcasecmp(cmd, "ENDIF") == 0) if_depth--;
-        else if (strcasecmp(cmd, "LOOP") == 0) loop_depth_check++;
-        else if (strcasecmp(cmd, "ENDLOOP") == 0) loop_depth_check--;
-        else if (strcasecmp(cmd, "FN") == 0) fn_depth++;
-        else if (strcasecmp(cmd, "ENDFN") == 0) fn_depth--;
-        else if (strcasecmp(cmd, "CLASS") == 0) class_depth++;
-        else if (strcasecmp(cmd, "ENDCLASS") == 0) class_depth--;
+// NOT term, (condition), or a comparison up to the next AND / OR / ')'
+int cond_term(CondTree* t) {
+    cond_skip(t);
+    const char* p = t->text + t->pos;
+    if (cond_keyword(t->text, p, "NOT")) {
+        t->pos += 3;
+        int a = cond_term(t);
+        return a < 0 ? -1 : cond_node(t, COND_NOT, a, -1);
+    }
+    if (*p == '(') {
+        // A group only if a condition ends at the matching ')': (a + b) > c is a comparison
+        int depth = 0, quoted = 0, close = -1;
+        for (int i = t->pos; t->text[i] && close < 0; i++) {
+            char c = t->text[i];
+            if (c == '"') quoted = !quoted;
+            else if (!quoted && c == '(') depth++;
+            else if (!quoted && c == ')' && --depth == 0) close = i;
+        }
+        if (close < 0) return -1;
+        const char* after = t->text + close + 1;
+        while (isspace((unsigned char)*after)) after++;
+        if (*after == '\0' || *after == ')' || cond_keyword(t->text, after, "AND") || cond_keyword(t->text, after, "OR")) {
+            t->pos++;
+            int a = cond_or(t);
+            cond_skip(t);
+            if (a < 0 || t->text[t->pos] != ')') return -1;
+            t->pos++;
+            return a;
+        }
+    }
+    
+    int start = t->pos, depth = 0, quoted = 0;
+    for (; t->text[t->pos]; t->pos++) {
+        const char* c = t->text + t->pos;
+        if (*c == '"') quoted = !quoted;
+        if (quoted) continue;
+        if (*c == '(') depth++;
+        else if (*c == ')' && depth-- == 0) break;
+        else if (depth == 0 && (cond_keyword(t->text, c, "AND") || cond_keyword(t->text, c, "OR"))) break;
+    }
+    int end = t->pos;
+    while (end > start && isspace((unsigned char)t->text[end - 1])) end--;
+    if (end == start) return -1;
+    int n = cond_node(t, COND_LEAF, -1, -1);
+    if (n >= 0) {
+        t->nodes[n].start = start;
+        t->nodes[n].len = end - start;
+    }
+    return n;
+}
 
-        if (if_depth < 0) { fprintf(stderr, "Syntax Error: Unexpected ENDIF at line %d\n", i+1); exit(1); }
-        if (loop_depth_check < 0) { fprintf(stderr, "Syntax Error: Unexpected ENDLOOP at line %d\n", i+1); exit(1); }
-        if (fn_depth < 0) { fprintf(stderr, "Syntax Error: Unexpected ENDFN at line %d\n", i+1); exit(1); }
-        if (class_depth < 0) { fprintf(stderr, "Syntax Error: Unexpected ENDCLASS at line %d\n", i+1); exit(1); }
+int cond_and(CondTree* t) {
+    int a = cond_term(t);
+    for (cond_skip(t); a >= 0 && cond_keyword(t->text, t->text + t->pos, "AND"); cond_skip(t)) {
+        t->pos += 3;
+        int b = cond_term(t);
+        a = b < 0 ? -1 : cond_node(t, COND_AND, a, b);
     }
+    return a;
+}
 
-    if (if_depth > 0) { fprintf(stderr, "Syntax Error: Missing ENDIF detected\n"); exit(1); }
-    if (loop_depth_check > 0) { fprintf(stderr, "Syntax Error: Missing ENDLOOP detected\n"); exit(1); }
-    if (fn_depth > 0) { fprintf(stderr, "Syntax Error: Missing ENDFN detected\n"); exit(1); }
-    if (class_depth > 0) { fprintf(stderr, "Syntax Error: Missing ENDCLASS detected\n"); exit(1); }
+int cond_or(CondTree* t) {
+    int a = cond_and(t);
+    for (cond_skip(t); a >= 0 && cond_keyword(t->text, t->text + t->pos, "OR"); cond_skip(t)) {
+        t->pos += 2;
+        int b = cond_and(t);
+        a = b < 0 ? -1 : cond_node(t, COND_OR, a, b);
+    }
+    return a;
 }
 
-// ============ Command Handlers ============
+// Root node of `text`. Leaves are numbered in text order. Text that does
+// not parse is one comparison, as before conditions could be combined.
+int cond_parse(const char* text, CondTree* t) {
+    t->text = text;
+    t->pos = 0;
+    t->count = 0;
+    int root = cond_or(t);
+    cond_skip(t);
+    if (root >= 0 && t->text[t->pos] == '\0') return root;
+    t->count = 0;
+    root = cond_node(t, COND_LEAF, -1, -1);
+    t->nodes[root].len = (int)strlen(text);
+    return root;
+}
 
-void skip_to_endif(void);
-void skip_to_else_or_elif_or_endif(void);
-void execute_line(const char* line);
+void cond_leaf_text(const CondTree* t, int node, char* out) {
+    const CondNode* n = &t->nodes[node];
+    int len = n->len < MAX_LINE ? n->len : MAX_LINE - 1;
+    memcpy(out, t->text + n->start, len);
+    out[len] = '\0';
+}
 
-void cmd_ec(const char* args) {
-    char name[MAX_NAME], rest[MAX_LINE] = "";
-    if (sscanf(args, "%127s %[^\n]", name, rest) < 1) {
-        runtime_error("EC requires variable name");
+// Where each leaf goes next when it is true and when it is false: another
+// leaf (always a later one), COND_TRUE or COND_FALSE
+void cond_targets(const CondTree* t, int node, int on_true, int on_false, int* leaf_true, int* leaf_false) {
+    const CondNode* n = &t->nodes[node];
+    int first = n->kind == COND_LEAF ? -1 : n->b;
+    while (first >= 0 && t->nodes[first].kind != COND_LEAF) first = t->nodes[first].a;
+    switch (n->kind) {
+        case COND_AND:
+            cond_targets(t, n->a, first, on_false, leaf_true, leaf_false);
+            cond_targets(t, n->b, on_true, on_false, leaf_true, leaf_false);
+            break;
+        case COND_OR:
+            cond_targets(t, n->a, on_true, first, leaf_true, leaf_false);
+            cond_targets(t, n->b, on_true, on_false, leaf_true, leaf_false);
+            break;
+        case COND_NOT:
+            cond_targets(t, n->a, on_false, on_true, leaf_true, leaf_false);
+            break;
+        default:
+            leaf_true[node] = on_true;
+            leaf_false[node] = on_false;
+            break;
     }
-    
-    ECVar* v = get_or_create_var(name);
+}
+
+int is_string_var(const char* name) {
+    ECVar* v = find_var(name);
+    return v && v->type == TYPE_STRING;
+}
+
+// A comparison is made on text when either side is a quoted string or
+// both are string variables
+int compare_text(const char* left, const char* right) {
+    return left[0] == '"' || right[0] == '"' || (is_string_var(left) && is_string_var(right));
+}
+
+// One comparison, or a value tested for non-zero
+int evaluate_comparison(const char* cond) {
+    char buf[MAX_LINE];
+    strncpy(buf, cond, MAX_LINE - 1);
+    buf[MAX_LINE - 1] = '\0';
+    trim(buf);
+    
+    int cmp;
+    char* pos = find_compare(buf, &cmp);
+    if (!pos) return evaluate_expr(buf) != 0;
+    char* right = pos + strlen(compare_names[cmp]);
+    *pos = '\0';
+    trim(buf);
+    trim(right);
+    if (compare_text(buf, right)) {
+        char lbuf[MAX_LINE], rbuf[MAX_LINE];
+        int order = strcmp(get_string_value(buf, lbuf), get_string_value(right, rbuf));
+        return num_compare(num_int(order), num_int(0), cmp);
+    }
+    return num_compare(evaluate_num(buf), evaluate_num(right), cmp);
+}
+
+int cond_eval(const CondTree* t, int node) {
+    const CondNode* n = &t->nodes[node];
+    switch (n->kind) {
+        case COND_AND: return cond_eval(t, n->a) && cond_eval(t, n->b);
+        case COND_OR: return cond_eval(t, n->a) || cond_eval(t, n->b);
+        case COND_NOT: return !cond_eval(t, n->a);
+        default: {
+            char leaf[MAX_LINE];
+            cond_leaf_text(t, node, leaf);
+            return evaluate_comparison(leaf);
+        }
+    }
+}
+
+int evaluate_condition(const char* cond) {
+    CondTree t;
+    int root = cond_parse(cond, &t);
+    return cond_eval(&t, root);
+}
+
+// ============ Static Analysis ============
+
+int parse_exec_args(const char* args, char* command, char* var_name);
+int valid_case_values(const char* args);
+
+// Lines before `from` were checked already (see append_source). This is also
+// the one pass over a whole file: with `block_end`, block_end[i] is set to
+// the end line of the top-level FN/CLASS block starting at line i.
+void validate_syntax(int from, int* block_end) {
+    int if_depth = 0;
+    int loop_depth_check = 0;
+    int fn_depth = 0;
+    int class_depth = 0;
+    int exec_depth = 0;
+    int parloop_depth = 0;
+    int foreach_depth = 0;
+    int match_depth = 0;
+    int match_state[MAX_STACK];     // Per open MATCH: 0 before the first CASE, 1 in a CASE, 2 after DEFAULT
+    int block_start = -1, block_fn = 0;
+
+    for (int i = from; i < ctx->line_count; i++) {
+        const char* temp = ctx->lines[i];
+        while (isspace((unsigned char)*temp)) temp++;
+        if (*temp == '\0' || *temp == '#') continue;
+
+        char cmd[MAX_NAME];
+        size_t len = 0;
+        while (temp[len] && !isspace((unsigned char)temp[len]) && len < MAX_NAME - 1) len++;
+        memcpy(cmd, temp, len);
+        cmd[len] = '\0';
+        if (match_depth > 0 && match_state[match_depth - 1] == 0 && strncmp(cmd, "//", 2) != 0 &&
+            strcasecmp(cmd, "CASE") != 0 && strcasecmp(cmd, "DEFAULT") != 0 && strcasecmp(cmd, "ENDMATCH") != 0) {
+            fatal_error("Syntax Error: Expected CASE after MATCH at line %d\n", source_line(i));
+        }
+        
+        if (block_end && block_start < 0 && fn_depth == 0 && class_depth == 0 &&
+            (strcasecmp(cmd, "FN") == 0 || strcasecmp(cmd, "CLASS") == 0)) {
+            block_start = i;
+            block_fn = strcasecmp(cmd, "FN") == 0;
+        }
+
+        if (strcasecmp(cmd, "IF") == 0) if_depth++;
+        else if (strcasecmp(cmd, "ENDIF") == 0) if_depth--;
+        else if (strcasecmp(cmd, "LOOP") == 0) loop_depth_check++;
+        else if (strcasecmp(cmd, "ENDLOOP") == 0) loop_depth_check--;
+        else if (strcasecmp(cmd, "FN") == 0) fn_depth++;
+        else if (strcasecmp(cmd, "ENDFN") == 0) fn_depth--;
+        else if (strcasecmp(cmd, "CLASS") == 0) class_depth++;
+        else if (strcasecmp(cmd, "ENDCLASS") == 0) class_depth--;
+        else if (strcasecmp(cmd, "ENDEXEC") == 0) exec_depth--;
+        else if (strcasecmp(cmd, "PARLOOP") == 0) parloop_depth++;
+        else if (strcasecmp(cmd, "ENDPARLOOP") == 0) parloop_depth--;
+        else if (strcasecmp(cmd, "FOREACH") == 0) foreach_depth++;
+        else if (strcasecmp(cmd, "ENDFOREACH") == 0) foreach_depth--;
+        else if (strcasecmp(cmd, "MATCH") == 0) {
+            if (match_depth == MAX_STACK) fatal_error("Syntax Error: Blocks nested too deeply at line %d\n", source_line(i));
+            match_state[match_depth++] = 0;
+        }
+        else if (strcasecmp(cmd, "CASE") == 0 || strcasecmp(cmd, "DEFAULT") == 0) {
+            int is_case = toupper((unsigned char)cmd[0]) == 'C';
+            if (match_depth == 0) fatal_error("Syntax Error: %s outside MATCH at line %d\n", is_case ? "CASE" : "DEFAULT", source_line(i));
+            if (match_state[match_depth - 1] == 2) fatal_error("Syntax Error: %s after DEFAULT at line %d\n", is_case ? "CASE" : "DEFAULT", source_line(i));
+            if (is_case && !valid_case_values(temp + len)) {
+                fatal_error("Syntax Error: CASE values must be numbers or quoted strings at line %d\n", source_line(i));
+            }
+            match_state[match_depth - 1] = is_case ? 1 : 2;
+        }
+        else if (strcasecmp(cmd, "ENDMATCH") == 0 && --match_depth < 0) {
+            fatal_error("Syntax Error: Unexpected ENDMATCH at line %d\n", source_line(i));
+        }
+        else if (strcasecmp(cmd, "YIELD") == 0 && fn_depth == 0) fatal_error("Syntax Error: YIELD outside FN at line %d\n", source_line(i));
+        else if (strcasecmp(cmd, "IMPORT") == 0 && (fn_depth > 0 || class_depth > 0)) {
+            fatal_error("Syntax Error: IMPORT inside FN or CLASS at line %d\n", source_line(i));
+        }
+        else if (strcasecmp(cmd, "EXEC") == 0) {
+            char command[MAX_LINE], var_name[MAX_NAME], rest[MAX_LINE];
+            strcpy(rest, temp + len);
+            trim(rest);
+            if (parse_exec_args(rest, command, var_name)) exec_depth++;
+        }
+        
+        if (block_start >= 0 && i > block_start && (block_fn ? fn_depth : class_depth) == 0) {
+            block_end[block_start] = i;
+            block_start = -1;
+        }
+
+        if (if_depth < 0) fatal_error("Syntax Error: Unexpected ENDIF at line %d\n", source_line(i));
+        if (loop_depth_check < 0) fatal_error("Syntax Error: Unexpected ENDLOOP at line %d\n", source_line(i));
+        if (fn_depth < 0) fatal_error("Syntax Error: Unexpected ENDFN at line %d\n", source_line(i));
+        if (class_depth < 0) fatal_error("Syntax Error: Unexpected ENDCLASS at line %d\n", source_line(i));
+        if (exec_depth < 0) fatal_error("Syntax Error: Unexpected ENDEXEC at line %d\n", source_line(i));
+        if (parloop_depth < 0) fatal_error("Syntax Error: Unexpected ENDPARLOOP at line %d\n", source_line(i));
+        if (foreach_depth < 0) fatal_error("Syntax Error: Unexpected ENDFOREACH at line %d\n", source_line(i));
+    }
+
+    if (if_depth > 0) fatal_error("Syntax Error: Missing ENDIF detected\n");
+    if (loop_depth_check > 0) fatal_error("Syntax Error: Missing ENDLOOP detected\n");
+    if (fn_depth > 0) fatal_error("Syntax Error: Missing ENDFN detected\n");
+    if (class_depth > 0) fatal_error("Syntax Error: Missing ENDCLASS detected\n");
+    if (exec_depth > 0) fatal_error("Syntax Error: Missing ENDEXEC detected\n");
+    if (parloop_depth > 0) fatal_error("Syntax Error: Missing ENDPARLOOP detected\n");
+    if (foreach_depth > 0) fatal_error("Syntax Error: Missing ENDFOREACH detected\n");
+    if (match_depth > 0) fatal_error("Syntax Error: Missing ENDMATCH detected\n");
+}
+
+// ============ Compiler ============
+
+const char* op_names[OP_COUNT] = {
+    "", "EC", "SET", "ARR", "OUT", "IN",
+    "IF", "ELIF", "ELSE", "ENDIF",
+    "LOOP", "ENDLOOP", "BREAK", "CONTINUE", "PARLOOP", "ENDPARLOOP",
+    "FN", "ENDFN", "CALL", "RET",
+    "CLASS", "ENDCLASS", "NEW",
+    "ADD", "SUB", "MUL", "DIV", "MOD",
+    "EXEC", "ENDEXEC", "PYRUN", "CRUN",
+    "ASYNC", "WAIT", "WAITALL", "JOBS",
+    "OPEN", "READLINE", "WRITE", "CLOSE", "FOREACH", "ENDFOREACH",
+    "LOADCSV", "SAVECSV",
+    "MAT", "MATMUL", "TRANSPOSE", "MATADD", "MATSUB", "MATEMUL", "MATEDIV",
+    "YIELD", "IMPORT",
+    "MATCH", "CASE", "DEFAULT", "ENDMATCH",
+    "SEED", "MAP", "FILLRAND",
+    "END", "", "", "", "", "", ""
+};
+
+ECOpcode lookup_opcode(const char* cmd) {
+    for (int op = OP_EC; op < OP_UNKNOWN; op++) {
+        if (strcasecmp(cmd, op_names[op]) == 0) return (ECOpcode)op;
+    }
+    return OP_UNKNOWN;
+}
+
+const char* instr_args(const ECInstr* in) {
+    return ctx->pool + in->args;
+}
+
+// Slot of the pool index holding `text` (or the free slot for it)
+int* pool_slot(const char* text, size_t len, uint64_t hash) {
+    int mask = ctx->pool_slot_cap - 1;
+    for (int i = (int)(hash & mask); ; i = (i + 1) & mask) {
+        int offset = ctx->pool_slots[i];
+        if (offset < 0) return &ctx->pool_slots[i];
+        const char* s = ctx->pool_buffer.data + offset;
+        if (strncmp(s, text, len) == 0 && s[len] == '\0') return &ctx->pool_slots[i];
+    }
+}
+
+// Forget the pool index; strings from here on are not shared with earlier ones
+void pool_reset(void) {
+    free(ctx->pool_slots);
+    ctx->pool_slots = NULL;
+    ctx->pool_slot_cap = ctx->pool_slot_count = 0;
+}
+
+// Offset of a NUL-terminated copy of text[0..len) in the pool. Equal strings
+// share one copy, so repeated arguments and names are stored once.
+int pool_add(const char* text, size_t len) {
+    if ((ctx->pool_slot_count + 1) * 2 > ctx->pool_slot_cap) {
+        int cap = ctx->pool_slot_cap ? ctx->pool_slot_cap * 2 : 1024;
+        int* old = ctx->pool_slots;
+        int old_cap = ctx->pool_slot_cap;
+        if (!(ctx->pool_slots = (int*)malloc(cap * sizeof(int)))) fatal_error("Error: Out of memory loading program\n");
+        memset(ctx->pool_slots, 0xff, cap * sizeof(int));
+        ctx->pool_slot_cap = cap;
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i] < 0) continue;
+            const char* s = ctx->pool_buffer.data + old[i];
+            size_t n = strlen(s);
+            *pool_slot(s, n, memo_hash(s, n)) = old[i];
+        }
+        free(old);
+    }
+    uint64_t hash = memo_hash(text, len);
+    int* slot = pool_slot(text, len, hash);
+    if (*slot >= 0) return *slot;
+    
+    int offset = (int)ctx->pool_buffer.len;
+    buffer_append(&ctx->pool_buffer, text, len);
+    ctx->pool_buffer.len++;
+    *slot = offset;
+    ctx->pool_slot_count++;
+    return offset;
+}
+
+typedef struct {
+    int lines[MAX_STACK];
+    int top;
+} BlockStack;
+
+void block_push(BlockStack* st, int line) {
+    if (st->top >= MAX_STACK) fatal_error("Syntax Error: Blocks nested too deeply at line %d\n", line + 1);
+    st->lines[st->top++] = line;
+}
+
+// Pair a block opener with its end line (unbalanced ends were rejected by validate_syntax)
+void block_close(BlockStack* st, int line) {
+    if (st->top == 0) return;
+    int open = st->lines[--st->top];
+    ctx->code[open].jump = line;
+    ctx->code[line].jump = open;
+}
+
+// Lower lines [from, to) to instructions and resolve every block's jump
+// targets, so execution never scans the source for a matching END line. The
+// bodies of the blocks in `block_end` (see validate_syntax) are left to
+// compile_block: only their FN/CLASS and end lines are lowered now.
+void compile_lines(int from, int to, const int* block_end) {
+    int n = ctx->line_count;
+    BlockStack ifs, branches, loops, parloops, fns, classes, execs, foreachs, matches, cases;
+    ifs.top = branches.top = loops.top = parloops.top = fns.top = classes.top = execs.top = foreachs.top = 0;
+    matches.top = cases.top = 0;
+    
+    for (int i = from; i < to; i++) {
+        ECInstr* in = &ctx->code[i];
+        in->op = OP_NOP;
+        in->args = 0;
+        in->jump = in->end = i;
+        
+        char buf[MAX_LINE]; strcpy(buf, ctx->lines[i]); trim(buf);
+        if (buf[0] == '\0' || buf[0] == '#' || (buf[0] == '/' && buf[1] == '/')) continue;
+        
+        char cmd[MAX_NAME], args[MAX_LINE] = "";
+        sscanf(buf, "%127s %[^\n]", cmd, args);
+        trim(args);
+        in->op = lookup_opcode(cmd);
+        in->args = in->op == OP_UNKNOWN ? pool_add(cmd, strlen(cmd)) : pool_add(args, strlen(args));
+        
+        switch (in->op) {
+            case OP_IF:
+                block_push(&ifs, i);
+                block_push(&branches, i);
+                break;
+            case OP_ELIF:
+            case OP_ELSE:
+                // Chain from the previous branch; a stray one skips to the end of the program
+                if (branches.top == 0) { in->jump = in->end = n - 1; break; }
+                ctx->code[branches.lines[branches.top - 1]].jump = i;
+                branches.lines[branches.top - 1] = i;
+                break;
+            case OP_ENDIF:
+                if (ifs.top == 0) break;
+                ctx->code[branches.lines[--branches.top]].jump = i;
+                for (int b = ifs.lines[--ifs.top]; b != i; b = ctx->code[b].jump) ctx->code[b].end = i;
+                break;
+            case OP_LOOP: block_push(&loops, i); break;
+            case OP_ENDLOOP: block_close(&loops, i); break;
+            case OP_PARLOOP: block_push(&parloops, i); break;
+            case OP_ENDPARLOOP: block_close(&parloops, i); break;
+            case OP_FN: block_push(&fns, i); break;
+            case OP_ENDFN: block_close(&fns, i); break;
+            case OP_CLASS: block_push(&classes, i); break;
+            case OP_ENDCLASS: block_close(&classes, i); break;
+            case OP_EXEC: {
+                char command[MAX_LINE], var_name[MAX_NAME];
+                if (parse_exec_args(args, command, var_name)) block_push(&execs, i);
+                break;
+            }
+            case OP_ENDEXEC: block_close(&execs, i); break;
+            case OP_FOREACH: block_push(&foreachs, i); break;
+            case OP_ENDFOREACH: block_close(&foreachs, i); break;
+            case OP_MATCH:
+                block_push(&matches, i);
+                block_push(&cases, i);
+                break;
+            case OP_CASE:
+            case OP_DEFAULT:
+                // Chained like ELIF/ELSE (see cmd_match)
+                if (cases.top == 0) { in->jump = in->end = n - 1; break; }
+                ctx->code[cases.lines[cases.top - 1]].jump = i;
+                cases.lines[cases.top - 1] = i;
+                break;
+            case OP_ENDMATCH:
+                if (matches.top == 0) break;
+                ctx->code[cases.lines[--cases.top]].jump = i;
+                for (int b = matches.lines[--matches.top]; b != i; b = ctx->code[b].jump) ctx->code[b].end = i;
+                break;
+            default: break;
+        }
+        
+        if (block_end && block_end[i] > i + 1) {
+            int end = block_end[i];
+            for (int k = i + 1; k < end; k++) {
+                ctx->code[k].op = OP_NOP;
+                ctx->code[k].args = 0;
+                ctx->code[k].jump = ctx->code[k].end = k;
+            }
+            ctx->code[i + 1].op = OP_LAZY;
+            ctx->code[i + 1].jump = end;
+            i = end - 1;
+        }
+    }
+    ctx->pool = ctx->pool_buffer.data;
+}
+
+// Lines before `from` are already compiled (reload_file appends blocks after them)
+void compile_program(int from, const int* block_end) {
+    int n = ctx->line_count;
+    ECInstr* code = (ECInstr*)realloc(ctx->code, (n > 0 ? n : 1) * sizeof(ECInstr));
+    if (!code) fatal_error("Error: Out of memory loading program\n");
+    ctx->code = code;
+    memset(code + from, 0, ((n > 0 ? n : 1) - from) * sizeof(ECInstr));
+    if (from == 0) {
+        buffer_clear(&ctx->pool_buffer);
+        pool_reset();
+        pool_add("", 0);
+    }
+    compile_lines(from, n, block_end);
+}
+
+// ============ Optimizer ============
+
+#define FOLD_MAX_OPERANDS 64
+
+// Numeric EC declarations that are safe to substitute into later code
+typedef struct {
+    char name[MAX_NAME];
+    char value[64];
+} FoldConstant;
+
+typedef struct {
+    FoldConstant items[MAX_VARS];
+    int count;
+} FoldTable;
+
+typedef struct {
+    char* text;
+    int is_const;
+    ECNum value;
+} FoldOperand;
+
+// Text that parses back to the same number and subtype. Only plain decimal
+// forms survive re-parsing (evaluate_num splits "1e+20" at '+'); integral
+// doubles get a ".0" so they do not turn into integers.
+int format_constant(ECNum value, char* out) {
+    if (value.is_int) {
+        snprintf(out, 64, "%lld", (long long)value.i);
+        return 1;
+    }
+    if (!isfinite(value.d)) return 0;
+    snprintf(out, 64, "%.17g", value.d);
+    if (strpbrk(out, "eE")) return 0;
+    if (!strchr(out, '.')) strcat(out, ".0");
+    return 1;
+}
+
+const char* lookup_constant(const FoldTable* table, const char* name) {
+    if (!table) return NULL;
+    for (int i = table->count - 1; i >= 0; i--) {
+        if (strcmp(table->items[i].name, name) == 0) return table->items[i].value;
+    }
+    return NULL;
+}
+
+int is_identifier(const char* s) {
+    if (!isalpha((unsigned char)*s) && *s != '_') return 0;
+    while (*++s) if (!isalnum((unsigned char)*s) && *s != '_') return 0;
+    return 1;
+}
+
+int fold_expr(const FoldTable* table, const char* expr, char* out, ECNum* value);
+
+// Classify one operand the way parse_value / evaluate_expr would read it
+void fold_operand(const FoldTable* table, FoldOperand* op, const char* token, int* changed) {
+    char buf[MAX_LINE];
+    strcpy(buf, token);
+    trim(buf);
+    op->is_const = 0;
+    
+    size_t len = strlen(buf);
+    if (buf[0] == '(' && len > 1 && buf[len - 1] == ')') {
+        char inner[MAX_LINE], folded[MAX_LINE];
+        memcpy(inner, buf + 1, len - 2);
+        inner[len - 2] = '\0';
+        char num[64];
+        if (fold_expr(table, inner, folded, &op->value) && format_constant(op->value, num)) {
+            op->is_const = 1;
+            *changed = 1;
+            op->text = strdup(num);
+            return;
+        }
+        size_t flen = strlen(folded);
+        if (strcmp(folded, inner) != 0 && flen + 2 < MAX_LINE) {
+            *changed = 1;
+            buf[0] = '(';
+            memcpy(buf + 1, folded, flen);
+            strcpy(buf + flen + 1, ")");
+        }
+    } else if (is_number(buf)) {
+        op->is_const = 1;
+        op->value = parse_number(buf);
+    } else {
+        const char* constant = lookup_constant(table, buf);
+        if (constant) {
+            op->is_const = 1;
+            op->value = parse_number(constant);
+            *changed = 1;
+            strcpy(buf, constant);
+        }
+    }
+    op->text = strdup(buf);
+}
+
+// Fold constant subexpressions of `expr` into `out`, keeping evaluate_expr's
+// left-to-right precedence. Returns 1 (and sets *value) when the whole
+// expression is constant. `out` is `expr` unchanged if nothing could be folded.
+int fold_expr(const FoldTable* table, const char* expr, char* out, ECNum* value) {
+    char buf[MAX_LINE];
+    strncpy(buf, expr, MAX_LINE - 1);
+    buf[MAX_LINE - 1] = '\0';
+    trim(buf);
+    strcpy(out, buf);
+    if (buf[0] == '\0') return 0;
+    
+    FoldOperand operands[FOLD_MAX_OPERANDS + 1];
+    char ops[FOLD_MAX_OPERANDS];
+    int count = 0, op_count = 0, changed = 0, valid = 1;
+    char token[MAX_LINE];
+    int token_pos = 0, paren_depth = 0;
+    
+    for (int i = 0; buf[i] && valid; i++) {
+        char c = buf[i];
+        if (c == '(') paren_depth++;
+        else if (c == ')') paren_depth--;
+        else if (paren_depth == 0 && strchr("+-*/%", c)) {
+            if (c == '-' && token_pos == 0 && count == 0) { token[token_pos++] = c; continue; }
+            token[token_pos] = '\0';
+            if (token_pos == 0 || count == FOLD_MAX_OPERANDS) { valid = 0; break; }
+            fold_operand(table, &operands[count++], token, &changed);
+            ops[op_count++] = c;
+            token_pos = 0;
+            continue;
+        }
+        token[token_pos++] = c;
+    }
+    if (valid && token_pos > 0) {
+        token[token_pos] = '\0';
+        fold_operand(table, &operands[count++], token, &changed);
+    } else valid = 0;
+    
+    // Fold a constant pair only where evaluate_expr would combine it first:
+    // c1*c2 at the start of a term, c1+c2 at the very start before +, - or the end
+    for (int k = 0; valid && k < op_count; k++) {
+        if (!operands[k].is_const || !operands[k + 1].is_const) continue;
+        char op = ops[k];
+        ECNum b = operands[k + 1].value;
+        if (get_precedence(op) == 2) {
+            if (k > 0 && get_precedence(ops[k - 1]) == 2) continue;
+        } else if (k > 0 || (k + 1 < op_count && get_precedence(ops[k + 1]) == 2)) continue;
+        if ((op == '/' || op == '%') && num_value(b) == 0) continue;
+        
+        ECNum result = num_apply(operands[k].value, b, op);
+        char num[64];
+        if (!format_constant(result, num)) continue;
+        
+        free(operands[k].text);
+        free(operands[k + 1].text);
+        operands[k].text = strdup(num);
+        operands[k].value = result;
+        memmove(&operands[k + 1], &operands[k + 2], (count - k - 2) * sizeof(FoldOperand));
+        memmove(&ops[k], &ops[k + 1], (op_count - k - 1) * sizeof(char));
+        count--;
+        op_count--;
+        changed = 1;
+        k = -1;
+    }
+    
+    int constant = valid && count == 1 && operands[0].is_const;
+    if (constant) *value = operands[0].value;
+    
+    if (valid && changed) {
+        // No spaces around operators: OUT splits its arguments on " + "
+        size_t len = 0;
+        out[0] = '\0';
+        for (int k = 0; k < count; k++) {
+            const char* text = operands[k].text;
+            int wrap = k > 0 && text[0] == '-';
+            len += snprintf(out + len, MAX_LINE - len, wrap ? "(%s)" : "%s", text);
+            if (k < op_count) len += snprintf(out + len, MAX_LINE - len, "%c", ops[k]);
+            if (len >= MAX_LINE) { strcpy(out, buf); constant = 0; break; }
+        }
+    }
+    for (int k = 0; k < count; k++) free(operands[k].text);
+    return constant;
+}
+
+// One comparison (same split as evaluate_comparison); 1 with *result set
+// when it is constant
+int fold_comparison(const FoldTable* table, const char* cond, char* out, int* result) {
+    char buf[MAX_LINE];
+    strncpy(buf, cond, MAX_LINE - 1);
+    buf[MAX_LINE - 1] = '\0';
+    trim(buf);
+    strcpy(out, buf);
+    if (strchr(buf, '"')) return 0;
+    
+    int cmp;
+    char* pos = find_compare(buf, &cmp);
+    if (pos) {
+        char left[MAX_LINE], right[MAX_LINE];
+        ECNum lval, rval;
+        *pos = '\0';
+        int lconst = fold_expr(table, buf, left, &lval);
+        int rconst = fold_expr(table, pos + strlen(compare_names[cmp]), right, &rval);
+        if (lconst && rconst) {
+            *result = num_compare(lval, rval, cmp);
+            return 1;
+        }
+        if (strlen(left) + strlen(right) + 4 >= MAX_LINE) strcpy(out, cond);
+        else sprintf(out, "%s %s %s", left, compare_names[cmp], right);
+        return 0;
+    }
+    
+    ECNum v;
+    if (fold_expr(table, buf, out, &v)) { *result = num_value(v) != 0; return 1; }
+    return 0;
+}
+
+// Folds `node` into out ("" on overflow) and *top to the operator that
+// joins it; returns 0 / 1 when its value is known, -1 otherwise. Known
+// operands only drop out where evaluation order would skip them anyway or
+// where they have no effect on the result.
+int fold_cond_node(const FoldTable* table, const CondTree* t, int node, char* out, int* top) {
+    const CondNode* n = &t->nodes[node];
+    *top = COND_LEAF;
+    if (n->kind == COND_LEAF) {
+        char leaf[MAX_LINE];
+        int result;
+        cond_leaf_text(t, node, leaf);
+        return fold_comparison(table, leaf, out, &result) ? result : -1;
+    }
+    
+    char a[MAX_LINE], b[MAX_LINE];
+    int a_top, b_top;
+    int left = fold_cond_node(table, t, n->a, a, &a_top);
+    if (n->kind == COND_NOT) {
+        if (left >= 0) return !left;
+        int group = a_top == COND_AND || a_top == COND_OR;
+        if (snprintf(out, MAX_LINE, group ? "NOT (%s)" : "NOT %s", a) >= MAX_LINE) out[0] = '\0';
+        *top = COND_NOT;
+        return -1;
+    }
+    
+    int and = n->kind == COND_AND;
+    if (left == !and) return left;          // 0 AND x, 1 OR x
+    int right = fold_cond_node(table, t, n->b, b, &b_top);
+    if (left >= 0) { strcpy(out, b); *top = b_top; return right; }
+    if (right == and) { strcpy(out, a); *top = a_top; return -1; }    // x AND 1, x OR 0
+    if (right >= 0) strcpy(b, right ? "1" : "0");
+    
+    // Only an OR inside an AND needs its parentheses back
+    int wrap_a = and && a_top == COND_OR;
+    int wrap_b = and && right < 0 && b_top == COND_OR;
+    if (!a[0] || !b[0] || snprintf(out, MAX_LINE, "%s%s%s %s %s%s%s", wrap_a ? "(" : "", a, wrap_a ? ")" : "",
+                                   and ? "AND" : "OR", wrap_b ? "(" : "", b, wrap_b ? ")" : "") >= MAX_LINE) {
+        out[0] = '\0';
+    }
+    *top = n->kind;
+    return -1;
+}
+
+// Constant conditions become "1" or "0"
+int fold_condition(const FoldTable* table, const char* cond, char* out) {
+    CondTree t;
+    int root = cond_parse(cond, &t);
+    int top;
+    int result = fold_cond_node(table, &t, root, out, &top);
+    if (result >= 0) { strcpy(out, result ? "1" : "0"); return 1; }
+    if (out[0] == '\0') strcpy(out, cond);
+    return 0;
+}
+
+void set_instr_args(ECInstr* in, const char* args) {
+    if (strcmp(args, instr_args(in)) == 0) return;
+    in->args = pool_add(args, strlen(args));
+    ctx->pool = ctx->pool_buffer.data;
+}
+
+int contains_word(const char* text, const char* word) {
+    size_t len = strlen(word);
+    for (const char* p = strstr(text, word); p; p = strstr(p + 1, word)) {
+        int before = p > text && (isalnum((unsigned char)p[-1]) || p[-1] == '_');
+        int after = isalnum((unsigned char)p[len]) || p[len] == '_';
+        if (!before && !after) return 1;
+    }
+    return 0;
+}
+
+int call_result_name(const char* args, char* name);
+
+// Conservative: any command not known to only read its arguments is
+// assumed to write every variable it mentions
+int op_may_write(int op, const char* args, const char* name) {
+    switch (op) {
+        case OP_NOP: case OP_IF: case OP_ELIF: case OP_ELSE: case OP_ENDIF:
+        case OP_LOOP: case OP_ENDLOOP: case OP_BREAK: case OP_CONTINUE: case OP_ENDPARLOOP:
+        case OP_ENDFN: case OP_RET: case OP_ENDCLASS: case OP_OUT:
+        case OP_ENDEXEC: case OP_WAITALL: case OP_JOBS: case OP_END: case OP_JUMP:
+        case OP_WRITE: case OP_CLOSE: case OP_ENDFOREACH: case OP_SAVECSV: case OP_YIELD: case OP_IMPORT:
+        case OP_MATCH: case OP_CASE: case OP_DEFAULT: case OP_ENDMATCH: case OP_SEED:
+            return 0;
+        case OP_CALL: {
+            char result[MAX_NAME];
+            return call_result_name(args, result) && strcmp(result, name) == 0;
+        }
+        case OP_EC: case OP_SET: case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: {
+            char target[MAX_NAME] = "";
+            sscanf(args, "%127[^ \t[]", target);
+            return strcmp(target, name) == 0;
+        }
+        default:
+            return contains_word(args, name);
+    }
+}
+
+int instr_may_write(const ECInstr* in, const char* name) {
+    return op_may_write(in->op, instr_args(in), name);
+}
+
+// Whether a line in [from, to) other than `skip` may write `name`. Bodies
+// not compiled yet (OP_LAZY) are checked on their source text.
+int lines_may_write(int from, int to, int skip, const char* name) {
+    for (int i = from; i < to; i++) {
+        const ECInstr* in = &ctx->code[i];
+        if (in->op != OP_LAZY) {
+            if (i != skip && instr_may_write(in, name)) return 1;
+            continue;
+        }
+        for (int end = in->jump; i < end && i < to; i++) {
+            if (!contains_word(ctx->lines[i], name)) continue;
+            char buf[MAX_LINE], cmd[MAX_NAME], args[MAX_LINE] = "";
+            strcpy(buf, ctx->lines[i]);
+            trim(buf);
+            if (sscanf(buf, "%127s %[^\n]", cmd, args) < 1 || cmd[0] == '#' || strncmp(cmd, "//", 2) == 0) continue;
+            trim(args);
+            int op = lookup_opcode(cmd);
+            if (op_may_write(op, op == OP_UNKNOWN ? cmd : args, name)) return 1;
+        }
+        i--;
+    }
+    return 0;
+}
+
+int is_simple_statement(const ECInstr* in) {
+    switch (in->op) {
+        case OP_EC: case OP_SET: case OP_ARR: case OP_OUT: case OP_IN: case OP_BREAK: case OP_CONTINUE:
+        case OP_CALL: case OP_RET: case OP_NEW: case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+        case OP_PYRUN: case OP_CRUN: case OP_ASYNC: case OP_WAIT: case OP_WAITALL: case OP_JOBS: case OP_END:
+        case OP_OPEN: case OP_READLINE: case OP_WRITE: case OP_CLOSE: case OP_LOADCSV: case OP_SAVECSV:
+        case OP_MAT: case OP_MATMUL: case OP_TRANSPOSE: case OP_MATADD: case OP_MATSUB: case OP_MATEMUL:
+        case OP_MATEDIV: case OP_YIELD: case OP_IMPORT: case OP_SEED: case OP_MAP: case OP_FILLRAND:
+        case OP_UNKNOWN:
+            return 1;
+        case OP_EXEC:
+            return in->jump == (int)(in - ctx->code);
+        default:
+            return 0;
+    }
+}
+
+// Lines strictly between `from` and `to` can never run; drop their statements
+// but keep block structure and FN/CLASS bodies (reachable through CALL)
+void mark_dead(int from, int to) {
+    for (int j = from + 1; j < to; j++) {
+        ECInstr* in = &ctx->code[j];
+        if (in->op == OP_FN || in->op == OP_CLASS) j = in->jump;
+        else if (is_simple_statement(in)) in->op = OP_NOP;
+    }
+}
+
+void fold_out_args(const FoldTable* table, const char* args, char* out) {
+    char buf[MAX_LINE], part[MAX_LINE], folded[MAX_LINE];
+    ECNum v;
+    strcpy(buf, args);
+    out[0] = '\0';
+    size_t len = 0;
+    
+    char* token = buf;
+    for (;;) {
+        char* plus = strstr(token, " + ");
+        if (plus) *plus = '\0';
+        strcpy(part, token);
+        trim(part);
+        size_t plen = strlen(part);
+        if (part[0] == '"' && plen > 1 && part[plen - 1] == '"') strcpy(folded, part);
+        else fold_expr(table, part, folded, &v);
+        len += snprintf(out + len, MAX_LINE - len, "%s%s", folded, plus ? " + " : "");
+        if (len >= MAX_LINE) { strcpy(out, args); return; }
+        if (!plus) break;
+        token = plus + 3;
+    }
+}
+
+void fold_call_args(const FoldTable* table, const char* args, char* out) {
+    strcpy(out, args);
+    const char* paren = strchr(args, '(');
+    const char* end = paren ? strchr(paren, ')') : NULL;
+    if (!end) return;
+    
+    char params[MAX_LINE], piece[MAX_LINE], folded[MAX_LINE];
+    size_t plen = end - paren - 1;
+    memcpy(params, paren + 1, plen);
+    params[plen] = '\0';
+    if (strchr(params, '(') || strchr(params, '"')) return;
+    
+    size_t len = paren - args + 1;
+    memcpy(out, args, len);
+    char* save;
+    ECNum v;
+    for (char* tok = strtok_r(params, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        strcpy(piece, tok);
+        fold_expr(table, piece, folded, &v);
+        len += snprintf(out + len, MAX_LINE - len, "%s%s", len > (size_t)(paren - args + 1) ? ", " : "", folded);
+        if (len >= MAX_LINE) { strcpy(out, args); return; }
+    }
+    snprintf(out + len, MAX_LINE - len, "%s", end);
+    if (len >= MAX_LINE) strcpy(out, args);
+}
+
+// Constant folding, constant propagation from single-assignment top-level
+// EC declarations (unless `propagate` is 0), and removal of IF/ELIF branches
+// that can never be taken. Runs after compile_program, so precompiled images
+// carry the result.
+void optimize_program(int from, int to, int propagate) {
+    FoldTable* table = (FoldTable*)calloc(1, sizeof(FoldTable));
+    if (!table) fatal_error("Error: Out of memory loading program\n");
+    int depth = 0, body_depth = 0;
+    
+    for (int i = from; i < to; i++) {
+        ECInstr* in = &ctx->code[i];
+        // Constants are only substituted into top-level code that runs after
+        // the declaration; FN bodies may be called before it
+        const FoldTable* consts = body_depth == 0 ? table : NULL;
+        char args[MAX_LINE], out[MAX_LINE];
+        strcpy(args, instr_args(in));
+        ECNum v;
+        
+        switch (in->op) {
+            case OP_EC: case OP_SET: case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: {
+                char target[MAX_NAME], rest[MAX_LINE] = "";
+                if (sscanf(args, "%127s %[^\n]", target, rest) < 2 || rest[0] == '"') break;
+                int constant = fold_expr(consts, rest, out, &v);
+                size_t tlen = strlen(target), olen = strlen(out);
+                if (tlen + olen + 2 < MAX_LINE) {
+                    memcpy(args, target, tlen);
+                    args[tlen] = ' ';
+                    memcpy(args + tlen + 1, out, olen + 1);
+                    set_instr_args(in, args);
+                }
+                
+                char num[64];
+                if (in->op == OP_EC && propagate && constant && depth == 0 && table->count < MAX_VARS &&
+                    is_identifier(target) && format_constant(v, num)) {
+                    if (!lines_may_write(0, ctx->line_count, i, target)) {
+                        strcpy(table->items[table->count].name, target);
+                        strcpy(table->items[table->count].value, num);
+                        table->count++;
+                    }
+                }
+                break;
+            }
+            case OP_IF: case OP_ELIF: case OP_LOOP:
+                if (args[0] == '\0') break;
+                fold_condition(consts, args, out);
+                set_instr_args(in, out);
+                break;
+            case OP_RET: case OP_MATCH:
+                if (args[0] == '\0' || args[0] == '"') break;
+                fold_expr(consts, args, out, &v);
+                set_instr_args(in, out);
+                break;
+            case OP_OUT:
+                fold_out_args(consts, args, out);
+                set_instr_args(in, out);
+                break;
+            case OP_CALL:
+                fold_call_args(consts, args, out);
+                set_instr_args(in, out);
+                break;
+            default:
+                break;
+        }
+        
+        switch (in->op) {
+            case OP_FN: case OP_CLASS: body_depth++; depth++; break;
+            case OP_ENDFN: case OP_ENDCLASS: body_depth--; depth--; break;
+            case OP_IF: case OP_LOOP: case OP_PARLOOP: case OP_FOREACH: case OP_MATCH: depth++; break;
+            case OP_ENDIF: case OP_ENDLOOP: case OP_ENDPARLOOP: case OP_ENDEXEC: case OP_ENDFOREACH: case OP_ENDMATCH:
+                depth--;
+                break;
+            case OP_EXEC: if (in->jump != i) depth++; break;
+            default: break;
+        }
+    }
+    free(table);
+    
+    // Dead branches
+    for (int i = from; i < to; i++) {
+        ECInstr* in = &ctx->code[i];
+        if (in->op != OP_IF) continue;
+        int first_branch = in->jump;
+        
+        int prev = i;
+        for (int b = in->jump; ctx->code[b].op == OP_ELIF; b = ctx->code[b].jump) {
+            if (strcmp(instr_args(&ctx->code[b]), "0") == 0) {
+                ctx->code[prev].jump = ctx->code[b].jump;
+                mark_dead(b, ctx->code[b].jump);
+            } else prev = b;
+        }
+        
+        const char* cond = instr_args(in);
+        ECInstr* target = &ctx->code[in->jump];
+        if (strcmp(cond, "1") == 0) {
+            in->op = OP_NOP;
+            mark_dead(first_branch, in->end);
+        } else if (strcmp(cond, "0") == 0) {
+            mark_dead(i, first_branch);
+            if (target->op != OP_ELIF || strcmp(instr_args(target), "1") == 0) {
+                in->op = OP_JUMP;
+                mark_dead(i, in->jump);
+            }
+        }
+    }
+}
+
+// ============ Superinstructions ============
+
+// Fusion targets come from dynamic opcode counts over examples/ and bench/:
+// ADD -> ENDLOOP -> LOOP, SET with small arithmetic or an array load, and
+// LOOP/IF comparing two plain values dominate. Their operands are decoded
+// once into ECOperands so the hot paths skip sscanf and evaluate_expr.
+
+#define FUSE_MAX_VALUES 3
+
+void cmd_loop(const char* args);
+void cmd_endloop(const char* args);
+int decode_match(int line);
+
+// Append the operand for a number, plain variable or name[number|variable]
+int decode_value(const char* text) {
+    char buf[MAX_LINE];
+    strncpy(buf, text, MAX_LINE - 1);
+    buf[MAX_LINE - 1] = '\0';
+    trim(buf);
+    
+    ECOperand op;
+    memset(&op, 0, sizeof(op));
+    if (is_number(buf)) {
+        ECNum n = parse_number(buf);
+        op.kind = n.is_int ? OPND_INT : OPND_NUMBER;
+        op.num = num_value(n);
+        op.ival = n.is_int ? n.i : 0;
+        buffer_append(&ctx->operand_buffer, (const char*)&op, sizeof(op));
+        return 1;
+    }
+    
+    char* bracket = strchr(buf, '[');
+    size_t len = strlen(buf);
+    if (bracket) {
+        if (buf[len - 1] != ']' || strchr(bracket, ']') != buf + len - 1) return 0;
+        *bracket = '\0';
+        buf[len - 1] = '\0';
+        if (!is_identifier(buf)) return 0;
+        op.kind = OPND_ELEM;
+        op.name = pool_add(buf, strlen(buf));
+        size_t mark = ctx->operand_buffer.len;
+        buffer_append(&ctx->operand_buffer, (const char*)&op, sizeof(op));
+        char* index = bracket + 1;
+        trim(index);
+        if (strchr(index, '[') || !decode_value(index)) { ctx->operand_buffer.len = mark; return 0; }
+        return 1;
+    }
+    
+    if (!is_identifier(buf)) return 0;
+    op.kind = OPND_VAR;
+    op.name = pool_add(buf, strlen(buf));
+    buffer_append(&ctx->operand_buffer, (const char*)&op, sizeof(op));
+    return 1;
+}
+
+// Decode an expression of up to FUSE_MAX_VALUES values, splitting it exactly
+// like evaluate_expr; *ops receives the operator characters
+int decode_expr(const char* expr, int32_t* ops) {
+    char buf[MAX_LINE], token[MAX_LINE];
+    strncpy(buf, expr, MAX_LINE - 1);
+    buf[MAX_LINE - 1] = '\0';
+    trim(buf);
+    if (buf[0] == '\0' || strchr(buf, '(')) return 0;
+    
+    size_t mark = ctx->operand_buffer.len;
+    int values = 0, token_pos = 0;
+    *ops = 0;
+    for (int i = 0; ; i++) {
+        char c = buf[i];
+        if (c && !strchr("+-*/%", c)) { token[token_pos++] = c; continue; }
+        if (c == '-' && token_pos == 0 && values == 0) { token[token_pos++] = c; continue; }
+        
+        token[token_pos] = '\0';
+        if (token_pos == 0 || values == FUSE_MAX_VALUES || !decode_value(token)) {
+            ctx->operand_buffer.len = mark;
+            return 0;
+        }
+        if (c == '\0') break;
+        *ops |= (int32_t)(unsigned char)c << (8 * values);
+        values++;
+        token_pos = 0;
+    }
+    return 1;
+}
+
+// `left CMP right` with one value per side; same split as evaluate_comparison
+int decode_condition(const char* cond, int32_t* cmp) {
+    char buf[MAX_LINE];
+    strncpy(buf, cond, MAX_LINE - 1);
+    buf[MAX_LINE - 1] = '\0';
+    trim(buf);
+    
+    int i;
+    char* pos = find_compare(buf, &i);
+    if (!pos) return 0;
+    size_t mark = ctx->operand_buffer.len;
+    *pos = '\0';
+    if (!decode_value(buf) || !decode_value(pos + strlen(compare_names[i]))) {
+        ctx->operand_buffer.len = mark;
+        return 0;
+    }
+    *cmp = i + 1;
+    return 1;
+}
+
+#define COND_PROGRAM 7          // ECInstr.ops of a decoded compound condition
+#define TEST_TRUTH 6            // OPND_TEST kinds after compares 0-5
+#define TEST_EXPR 7
+
+// A compound condition becomes a header (OPND_INT, ival = operand count)
+// followed by one step per comparison, in text order. A step is an
+// OPND_TEST (name = compare 0-5, TEST_TRUTH with one value or TEST_EXPR
+// with an OPND_EXPR) whose ival packs the operand offsets, from the header,
+// of the steps to go to when it is true (high half) and false (low half),
+// or COND_TRUE / COND_FALSE.
+int decode_program(const char* cond) {
+    CondTree t;
+    int root = cond_parse(cond, &t);
+    if (t.nodes[root].kind == COND_LEAF) return 0;
+    
+    int leaf_true[MAX_COND], leaf_false[MAX_COND], step_at[MAX_COND];
+    cond_targets(&t, root, COND_TRUE, COND_FALSE, leaf_true, leaf_false);
+    
+    ECOperand op;
+    memset(&op, 0, sizeof(op));
+    op.kind = OPND_INT;
+    size_t start = ctx->operand_buffer.len;
+    buffer_append(&ctx->operand_buffer, (const char*)&op, sizeof(op));
+    for (int n = 0; n < t.count; n++) {
+        if (t.nodes[n].kind != COND_LEAF) continue;
+        char leaf[MAX_LINE];
+        cond_leaf_text(&t, n, leaf);
+        step_at[n] = (int)((ctx->operand_buffer.len - start) / sizeof(ECOperand));
+        size_t step = ctx->operand_buffer.len;
+        op.kind = OPND_TEST;
+        buffer_append(&ctx->operand_buffer, (const char*)&op, sizeof(op));
+        
+        int32_t cmp;
+        if (!strchr(leaf, '"') && decode_condition(leaf, &cmp)) cmp--;
+        else if (!strchr(leaf, '"') && !find_compare(leaf, &cmp) && decode_value(leaf)) cmp = TEST_TRUTH;
+        else {
+            ECOperand expr;
+            memset(&expr, 0, sizeof(expr));
+            expr.kind = OPND_EXPR;
+            expr.name = pool_add(leaf, strlen(leaf));
+            buffer_append(&ctx->operand_buffer, (const char*)&expr, sizeof(expr));
+            cmp = TEST_EXPR;
+        }
+        ((ECOperand*)(ctx->operand_buffer.data + step))->name = cmp;
+    }
+    
+    ECOperand* program = (ECOperand*)(ctx->operand_buffer.data + start);
+    program->ival = (int64_t)((ctx->operand_buffer.len - start) / sizeof(ECOperand));
+    for (int n = 0; n < t.count; n++) {
+        if (t.nodes[n].kind != COND_LEAF) continue;
+        int on_true = leaf_true[n] < 0 ? leaf_true[n] : step_at[leaf_true[n]];
+        int on_false = leaf_false[n] < 0 ? leaf_false[n] : step_at[leaf_false[n]];
+        program[step_at[n]].ival = (int64_t)(((uint64_t)(uint32_t)on_true << 32) | (uint32_t)on_false);
+    }
+    return 1;
+}
+
+int test_target(const ECOperand* step, int truth) {
+    return truth ? (int32_t)(uint32_t)((uint64_t)step->ival >> 32) : (int32_t)(uint32_t)step->ival;
+}
+
+// Operand slots of one value (an OPND_ELEM carries its index), 0 if malformed
+int value_span(const ECOperand* operands, int at, int end) {
+    if (at >= end || operands[at].kind > OPND_ELEM) return 0;
+    if (operands[at].kind != OPND_ELEM) return 1;
+    return at + 1 < end && operands[at + 1].kind < OPND_ELEM ? 2 : 0;
+}
+
+// Length of the condition program at `at`, -1 if a step or a jump is malformed
+int program_span(const ECOperand* operands, int count, int at) {
+    if (at >= count || operands[at].kind != OPND_INT || operands[at].ival < 2 || operands[at].ival > count - at) return -1;
+    int span = (int)operands[at].ival, end = at + span;
+    for (int k = 1; k < span; ) {
+        const ECOperand* step = &operands[at + k];
+        if (step->kind != OPND_TEST || step->name < 0 || step->name > TEST_EXPR) return -1;
+        for (int truth = 0; truth < 2; truth++) {
+            int target = test_target(step, truth);
+            if (target != COND_TRUE && target != COND_FALSE &&
+                (target <= k || target >= span || operands[at + target].kind != OPND_TEST)) return -1;
+        }
+        k++;
+        if (step->name == TEST_EXPR) {
+            if (at + k >= end || operands[at + k].kind != OPND_EXPR) return -1;
+            k++;
+            continue;
+        }
+        for (int v = step->name == TEST_TRUTH ? 1 : 2; v > 0; v--) {
+            int slots = value_span(operands, at + k, end);
+            if (!slots) return -1;
+            k += slots;
+        }
+    }
+    return span;
+}
+
+int match_span(const ECOperand* operands, int count, const ECInstr* in);
+
+// Number of ECOperand slots an instruction reads, -1 if they run past `count`
+int operand_span(const ECOperand* operands, int count, const ECInstr* in) {
+    int values;
+    switch (in->op) {
+        case OP_SET_FAST: case OP_ARITH_FAST: case OP_ARITH_LOOP:
+            if (in->op != OP_SET_FAST && (in->base < OP_ADD || in->base > OP_MOD)) return -1;
+            values = 2;     // Destination and first value
+            for (uint32_t ops = (uint32_t)in->ops; ops & 0xff; ops >>= 8) values++;
+            break;
+        case OP_IF: case OP_ELIF: case OP_LOOP:
+            if (in->operands < 0) return 0;
+            if (in->ops == COND_PROGRAM) return program_span(operands, count, in->operands);
+            if (in->ops < 1 || in->ops > 6) return -1;
+            values = 2;
+            break;
+        case OP_MATCH:
+            return in->operands < 0 ? 0 : match_span(operands, count, in);
+        default:
+            return 0;
+    }
+    int span = 0;
+    for (int v = 0; v < values; v++) {
+        if (in->operands < 0 || in->operands + span >= count) return -1;
+        if (operands[in->operands + span++].kind == OPND_ELEM) span++;
+    }
+    return in->operands + span <= count ? span : -1;
+}
+
+// Intern the variable and array names of operands [from, operand_count)
+void intern_operands(int from) {
+    int count = ctx->operand_count > 0 ? ctx->operand_count : 1;
+    const char** names = (const char**)realloc((void*)ctx->operand_names, count * sizeof(char*));
+    if (!names) fatal_error("Error: Out of memory loading program\n");
+    ctx->operand_names = names;
+    for (int i = from; i < ctx->operand_count; i++) {
+        const ECOperand* p = &ctx->operands[i];
+        const char* text = ctx->pool + p->name;
+        names[i] = p->kind == OPND_VAR || p->kind == OPND_ELEM ? intern(text, strlen(text)) : NULL;
+    }
+}
+
+// Lower hot statement shapes to superinstructions. `base` keeps the plain
+// opcode, which the profiler runs so that per-line statistics stay exact.
+// Operands are appended: lines outside from..to keep theirs.
+void fuse_program(int from, int to) {
+    int first_operand = (int)(ctx->operand_buffer.len / sizeof(ECOperand));
+    for (int i = from; i < to; i++) {
+        ECInstr* in = &ctx->code[i];
+        in->base = in->op;
+        in->operands = -1;
+        in->ops = 0;
+        
+        char args[MAX_LINE];
+        ctx->pool = ctx->pool_buffer.data;  // pool_add may have moved it
+        strcpy(args, instr_args(in));
+        int first = (int)(ctx->operand_buffer.len / sizeof(ECOperand));
+        size_t mark = ctx->operand_buffer.len;
+        
+        switch (in->op) {
+            case OP_SET: case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: {
+                char dest[MAX_NAME], rest[MAX_LINE] = "";
+                if (sscanf(args, "%127s %[^\n]", dest, rest) < 2 || rest[0] == '"') break;
+                if (is_number(dest) || (in->op != OP_SET && !is_identifier(dest))) break;
+                if (!decode_value(dest) || !decode_expr(rest, &in->ops)) {
+                    ctx->operand_buffer.len = mark;
+                    in->ops = 0;
+                    break;
+                }
+                in->operands = first;
+                if (in->op == OP_SET) in->op = OP_SET_FAST;
+                else if (i + 1 < ctx->line_count && ctx->code[i + 1].op == OP_ENDLOOP) in->op = OP_ARITH_LOOP;
+                else in->op = OP_ARITH_FAST;
+                break;
+            }
+            case OP_IF: case OP_ELIF: case OP_LOOP:
+                if (decode_condition(args, &in->ops)) in->operands = first;
+                else if (decode_program(args)) { in->operands = first; in->ops = COND_PROGRAM; }
+                else in->ops = 0;
+                break;
+            case OP_MATCH:
+                if ((in->ops = decode_match(i))) in->operands = first;
+                break;
+            default:
+                break;
+        }
+    }
+    ctx->operands = (const ECOperand*)ctx->operand_buffer.data;
+    ctx->operand_count = (int)(ctx->operand_buffer.len / sizeof(ECOperand));
+    ctx->pool = ctx->pool_buffer.data;
+    intern_operands(first_operand);
+}
+
+const char* operand_name(const ECOperand* p) {
+    return ctx->operand_names[p - ctx->operands];
+}
+
+ECVar* operand_var(const ECOperand* p) {
+    ECVar* v = writable_var_name(operand_name(p));
+    if (!v) runtime_error("Undefined variable '%s'. Please declare it with 'EC' first.", operand_name(p));
+    return v;
+}
+
+ECArray* operand_array(const ECOperand* p, int index, int store) {
+    const char* name = operand_name(p);
+    ECVar* av = find_var_name(name);
+    if (store) {
+        if (!av) runtime_error("Undefined array '%s'", name);
+        if (av->arr_id < 0) runtime_error("Variable '%s' is not an array", name);
+    } else {
+        if (!av) runtime_error("Undefined array '%s'.", name);
+        if (av->arr_id < 0) runtime_error("Variable '%s' is not an array.", name);
+    }
+    ECArray* arr = &ctx->arrays[av->arr_id];
+    if (index < 0 || index >= arr->size) {
+        if (store) runtime_error("Array assignment index out of bounds: %d", index);
+        runtime_error("Array Index Out of Bounds: Index %d, Size %d.", index, arr->size);
+    }
+    return arr;
+}
+
+// Value of the operand at *o (what parse_num returns for its text); advances *o
+ECNum operand_load(const ECOperand** o) {
+    const ECOperand* p = (*o)++;
+    if (p->kind == OPND_INT) return num_int(p->ival);
+    if (p->kind == OPND_NUMBER) return num_double(p->num);
+    
+    if (p->kind == OPND_ELEM) {
+        int index = num_index(operand_load(o));
+        return num_double(operand_array(p, index, 0)->num_data[index]);
+    }
+    ECVar* v = find_var_name(operand_name(p));
+    if (!v) runtime_error("Undefined variable '%s'. Please declare it with 'EC' first.", operand_name(p));
+    if (v->type == TYPE_STRING) return num_double(atof(v->str_val));
+    return var_num(v);
+}
+
+// Same order of evaluation (and so of errors) as evaluate_num
+ECNum operand_expr(const ECOperand** o, int32_t ops) {
+    char op1 = (char)(ops & 0xff), op2 = (char)((ops >> 8) & 0xff);
+    ECNum a = operand_load(o);
+    if (!op1) return a;
+    ECNum b = operand_load(o);
+    if (!op2) return num_arith(a, b, op1);
+    if (get_precedence(op2) > get_precedence(op1)) {
+        ECNum c = operand_load(o);
+        return num_arith(a, num_arith(b, c, op2), op1);
+    }
+    a = num_arith(a, b, op1);
+    return num_arith(a, operand_load(o), op2);
+}
+
+// operand_load that also yields the text of a string variable (else NULL)
+ECNum operand_fetch(const ECOperand** o, const char** text) {
+    const ECOperand* p = *o;
+    *text = NULL;
+    if (p->kind != OPND_VAR) return operand_load(o);
+    (*o)++;
+    ECVar* v = find_var_name(operand_name(p));
+    if (!v) runtime_error("Undefined variable '%s'. Please declare it with 'EC' first.", operand_name(p));
+    if (v->type != TYPE_STRING) return var_num(v);
+    *text = v->str_val;
+    return num_double(atof(v->str_val));
+}
+
+// Two string variables compare as text, like evaluate_comparison
+int operand_compare(const ECOperand** o, int cmp) {
+    const char *ltext, *rtext;
+    ECNum lval = operand_fetch(o, &ltext);
+    ECNum rval = operand_fetch(o, &rtext);
+    if (ltext && rtext) return num_compare(num_int(strcmp(ltext, rtext)), num_int(0), cmp);
+    return num_compare(lval, rval, cmp);
+}
+
+int run_condition(const ECOperand* program) {
+    const ECOperand* step = program + 1;
+    for (;;) {
+        const ECOperand* o = step + 1;
+        int truth;
+        if (step->name == TEST_EXPR) truth = evaluate_comparison(ctx->pool + o->name);
+        else if (step->name == TEST_TRUTH) truth = num_value(operand_load(&o)) != 0;
+        else truth = operand_compare(&o, (int)step->name);
+        int next = test_target(step, truth);
+        if (next < 0) return next == COND_TRUE;
+        step = program + next;
+    }
+}
+
+int instr_condition(const ECInstr* in) {
+    if (in->operands < 0) return evaluate_condition(instr_args(in));
+    const ECOperand* o = &ctx->operands[in->operands];
+    if (in->ops == COND_PROGRAM) return run_condition(o);
+    return operand_compare(&o, in->ops - 1);
+}
+
+void op_set_fast(const ECInstr* in) {
+    const ECOperand* o = &ctx->operands[in->operands];
+    const ECOperand* dest = o++;
+    
+    if (dest->kind == OPND_ELEM) {
+        int index = num_index(operand_load(&o));
+        ECArray* arr = operand_array(dest, index, 1);
+        arr->num_data[index] = num_value(operand_expr(&o, in->ops));
+        return;
+    }
+    ECVar* v = operand_var(dest);
+    v->type = TYPE_NUMBER;
+    var_set_num(v, operand_expr(&o, in->ops));
+}
+
+// ADD/SUB/MUL/DIV/MOD with a decoded operand, in cmd_add..cmd_mod order
+void op_arith_fast(const ECInstr* in) {
+    const ECOperand* o = &ctx->operands[in->operands];
+    const ECOperand* dest = o++;
+    
+    if (in->base == OP_DIV) {
+        ECNum divisor = operand_expr(&o, in->ops);
+        if (num_value(divisor) == 0) runtime_error("Division by zero");
+        ECVar* v = operand_var(dest);
+        var_set_num(v, num_apply(var_num(v), divisor, '/'));
+        return;
+    }
+    ECVar* v = operand_var(dest);
+    ECNum value = operand_expr(&o, in->ops);
+    
+    // Integer counters and accumulators: no conversions, no fmod
+    if (v->num.is_int && value.is_int) {
+        int64_t r;
+        int exact = 0;
+        switch (in->base) {
+            case OP_ADD: exact = !__builtin_add_overflow(v->num.i, value.i, &r); break;
+            case OP_SUB: exact = !__builtin_sub_overflow(v->num.i, value.i, &r); break;
+            case OP_MUL: exact = !__builtin_mul_overflow(v->num.i, value.i, &r); break;
+            default: if ((exact = value.i != 0)) r = int_mod(v->num.i, value.i); break;
+        }
+        if (exact) {
+            v->type = TYPE_NUMBER;
+            v->num.i = r;
+            return;
+        }
+    }
+    switch (in->base) {
+        case OP_ADD: var_set_num(v, num_apply(var_num(v), value, '+')); break;
+        case OP_SUB: var_set_num(v, num_apply(var_num(v), value, '-')); break;
+        case OP_MUL: var_set_num(v, num_apply(var_num(v), value, '*')); break;
+        default: var_set_num(v, num_mod(var_num(v), value)); break;
+    }
+}
+
+// Increment-compare-branch: the arithmetic, the ENDLOOP after it and the
+// LOOP test it jumps back to, in one dispatch
+void op_arith_loop(const ECInstr* in) {
+    op_arith_fast(in);
+    ctx->current_line++;
+    if (ctx->loop_depth == 0) return;
+    
+    int start = ctx->loop_start[ctx->loop_depth - 1];
+    if (ctx->code[start].base != OP_LOOP) { cmd_endloop(""); return; }
+    ctx->loop_depth--;
+    ctx->current_line = start;
+    cmd_loop(instr_args(&ctx->code[start]));
+}
+
+// ============ MATCH ============
+// MATCH compares its subject with the CASE values in order, like an
+// IF/ELIF chain on ==, and runs the first CASE that has an equal value (or
+// DEFAULT). fuse_program replaces the scan with a table: dense integer
+// values index a jump table, any others are looked up in a hash table.
+
+#define MATCH_JUMP 1            // ECInstr.ops of a decoded MATCH
+#define MATCH_HASH 2
+#define MATCH_MAX_JUMP 4096     // Largest jump table, in slots
+#define MATCH_MAX_INT 2147483647.0
+
+uint64_t memo_hash(const char* key, size_t len);
+
+// Copy the next comma-separated CASE value at *p into `value` (trimmed,
+// quotes kept); 0 when there are no more
+int next_case_value(const char** p, char* value) {
+    const char* s = *p;
+    while (isspace((unsigned char)*s)) s++;
+    if (*s == '\0') return 0;
+    int quoted = 0;
+    size_t len = 0;
+    for (; *s && (quoted || *s != ','); s++) {
+        if (*s == '"') quoted = !quoted;
+        if (len < MAX_LINE - 1) value[len++] = *s;
+    }
+    value[len] = '\0';
+    trim(value);
+    *p = *s ? s + 1 : s;
+    return 1;
+}
+
+int valid_case_values(const char* args) {
+    char value[MAX_LINE];
+    int count = 0;
+    for (const char* p = args; next_case_value(&p, value); count++) {
+        size_t len = strlen(value);
+        if (value[0] == '"' ? len < 2 || value[len - 1] != '"' : !is_number(value)) return 0;
+    }
+    return count > 0;
+}
+
+// Value of a MATCH subject; *text is set for a quoted string or a string
+// variable, which CASE strings are compared with
+ECNum match_subject(const char* args, const char** text, char* buf) {
+    *text = NULL;
+    if (args[0] == '"' || is_string_var(args)) {
+        *text = get_string_value(args, buf);
+        return num_double(atof(*text));
+    }
+    return evaluate_num(args);
+}
+
+int case_matches(const char* value, ECNum num, const char* text) {
+    if (value[0] != '"') return num_compare(num, parse_number(value), 0);
+    size_t len = strlen(value) - 2;
+    return text && strlen(text) == len && strncmp(text, value + 1, len) == 0;
+}
+
+// The CASE line (else the DEFAULT or ENDMATCH line) selected for `in`
+int match_scan(const ECInstr* in) {
+    char buf[MAX_LINE], value[MAX_LINE];
+    const char* text;
+    ECNum num = match_subject(instr_args(in), &text, buf);
+    int b = in->jump;
+    for (; ctx->code[b].op == OP_CASE; b = ctx->code[b].jump) {
+        const char* p = instr_args(&ctx->code[b]);
+        while (next_case_value(&p, value)) {
+            if (case_matches(value, num, text)) return b;
+        }
+    }
+    return b;
+}
+
+uint64_t case_hash(double d) {
+    if (d == 0) d = 0;          // -0 == 0
+    return memo_hash((const char*)&d, sizeof(d));
+}
+
+// Decoded MATCH: the subject (a value, or OPND_EXPR), an OPND_CASE header
+// (ival = slot count, num = the value of slot 0 in a jump table), an
+// OPND_CASE holding the DEFAULT / ENDMATCH line in ival, then the slots.
+// A slot's ival is its CASE line (-1 when empty); hash slots keep their
+// value in num, or in the pool (name) for a string. Earlier CASEs win.
+int decode_match(int line) {
+    const ECInstr* in = &ctx->code[line];
+    char subject[MAX_LINE], value[MAX_LINE];
+    strcpy(subject, instr_args(in));
+    int values = 0, dense = 1, last = in->jump;
+    double low = 0, high = 0;
+    for (; ctx->code[last].op == OP_CASE; last = ctx->code[last].jump) {
+        const char* p = instr_args(&ctx->code[last]);
+        while (next_case_value(&p, value)) {
+            if (value[0] == '"') { dense = 0; values++; continue; }
+            ECNum n = parse_number(value);
+            double d = num_value(n);
+            if (n.is_int && fabs(d) >= 9007199254740992.0) return 0;    // Not exact as a double
+            if (d != floor(d) || fabs(d) > MATCH_MAX_INT) dense = 0;
+            if (values == 0 || d < low) low = d;
+            if (values == 0 || d > high) high = d;
+            values++;
+        }
+    }
+    if (values == 0) return 0;
+    
+    int kind = MATCH_HASH;
+    int64_t slots = 4;
+    if (dense && high - low + 1 <= MATCH_MAX_JUMP && high - low + 1 <= 2 * values + 8) {
+        kind = MATCH_JUMP;
+        slots = (int64_t)(high - low) + 1;
+    } else {
+        while (slots < 2 * values) slots *= 2;
+    }
+    
+    ECOperand op;
+    memset(&op, 0, sizeof(op));
+    if (subject[0] == '"' || !decode_value(subject)) {
+        op.kind = OPND_EXPR;
+        op.name = pool_add(subject, strlen(subject));
+        buffer_append(&ctx->operand_buffer, (const char*)&op, sizeof(op));
+    }
+    size_t table = ctx->operand_buffer.len;
+    op.kind = OPND_CASE;
+    op.name = -1;
+    op.num = kind == MATCH_JUMP ? low : 0;
+    op.ival = slots;
+    buffer_append(&ctx->operand_buffer, (const char*)&op, sizeof(op));
+    op.num = 0;
+    op.ival = last;
+    buffer_append(&ctx->operand_buffer, (const char*)&op, sizeof(op));
+    op.ival = -1;
+    for (int64_t k = 0; k < slots; k++) buffer_append(&ctx->operand_buffer, (const char*)&op, sizeof(op));
+    
+    for (int b = in->jump; b != last; b = ctx->code[b].jump) {
+        const char* p = instr_args(&ctx->code[b]);
+        while (next_case_value(&p, value)) {
+            ECOperand* slot = (ECOperand*)(ctx->operand_buffer.data + table) + 2;
+            int text = value[0] == '"';
+            size_t len = text ? strlen(value) - 2 : 0;
+            double d = text ? 0 : num_value(parse_number(value));
+            if (kind == MATCH_JUMP) {
+                slot += (int64_t)(d - low);
+                if (slot->ival < 0) slot->ival = b;
+                continue;
+            }
+            uint64_t h = text ? memo_hash(value + 1, len) : case_hash(d);
+            for (;; h++) {
+                ECOperand* s = &slot[h & (slots - 1)];
+                if (s->ival < 0) {
+                    s->ival = b;
+                    s->num = d;
+                    if (text) s->name = pool_add(value + 1, len);
+                    break;
+                }
+                if (text ? s->name >= 0 && strlen(ctx->pool_buffer.data + s->name) == len &&
+                           memcmp(ctx->pool_buffer.data + s->name, value + 1, len) == 0
+                         : s->name < 0 && s->num == d) break;
+            }
+        }
+    }
+    ctx->pool = ctx->pool_buffer.data;
+    return kind;
+}
+
+int match_lookup(const ECInstr* in) {
+    const ECOperand* o = &ctx->operands[in->operands];
+    const char* text;
+    char buf[MAX_LINE];
+    ECNum num;
+    if (o->kind == OPND_EXPR) num = match_subject(ctx->pool + (o++)->name, &text, buf);
+    else num = operand_fetch(&o, &text);
+    
+    int64_t slots = o->ival;
+    int fallback = (int)o[1].ival;
+    const ECOperand* slot = o + 2;
+    if (in->ops == MATCH_JUMP) {
+        double d = num_value(num);
+        int64_t k;
+        if (num.is_int) k = num.i;
+        else if (d == floor(d) && fabs(d) <= MATCH_MAX_INT) k = (int64_t)d;
+        else return fallback;
+        int64_t low = (int64_t)o->num;
+        if (k < low || k >= low + slots) return fallback;
+        return slot[k - low].ival >= 0 ? (int)slot[k - low].ival : fallback;
+    }
+    
+    // A text subject can equal a string and a number: the earlier CASE wins
+    int found = fallback;
+    double d = num_value(num);
+    uint64_t h = case_hash(d);
+    for (int64_t k = 0; k < slots; k++, h++) {
+        const ECOperand* s = &slot[h & (slots - 1)];
+        if (s->ival < 0) break;
+        if (s->name < 0 && s->num == d) { found = (int)s->ival; break; }
+    }
+    if (text) {
+        h = memo_hash(text, strlen(text));
+        for (int64_t k = 0; k < slots; k++, h++) {
+            const ECOperand* s = &slot[h & (slots - 1)];
+            if (s->ival < 0) break;
+            if (s->name >= 0 && strcmp(ctx->pool + s->name, text) == 0) return s->ival < found ? (int)s->ival : found;
+        }
+    }
+    return found;
+}
+
+// Operand slots of a decoded MATCH, -1 if malformed
+int match_span(const ECOperand* operands, int count, const ECInstr* in) {
+    int at = in->operands;
+    if (in->ops != MATCH_JUMP && in->ops != MATCH_HASH) return -1;
+    int k = at < count && operands[at].kind == OPND_EXPR ? 1 : value_span(operands, at, count);
+    if (!k || at + k + 2 > count) return -1;
+    const ECOperand* header = &operands[at + k];
+    int64_t slots = header->ival;
+    if (slots < 1 || slots > count - (at + k + 2) || (in->ops == MATCH_HASH && (slots & (slots - 1)))) return -1;
+    if (in->ops == MATCH_JUMP && !(fabs(header->num) <= MATCH_MAX_INT && header->num == floor(header->num))) return -1;
+    for (int64_t s = 0; s < slots + 2; s++) {
+        if (operands[at + k + s].kind != OPND_CASE) return -1;
+    }
+    return k + 2 + (int)slots;
+}
+
+// Every line a decoded MATCH can go to is in the program (span checked)
+int match_targets_ok(const ECOperand* operands, const ECInstr* in, int line_count) {
+    const ECOperand* o = &operands[in->operands];
+    o += o->kind == OPND_EXPR ? 1 : o->kind == OPND_ELEM ? 2 : 1;
+    if (o[1].ival < 0 || o[1].ival >= line_count) return 0;
+    for (int64_t s = 0; s < o->ival; s++) {
+        if (o[2 + s].ival < -1 || o[2 + s].ival >= line_count) return 0;
+    }
+    return 1;
+}
+
+void cmd_match(const char* args) {
+    const ECInstr* in = &ctx->code[ctx->current_line];
+    ctx->current_line = in->operands < 0 ? match_scan(in) : match_lookup(in);
+}
+
+// Reached after a CASE body ran: skip the rest of the MATCH
+void cmd_case(const char* args) { ctx->current_line = ctx->code[ctx->current_line].end; }
+
+// ============ JIT (x86-64) ============
+
+// Baseline template JIT: once a LOOP head has run JIT_THRESHOLD times, the
+// loop is translated line by line into native code if every line in it is a
+// decoded SET/ADD/SUB/MUL/DIV/MOD, IF/ELIF/ELSE, LOOP, BREAK or CONTINUE.
+// The code is specialized for the integer/double types the variables have at
+// that point. Anything it cannot finish exactly - integer overflow, an inexact
+// division, a zero divisor, an index out of bounds - happens before the line
+// stores anything, so it returns that line and the interpreter re-runs it.
+
+void take_branch(void);
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#define JIT_THRESHOLD 100
+#define JIT_MAX_SLOTS 32
+#define JIT_MAX_RECOMPILES 4
+
+enum { JIT_INT, JIT_DOUBLE, JIT_ARRAY };
+enum { JIT_TO_LINE, JIT_TO_COND, JIT_TO_DEOPT, JIT_TO_CODE };
+
+// A variable or array the native code uses; bound to env[slot] on entry
+typedef struct {
+    int32_t name;
+    int kind;
+} JitSlot;
+
+typedef struct {
+    int (*entry)(void** env);       // -1 when the loop ended, else the line to resume at
+    void* mem;
+    size_t mem_size;
+    JitSlot slots[JIT_MAX_SLOTS];
+    int slot_count;
+} JitRegion;
+
+struct ECJit {
+    int* counts;                    // LOOP head executions; -1 = never compile
+    int* recompiles;
+    JitRegion** regions;
+    int line_count;
+};
+
+typedef struct {
+    int kind;
+    int line;                       // JIT_TO_CODE: a code offset
+    size_t at;                      // Offset of the rel32 to patch
+} JitFixup;
+
+typedef struct {
+    ECBuffer code;
+    ECBuffer fixups;
+    int head, end;
+    size_t* line_pos;               // Code offset of lines head..end+1
+    size_t* cond_pos;               // Condition test of each ELIF
+    JitSlot slots[JIT_MAX_SLOTS];
+    int slot_count;
+    int loops[MAX_STACK];           // Open LOOP heads while emitting
+    int loop_top;
+    int failed;
+} JitCompiler;
+
+#define JIT_EMIT(c, bytes) buffer_append(&(c)->code, bytes, sizeof(bytes) - 1)
+
+void jit_u32(JitCompiler* c, uint32_t v) { buffer_append(&c->code, (const char*)&v, 4); }
+void jit_u64(JitCompiler* c, uint64_t v) { buffer_append(&c->code, (const char*)&v, 8); }
+
+// Jump instruction (opcode bytes given) to a target resolved after emission
+void jit_jump(JitCompiler* c, const char* opcode, int kind, int line) {
+    buffer_append(&c->code, opcode, strlen(opcode));
+    JitFixup f = {kind, line, c->code.len};
+    buffer_append(&c->fixups, (const char*)&f, sizeof(f));
+    jit_u32(c, 0);
+}
+
+#define JIT_JMP "\xE9"
+#define JIT_JE  "\x0F\x84"
+#define JIT_JNE "\x0F\x85"
+
+// Slot for a scalar (array = 0) or array operand, typed by its current value
+int jit_slot(JitCompiler* c, int32_t name, int array) {
+    const char* text = ctx->pool + name;
+    for (int k = 0; k < c->slot_count; k++) {
+        if ((c->slots[k].kind == JIT_ARRAY) == array && strcmp(ctx->pool + c->slots[k].name, text) == 0) return k;
+    }
+    ECVar* v = find_var(text);
+    if (!v || c->slot_count == JIT_MAX_SLOTS) return -1;
+    if (array ? v->arr_id < 0 : v->type != TYPE_NUMBER) return -1;
+    c->slots[c->slot_count].name = name;
+    c->slots[c->slot_count].kind = array ? JIT_ARRAY : v->num.is_int ? JIT_INT : JIT_DOUBLE;
+    return c->slot_count++;
+}
+
+// r11 = env[k]
+void jit_load_slot(JitCompiler* c, int k) {
+    JIT_EMIT(c, "\x4D\x8B\x9C\x24");
+    jit_u32(c, (uint32_t)(k * sizeof(void*)));
+}
+
+void jit_push(JitCompiler* c, int type) {
+    if (type == JIT_INT) JIT_EMIT(c, "\x50");
+    else JIT_EMIT(c, "\x48\x83\xEC\x08\xF2\x0F\x11\x04\x24");
+}
+
+int jit_value(JitCompiler* c, const ECOperand** o, int line);
+
+// Bounds-checked element index in rax and the array data in rdx
+int jit_index(JitCompiler* c, const ECOperand** o, int k, int line) {
+    int type = jit_value(c, o, line);
+    if (type < 0) return -1;
+    if (type == JIT_DOUBLE) JIT_EMIT(c, "\xF2\x0F\x2C\xC0\x48\x63\xC0");    // (int)d
+    jit_load_slot(c, k);
+    JIT_EMIT(c, "\x49\x8B\x93");
+    jit_u32(c, offsetof(ECArray, num_data));
+    JIT_EMIT(c, "\x49\x63\x8B");
+    jit_u32(c, offsetof(ECArray, size));
+    JIT_EMIT(c, "\x48\x39\xC8");
+    jit_jump(c, "\x0F\x83", JIT_TO_DEOPT, line);                            // jae
+    return 0;
+}
+
+// Load the operand at *o into rax (JIT_INT) or xmm0 (JIT_DOUBLE)
+int jit_value(JitCompiler* c, const ECOperand** o, int line) {
+    const ECOperand* p = (*o)++;
+    uint64_t bits;
+    int k;
+    switch (p->kind) {
+        case OPND_INT:
+            JIT_EMIT(c, "\x48\xB8");
+            jit_u64(c, (uint64_t)p->ival);
+            return JIT_INT;
+        case OPND_NUMBER:
+            memcpy(&bits, &p->num, sizeof(bits));
+            JIT_EMIT(c, "\x48\xB8");
+            jit_u64(c, bits);
+            JIT_EMIT(c, "\x66\x48\x0F\x6E\xC0");
+            return JIT_DOUBLE;
+        case OPND_VAR:
+            if ((k = jit_slot(c, p->name, 0)) < 0) return -1;
+            jit_load_slot(c, k);
+            if (c->slots[k].kind == JIT_INT) JIT_EMIT(c, "\x49\x8B\x83");
+            else JIT_EMIT(c, "\xF2\x41\x0F\x10\x83");
+            jit_u32(c, offsetof(ECVar, num));
+            return c->slots[k].kind;
+        case OPND_ELEM:
+            if ((k = jit_slot(c, p->name, 1)) < 0 || jit_index(c, o, k, line) < 0) return -1;
+            JIT_EMIT(c, "\xF2\x0F\x10\x04\xC2");
+            return JIT_DOUBLE;
+    }
+    return -1;
+}
+
+// Left value from the stack into rax/xmm0, right (in rax/xmm0) into
+// rcx/xmm1; both become doubles unless both are integers
+int jit_pair(JitCompiler* c, int left, int right) {
+    if (right == JIT_INT) JIT_EMIT(c, "\x48\x89\xC1");
+    else JIT_EMIT(c, "\x66\x0F\x28\xC8");
+    if (left == JIT_INT) JIT_EMIT(c, "\x58");
+    else JIT_EMIT(c, "\xF2\x0F\x10\x04\x24\x48\x83\xC4\x08");
+    if (left == JIT_INT && right == JIT_INT) return JIT_INT;
+    if (left == JIT_INT) JIT_EMIT(c, "\xF2\x48\x0F\x2A\xC0");
+    if (right == JIT_INT) JIT_EMIT(c, "\xF2\x48\x0F\x2A\xC9");
+    return JIT_DOUBLE;
+}
+
+// Pushed left value `op` right value, with num_apply's result type
+int jit_binop(JitCompiler* c, int left, int right, char op, int line) {
+    if (left < 0 || right < 0) return -1;
+    if (jit_pair(c, left, right) == JIT_INT) {
+        switch (op) {
+            case '+': JIT_EMIT(c, "\x48\x01\xC8"); break;
+            case '-': JIT_EMIT(c, "\x48\x29\xC8"); break;
+            case '*': JIT_EMIT(c, "\x48\x0F\xAF\xC1"); break;
+            default:
+                JIT_EMIT(c, "\x48\x85\xC9");
+                jit_jump(c, JIT_JE, JIT_TO_DEOPT, line);
+                JIT_EMIT(c, "\x48\x83\xF9\xFF");
+                jit_jump(c, JIT_JE, JIT_TO_DEOPT, line);
+                JIT_EMIT(c, "\x48\x99\x48\xF7\xF9");                        // cqo; idiv rcx
+                if (op == '%') { JIT_EMIT(c, "\x48\x89\xD0"); return JIT_INT; }
+                JIT_EMIT(c, "\x48\x85\xD2");                                // Inexact: double result
+                jit_jump(c, JIT_JNE, JIT_TO_DEOPT, line);
+                return JIT_INT;
+        }
+        jit_jump(c, "\x0F\x80", JIT_TO_DEOPT, line);                        // jo
+        return JIT_INT;
+    }
+    switch (op) {
+        case '+': JIT_EMIT(c, "\xF2\x0F\x58\xC1"); break;
+        case '-': JIT_EMIT(c, "\xF2\x0F\x5C\xC1"); break;
+        case '*': JIT_EMIT(c, "\xF2\x0F\x59\xC1"); break;
+        default:
+            JIT_EMIT(c, "\x66\x0F\x57\xD2\x66\x0F\x2E\xCA");                // Zero (or NaN) divisor
+            jit_jump(c, JIT_JE, JIT_TO_DEOPT, line);
+            if (op == '/') { JIT_EMIT(c, "\xF2\x0F\x5E\xC1"); break; }
+            // fmod with a 16-byte aligned stack; rbx is callee-saved
+            JIT_EMIT(c, "\x48\x89\xE3\x48\x83\xE4\xF0\x48\xB8");
+            jit_u64(c, (uint64_t)(uintptr_t)&fmod);
+            JIT_EMIT(c, "\xFF\xD0\x48\x89\xDC");
+            break;
+    }
+    return JIT_DOUBLE;
+}
+
+// Same precedence rules as operand_expr
+int jit_expr(JitCompiler* c, const ECOperand** o, int32_t ops, int line) {
+    char op1 = (char)(ops & 0xff), op2 = (char)((ops >> 8) & 0xff);
+    int a = jit_value(c, o, line);
+    if (a < 0 || !op1) return a;
+    jit_push(c, a);
+    if (op2 && get_precedence(op2) > get_precedence(op1)) {
+        int b = jit_value(c, o, line);
+        if (b < 0) return -1;
+        jit_push(c, b);
+        b = jit_binop(c, b, jit_value(c, o, line), op2, line);
+        return jit_binop(c, a, b, op1, line);
+    }
+    a = jit_binop(c, a, jit_value(c, o, line), op1, line);
+    if (!op2 || a < 0) return a;
+    jit_push(c, a);
+    return jit_binop(c, a, jit_value(c, o, line), op2, line);
+}
+
+// Compare the values jit_pair left (as `type`) with compare 0-5 and jump
+// when the result is false; comparisons with NaN are false, as in C
+void jit_compare(JitCompiler* c, int type, int cmp, int kind, int target) {
+    if (type == JIT_INT) {
+        static const char* const jump_false[] = {"\x0F\x85", "\x0F\x84", "\x0F\x8C", "\x0F\x8F", "\x0F\x8E", "\x0F\x8D"};
+        JIT_EMIT(c, "\x48\x39\xC8");
+        jit_jump(c, jump_false[cmp], kind, target);
+        return;
+    }
+    switch (cmp) {
+        case 0: JIT_EMIT(c, "\x66\x0F\x2E\xC1"); jit_jump(c, "\x0F\x8A", kind, target); jit_jump(c, JIT_JNE, kind, target); break;
+        case 1: JIT_EMIT(c, "\x66\x0F\x2E\xC1\x7A\x06"); jit_jump(c, JIT_JE, kind, target); break;
+        case 2: JIT_EMIT(c, "\x66\x0F\x2E\xC1"); jit_jump(c, "\x0F\x82", kind, target); break;
+        case 3: JIT_EMIT(c, "\x66\x0F\x2E\xC8"); jit_jump(c, "\x0F\x82", kind, target); break;
+        case 4: JIT_EMIT(c, "\x66\x0F\x2E\xC1"); jit_jump(c, "\x0F\x86", kind, target); break;
+        default: JIT_EMIT(c, "\x66\x0F\x2E\xC8"); jit_jump(c, "\x0F\x86", kind, target); break;
+    }
+}
+
+// Jump through `kind`/`target`, or within the program when `to` is a step
+// (its offset from the program header) or COND_TRUE (the end). The
+// fixups are recorded so that jit_program can fill in the code offsets.
+void jit_edge(JitCompiler* c, const char* opcode, int to, int kind, int target, int* edges, int* edge_to, int* edge_count) {
+    if (to == COND_FALSE) { jit_jump(c, opcode, kind, target); return; }
+    edges[*edge_count] = (int)(c->fixups.len / sizeof(JitFixup));
+    edge_to[(*edge_count)++] = to;
+    jit_jump(c, opcode, JIT_TO_CODE, 0);
+}
+
+// A compound condition (see decode_program) as a chain of tests that fall
+// through on true; leaves that are not plain values keep the loop interpreted
+int jit_program(JitCompiler* c, const ECOperand* program, int line, int kind, int target) {
+    int span = (int)program->ival;
+    int edges[MAX_COND * 3], edge_to[MAX_COND * 3], edge_count = 0;
+    size_t* step_pos = (size_t*)calloc(span + 1, sizeof(size_t));
+    if (!step_pos) return -1;
+    
+    for (int k = 1; k < span; ) {
+        const ECOperand* step = program + k;
+        const ECOperand* o = step + 1;
+        step_pos[k] = c->code.len;
+        if (step->name == TEST_EXPR) { free(step_pos); return -1; }
+        
+        int left = jit_value(c, &o, line), type = left, cmp = (int)step->name;
+        if (left < 0) { free(step_pos); return -1; }
+        if (cmp == TEST_TRUTH) {
+            if (left == JIT_INT) JIT_EMIT(c, "\x31\xC9");                // xor ecx, ecx
+            else JIT_EMIT(c, "\x66\x0F\x57\xC9");                      // xorpd xmm1, xmm1
+            cmp = 1;
+        } else {
+            jit_push(c, left);
+            int right = jit_value(c, &o, line);
+            if (right < 0) { free(step_pos); return -1; }
+            type = jit_pair(c, left, right);
+        }
+        k = (int)(o - program);
+        
+        int on_true = test_target(step, 1), on_false = test_target(step, 0);
+        int first = (int)(c->fixups.len / sizeof(JitFixup));
+        jit_compare(c, type, cmp, on_false == COND_FALSE ? kind : JIT_TO_CODE, target);
+        if (on_false != COND_FALSE) {
+            for (int f = first; f < (int)(c->fixups.len / sizeof(JitFixup)); f++) {
+                edges[edge_count] = f;
+                edge_to[edge_count++] = on_false;
+            }
+        }
+        if (on_true != k && !(on_true == COND_TRUE && k == span)) {
+            jit_edge(c, JIT_JMP, on_true, kind, target, edges, edge_to, &edge_count);
+        }
+    }
+    step_pos[span] = c->code.len;
+    
+    JitFixup* fixups = (JitFixup*)c->fixups.data;
+    for (int e = 0; e < edge_count; e++) {
+        fixups[edges[e]].line = (int)step_pos[edge_to[e] == COND_TRUE ? span : edge_to[e]];
+    }
+    free(step_pos);
+    return 0;
+}
+
+// Jump to `line` (or the condition of the ELIF there) when the decoded
+// condition of `in` is false
+int jit_condition(JitCompiler* c, const ECInstr* in, int line, int kind, int target) {
+    if (in->operands < 0) return -1;
+    const ECOperand* o = &ctx->operands[in->operands];
+    if (in->ops == COND_PROGRAM) return jit_program(c, o, line, kind, target);
+    int left = jit_value(c, &o, line);
+    if (left < 0) return -1;
+    jit_push(c, left);
+    int right = jit_value(c, &o, line);
+    if (right < 0) return -1;
+    jit_compare(c, jit_pair(c, left, right), in->ops - 1, kind, target);
+    return 0;
+}
+
+// The false edge of an IF/ELIF: the next ELIF's test, else past ELSE/ENDIF
+int jit_branch(JitCompiler* c, const ECInstr* in, int line) {
+    int next = in->jump;
+    if (next <= line || next > c->end) return -1;
+    if (ctx->code[next].op == OP_ELIF) return jit_condition(c, in, line, JIT_TO_COND, next);
+    return jit_condition(c, in, line, JIT_TO_LINE, next + 1);
+}
+
+void jit_store(JitCompiler* c, int k) {
+    jit_load_slot(c, k);
+    if (c->slots[k].kind == JIT_INT) JIT_EMIT(c, "\x49\x89\x83");
+    else JIT_EMIT(c, "\xF2\x41\x0F\x11\x83");
+    jit_u32(c, offsetof(ECVar, num));
+}
+
+int jit_statement(JitCompiler* c, const ECInstr* in, int line) {
+    const ECOperand* o = &ctx->operands[in->operands];
+    const ECOperand* dest = o++;
+    int k, type;
+    
+    if (in->op == OP_SET_FAST && dest->kind == OPND_ELEM) {
+        if ((k = jit_slot(c, dest->name, 1)) < 0 || jit_index(c, &o, k, line) < 0) return -1;
+        JIT_EMIT(c, "\x50");
+        if ((type = jit_expr(c, &o, in->ops, line)) < 0) return -1;
+        if (type == JIT_INT) JIT_EMIT(c, "\xF2\x48\x0F\x2A\xC0");
+        JIT_EMIT(c, "\x59");
+        jit_load_slot(c, k);
+        JIT_EMIT(c, "\x49\x8B\x93");
+        jit_u32(c, offsetof(ECArray, num_data));
+        JIT_EMIT(c, "\xF2\x0F\x11\x04\xCA");
+        return 0;
+    }
+    if (dest->kind != OPND_VAR || (k = jit_slot(c, dest->name, 0)) < 0) return -1;
+    
+    if (in->op == OP_SET_FAST) {
+        type = jit_expr(c, &o, in->ops, line);
+    } else {
+        static const char ops[] = "+-*/%";
+        const ECOperand* var = dest;
+        type = jit_value(c, &var, line);
+        jit_push(c, type);
+        type = jit_binop(c, type, jit_expr(c, &o, in->ops, line), ops[in->base - OP_ADD], line);
+    }
+    // A variable that changes type is left to the interpreter
+    if (type != c->slots[k].kind) return -1;
+    jit_store(c, k);
+    return 0;
+}
+
+int jit_line(JitCompiler* c, int line) {
+    const ECInstr* in = &ctx->code[line];
+    int loop = c->loop_top ? c->loops[c->loop_top - 1] : -1;
+    switch (in->op) {
+        case OP_NOP: case OP_ENDIF:
+            return 0;
+        case OP_LOOP:
+            if (c->loop_top == MAX_STACK / 2 || in->jump <= line || in->jump > c->end) return -1;
+            c->loops[c->loop_top++] = line;
+            if (instr_args(in)[0] == '\0') return 0;
+            return jit_condition(c, in, line, JIT_TO_LINE, in->jump + 1);
+        case OP_ENDLOOP:
+            if (loop < 0 || ctx->code[loop].jump != line) return -1;
+            c->loop_top--;
+            jit_jump(c, JIT_JMP, JIT_TO_LINE, loop);
+            return 0;
+        case OP_BREAK:
+            jit_jump(c, JIT_JMP, JIT_TO_LINE, ctx->code[loop].jump + 1);
+            return 0;
+        case OP_CONTINUE:
+            jit_jump(c, JIT_JMP, JIT_TO_LINE, loop);
+            return 0;
+        case OP_IF:
+            return jit_branch(c, in, line);
+        case OP_ELIF:
+            jit_jump(c, JIT_JMP, JIT_TO_LINE, in->end + 1);
+            c->cond_pos[line - c->head] = c->code.len;
+            return jit_branch(c, in, line);
+        case OP_ELSE:
+            jit_jump(c, JIT_JMP, JIT_TO_LINE, in->end + 1);
+            return 0;
+        case OP_JUMP:
+            jit_jump(c, JIT_JMP, JIT_TO_LINE, in->jump + 1);
+            return 0;
+        case OP_SET_FAST: case OP_ARITH_FAST: case OP_ARITH_LOOP:
+            return jit_statement(c, in, line);
+        default:
+            return -1;
+    }
+}
+
+void jit_free_region(JitRegion* r) {
+    munmap(r->mem, r->mem_size);
+    free(r);
+}
+
+// Translate the loop at `head`; NULL if any line is not supported
+JitRegion* jit_compile(int head) {
+    JitCompiler* c = (JitCompiler*)calloc(1, sizeof(JitCompiler));
+    if (!c) return NULL;
+    c->head = head;
+    c->end = ctx->code[head].jump;
+    int span = c->end > head ? c->end - head + 2 : 0;
+    c->line_pos = (size_t*)malloc(span * sizeof(size_t));
+    c->cond_pos = (size_t*)malloc(span * sizeof(size_t));
+    JitRegion* r = NULL;
+    if (!span || !c->line_pos || !c->cond_pos) goto done;
+    for (int i = 0; i < span; i++) c->cond_pos[i] = SIZE_MAX;
+    
+    // push r12; push rbx; push rbp; mov rbp, rsp; mov r12, rdi (env)
+    JIT_EMIT(c, "\x41\x54\x53\x55\x48\x89\xE5\x49\x89\xFC");
+    for (int i = head; i <= c->end; i++) {
+        c->line_pos[i - head] = c->code.len;
+        if (jit_line(c, i) < 0) goto done;
+    }
+    c->line_pos[span - 1] = c->code.len;
+    JIT_EMIT(c, "\xB8\xFF\xFF\xFF\xFF");                           // mov eax, -1
+    size_t epilogue = c->code.len;                                  // Also drops temporaries
+    JIT_EMIT(c, "\x48\x89\xEC\x5D\x5B\x41\x5C\xC3");
+    
+    JitFixup* fixups = (JitFixup*)c->fixups.data;
+    size_t fixup_count = c->fixups.len / sizeof(JitFixup);
+    for (size_t i = 0; i < fixup_count; i++) {
+        JitFixup* f = &fixups[i];
+        size_t target;
+        if (f->kind == JIT_TO_CODE) {
+            target = (size_t)f->line;
+        } else if (f->kind == JIT_TO_DEOPT) {
+            target = c->code.len;
+            JIT_EMIT(c, "\xB8");
+            jit_u32(c, (uint32_t)f->line);
+            JIT_EMIT(c, "\xE9");
+            jit_u32(c, (uint32_t)(epilogue - (c->code.len + 4)));
+        } else {
+            if (f->line < head || f->line > c->end + 1) goto done;
+            target = f->kind == JIT_TO_LINE ? c->line_pos[f->line - head] : c->cond_pos[f->line - head];
+            if (target == SIZE_MAX) goto done;
+        }
+        int32_t rel = (int32_t)(target - (f->at + 4));
+        memcpy(c->code.data + f->at, &rel, 4);
+    }
+    
+    r = (JitRegion*)calloc(1, sizeof(JitRegion));
+    if (!r) goto done;
+    long page = sysconf(_SC_PAGESIZE);
+    r->mem_size = (c->code.len + page - 1) / page * page;
+    r->mem = mmap(NULL, r->mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->mem == MAP_FAILED) { free(r); r = NULL; goto done; }
+    memcpy(r->mem, c->code.data, c->code.len);
+    if (mprotect(r->mem, r->mem_size, PROT_READ | PROT_EXEC) != 0) { jit_free_region(r); r = NULL; goto done; }
+    r->entry = (int (*)(void**))r->mem;
+    memcpy(r->slots, c->slots, sizeof(c->slots));
+    r->slot_count = c->slot_count;
+    
+done:
+    buffer_free(&c->code);
+    buffer_free(&c->fixups);
+    free(c->line_pos);
+    free(c->cond_pos);
+    free(c);
+    return r;
+}
+
+// Point env at the region's variables and arrays; 0 if one is missing or
+// no longer has the type the code was specialized for
+int jit_bind(const JitRegion* r, void** env) {
+    for (int k = 0; k < r->slot_count; k++) {
+        ECVar* v = find_var(ctx->pool + r->slots[k].name);
+        if (!v) return 0;
+        if (r->slots[k].kind == JIT_ARRAY) {
+            if (v->arr_id < 0) return 0;
+            env[k] = &ctx->arrays[v->arr_id];
+        } else {
+            if (v->type != TYPE_NUMBER || v->num.is_int != (r->slots[k].kind == JIT_INT)) return 0;
+            env[k] = v;
+        }
+    }
+    return 1;
+}
+
+// Continue in the interpreter at line `resume`: open the LOOP frames the
+// native code was inside and let the line run (or fail) there
+int jit_deopt(int head, int resume) {
+    if (resume == head) return 0;       // The head's own test: cmd_loop runs it
+    for (int i = head; i < resume; i++) {
+        if (ctx->code[i].op == OP_LOOP && ctx->code[i].jump > resume) {
+            ctx->loop_start[ctx->loop_depth] = i;
+            ctx->loop_end[ctx->loop_depth] = ctx->code[i].jump;
+            ctx->loop_depth++;
+        }
+    }
+    if (ctx->code[resume].op == OP_ELIF) {
+        ctx->current_line = resume;
+        take_branch();
+    } else {
+        ctx->current_line = resume - 1;
+    }
+    return 1;
+}
+
+void jit_reset(void) {
+    ECJit* j = ctx->jit;
+    if (!j) return;
+    for (int i = 0; i < j->line_count; i++) {
+        if (j->regions[i]) jit_free_region(j->regions[i]);
+    }
+    free(j->counts);
+    free(j->recompiles);
+    free(j->regions);
+    free(j);
+    ctx->jit = NULL;
+}
+
+// Called by the LOOP at `line` each time it is reached; 1 if native code ran
+// the loop (ctx->current_line is then where the interpreter continues)
+int jit_enter(int line) {
+    if (ctx->jit_disabled || ctx->parent || ctx->profile) return 0;
+    ECJit* j = ctx->jit;
+    if (!j) {
+        j = (ECJit*)calloc(1, sizeof(ECJit));
+        if (!j) return 0;
+        j->line_count = ctx->line_count;
+        j->counts = (int*)calloc(j->line_count, sizeof(int));
+        j->recompiles = (int*)calloc(j->line_count, sizeof(int));
+        j->regions = (JitRegion**)calloc(j->line_count, sizeof(JitRegion*));
+        ctx->jit = j;
+        if (!j->counts || !j->recompiles || !j->regions) { jit_reset(); ctx->jit_disabled = 1; return 0; }
+    }
+    if (j->counts[line] < 0) return 0;
+    
+    JitRegion* r = j->regions[line];
+    if (!r) {
+        if (++j->counts[line] < JIT_THRESHOLD) return 0;
+        if (!(r = j->regions[line] = jit_compile(line))) { j->counts[line] = -1; return 0; }
+    }
+    void* env[JIT_MAX_SLOTS];
+    if (!jit_bind(r, env)) {
+        // Types changed since compiling: specialize again once it is hot
+        jit_free_region(r);
+        j->regions[line] = NULL;
+        j->counts[line] = ++j->recompiles[line] > JIT_MAX_RECOMPILES ? -1 : 0;
+        return 0;
+    }
+    int resume = r->entry(env);
+    if (resume < 0) {
+        ctx->current_line = ctx->code[line].jump;
+        return 1;
+    }
+    return jit_deopt(line, resume);
+}
+
+#else
+
+void jit_reset(void) {}
+int jit_enter(int line) { return 0; }
+
+#endif
+
+// ============ Memoization ============
+// FN MEMO functions cache their result per argument tuple. The key is built
+// from the parameter variables once they are bound, so a hit skips the body
+// entirely; a miss is recorded when the frame returns. With a limit the
+// least recently used result is evicted.
+
+// Strip a leading "MEMO [limit]" from FN arguments
+const char* fn_attributes(const char* args, int* memo, int* limit) {
+    *memo = 0;
+    *limit = 0;
+    if (strncmp(args, "MEMO", 4) != 0 || !isspace((unsigned char)args[4])) return args;
+    const char* p = args + 4;
+    while (isspace((unsigned char)*p)) p++;
+    if (isdigit((unsigned char)*p)) {
+        char* end;
+        long n = strtol(p, &end, 10);
+        if (!isspace((unsigned char)*end)) return args;
+        *limit = n > INT_MAX ? INT_MAX : (int)n;
+        p = end;
+        while (isspace((unsigned char)*p)) p++;
+    }
+    if (*p == '\0' || *p == '(') return args;
+    *memo = 1;
+    return p;
+}
+
+// Result variable after the closing parenthesis of `CALL name(args) result`
+int call_result_name(const char* args, char* name) {
+    const char* paren = strchr(args, '(');
+    const char* end = paren ? strchr(paren, ')') : NULL;
+    if (!end) return 0;
+    return sscanf(end + 1, " %127[A-Za-z0-9_]", name) == 1;
+}
+
+uint64_t memo_hash(const char* key, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Argument tuple of a call: the parameters' types and values
+void memo_key(const ECFunc* fn, ECBuffer* key) {
+    buffer_clear(key);
+    for (int i = 0; i < fn->param_count; i++) {
+        const ECVar* v = find_var(fn->params[i]);
+        if (!v || v->type == TYPE_NULL) { buffer_append(key, "u", 1); continue; }
+        if (v->type == TYPE_STRING) {
+            size_t len = strlen(v->str_val);
+            buffer_append(key, "s", 1);
+            buffer_append(key, (const char*)&len, sizeof(len));
+            buffer_append(key, v->str_val, len);
+        } else if (v->type == TYPE_NUMBER) {
+            buffer_append(key, v->num.is_int ? "i" : "d", 1);
+            buffer_append(key, (const char*)&v->num.i, sizeof(v->num.i));
+        } else {
+            int id = v->type == TYPE_ARRAY ? v->arr_id : v->obj_class_id;
+            buffer_append(key, v->type == TYPE_ARRAY ? "a" : "o", 1);
+            buffer_append(key, (const char*)&id, sizeof(id));
+        }
+    }
+}
+
+void memo_unlink(ECMemo* m, MemoEntry* e) {
+    if (e->newer) e->newer->older = e->older; else m->newest = e->older;
+    if (e->older) e->older->newer = e->newer; else m->oldest = e->newer;
+}
+
+void memo_push(ECMemo* m, MemoEntry* e) {
+    e->newer = NULL;
+    e->older = m->newest;
+    if (m->newest) m->newest->newer = e; else m->oldest = e;
+    m->newest = e;
+}
+
+MemoEntry* memo_find(ECMemo* m, const ECBuffer* key, uint64_t hash) {
+    if (!m->bucket_count) return NULL;
+    for (MemoEntry* e = m->buckets[hash & (m->bucket_count - 1)]; e; e = e->next) {
+        if (e->hash == hash && e->key_len == key->len && memcmp(e->key, key->data, key->len) == 0) {
+            if (m->newest != e) { memo_unlink(m, e); memo_push(m, e); }
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void memo_remove(ECMemo* m, MemoEntry* e) {
+    MemoEntry** link = &m->buckets[e->hash & (m->bucket_count - 1)];
+    while (*link != e) link = &(*link)->next;
+    *link = e->next;
+    memo_unlink(m, e);
+    m->count--;
+    free(e);
+}
+
+void memo_insert(ECMemo* m, int limit, const ECBuffer* key, ECNum value) {
+    uint64_t hash = memo_hash(key->data, key->len);
+    MemoEntry* e = memo_find(m, key, hash);
+    if (e) { e->value = value; return; }
+    if (limit > 0 && m->count >= (size_t)limit) memo_remove(m, m->oldest);
+    
+    if (m->count >= m->bucket_count) {
+        size_t count = m->bucket_count ? m->bucket_count * 2 : 64;
+        MemoEntry** buckets = (MemoEntry**)calloc(count, sizeof(MemoEntry*));
+        if (!buckets) runtime_error("Out of memory caching function result");
+        for (size_t i = 0; i < m->bucket_count; i++) {
+            for (MemoEntry* old = m->buckets[i], *next; old; old = next) {
+                next = old->next;
+                old->next = buckets[old->hash & (count - 1)];
+                buckets[old->hash & (count - 1)] = old;
+            }
+        }
+        free(m->buckets);
+        m->buckets = buckets;
+        m->bucket_count = count;
+    }
+    
+    e = (MemoEntry*)malloc(sizeof(MemoEntry) + key->len);
+    if (!e) runtime_error("Out of memory caching function result");
+    e->hash = hash;
+    e->value = value;
+    e->key_len = key->len;
+    memcpy(e->key, key->data, key->len);
+    e->next = m->buckets[hash & (m->bucket_count - 1)];
+    m->buckets[hash & (m->bucket_count - 1)] = e;
+    memo_push(m, e);
+    m->count++;
+}
+
+// Drop the cached results of function `idx` (or of all functions if -1)
+void memo_clear(int idx) {
+    if (!ctx->memos) return;
+    for (int f = idx < 0 ? 0 : idx; f < (idx < 0 ? MAX_FUNCS : idx + 1); f++) {
+        ECMemo* m = ctx->memos[f];
+        if (!m) continue;
+        for (MemoEntry* e = m->newest, *older; e; e = older) { older = e->older; free(e); }
+        free(m->buckets);
+        free(m);
+        ctx->memos[f] = NULL;
+    }
+    // A call still running records nothing for the old body
+    for (int i = 0; i < ctx->call_stack_top; i++) {
+        if (idx < 0 || ctx->call_memo[i] == idx) ctx->call_memo[i] = -1;
+    }
+}
+
+// Look the bound arguments up; returns 1 (result in return_value) on a hit
+int memo_lookup(const ECFunc* fn) {
+    int idx = fn - ctx->funcs;
+    if (!ctx->memos) {
+        ctx->memos = (ECMemo**)calloc(MAX_FUNCS, sizeof(ECMemo*));
+        ctx->memo_keys = (ECBuffer*)calloc(MAX_STACK, sizeof(ECBuffer));
+        if (!ctx->memos || !ctx->memo_keys) runtime_error("Out of memory caching function result");
+    }
+    if (!ctx->memos[idx]) {
+        ctx->memos[idx] = (ECMemo*)calloc(1, sizeof(ECMemo));
+        if (!ctx->memos[idx]) runtime_error("Out of memory caching function result");
+    }
+    ECBuffer* key = &ctx->memo_keys[ctx->call_stack_top];
+    memo_key(fn, key);
+    MemoEntry* e = memo_find(ctx->memos[idx], key, memo_hash(key->data, key->len));
+    if (!e) return 0;
+    ctx->return_value = e->value;
+    ctx->has_return = 1;
+    return 1;
+}
+
+// ============ Command Handlers ============
+
+void execute_line(void);
+void exec_stream_close(void);
+void foreach_close(void);
+int call_function(ECFunc* fn, const char* params);
+void bind_params(const ECFunc* fn, const char* params);
+void push_frame(const ECFunc* fn, int return_line);
+void generator_finish(ForeachStream* fs);
+void compile_block(int line);
+void compile_all_blocks(void);
+void profile_call(int func);
+
+void cmd_ec(const char* args) {
+    char name[MAX_NAME], rest[MAX_LINE] = "";
+    if (sscanf(args, "%127s %[^\n]", name, rest) < 1) {
+        runtime_error("EC requires variable name");
+    }
+    
+    ECVar* v = get_or_create_var(name);
     if (strlen(rest) > 0) {
         trim(rest);
         if (rest[0] == '"') {
             v->type = TYPE_STRING;
             char* end = strrchr(rest, '"');
-            if (end && end != rest) {
-                int len = end - rest - 1;
-                strncpy(v->str_val, rest + 1, len);
-                v->str_val[len] = '\0';
+            if (end && end != rest) set_var_string(v, rest + 1, end - rest - 1);
+        } else {
+            v->type = TYPE_NUMBER;
+            var_set_num(v, evaluate_num(rest));
+        }
+    }
+}
+
+void cmd_set(const char* args) {
+    char name[MAX_NAME], rest[MAX_LINE];
+    if (sscanf(args, "%127s %[^\n]", name, rest) < 2) {
+        runtime_error("SET requires variable and value");
+    }
+    
+    char* bracket = strchr(name, '[');
+    if (bracket) {
+        char arr_name[MAX_NAME];
+        int name_len = bracket - name;
+        strncpy(arr_name, name, name_len);
+        arr_name[name_len] = '\0';
+        
+        char* end_bracket = strchr(bracket, ']');
+        if (end_bracket) {
+            char idx_str[MAX_NAME];
+            int idx_len = end_bracket - bracket - 1;
+            strncpy(idx_str, bracket + 1, idx_len);
+            idx_str[idx_len] = '\0';
+            
+            int arr_idx = num_index(evaluate_num(idx_str));
+            ECVar* av = find_var(arr_name);
+            
+            if (!av) runtime_error("Undefined array '%s'", arr_name);
+            if (av->arr_id < 0) runtime_error("Variable '%s' is not an array", arr_name);
+            
+            ECArray* arr = &ctx->arrays[av->arr_id];
+            if (end_bracket[1] == '[') arr_idx = matrix_index(arr_name, arr, arr_idx, end_bracket + 1);
+            if (arr_idx < 0 || arr_idx >= arr->size) {
+                 runtime_error("Array assignment index out of bounds: %d", arr_idx);
+            }
+            arr->num_data[arr_idx] = evaluate_expr(rest);
+        }
+        return;
+    }
+    
+    ECVar* v = get_var_checked(name); // Must exist
+    trim(rest);
+    if (rest[0] == '"') {
+        v->type = TYPE_STRING;
+        char* end = strrchr(rest, '"');
+        if (end && end != rest) set_var_string(v, rest + 1, end - rest - 1);
+    } else {
+        v->type = TYPE_NUMBER;
+        var_set_num(v, evaluate_num(rest));
+    }
+}
+
+void cmd_arr(const char* args) {
+    require_main_thread("ARR");
+    char name[MAX_NAME]; int size;
+    if (sscanf(args, "%127s %d", name, &size) < 2) {
+        runtime_error("ARR requires name and size");
+    }
+    if (size <= 0) runtime_error("Array size must be positive");
+    if (ctx->array_count >= MAX_ARRAYS) runtime_error("Too many arrays");
+    
+    ECArray* arr = &ctx->arrays[ctx->array_count];
+    arr->num_data = (double*)calloc(size, sizeof(double));
+    arr->str_data = NULL;
+    arr->size = size;
+    arr->capacity = size;
+    arr->rows = arr->cols = 0;
+    arr->elem_type = TYPE_NUMBER;
+    
+    ECVar* v = get_or_create_var(name);
+    v->type = TYPE_ARRAY;
+    v->arr_id = ctx->array_count++;
+}
+
+// Concatenate `value + value ...` (OUT, WRITE and YIELD)
+void join_parts(ECBuffer* out, const char* args) {
+    char buf[MAX_LINE];
+    size_t n = strlen(args);
+    if (n > MAX_LINE - 1) n = MAX_LINE - 1;
+    memcpy(buf, args, n);
+    buf[n] = '\0';
+    trim(buf);
+    
+    char* token = buf;
+    char* plus;
+    char val[MAX_LINE];
+    buffer_clear(out);
+    while ((plus = strstr(token, " + ")) != NULL) {
+        *plus = '\0';
+        trim(token);
+        const char* text = get_string_value(token, val);
+        buffer_append(out, text, strlen(text));
+        token = plus + 3;
+    }
+    const char* text = get_string_value(token, val);
+    buffer_append(out, text, strlen(text));
+}
+
+// `value + value ...` as one line
+void print_parts(FILE* out, const char* args) {
+    join_parts(&ctx->line_buffer, args);
+    flockfile(out);      // Keep lines from PARLOOP workers whole
+    fwrite(ctx->line_buffer.data, 1, ctx->line_buffer.len, out);
+    putc('\n', out);
+    funlockfile(out);
+}
+
+void cmd_out(const char* args) {
+    print_parts(stdout, args);
+}
+
+void cmd_in(const char* args) {
+    char name[MAX_NAME], prompt[MAX_LINE] = "";
+    if (sscanf(args, "%127s %[^\n]", name, prompt) < 1) {
+        runtime_error("IN requires variable name");
+    }
+    
+    if (strlen(prompt) > 0) {
+        trim(prompt);
+        if (prompt[0] == '"') {
+            prompt[strlen(prompt) - 1] = '\0';
+            printf("%s", prompt + 1);
+        }
+    }
+    
+    char input[MAX_LINE];
+    if (fgets(input, MAX_LINE, stdin)) {
+        input[strcspn(input, "\n")] = '\0';
+        ECVar* v = get_or_create_var(name);
+        if (is_number(input)) var_set_num(v, parse_number(input));
+        else set_var_string(v, input, strlen(input));
+    }
+}
+
+void cmd_if(const char* args) {
+    if (instr_condition(&ctx->code[ctx->current_line])) return;
+    ctx->current_line = ctx->code[ctx->current_line].jump;
+    take_branch();
+}
+
+// From the chain entry at current_line: take the first ELIF whose condition
+// holds, else the ELSE or ENDIF
+void take_branch(void) {
+    while (ctx->code[ctx->current_line].op == OP_ELIF && !instr_condition(&ctx->code[ctx->current_line])) {
+        ctx->current_line = ctx->code[ctx->current_line].jump;
+    }
+}
+
+// Reached after a branch body ran: skip the rest of the chain
+void cmd_elif(const char* args) { ctx->current_line = ctx->code[ctx->current_line].end; }
+void cmd_else(const char* args) { ctx->current_line = ctx->code[ctx->current_line].end; }
+
+void cmd_loop(const char* args) {
+    if (jit_enter(ctx->current_line)) return;
+    ctx->loop_start[ctx->loop_depth] = ctx->current_line;
+    ctx->loop_end[ctx->loop_depth] = ctx->code[ctx->current_line].jump;
+    
+    if (args[0] != '\0' && !instr_condition(&ctx->code[ctx->current_line])) {
+        ctx->current_line = ctx->loop_end[ctx->loop_depth];
+        return;
+    }
+    ctx->loop_depth++;
+}
+
+void cmd_endloop(const char* args) {
+    if (ctx->loop_depth > 0) { ctx->loop_depth--; ctx->current_line = ctx->loop_start[ctx->loop_depth] - 1; }
+}
+
+void cmd_break(const char* args) {
+    if (ctx->loop_depth > 0) {
+        ctx->loop_depth--;
+        ctx->current_line = ctx->loop_end[ctx->loop_depth];
+        // Leaving an EXEC EACH body early: stop reading and reap the command
+        if (ctx->exec_stream_top > 0 && ctx->exec_streams[ctx->exec_stream_top - 1].end_line == ctx->current_line)
+            exec_stream_close();
+        if (ctx->foreach_top > 0 && ctx->foreach_streams[ctx->foreach_top - 1]->end_line == ctx->current_line)
+            foreach_close();
+    }
+}
+
+void cmd_continue(const char* args) {
+    if (ctx->loop_depth == 0) return;
+    int start = ctx->loop_start[ctx->loop_depth - 1];
+    // A LOOP head pushes its frame again when it re-tests the condition
+    if (ctx->code[start].op == OP_LOOP) ctx->loop_depth--;
+    ctx->current_line = start - 1;
+}
+
+void cmd_fn(const char* args) {
+    require_main_thread("FN");
+    char name[MAX_NAME], params[MAX_LINE] = "";
+    int memo, memo_limit;
+    args = fn_attributes(args, &memo, &memo_limit);
+    char* paren = strchr(args, '(');
+    if (paren) {
+        int name_len = paren - args;
+        strncpy(name, args, name_len);
+        name[name_len] = '\0'; trim(name);
+        char* end_paren = strchr(paren, ')');
+        if (end_paren) {
+            int param_len = end_paren - paren - 1;
+            strncpy(params, paren + 1, param_len);
+            params[param_len] = '\0';
+        }
+    } else sscanf(args, "%127s", name);
+    if (ctx->func_count >= MAX_FUNCS) runtime_error("Too many functions");
+    
+    ECFunc* fn = &ctx->funcs[ctx->func_count];
+    strncpy(fn->name, name, MAX_NAME - 1);
+    fn->start_line = ctx->current_line;
+    fn->param_count = 0;
+    fn->memo = memo;
+    fn->memo_limit = memo_limit;
+    
+    if (strlen(params) > 0) {
+        char* save;
+        char* tok = strtok_r(params, ",", &save);
+        while (tok && fn->param_count < 16) {
+            trim(tok);
+            strncpy(fn->params[fn->param_count++], tok, MAX_NAME - 1);
+            tok = strtok_r(NULL, ",", &save);
+        }
+    }
+    
+    fn->end_line = ctx->code[ctx->current_line].jump;
+    ctx->func_count++;
+    ctx->current_line = fn->end_line;
+}
+
+void cmd_call(const char* args) {
+    char name[MAX_NAME], params[MAX_LINE] = "";
+    char* paren = strchr(args, '(');
+    if (paren) {
+        int name_len = paren - args;
+        strncpy(name, args, name_len);
+        name[name_len] = '\0'; trim(name);
+        char* end_paren = strchr(paren, ')');
+        if (end_paren) {
+            int param_len = end_paren - paren - 1;
+            strncpy(params, paren + 1, param_len);
+            params[param_len] = '\0';
+        }
+    } else sscanf(args, "%127s %[^\n]", name, params);
+    
+    int fn_idx = find_func(name);
+    if (fn_idx < 0) {
+        runtime_error("Function '%s' not found", name);
+    }
+    
+    char result[MAX_NAME];
+    int has_result = paren && call_result_name(args, result);
+    if (call_function(&ctx->funcs[fn_idx], params)) ctx->call_result[ctx->call_stack_top - 1] = has_result;
+    else if (has_result) var_set_num(get_or_create_var(result), ctx->return_value);
+}
+
+// Bind the comma-separated arguments and jump to the function body. Returns
+// 0 when a FN MEMO result was found instead (it is in return_value).
+int call_function(ECFunc* fn, const char* params) {
+    if (ctx->call_stack_top >= MAX_STACK) {
+        runtime_error("Stack Overflow: Call depth exceeded (Limit: %d).", MAX_STACK);
+    }
+    
+    bind_params(fn, params);
+    if (fn->memo && !in_parallel_worker()) {
+        if (memo_lookup(fn)) return 0;
+        push_frame(fn, ctx->current_line);
+        ctx->call_memo[ctx->call_stack_top - 1] = fn - ctx->funcs;
+        return 1;
+    }
+    push_frame(fn, ctx->current_line);
+    return 1;
+}
+
+void bind_params(const ECFunc* fn, const char* params) {
+    if (strlen(params) > 0 && fn->param_count > 0) {
+        char params_copy[MAX_LINE]; strcpy(params_copy, params);
+        char* save;
+        char* tok = strtok_r(params_copy, ",", &save);
+        int i = 0;
+        while (tok && i < fn->param_count) {
+            trim(tok);
+            ECVar* v = get_or_create_var(fn->params[i]);
+            ECVar* src = find_var(tok);
+            if (tok[0] == '"') {
+                tok[strlen(tok) - 1] = '\0';
+                set_var_string(v, tok + 1, strlen(tok + 1));
+            } else if (src && src->type == TYPE_STRING) {
+                if (src != v) set_var_string(v, src->str_val, strlen(src->str_val));
+            } else {
+                v->type = TYPE_NUMBER;
+                var_set_num(v, evaluate_num(tok));
+            }
+            tok = strtok_r(NULL, ",", &save);
+            i++;
+        }
+    }
+}
+
+// Enter the body of `fn`; its RET / ENDFN continues after `return_line`
+void push_frame(const ECFunc* fn, int return_line) {
+    int top = ctx->call_stack_top;
+    ctx->call_stack[top] = return_line;
+    ctx->call_loop_depth[top] = ctx->loop_depth;
+    ctx->call_exec_top[top] = ctx->exec_stream_top;
+    ctx->call_foreach_top[top] = ctx->foreach_top;
+    ctx->call_memo[top] = -1;
+    ctx->call_result[top] = 0;
+    ctx->call_generator[top] = NULL;
+    
+    // Debug stack info
+    ctx->debug_stack[top].line_num = ctx->current_line;
+    strncpy(ctx->debug_stack[top].func_name, "Global/Previous", MAX_NAME);
+    
+    if (ctx->profile && !in_parallel_worker()) profile_call(fn - ctx->funcs);
+    
+    ctx->call_stack_top++;
+    ctx->in_function++;
+    ctx->has_return = 0;
+    ctx->current_line = fn->start_line;
+}
+
+// Back to the CALL line, closing the loops, EXEC EACH and FOREACH streams a
+// RET left from, and store the result for FN MEMO and `CALL name(args) result`
+void return_from_call(void) {
+    int top = --ctx->call_stack_top;
+    ctx->current_line = ctx->call_stack[top];
+    ctx->loop_depth = ctx->call_loop_depth[top];
+    while (ctx->exec_stream_top > ctx->call_exec_top[top]) exec_stream_close();
+    while (ctx->foreach_top > ctx->call_foreach_top[top]) foreach_close();
+    ctx->in_function--;
+    if (ctx->call_generator[top]) {
+        generator_finish(ctx->call_generator[top]);
+        return;
+    }
+    
+    ECNum value = ctx->has_return ? ctx->return_value : num_int(0);
+    int idx = ctx->call_memo[top];
+    if (idx >= 0 && ctx->memos[idx]) memo_insert(ctx->memos[idx], ctx->funcs[idx].memo_limit, &ctx->memo_keys[top], value);
+    char result[MAX_NAME];
+    if (ctx->call_result[top] && call_result_name(instr_args(&ctx->code[ctx->current_line]), result))
+        var_set_num(get_or_create_var(result), value);
+}
+
+void cmd_ret(const char* args) {
+    if (strlen(args) > 0) { ctx->return_value = evaluate_num(args); ctx->has_return = 1; }
+    if (ctx->call_stack_top > 0) return_from_call();
+}
+
+
+void cmd_class(const char* args) {
+    require_main_thread("CLASS");
+    char name[MAX_NAME];
+    sscanf(args, "%127s", name);
+    if (ctx->class_count >= MAX_CLASSES) runtime_error("Too many classes");
+    
+    ECClass* cls = &ctx->classes[ctx->class_count];
+    strncpy(cls->name, name, MAX_NAME - 1);
+    cls->start_line = ctx->current_line;
+    cls->member_count = 0;
+    cls->method_count = 0;
+    
+    cls->end_line = ctx->code[ctx->current_line].jump;
+    ctx->class_count++;
+    ctx->current_line = cls->end_line;
+}
+
+void cmd_new(const char* args) {
+    char var_name[MAX_NAME], class_name[MAX_NAME];
+    if (sscanf(args, "%127s %127s", var_name, class_name) < 2) {
+        runtime_error("NEW requires variable and class name");
+    }
+    int cls_idx = find_class(class_name);
+    if (cls_idx < 0) {
+        runtime_error("Class '%s' not found", class_name);
+    }
+    ECVar* v = get_or_create_var(var_name);
+    v->type = TYPE_OBJECT;
+    v->obj_class_id = cls_idx;
+}
+
+void cmd_add(const char* args) {
+    char dest[MAX_NAME], rest[MAX_LINE];
+    if (sscanf(args, "%127s %[^\n]", dest, rest) < 2) runtime_error("ADD requires variable and value");
+    ECVar* v = get_var_checked(dest);
+    var_set_num(v, num_apply(var_num(v), evaluate_num(rest), '+'));
+}
+
+void cmd_sub(const char* args) {
+    char dest[MAX_NAME], rest[MAX_LINE];
+    if (sscanf(args, "%127s %[^\n]", dest, rest) < 2) runtime_error("SUB requires variable and value");
+    ECVar* v = get_var_checked(dest);
+    var_set_num(v, num_apply(var_num(v), evaluate_num(rest), '-'));
+}
+
+void cmd_mul(const char* args) {
+    char dest[MAX_NAME], rest[MAX_LINE];
+    if (sscanf(args, "%127s %[^\n]", dest, rest) < 2) runtime_error("MUL requires variable and value");
+    ECVar* v = get_var_checked(dest);
+    var_set_num(v, num_apply(var_num(v), evaluate_num(rest), '*'));
+}
+
+void cmd_div(const char* args) {
+    char dest[MAX_NAME], rest[MAX_LINE];
+    if (sscanf(args, "%127s %[^\n]", dest, rest) < 2) runtime_error("DIV requires variable and value");
+    ECNum divisor = evaluate_num(rest);
+    if (num_value(divisor) == 0) runtime_error("Division by zero");
+    ECVar* v = get_var_checked(dest);
+    var_set_num(v, num_apply(var_num(v), divisor, '/'));
+}
+
+void cmd_mod(const char* args) {
+    char dest[MAX_NAME], rest[MAX_LINE];
+    if (sscanf(args, "%127s %[^\n]", dest, rest) < 2) runtime_error("MOD requires variable and value");
+    ECVar* v = get_var_checked(dest);
+    var_set_num(v, num_mod(var_num(v), evaluate_num(rest)));
+}
+
+// ============ Parallel Loops ============
+
+void rng_fork(ECContext* child);
+
+int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+// Take the next index from our own range, or steal the upper half of the
+// largest remaining range. Returns 0 once no iterations are left anywhere.
+int parloop_next(ParWorker* self, long* index) {
+    pthread_mutex_lock(&self->lock);
+    if (self->lo < self->hi) {
+        *index = self->lo++;
+        pthread_mutex_unlock(&self->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&self->lock);
+    
+    ParLoop* loop = self->loop;
+    for (;;) {
+        ParWorker* victim = NULL;
+        long best = 0;
+        for (int i = 0; i < loop->worker_count; i++) {
+            ParWorker* w = &loop->workers[i];
+            if (w == self) continue;
+            pthread_mutex_lock(&w->lock);
+            long remaining = w->hi - w->lo;
+            pthread_mutex_unlock(&w->lock);
+            if (remaining > best) { best = remaining; victim = w; }
+        }
+        if (!victim) return 0;
+        
+        pthread_mutex_lock(&victim->lock);
+        long remaining = victim->hi - victim->lo;
+        if (remaining <= 0) { pthread_mutex_unlock(&victim->lock); continue; }
+        long lo = victim->lo + remaining / 2, hi = victim->hi;
+        victim->hi = lo;
+        pthread_mutex_unlock(&victim->lock);
+        
+        pthread_mutex_lock(&self->lock);
+        self->lo = lo + 1;
+        self->hi = hi;
+        pthread_mutex_unlock(&self->lock);
+        *index = lo;
+        return 1;
+    }
+}
+
+int parloop_failed(ParLoop* loop) {
+    return __atomic_load_n(&loop->failed, __ATOMIC_ACQUIRE);
+}
+
+// Run this worker's share of the iterations in its own child context
+void parloop_run(ParWorker* self) {
+    ParLoop* loop = self->loop;
+    
+    // SUM variables start from 0; MIN and MAX from the value on entry, which
+    // the combined result includes anyway
+    ECVar* reduce[MAX_REDUCTIONS];
+    for (int k = 0; k < loop->reduce_count; k++) {
+        reduce[k] = new_var(loop->reduce_vars[k]);
+        var_set_num(reduce[k], loop->reduce_ops[k] == REDUCE_SUM ? num_int(0) : loop->reduce_init[k]);
+    }
+    ECVar* index_var = new_var(loop->index_var);
+    
+    long index;
+    while (ctx->running && !parloop_failed(loop) && parloop_next(self, &index)) {
+        var_set_num(index_var, num_int(index));
+        
+        // The body is a loop frame of its own, so BREAK/CONTINUE end the iteration
+        ctx->call_stack_top = 0;
+        ctx->in_function = 0;
+        ctx->loop_start[0] = ctx->loop_end[0] = loop->end_line;
+        ctx->loop_depth = 1;
+        
+        ctx->current_line = loop->body_line + 1;
+        while (ctx->running && ctx->current_line < ctx->line_count) {
+            if (ctx->call_stack_top == 0 && (ctx->current_line >= loop->end_line || ctx->current_line <= loop->body_line)) break;
+            execute_line();
+            ctx->current_line++;
+        }
+    }
+    
+    for (int k = 0; k < loop->reduce_count; k++) self->partial[k] = reduce[k]->type == TYPE_NUMBER ? reduce[k]->num : num_int(0);
+}
+
+void* parloop_worker(void* arg) {
+    ParWorker* self = (ParWorker*)arg;
+    jmp_buf jmp;
+    
+    ctx = self->context;
+    ctx->error_jmp = &jmp;
+    if (setjmp(jmp) == 0) {
+        parloop_run(self);
+    } else {
+        // Keep the report in the worker's context; the spawning thread re-raises it
+        self->failed = 1;
+        __atomic_store_n(&self->loop->failed, 1, __ATOMIC_RELEASE);
+    }
+    ctx->error_jmp = NULL;
+    return NULL;
+}
+
+void cmd_parloop(const char* args) {
+    // PARLOOP i start end [THREADS n] [SUM var] [MIN var] [MAX var] ... ENDPARLOOP
+    require_main_thread("Nested PARLOOP");
+    compile_all_blocks();
+    
+    ParLoop loop;
+    char start_str[MAX_NAME], end_str[MAX_NAME];
+    int consumed = 0;
+    if (sscanf(args, "%127s %127s %127s%n", loop.index_var, start_str, end_str, &consumed) < 3) {
+        runtime_error("PARLOOP requires index variable, start and end");
+    }
+    loop.body_line = ctx->current_line;
+    loop.end_line = ctx->code[ctx->current_line].jump;
+    loop.reduce_count = 0;
+    
+    long start = (long)evaluate_expr(start_str);
+    long end = (long)evaluate_expr(end_str);
+    int threads = 0;
+    
+    const char* ptr = args + consumed;
+    char clause[MAX_NAME], value[MAX_NAME];
+    int n;
+    while (sscanf(ptr, "%127s %127s%n", clause, value, &n) == 2) {
+        ptr += n;
+        if (strcasecmp(clause, "THREADS") == 0) {
+            threads = (int)evaluate_expr(value);
+            continue;
+        }
+        
+        ReduceOp op;
+        if (strcasecmp(clause, "SUM") == 0) op = REDUCE_SUM;
+        else if (strcasecmp(clause, "MIN") == 0) op = REDUCE_MIN;
+        else if (strcasecmp(clause, "MAX") == 0) op = REDUCE_MAX;
+        else runtime_error("Unknown PARLOOP clause '%s' (expected THREADS, SUM, MIN or MAX)", clause);
+        
+        if (loop.reduce_count >= MAX_REDUCTIONS) runtime_error("Too many PARLOOP reductions (Limit: %d)", MAX_REDUCTIONS);
+        ECVar* v = get_var_checked(value);
+        loop.reduce_init[loop.reduce_count] = v->type == TYPE_NUMBER ? v->num : num_int(0);
+        strcpy(loop.reduce_vars[loop.reduce_count], value);
+        loop.reduce_ops[loop.reduce_count++] = op;
+    }
+    
+    ctx->current_line = loop.end_line;
+    if (end <= start) return;
+    
+    if (threads <= 0) threads = cpu_count();
+    if (threads > end - start) threads = (int)(end - start);
+    
+    loop.worker_count = threads;
+    loop.workers = (ParWorker*)calloc(threads, sizeof(ParWorker));
+    loop.failed = 0;
+    if (!loop.workers) runtime_error("Out of memory starting PARLOOP");
+    
+    // Static initial split; stealing rebalances uneven iterations
+    long total = end - start;
+    for (int i = 0; i < threads; i++) {
+        ParWorker* w = &loop.workers[i];
+        w->loop = &loop;
+        w->lo = start + total * i / threads;
+        w->hi = start + total * (i + 1) / threads;
+        w->context = context_create(ctx);
+        if (!w->context) runtime_error("Out of memory starting PARLOOP");
+        rng_fork(w->context);
+        pthread_mutex_init(&w->lock, NULL);
+    }
+    int started = 0;
+    while (started < threads &&
+           pthread_create(&loop.workers[started].thread, NULL, parloop_worker, &loop.workers[started]) == 0) {
+        started++;
+    }
+    if (started < threads) __atomic_store_n(&loop.failed, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < started; i++) pthread_join(loop.workers[i].thread, NULL);
+    
+    // A worker error is re-raised here with the worker's line and stack trace
+    int failed = -1;
+    for (int i = 0; i < started && failed < 0; i++) {
+        if (loop.workers[i].failed) failed = i;
+    }
+    if (failed >= 0) {
+        ECBuffer* report = &loop.workers[failed].context->error;
+        buffer_clear(&ctx->error);
+        buffer_append(&ctx->error, report->data, report->len);
+    }
+    
+    if (failed < 0 && started == threads) {
+        for (int k = 0; k < loop.reduce_count; k++) {
+            ECVar* v = get_var_checked(loop.reduce_vars[k]);
+            ECNum total = loop.reduce_init[k];
+            for (int i = 0; i < threads; i++) {
+                ECNum part = loop.workers[i].partial[k];
+                switch (loop.reduce_ops[k]) {
+                    case REDUCE_SUM: total = num_apply(total, part, '+'); break;
+                    case REDUCE_MIN: if (num_compare(part, total, 5)) total = part; break;
+                    case REDUCE_MAX: if (num_compare(part, total, 4)) total = part; break;
+                }
+            }
+            var_set_num(v, total);
+        }
+    }
+    
+    for (int i = 0; i < threads; i++) {
+        context_free_locals(loop.workers[i].context);
+        free(loop.workers[i].context);
+        pthread_mutex_destroy(&loop.workers[i].lock);
+    }
+    free(loop.workers);
+    
+    if (failed >= 0) raise_error();
+    if (started < threads) runtime_error("Cannot start PARLOOP worker thread");
+}
+
+// ============ External Execution ============
+
+// Run a shell command and capture its whole stdout into `out` (linear time,
+// no size limit). A single trailing newline is removed.
+void capture_command(const char* command, ECBuffer* out) {
+    buffer_clear(out);
+    FILE* fp = popen(command, "r");
+    if (!fp) return;
+    
+    char chunk[MAX_LINE * 4];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) buffer_append(out, chunk, n);
+    pclose(fp);
+    
+    if (out->len > 0 && out->data[out->len - 1] == '\n') out->data[--out->len] = '\0';
+}
+
+// Copy captured output into result_var (if given), as a number when it parses as one
+void store_exec_result(const char* result_var, const ECBuffer* out, int detect_number) {
+    if (strlen(result_var) == 0) return;
+    ECVar* v = get_or_create_var(result_var);
+    if (detect_number && is_number(out->data)) {
+        var_set_num(v, parse_number(out->data));
+    } else {
+        set_var_string(v, out->data, out->len);
+    }
+}
+
+// Parse `"command" [result_var]` or the streaming form `"command" EACH var`.
+// Returns 1 for the streaming form.
+int parse_exec_args(const char* args, char* command, char* var_name) {
+    char word[MAX_NAME] = "", second[MAX_NAME] = "";
+    command[0] = var_name[0] = '\0';
+    
+    if (args[0] == '"') {
+        const char* end = strchr(args + 1, '"');
+        if (end) {
+            int len = end - args - 1;
+            strncpy(command, args + 1, len);
+            command[len] = '\0';
+            
+            int n = sscanf(end + 1, "%127s %127s", word, second);
+            if (n == 2 && strcasecmp(word, "EACH") == 0) {
+                strcpy(var_name, second);
+                return 1;
+            }
+            if (n >= 1) strcpy(var_name, word);
+        }
+    } else {
+        sscanf(args, "%[^\n]", command);
+    }
+    return 0;
+}
+
+void exec_stream_close(void) {
+    pclose(ctx->exec_streams[--ctx->exec_stream_top].fp);
+}
+
+// Read the next output line of the innermost stream into its loop variable
+int exec_stream_next(void) {
+    ExecStream* es = &ctx->exec_streams[ctx->exec_stream_top - 1];
+    if (!read_line(es->fp, &ctx->line_buffer)) return 0;
+    set_var_string(get_or_create_var(es->var_name), ctx->line_buffer.data, ctx->line_buffer.len);
+    return 1;
+}
+
+void cmd_exec(const char* args) {
+    // EXEC "command" [result_var]
+    // EXEC "command" EACH line ... ENDEXEC   (body runs once per output line)
+    char command[MAX_LINE], result_var[MAX_NAME];
+    
+    if (!parse_exec_args(args, command, result_var)) {
+        capture_command(command, &ctx->last_exec_output);
+        store_exec_result(result_var, &ctx->last_exec_output, 0);
+        return;
+    }
+    
+    int end_line = ctx->code[ctx->current_line].jump;
+    if (ctx->exec_stream_top >= MAX_STACK) runtime_error("Too many nested EXEC EACH blocks");
+    
+    FILE* fp = popen(command, "r");
+    if (!fp) runtime_error("Cannot run command '%s'", command);
+    
+    ExecStream* es = &ctx->exec_streams[ctx->exec_stream_top++];
+    es->fp = fp;
+    es->body_line = ctx->current_line;
+    es->end_line = end_line;
+    strcpy(es->var_name, result_var);
+    
+    if (!exec_stream_next()) {
+        exec_stream_close();
+        ctx->current_line = end_line;
+        return;
+    }
+    
+    // Registered as a loop so BREAK and CONTINUE work inside the body
+    ctx->loop_start[ctx->loop_depth] = end_line;
+    ctx->loop_end[ctx->loop_depth] = end_line;
+    ctx->loop_depth++;
+}
+
+void cmd_endexec(const char* args) {
+    if (ctx->exec_stream_top == 0) return;
+    if (exec_stream_next()) {
+        ctx->current_line = ctx->exec_streams[ctx->exec_stream_top - 1].body_line;
+        return;
+    }
+    exec_stream_close();
+    if (ctx->loop_depth > 0) ctx->loop_depth--;
+}
+
+// Build the shell command for `PYRUN "script.py" [func(args)] [result_var]`
+void build_pyrun_command(const char* args, char* command, char* result_var) {
+    char script[MAX_LINE] = "", func[MAX_NAME] = "", py_args[MAX_LINE] = "";
+    result_var[0] = '\0';
+    
+    char* ptr = (char*)args;
+    while (*ptr && isspace(*ptr)) ptr++;
+    
+    if (*ptr == '"') {
+        char* end = strchr(ptr + 1, '"');
+        if (end) {
+            int len = end - ptr - 1;
+            strncpy(script, ptr + 1, len);
+            script[len] = '\0';
+            ptr = end + 1;
+        }
+    }
+    
+    while (*ptr && isspace(*ptr)) ptr++;
+    
+    // Parse remaining: func(args) result_var  OR just result_var
+    char* paren = strchr(ptr, '(');
+    if (paren) {
+        int len = paren - ptr;
+        strncpy(func, ptr, len);
+        func[len] = '\0';
+        trim(func);
+        
+        char* end_paren = strchr(paren, ')');
+        if (end_paren) {
+            int arg_len = end_paren - paren - 1;
+            strncpy(py_args, paren + 1, arg_len);
+            py_args[arg_len] = '\0';
+            
+            ptr = end_paren + 1;
+            while (*ptr && isspace(*ptr)) ptr++;
+            if (*ptr) sscanf(ptr, "%127s", result_var);
+        }
+    } else if (*ptr) {
+        sscanf(ptr, "%127s", result_var);
+    }
+    
+    if (strlen(func) > 0) {
+        sprintf(command, "python -c \"import sys; sys.path.insert(0, '.'); from %.*s import %s; print(%s(%s))\"",
+                (int)(strrchr(script, '.') ? strrchr(script, '.') - script : strlen(script)),
+                script, func, func, py_args);
+    } else {
+        sprintf(command, "python \"%s\"", script);
+    }
+}
+
+void cmd_pyrun(const char* args) {
+    // PYRUN "script.py" [func_name] [args...] [result_var]
+    char command[MAX_LINE * 2], result_var[MAX_NAME];
+    build_pyrun_command(args, command, result_var);
+    capture_command(command, &ctx->last_exec_output);
+    store_exec_result(result_var, &ctx->last_exec_output, 1);
+}
+
+// Build the shell command for `CRUN "source.c" [result_var]`, compiling to temp_exe
+void build_crun_command(const char* args, const char* temp_exe, char* command, char* result_var) {
+    char source[MAX_LINE] = "";
+    result_var[0] = '\0';
+    
+    char* ptr = (char*)args;
+    while (*ptr && isspace(*ptr)) ptr++;
+    
+    if (*ptr == '"') {
+        char* end = strchr(ptr + 1, '"');
+        if (end) {
+            int len = end - ptr - 1;
+            strncpy(source, ptr + 1, len);
+            source[len] = '\0';
+            ptr = end + 1;
+        }
+    }
+    
+    while (*ptr && isspace(*ptr)) ptr++;
+    if (*ptr) sscanf(ptr, "%127s", result_var);
+    
+    sprintf(command, "gcc -o %s \"%s\" -lm 2>&1 && %s", temp_exe, source, temp_exe);
+}
+
+void cmd_crun(const char* args) {
+    // CRUN "source.c" [result_var]
+    // Compiles and runs C source, captures output
+    char command[MAX_LINE * 2], result_var[MAX_NAME];
+    #ifdef _WIN32
+        char temp_exe[] = "__ec_temp.exe";
+    #else
+        char temp_exe[] = "./__ec_temp";
+    #endif
+    
+    build_crun_command(args, temp_exe, command, result_var);
+    capture_command(command, &ctx->last_exec_output);
+    remove(temp_exe);
+    store_exec_result(result_var, &ctx->last_exec_output, 1);
+}
+
+// ============ Asynchronous Jobs ============
+
+int job_concurrency(void) {
+    return ctx->job_limit > 0 ? ctx->job_limit : cpu_count();
+}
+
+void job_finish(ECJob* job) {
+    ECBuffer* out = &job->output;
+    if (out->len > 0 && out->data[out->len - 1] == '\n') out->data[--out->len] = '\0';
+    job->state = JOB_DONE;
+}
+
+#ifdef _WIN32
+
+// No posix_spawn: jobs run to completion as soon as they are started
+void job_start(ECJob* job) {
+    capture_command(job->command, &job->output);
+    job->state = JOB_DONE;
+}
+
+void jobs_pump(int block) {
+    if (!ctx->jobs) return;
+    for (int i = 0; i < ctx->job_count; i++)
+        if (ctx->jobs[i].state == JOB_QUEUED) job_start(&ctx->jobs[i]);
+}
+
+#else
+
+// Spawn `sh -c command` with stdout connected to a non-blocking pipe
+void job_start(ECJob* job) {
+    int pipefd[2];
+    buffer_clear(&job->output);
+    if (pipe(pipefd) != 0) runtime_error("Cannot create pipe for job: %s", strerror(errno));
+    
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, pipefd[0]);
+    posix_spawn_file_actions_addclose(&actions, pipefd[1]);
+    
+    char* argv[] = { "sh", "-c", job->command, NULL };
+    pid_t pid;
+    int err = posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipefd[1]);
+    
+    if (err != 0) {
+        close(pipefd[0]);
+        job_finish(job);
+        return;
+    }
+    
+    fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    job->pid = pid;
+    job->fd = pipefd[0];
+    job->state = JOB_RUNNING;
+    ctx->jobs_running++;
+}
+
+// Drain whatever is readable; on EOF reap the child and mark the job done
+void job_read(ECJob* job) {
+    char chunk[MAX_LINE * 4];
+    for (;;) {
+        ssize_t n = read(job->fd, chunk, sizeof(chunk));
+        if (n > 0) { buffer_append(&job->output, chunk, n); continue; }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        break;
+    }
+    close(job->fd);
+    waitpid(job->pid, NULL, 0);
+    ctx->jobs_running--;
+    job_finish(job);
+}
+
+// One event-loop step: start queued jobs up to the concurrency limit, then
+// poll every running job's pipe. With block=0 this never waits.
+void jobs_pump(int block) {
+    if (!ctx->jobs) return;
+    int limit = job_concurrency();
+    for (int i = 0; i < ctx->job_count && ctx->jobs_running < limit; i++)
+        if (ctx->jobs[i].state == JOB_QUEUED) job_start(&ctx->jobs[i]);
+    if (ctx->jobs_running == 0) return;
+    
+    struct pollfd* fds = (struct pollfd*)malloc(ctx->jobs_running * sizeof(struct pollfd));
+    int* owner = (int*)malloc(ctx->jobs_running * sizeof(int));
+    if (!fds || !owner) { free(fds); free(owner); runtime_error("Out of memory polling jobs"); }
+    int nfds = 0;
+    for (int i = 0; i < ctx->job_count; i++) {
+        if (ctx->jobs[i].state != JOB_RUNNING) continue;
+        fds[nfds].fd = ctx->jobs[i].fd;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        owner[nfds++] = i;
+    }
+    
+    int ready = poll(fds, nfds, block ? -1 : 0);
+    for (int i = 0; ready > 0 && i < nfds; i++)
+        if (fds[i].revents) job_read(&ctx->jobs[owner[i]]);
+    free(fds);
+    free(owner);
+}
+
+#endif
+
+ECJob* get_job_checked(const char* handle) {
+    int id = (int)parse_value(handle);
+    if (!ctx->jobs || id < 1 || id > ctx->job_count || ctx->jobs[id - 1].state == JOB_FREE)
+        runtime_error("'%s' is not a pending job handle", handle);
+    return &ctx->jobs[id - 1];
+}
+
+void job_wait(ECJob* job) {
+    while (job->state == JOB_QUEUED || job->state == JOB_RUNNING) jobs_pump(1);
+}
+
+// Store a finished job's output and release its slot
+void job_collect(ECJob* job, const char* result_var) {
+    store_exec_result(result_var, &job->output, job->detect_number);
+    if (job->temp_exe[0]) remove(job->temp_exe);
+    free(job->command);
+    job->command = NULL;
+    job->state = JOB_FREE;
+    int slot = job - ctx->jobs;
+    if (slot < ctx->job_free) ctx->job_free = slot;
+}
+
+// A free slot in the job table. Uncollected jobs keep theirs (WAITALL still
+// collects a job whose handle was reused), so the table grows instead of
+// imposing a limit.
+int job_slot(void) {
+    for (int i = ctx->job_free; i < ctx->job_count; i++) {
+        if (ctx->jobs[i].state == JOB_FREE) return ctx->job_free = i;
+    }
+    if (ctx->job_count == ctx->job_cap) {
+        int cap = ctx->job_cap ? ctx->job_cap * 2 : 16;
+        ECJob* jobs = (ECJob*)realloc(ctx->jobs, cap * sizeof(ECJob));
+        if (!jobs) runtime_error("Out of memory allocating the job table");
+        memset(jobs + ctx->job_cap, 0, (cap - ctx->job_cap) * sizeof(ECJob));
+        ctx->jobs = jobs;
+        ctx->job_cap = cap;
+    }
+    return ctx->job_free = ctx->job_count++;
+}
+
+void cmd_async(const char* args) {
+    // ASYNC handle EXEC "command" [result_var]
+    // ASYNC handle PYRUN "script.py" [func(args)] [result_var]
+    // ASYNC handle CRUN "source.c" [result_var]
+    require_main_thread("ASYNC");
+    char handle[MAX_NAME], kind[MAX_NAME], rest[MAX_LINE] = "";
+    if (sscanf(args, "%127s %127s %[^\n]", handle, kind, rest) < 3) {
+        runtime_error("ASYNC requires a handle and an EXEC, PYRUN or CRUN command");
+    }
+    
+    int slot = job_slot();
+    ECJob* job = &ctx->jobs[slot];
+    char command[MAX_LINE * 2];
+    job->temp_exe[0] = '\0';
+    job->detect_number = 1;
+    
+    if (strcasecmp(kind, "EXEC") == 0) {
+        if (parse_exec_args(rest, command, job->result_var))
+            runtime_error("EXEC ... EACH cannot run asynchronously");
+        job->detect_number = 0;
+    } else if (strcasecmp(kind, "PYRUN") == 0) {
+        build_pyrun_command(rest, command, job->result_var);
+    } else if (strcasecmp(kind, "CRUN") == 0) {
+        // Each job compiles to its own binary so concurrent CRUNs don't collide
+    #ifdef _WIN32
+        sprintf(job->temp_exe, "__ec_job%d.exe", slot);
+    #else
+        sprintf(job->temp_exe, "./__ec_job%d_%d", (int)getpid(), slot);
+    #endif
+        build_crun_command(rest, job->temp_exe, command, job->result_var);
+    } else {
+        runtime_error("ASYNC supports EXEC, PYRUN and CRUN, not '%s'", kind);
+    }
+    
+    job->command = strdup(command);
+    if (!job->command) runtime_error("Out of memory queuing job");
+    job->state = JOB_QUEUED;
+    ECVar* v = get_or_create_var(handle);
+    var_set_num(v, num_int(slot + 1));
+    
+    jobs_pump(0);
+}
+
+void cmd_wait(const char* args) {
+    // WAIT handle [result_var]
+    require_main_thread("WAIT");
+    char handle[MAX_NAME], result_var[MAX_NAME] = "";
+    if (sscanf(args, "%127s %127s", handle, result_var) < 1) runtime_error("WAIT requires a job handle");
+    
+    ECJob* job = get_job_checked(handle);
+    job_wait(job);
+    job_collect(job, strlen(result_var) > 0 ? result_var : job->result_var);
+}
+
+void cmd_waitall(const char* args) {
+    require_main_thread("WAITALL");
+    if (!ctx->jobs) return;
+    for (int i = 0; i < ctx->job_count; i++) {
+        if (ctx->jobs[i].state == JOB_FREE) continue;
+        job_wait(&ctx->jobs[i]);
+        job_collect(&ctx->jobs[i], ctx->jobs[i].result_var);
+    }
+}
+
+void cmd_jobs(const char* args) {
+    // JOBS n   (max concurrently running jobs; 0 = number of CPUs)
+    require_main_thread("JOBS");
+    if (strlen(args) == 0) runtime_error("JOBS requires a concurrency limit");
+    int n = (int)evaluate_expr(args);
+    if (n < 0) runtime_error("Job limit must not be negative");
+    ctx->job_limit = n;
+}
+
+// ============ File I/O ============
+
+#define READ_BUFFER (1 << 20)
+
+// Map a whole file privately (copy-on-write; read into memory on Windows).
+// An empty file gives base NULL. Returns 0 if it cannot be read.
+int map_file(const char* filename, char** base, size_t* size) {
+    *base = NULL;
+    *size = 0;
+#ifdef _WIN32
+    FILE* f = fopen(filename, "rb");
+    if (!f) return 0;
+    int ok = fseek(f, 0, SEEK_END) == 0;
+    long len = ok ? ftell(f) : -1;
+    if (len > 0) {
+        rewind(f);
+        *base = (char*)malloc((size_t)len);
+        ok = *base && fread(*base, 1, (size_t)len, f) == (size_t)len;
+        if (!ok) { free(*base); *base = NULL; }
+        else *size = (size_t)len;
+    }
+    fclose(f);
+    return ok && len >= 0;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    int ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size > 0) {
+        char* mem = (char*)mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ok = mem != (char*)MAP_FAILED;
+        if (ok) { *base = mem; *size = (size_t)st.st_size; }
+    }
+    close(fd);
+    return ok;
+#endif
+}
+
+void unmap_file(char* base, size_t size) {
+    if (!base) return;
+#ifdef _WIN32
+    free(base);
+#else
+    munmap(base, size);
+#endif
+}
+
+// Open `path` with a READ_BUFFER-sized buffer. Reads bypass stdio and go
+// straight into it; writes use it as the stdio buffer.
+int reader_open(LineReader* r, const char* path, const char* mode) {
+    memset(r, 0, sizeof(*r));
+    r->fp = fopen(path, mode);
+    if (!r->fp) return 0;
+    r->cap = READ_BUFFER;
+    r->buf = (char*)malloc(r->cap);
+    if (!r->buf) {
+        fclose(r->fp);
+        r->fp = NULL;
+        errno = ENOMEM;
+        return 0;
+    }
+    if (mode[0] == 'r') setvbuf(r->fp, NULL, _IONBF, 0);
+    else setvbuf(r->fp, r->buf, _IOFBF, r->cap);
+    return 1;
+}
+
+// Nonzero if buffered output could not be written
+int reader_close(LineReader* r) {
+    int failed = ferror(r->fp) | (fclose(r->fp) != 0);
+    free(r->buf);
+    r->fp = NULL;
+    r->buf = NULL;
+    return failed;
+}
+
+// Next line (without its newline) as a NUL-terminated pointer into the
+// buffer, valid until the following call. Returns 0 at end of file.
+int reader_next(LineReader* r, char** line, size_t* len) {
+    for (;;) {
+        char* start = r->buf + r->pos;
+        char* nl = (char*)memchr(start, '\n', r->len - r->pos);
+        if (nl || (r->eof && r->pos < r->len)) {
+            *line = start;
+            *len = nl ? (size_t)(nl - start) : r->len - r->pos;
+            r->pos += *len + (nl != NULL);
+            break;
+        }
+        if (r->eof) return 0;
+        
+        // Keep the partial line and refill behind it
+        memmove(r->buf, start, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+        if (r->len + 1 >= r->cap) {
+            char* grown = (char*)realloc(r->buf, r->cap * 2);
+            if (!grown) runtime_error("Out of memory reading a %zu byte line", r->len);
+            r->buf = grown;
+            r->cap *= 2;
+        }
+        size_t n = fread(r->buf + r->len, 1, r->cap - r->len - 1, r->fp);
+        if (n == 0) {
+            if (ferror(r->fp)) runtime_error("Error reading file: %s", strerror(errno));
+            r->eof = 1;
+        }
+        r->len += n;
+    }
+    if (*len > 0 && (*line)[*len - 1] == '\r') (*len)--;
+    (*line)[*len] = '\0';
+    return 1;
+}
+
+// Like parse_number, but a single pass that also rejects non-numbers
+int scan_number(const char* text, ECNum* out) {
+    if (!*text || isspace((unsigned char)*text)) return 0;
+    char* end;
+    errno = 0;
+    long long i = strtoll(text, &end, 10);
+    if (*end == '\0' && errno != ERANGE) {
+        *out = num_int(i);
+        return 1;
+    }
+    double d = strtod(text, &end);
+    if (*end != '\0') return 0;
+    *out = num_double(d);
+    return 1;
+}
+
+// A numeric field becomes a number, anything else a string
+void store_field(const char* name, const char* text, size_t len) {
+    ECVar* v = get_or_create_var(name);
+    ECNum n;
+    if (scan_number(text, &n)) var_set_num(v, n);
+    else set_var_string(v, text, len);
+}
+
+// Split the line in place and assign its fields; missing ones are ""
+void store_fields(const ForeachStream* fs, char* line, size_t len) {
+    char* p = line;
+    char* end = line + len;
+    for (int f = 0; f < fs->var_count; f++) {
+        if (!fs->sep) p += strspn(p, " \t");
+        char* field = p;
+        if (fs->sep) {
+            char* q = (char*)memchr(p, fs->sep, end - p);
+            p = q ? q : end;
+        } else {
+            p += strcspn(p, " \t");
+        }
+        size_t flen = p - field;
+        if (p < end) *p++ = '\0';
+        store_field(fs->vars[f], field, flen);
+    }
+}
+
+// FOREACH var [var ...] IN source [SPLIT "sep"]. Returns the function
+// index for `IN name(args)`, with the arguments in `path`, otherwise -1.
+int parse_foreach_args(const char* args, ForeachStream* fs, char* path) {
+    const char* p = args;
+    int found = 0;
+    fs->var_count = 0;
+    for (;;) {
+        p += strspn(p, " \t,");
+        size_t n = strcspn(p, " \t,");
+        if (n == 0) break;
+        if (n == 2 && strncasecmp(p, "IN", 2) == 0) { p += 2; found = 1; break; }
+        if (n >= MAX_NAME) runtime_error("FOREACH variable name too long");
+        if (fs->var_count == MAX_FIELDS) runtime_error("FOREACH takes at most %d variables", MAX_FIELDS);
+        memcpy(fs->vars[fs->var_count], p, n);
+        fs->vars[fs->var_count++][n] = '\0';
+        p += n;
+    }
+    if (!found || fs->var_count == 0) runtime_error("FOREACH requires variables, IN and a file name");
+    
+    char source[MAX_LINE], val[MAX_LINE];
+    strncpy(source, p, MAX_LINE - 1);
+    source[MAX_LINE - 1] = '\0';
+    trim(source);
+    char* rest = source;
+    char* params = NULL;
+    int fn = -1;
+    if (*rest == '"') {
+        char* close = strchr(rest + 1, '"');
+        rest = close ? close + 1 : rest + strlen(rest);
+    } else if (rest[strcspn(rest, " \t(")] == '(') {
+        char name[MAX_NAME];
+        size_t n = strcspn(rest, "(");
+        if (n >= MAX_NAME) n = MAX_NAME - 1;
+        memcpy(name, rest, n);
+        name[n] = '\0';
+        if ((fn = find_func(name)) < 0) runtime_error("Function '%s' not found", name);
+        params = rest + strcspn(rest, "(");
+        int depth = 0, quoted = 0;
+        for (rest = params; *rest; rest++) {
+            if (*rest == '"') quoted = !quoted;
+            else if (!quoted && *rest == '(') depth++;
+            else if (!quoted && *rest == ')' && --depth == 0) break;
+        }
+        if (!*rest) runtime_error("FOREACH: missing ')' after '%s'", name);
+        *rest++ = '\0';
+        params++;
+    } else {
+        rest += strcspn(rest, " \t");
+    }
+    
+    fs->split = fs->var_count > 1;
+    fs->sep = 0;
+    char* opt = rest + strspn(rest, " \t");
+    if (*opt) {
+        if (strncasecmp(opt, "SPLIT", 5) != 0) runtime_error("Unexpected '%s' after FOREACH file", opt);
+        char sep[MAX_LINE];
+        const char* text = get_string_value(opt + 5, sep);
+        fs->sep = strcmp(text, "\\t") == 0 ? '\t' : text[0];
+        fs->split = 1;
+    }
+    *rest = '\0';
+    if (params) { strcpy(path, params); return fn; }
+    if (!*source) runtime_error("FOREACH requires a file name");
+    strcpy(path, get_string_value(source, val));
+    return -1;
+}
+
+void foreach_free(ForeachStream* fs) {
+    if (fs->co) {
+        for (int i = 0; i < fs->co->stream_count; i++) foreach_free(fs->co->streams[i]);
+        free(fs->co);
+    } else {
+        reader_close(&fs->reader);
+    }
+    free(fs);
+}
+
+void foreach_close(void) {
+    foreach_free(ctx->foreach_streams[--ctx->foreach_top]);
+}
+
+// Read the next line of the innermost FOREACH into its variables
+int foreach_next(void) {
+    ForeachStream* fs = ctx->foreach_streams[ctx->foreach_top - 1];
+    char* line;
+    size_t len;
+    if (!reader_next(&fs->reader, &line, &len)) return 0;
+    if (fs->split) store_fields(fs, line, len);
+    else store_field(fs->vars[0], line, len);
+    return 1;
+}
+
+// Run the FOREACH body as a loop so BREAK and CONTINUE work inside it
+void foreach_enter_body(const ForeachStream* fs) {
+    ctx->loop_start[ctx->loop_depth] = fs->end_line;
+    ctx->loop_end[ctx->loop_depth] = fs->end_line;
+    ctx->loop_depth++;
+}
+
+// `FOREACH vars IN name(args)` runs FN `name` as a coroutine. Its frame is
+// pushed with the ENDFOREACH line as the return address, so when the body
+// ends (RET / ENDFN) the loop is over. YIELD assigns the FOREACH variables
+// and suspends: the generator's loops and nested FOREACH streams move from
+// the shared stacks into its Coroutine and the frame is popped. ENDFOREACH
+// pushes them back and continues after the YIELD.
+
+void generator_start(ForeachStream* fs, int fn_idx, const char* params) {
+    ECFunc* fn = &ctx->funcs[fn_idx];
+    if (ctx->call_stack_top >= MAX_STACK) {
+        runtime_error("Stack Overflow: Call depth exceeded (Limit: %d).", MAX_STACK);
+    }
+    fs->co = (Coroutine*)calloc(1, sizeof(Coroutine));
+    if (!fs->co) { free(fs); runtime_error("Out of memory starting generator '%s'", fn->name); }
+    fs->co->exec_base = ctx->exec_stream_top;
+    fs->index = ctx->foreach_top;
+    ctx->foreach_streams[ctx->foreach_top++] = fs;
+    
+    bind_params(fn, params);
+    push_frame(fn, fs->end_line);
+    ctx->call_generator[ctx->call_stack_top - 1] = fs;
+}
+
+// The generator returned: close what its body left open, and the loop
+void generator_finish(ForeachStream* fs) {
+    int index = fs->index;
+    while (ctx->foreach_top > index) foreach_close();
+}
+
+void generator_resume(ForeachStream* fs) {
+    Coroutine* co = fs->co;
+    if (ctx->call_stack_top >= MAX_STACK) {
+        runtime_error("Stack Overflow: Call depth exceeded (Limit: %d).", MAX_STACK);
+    }
+    if (ctx->loop_depth + co->loop_count > MAX_STACK || ctx->foreach_top + co->stream_count > MAX_STACK) {
+        runtime_error("Too many nested loops resuming generator");
+    }
+    if (ctx->loop_depth > 0) ctx->loop_depth--;
+    
+    int top = ctx->call_stack_top++;
+    ctx->call_stack[top] = fs->end_line;
+    ctx->call_loop_depth[top] = ctx->loop_depth;
+    ctx->call_exec_top[top] = ctx->exec_stream_top;
+    ctx->call_foreach_top[top] = ctx->foreach_top;
+    ctx->call_memo[top] = -1;
+    ctx->call_result[top] = 0;
+    ctx->call_generator[top] = fs;
+    ctx->debug_stack[top].line_num = ctx->current_line;
+    strncpy(ctx->debug_stack[top].func_name, "Global/Previous", MAX_NAME);
+    ctx->in_function++;
+    
+    memcpy(ctx->loop_start + ctx->loop_depth, co->loop_start, co->loop_count * sizeof(int));
+    memcpy(ctx->loop_end + ctx->loop_depth, co->loop_end, co->loop_count * sizeof(int));
+    ctx->loop_depth += co->loop_count;
+    memcpy(ctx->foreach_streams + ctx->foreach_top, co->streams, co->stream_count * sizeof(ForeachStream*));
+    ctx->foreach_top += co->stream_count;
+    co->stream_count = 0;
+    ctx->current_line = co->resume_line;
+}
+
+// YIELD value: a number, or text joined like OUT. Several FOREACH variables
+// (or SPLIT) split the text like a line of a file.
+void cmd_yield(const char* args) {
+    int top = ctx->call_stack_top - 1;
+    ForeachStream* fs = top >= 0 ? ctx->call_generator[top] : NULL;
+    if (!fs) runtime_error("YIELD is only allowed in a FN run by FOREACH");
+    Coroutine* co = fs->co;
+    if (ctx->exec_stream_top > co->exec_base) runtime_error("YIELD inside EXEC EACH is not supported");
+    
+    ECVar* src = find_var(args);
+    if (fs->split || strchr(args, '"') || (src && src->type == TYPE_STRING)) {
+        join_parts(&ctx->line_buffer, args);
+        if (fs->split) store_fields(fs, ctx->line_buffer.data, ctx->line_buffer.len);
+        else set_var_string(get_or_create_var(fs->vars[0]), ctx->line_buffer.data, ctx->line_buffer.len);
+    } else {
+        var_set_num(get_or_create_var(fs->vars[0]), evaluate_num(args));
+    }
+    
+    int base = ctx->call_loop_depth[top];
+    co->resume_line = ctx->current_line;
+    co->loop_count = ctx->loop_depth - base;
+    memcpy(co->loop_start, ctx->loop_start + base, co->loop_count * sizeof(int));
+    memcpy(co->loop_end, ctx->loop_end + base, co->loop_count * sizeof(int));
+    co->stream_count = ctx->foreach_top - fs->index - 1;
+    memcpy(co->streams, ctx->foreach_streams + fs->index + 1, co->stream_count * sizeof(ForeachStream*));
+    
+    ctx->foreach_top = fs->index + 1;
+    ctx->loop_depth = base;
+    ctx->call_stack_top = top;
+    ctx->in_function--;
+    foreach_enter_body(fs);
+    ctx->current_line = fs->body_line;
+}
+
+void cmd_foreach(const char* args) {
+    // FOREACH line IN "file" ... ENDFOREACH           (body runs once per line)
+    // FOREACH a b c IN "file" [SPLIT ","] ... ENDFOREACH   (one field per variable)
+    // FOREACH x IN gen(args) ... ENDFOREACH           (once per YIELD of FN gen)
+    require_main_thread("FOREACH");
+    int end_line = ctx->code[ctx->current_line].jump;
+    if (ctx->foreach_top >= MAX_STACK) runtime_error("Too many nested FOREACH blocks");
+    
+    ForeachStream spec;
+    char path[MAX_LINE];
+    memset(&spec, 0, sizeof(spec));
+    int fn_idx = parse_foreach_args(args, &spec, path);
+    ForeachStream* fs = (ForeachStream*)malloc(sizeof(ForeachStream));
+    if (!fs) runtime_error("Out of memory starting FOREACH");
+    *fs = spec;
+    fs->body_line = ctx->current_line;
+    fs->end_line = end_line;
+    if (fn_idx >= 0) {
+        generator_start(fs, fn_idx, path);
+        return;
+    }
+    if (!reader_open(&fs->reader, path, "r")) {
+        free(fs);
+        runtime_error("Cannot open file '%s': %s", path, strerror(errno));
+    }
+    fs->index = ctx->foreach_top;
+    ctx->foreach_streams[ctx->foreach_top++] = fs;
+    
+    if (!foreach_next()) {
+        foreach_close();
+        ctx->current_line = end_line;
+        return;
+    }
+    foreach_enter_body(fs);
+}
+
+void cmd_endforeach(const char* args) {
+    if (ctx->foreach_top == 0) return;
+    ForeachStream* fs = ctx->foreach_streams[ctx->foreach_top - 1];
+    if (fs->co) { generator_resume(fs); return; }
+    if (foreach_next()) {
+        ctx->current_line = fs->body_line;
+        return;
+    }
+    foreach_close();
+    if (ctx->loop_depth > 0) ctx->loop_depth--;
+}
+
+ECFile* get_file_checked(const char* handle) {
+    int id = (int)parse_value(handle);
+    if (!ctx->files || id < 1 || id > MAX_FILES || !ctx->files[id - 1].io.fp)
+        runtime_error("'%s' is not an open file handle", handle);
+    return &ctx->files[id - 1];
+}
+
+void cmd_open(const char* args) {
+    // OPEN handle "path" [READ|WRITE|APPEND]
+    require_main_thread("OPEN");
+    char handle[MAX_NAME], rest[MAX_LINE] = "", val[MAX_LINE];
+    if (sscanf(args, "%127s %[^\n]", handle, rest) < 2) runtime_error("OPEN requires a handle and a file name");
+    
+    const char* mode = "r";
+    char* last = strrchr(rest, ' ');
+    if (last) {
+        if (strcasecmp(last + 1, "READ") == 0) *last = '\0';
+        else if (strcasecmp(last + 1, "WRITE") == 0) { mode = "w"; *last = '\0'; }
+        else if (strcasecmp(last + 1, "APPEND") == 0) { mode = "a"; *last = '\0'; }
+    }
+    const char* path = get_string_value(rest, val);
+    
+    if (!ctx->files) {
+        ctx->files = (ECFile*)calloc(MAX_FILES, sizeof(ECFile));
+        if (!ctx->files) runtime_error("Out of memory allocating the file table");
+    }
+    int slot = -1;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!ctx->files[i].io.fp) { slot = i; break; }
+    }
+    if (slot < 0) runtime_error("Too many open files (Limit: %d). CLOSE some first.", MAX_FILES);
+    
+    ECFile* f = &ctx->files[slot];
+    if (!reader_open(&f->io, path, mode)) runtime_error("Cannot open file '%s': %s", path, strerror(errno));
+    f->writing = mode[0] != 'r';
+    var_set_num(get_or_create_var(handle), num_int(slot + 1));
+}
+
+void cmd_readline(const char* args) {
+    // READLINE handle var [ok]   (ok = 1 if a line was read, 0 at end of file)
+    require_main_thread("READLINE");
+    char handle[MAX_NAME], name[MAX_NAME], ok[MAX_NAME] = "";
+    if (sscanf(args, "%127s %127s %127s", handle, name, ok) < 2)
+        runtime_error("READLINE requires a file handle and a variable");
+    
+    ECFile* f = get_file_checked(handle);
+    if (f->writing) runtime_error("'%s' is not open for reading", handle);
+    char* line;
+    size_t len;
+    int got = reader_next(&f->io, &line, &len);
+    if (got) store_field(name, line, len);
+    if (ok[0]) var_set_num(get_or_create_var(ok), num_int(got));
+}
+
+void cmd_write(const char* args) {
+    // WRITE handle value [+ value ...]   (one line, formatted like OUT)
+    require_main_thread("WRITE");
+    char handle[MAX_NAME], rest[MAX_LINE] = "";
+    if (sscanf(args, "%127s %[^\n]", handle, rest) < 1) runtime_error("WRITE requires a file handle");
+    
+    ECFile* f = get_file_checked(handle);
+    if (!f->writing) runtime_error("'%s' is not open for writing", handle);
+    print_parts(f->io.fp, rest);
+}
+
+void cmd_close(const char* args) {
+    require_main_thread("CLOSE");
+    char handle[MAX_NAME];
+    if (sscanf(args, "%127s", handle) < 1) runtime_error("CLOSE requires a file handle");
+    
+    ECFile* f = get_file_checked(handle);
+    if (reader_close(&f->io) && f->writing) runtime_error("Error writing file '%s'", handle);
+}
+
+// ============ CSV Columns ============
+
+#define CSV_CHUNK_MIN (1 << 20)     // Bytes per LOADCSV thread at least
+#define CSV_BATCH_ROWS 65536        // Rows each SAVECSV thread formats per round
+
+// LOADCSV / SAVECSV: "file" col [col ...] [ROWS n] [SPLIT ","] [SKIP k] [THREADS t]
+typedef struct {
+    char path[MAX_LINE];
+    char cols[MAX_FIELDS][MAX_NAME];
+    int col_count;
+    char rows_var[MAX_NAME];
+    char sep;
+    long skip;
+    int threads;
+} CsvSpec;
+
+// One LOADCSV thread's range of whole lines
+typedef struct {
+    const char* begin;
+    const char* end;
+    long rows;          // Non-blank lines
+    long lines;
+    long first_row;
+    long first_line;    // 0-based file line of `begin`
+    double** cols;      // Destination per field, NULL = skipped
+    int col_count;
+    char sep;
+    long bad_line;      // First line with a bad field, -1 = none
+    int bad_col;
+    const char* bad_text;   // NULL if the field is missing
+    size_t bad_len;
+} CsvChunk;
+
+// One SAVECSV thread's rows of the current round
+typedef struct {
+    double** cols;
+    int col_count;
+    char sep;
+    long begin;
+    long end;
+    ECBuffer out;
+} CsvRows;
+
+static const double csv_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Run fn on every item, all but the first on threads of their own. Items
+// whose thread cannot be started run on the calling thread.
+void run_parallel(void* (*fn)(void*), char* items, size_t size, int count) {
+    pthread_t* threads = (pthread_t*)malloc(count * sizeof(pthread_t));
+    int started = 0;
+    while (threads && started + 1 < count &&
+           pthread_create(&threads[started], NULL, fn, items + (started + 1) * size) == 0) {
+        started++;
+    }
+    fn(items);
+    for (int i = started + 1; i < count; i++) fn(items + i * size);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+void parse_csv_args(const char* cmd, const char* args, CsvSpec* spec) {
+    memset(spec, 0, sizeof(*spec));
+    spec->sep = ',';
+    
+    char word[MAX_LINE], val[MAX_LINE];
+    const char* p = args + strspn(args, " \t");
+    size_t n = *p == '"' && strchr(p + 1, '"') ? (size_t)(strchr(p + 1, '"') - p + 1) : strcspn(p, " \t");
+    if (n == 0 || n >= MAX_LINE) runtime_error("%s requires a file name", cmd);
+    memcpy(word, p, n);
+    word[n] = '\0';
+    strcpy(spec->path, get_string_value(word, val));
+    p += n;
+    
+    int used;
+    while (sscanf(p, "%4095s%n", word, &used) == 1) {
+        p += used;
+        int clause = strcasecmp(word, "ROWS") == 0 || strcasecmp(word, "SPLIT") == 0 ||
+                     strcasecmp(word, "SKIP") == 0 || strcasecmp(word, "THREADS") == 0;
+        if (!clause) {
+            if (strlen(word) >= MAX_NAME) runtime_error("%s column name too long", cmd);
+            if (spec->col_count == MAX_FIELDS) runtime_error("%s takes at most %d columns", cmd, MAX_FIELDS);
+            strcpy(spec->cols[spec->col_count++], word);
+            continue;
+        }
+        
+        p += strspn(p, " \t");
+        if (strcasecmp(word, "SPLIT") == 0 && *p == '"') {
+            const char* close = strchr(p + 1, '"');
+            if (!close || close == p + 1) runtime_error("%s SPLIT requires a separator", cmd);
+            spec->sep = close - p == 3 && p[1] == '\\' && p[2] == 't' ? '\t' : p[1];
+            p = close + 1;
+            continue;
+        }
+        char value[MAX_LINE];
+        if (sscanf(p, "%4095s%n", value, &used) != 1) runtime_error("%s %s requires a value", cmd, word);
+        p += used;
+        if (strcasecmp(word, "ROWS") == 0) {
+            if (strlen(value) >= MAX_NAME) runtime_error("%s ROWS name too long", cmd);
+            strcpy(spec->rows_var, value);
+        } else if (strcasecmp(word, "SPLIT") == 0) {
+            spec->sep = get_string_value(value, val)[0];
+        } else if (strcasecmp(word, "SKIP") == 0) {
+            spec->skip = (long)evaluate_expr(value);
+        } else {
+            spec->threads = (int)evaluate_expr(value);
+        }
+    }
+    if (spec->col_count == 0) runtime_error("%s requires at least one column", cmd);
+    if (!spec->sep || spec->sep == '\n' || spec->sep == '"') runtime_error("%s separator must be one character", cmd);
+}
+
+int csv_blank(const char* p, const char* eol) {
+    while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p == eol;
+}
+
+// Parse one field (surrounding blanks and quotes are ignored, empty = 0).
+// Decimals of up to 19 significant digits with a small exponent convert
+// exactly in double arithmetic; anything else is handed to strtod.
+int csv_field(const char* p, const char* end, double* out) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+    if (end - p >= 2 && *p == '"' && end[-1] == '"') { p++; end--; }
+    if (p == end) { *out = 0; return 1; }
+    
+    const char* s = p + (*p == '-' || *p == '+');
+    uint64_t mant = 0;
+    int digits = 0, exp = 0, any = 0;
+    for (int frac = 0; s < end; s++) {
+        if (*s == '.' && !frac) { frac = 1; continue; }
+        if ((unsigned)(*s - '0') > 9) break;
+        if ((mant || *s != '0') && ++digits > 19) goto slow;
+        mant = mant * 10 + (uint64_t)(*s - '0');
+        exp -= frac;
+        any = 1;
+    }
+    if (!any) goto slow;
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        s++;
+        int neg = s < end && *s == '-';
+        if (s < end && (*s == '-' || *s == '+')) s++;
+        const char* first = s;
+        int e = 0;
+        for (; s < end && (unsigned)(*s - '0') <= 9; s++) {
+            if (e < 10000) e = e * 10 + (*s - '0');
+        }
+        if (s == first) goto slow;
+        exp += neg ? -e : e;
+    }
+    if (s == end && mant <= (1ULL << 53) && exp >= -22 && exp <= 22) {
+        double v = exp < 0 ? (double)mant / csv_pow10[-exp] : (double)mant * csv_pow10[exp];
+        *out = *p == '-' ? -v : v;
+        return 1;
+    }
+    
+slow:;
+    char buf[64];
+    size_t len = end - p;
+    if (len >= sizeof(buf)) return 0;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    char* stop;
+    *out = strtod(buf, &stop);
+    return *stop == '\0';
+}
+
+void* csv_count_chunk(void* arg) {
+    CsvChunk* c = (CsvChunk*)arg;
+    for (const char* p = c->begin; p < c->end; c->lines++) {
+        const char* nl = (const char*)memchr(p, '\n', c->end - p);
+        const char* eol = nl ? nl : c->end;
+        if (!csv_blank(p, eol)) c->rows++;
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+void* csv_parse_chunk(void* arg) {
+    CsvChunk* c = (CsvChunk*)arg;
+    long row = c->first_row, line = c->first_line;
+    for (const char* p = c->begin; p < c->end; line++) {
+        const char* nl = (const char*)memchr(p, '\n', c->end - p);
+        const char* eol = nl ? nl : c->end;
+        if (!csv_blank(p, eol)) {
+            const char* field = p;
+            for (int k = 0; k < c->col_count; k++) {
+                if (field > eol) {
+                    c->bad_line = line;
+                    c->bad_col = k;
+                    return NULL;
+                }
+                const char* next = (const char*)memchr(field, c->sep, eol - field);
+                if (!next) next = eol;
+                if (c->cols[k] && !csv_field(field, next, &c->cols[k][row])) {
+                    c->bad_line = line;
+                    c->bad_col = k;
+                    c->bad_text = field;
+                    c->bad_len = next - field;
+                    return NULL;
+                }
+                field = next + 1;
+            }
+            row++;
+        }
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+// Point array `name` at `data`, reusing its slot if it already is an array
+ECArray* install_array(const char* name, double* data, int size) {
+    ECVar* v = get_or_create_var(name);
+    ECArray* arr;
+    if (v->arr_id >= 0) {
+        arr = &ctx->arrays[v->arr_id];
+        free(arr->num_data);
+        if (arr->str_data) {
+            for (int j = 0; j < arr->size; j++) free(arr->str_data[j]);
+            free(arr->str_data);
+        }
+    } else {
+        arr = &ctx->arrays[ctx->array_count];
+        v->arr_id = ctx->array_count++;
+    }
+    v->type = TYPE_ARRAY;
+    arr->num_data = data;
+    arr->str_data = NULL;
+    arr->size = size;
+    arr->capacity = size;
+    arr->rows = arr->cols = 0;
+    arr->elem_type = TYPE_NUMBER;
+    return arr;
+}
+
+void cmd_loadcsv(const char* args) {
+    // LOADCSV "file.csv" col [col ...] [ROWS n] [SPLIT ","] [SKIP k] [THREADS t]
+    // Fields go into numeric arrays (_ skips a column); n receives the row count
+    require_main_thread("LOADCSV");
+    CsvSpec spec;
+    parse_csv_args("LOADCSV", args, &spec);
+    
+    int fresh = 0;
+    for (int k = 0; k < spec.col_count; k++) {
+        ECVar* v = find_var(spec.cols[k]);
+        if (strcmp(spec.cols[k], "_") != 0 && (!v || v->arr_id < 0)) fresh++;
+    }
+    if (ctx->array_count + fresh > MAX_ARRAYS) runtime_error("Too many arrays");
+    
+    char* data;
+    size_t size;
+    if (!map_file(spec.path, &data, &size)) runtime_error("Cannot open file '%s': %s", spec.path, strerror(errno));
+    const char* p = data;
+    const char* end = data + size;
+    long line = 0;
+    for (; line < spec.skip && p < end; line++) {
+        const char* nl = (const char*)memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+    }
+    
+    int threads = spec.threads;
+    if (threads <= 0) {
+        threads = cpu_count();
+        if (threads > (end - p) / CSV_CHUNK_MIN + 1) threads = (int)((end - p) / CSV_CHUNK_MIN + 1);
+    }
+    CsvChunk* chunks = (CsvChunk*)calloc(threads, sizeof(CsvChunk));
+    double** cols = (double**)calloc(spec.col_count, sizeof(double*));
+    if (!chunks || !cols) {
+        free(chunks);
+        free(cols);
+        unmap_file(data, size);
+        runtime_error("Out of memory loading '%s'", spec.path);
+    }
+    
+    // Chunks of whole lines, counted in parallel to place each chunk's rows
+    const char* start = p;
+    for (int i = 0; i < threads; i++) {
+        const char* cut = i + 1 == threads ? end : start + (end - start) * (i + 1) / threads;
+        if (cut < p) cut = p;
+        if (cut < end) {
+            const char* nl = (const char*)memchr(cut, '\n', end - cut);
+            cut = nl ? nl + 1 : end;
+        }
+        chunks[i].begin = p;
+        chunks[i].end = cut;
+        chunks[i].cols = cols;
+        chunks[i].col_count = spec.col_count;
+        chunks[i].sep = spec.sep;
+        chunks[i].bad_line = -1;
+        p = cut;
+    }
+    run_parallel(csv_count_chunk, (char*)chunks, sizeof(CsvChunk), threads);
+    
+    long rows = 0;
+    for (int i = 0; i < threads; i++) {
+        chunks[i].first_row = rows;
+        chunks[i].first_line = line;
+        rows += chunks[i].rows;
+        line += chunks[i].lines;
+    }
+    
+    int failed = rows > INT_MAX;
+    for (int k = 0; k < spec.col_count && !failed; k++) {
+        if (strcmp(spec.cols[k], "_") == 0) continue;
+        cols[k] = (double*)malloc((rows ? rows : 1) * sizeof(double));
+        failed = !cols[k];
+    }
+    if (!failed) run_parallel(csv_parse_chunk, (char*)chunks, sizeof(CsvChunk), threads);
+    
+    char message[MAX_LINE * 2] = "";
+    if (failed) {
+        snprintf(message, sizeof(message), "Out of memory loading %ld rows from '%s'", rows, spec.path);
+    }
+    for (int i = 0; i < threads && !message[0]; i++) {
+        CsvChunk* c = &chunks[i];
+        if (c->bad_line < 0) continue;
+        if (c->bad_text) {
+            snprintf(message, sizeof(message), "'%s' line %ld, column %d: '%.*s' is not a number",
+                     spec.path, c->bad_line + 1, c->bad_col + 1, (int)(c->bad_len < 64 ? c->bad_len : 64), c->bad_text);
+        } else {
+            snprintf(message, sizeof(message), "'%s' line %ld has no column %d",
+                     spec.path, c->bad_line + 1, c->bad_col + 1);
+        }
+    }
+    unmap_file(data, size);
+    free(chunks);
+    if (message[0]) {
+        for (int k = 0; k < spec.col_count; k++) free(cols[k]);
+        free(cols);
+        runtime_error("%s", message);
+    }
+    
+    for (int k = 0; k < spec.col_count; k++) {
+        if (cols[k]) install_array(spec.cols[k], cols[k], (int)rows);
+    }
+    free(cols);
+    if (spec.rows_var[0]) var_set_num(get_or_create_var(spec.rows_var), num_int(rows));
+}
+
+// Same text as %.15g when that reads back exactly (else %.17g). Integers and
+// values with up to 15 significant digits are printed from a scaled integer.
+int csv_format(double v, char* out) {
+    double a = fabs(v), r = -1;
+    int k = 0;
+    if (v == floor(v) && a < 9.2e18) {
+        r = a;
+    } else if (a >= 1e-4 && a < 1e15) {
+        for (k = 1; k <= 15; k++) {
+            double scaled = floor(a * csv_pow10[k] + 0.5);
+            if (scaled >= 1e15) break;
+            if (scaled / csv_pow10[k] == a) { r = scaled; break; }
+        }
+    }
+    if (r < 0) {
+        int n = sprintf(out, "%.15g", v);
+        if (strtod(out, NULL) != v) n = sprintf(out, "%.17g", v);
+        return n;
+    }
+    
+    char digits[24];
+    int len = 0, n = 0;
+    for (unsigned long long i = (unsigned long long)r; i; i /= 10) digits[len++] = (char)('0' + i % 10);
+    while (len <= k) digits[len++] = '0';
+    if (v < 0 && r > 0) out[n++] = '-';
+    while (len > k) out[n++] = digits[--len];
+    if (k > 0) out[n++] = '.';
+    while (len > 0) out[n++] = digits[--len];
+    out[n] = '\0';
+    return n;
+}
+
+void* csv_format_rows(void* arg) {
+    CsvRows* r = (CsvRows*)arg;
+    char cell[64];
+    buffer_clear(&r->out);
+    for (long row = r->begin; row < r->end; row++) {
+        for (int k = 0; k < r->col_count; k++) {
+            int n = csv_format(r->cols[k][row], cell);
+            cell[n++] = k + 1 < r->col_count ? r->sep : '\n';
+            buffer_append(&r->out, cell, n);
+        }
+    }
+    return NULL;
+}
+
+void cmd_savecsv(const char* args) {
+    // SAVECSV "file.csv" col [col ...] [ROWS n] [SPLIT ","] [THREADS t]
+    require_main_thread("SAVECSV");
+    CsvSpec spec;
+    parse_csv_args("SAVECSV", args, &spec);
+    if (spec.skip) runtime_error("SAVECSV does not take SKIP");
+    
+    double* cols[MAX_FIELDS];
+    long rows = -1;
+    if (spec.rows_var[0]) {
+        rows = (long)evaluate_expr(spec.rows_var);
+        if (rows < 0) runtime_error("SAVECSV row count must not be negative");
+    }
+    for (int k = 0; k < spec.col_count; k++) {
+        ECVar* v = find_var(spec.cols[k]);
+        if (!v) runtime_error("Undefined array '%s'", spec.cols[k]);
+        if (v->arr_id < 0) runtime_error("Variable '%s' is not an array", spec.cols[k]);
+        ECArray* arr = &ctx->arrays[v->arr_id];
+        cols[k] = arr->num_data;
+        if (spec.rows_var[0] && rows > arr->size)
+            runtime_error("SAVECSV: array '%s' has only %d elements", spec.cols[k], arr->size);
+        if (!spec.rows_var[0] && rows >= 0 && rows != arr->size)
+            runtime_error("SAVECSV: arrays '%s' and '%s' differ in size; give ROWS", spec.cols[0], spec.cols[k]);
+        if (!spec.rows_var[0]) rows = arr->size;
+    }
+    
+    int threads = spec.threads;
+    if (threads <= 0) {
+        threads = cpu_count();
+        if (threads > rows / CSV_BATCH_ROWS + 1) threads = (int)(rows / CSV_BATCH_ROWS + 1);
+    }
+    CsvRows* parts = (CsvRows*)calloc(threads, sizeof(CsvRows));
+    if (!parts) runtime_error("Out of memory saving '%s'", spec.path);
+    FILE* fp = fopen(spec.path, "wb");
+    if (!fp) {
+        free(parts);
+        runtime_error("Cannot open file '%s': %s", spec.path, strerror(errno));
+    }
+    
+    // Rounds of CSV_BATCH_ROWS rows per thread, written in order
+    int failed = 0;
+    for (long row = 0; row < rows && !failed; ) {
+        for (int i = 0; i < threads; i++) {
+            parts[i].cols = cols;
+            parts[i].col_count = spec.col_count;
+            parts[i].sep = spec.sep;
+            parts[i].begin = row;
+            row = row + CSV_BATCH_ROWS < rows ? row + CSV_BATCH_ROWS : rows;
+            parts[i].end = row;
+        }
+        run_parallel(csv_format_rows, (char*)parts, sizeof(CsvRows), threads);
+        for (int i = 0; i < threads && !failed; i++) {
+            failed = fwrite(parts[i].out.data, 1, parts[i].out.len, fp) != parts[i].out.len;
+        }
+    }
+    failed |= fclose(fp) != 0;
+    for (int i = 0; i < threads; i++) buffer_free(&parts[i].out);
+    free(parts);
+    if (failed) runtime_error("Error writing file '%s'", spec.path);
+}
+
+// ============ Matrices ============
+
+#define MAT_BLOCK 64                // Tile edge for MATMUL and TRANSPOSE
+#define MAT_PARALLEL_FLOPS (1 << 22)  // Smaller products run on one thread
+
+// Rows [row_begin, row_end) of c = a * b (a is n x m, b is m x p)
+typedef struct {
+    const double* a;
+    const double* b;
+    double* c;
+    int m;
+    int p;
+    int row_begin;
+    int row_end;
+} MatTask;
+
+ECArray* get_matrix(const char* cmd, const char* name) {
+    ECVar* v = find_var(name);
+    if (!v) runtime_error("%s: undefined matrix '%s'", cmd, name);
+    if (v->arr_id < 0 || ctx->arrays[v->arr_id].cols == 0) runtime_error("%s: '%s' is not a matrix", cmd, name);
+    return &ctx->arrays[v->arr_id];
+}
+
+// Storage for a rows x cols result in `name`: the existing matrix when it
+// already has that shape and may be overwritten, else a new zeroed block
+double* matrix_result(const char* cmd, const char* name, int rows, int cols, int may_reuse) {
+    ECVar* v = find_var(name);
+    if (v && v->arr_id >= 0) {
+        ECArray* arr = &ctx->arrays[v->arr_id];
+        if (may_reuse && arr->rows == rows && arr->cols == cols) return arr->num_data;
+    } else if (ctx->array_count >= MAX_ARRAYS) {
+        runtime_error("Too many arrays");
+    }
+    if ((long long)rows * cols > INT_MAX) runtime_error("%s: %dx%d matrix is too large", cmd, rows, cols);
+    double* data = (double*)calloc((size_t)rows * cols, sizeof(double));
+    if (!data) runtime_error("Out of memory allocating a %dx%d matrix", rows, cols);
+    return data;
+}
+
+// Make `data` the contents of matrix `name` (no-op if it already is)
+void store_matrix(const char* name, double* data, int rows, int cols) {
+    ECVar* v = find_var(name);
+    if (v && v->arr_id >= 0 && ctx->arrays[v->arr_id].num_data == data) return;
+    ECArray* arr = install_array(name, data, rows * cols);
+    arr->rows = rows;
+    arr->cols = cols;
+}
+
+void cmd_mat(const char* args) {
+    // MAT name rows cols   (row-major, zero-filled; m[i][j])
+    require_main_thread("MAT");
+    char name[MAX_NAME], rows_str[MAX_NAME], cols_str[MAX_NAME];
+    if (sscanf(args, "%127s %127s %127s", name, rows_str, cols_str) < 3) runtime_error("MAT requires name, rows and columns");
+    int rows = (int)evaluate_expr(rows_str);
+    int cols = (int)evaluate_expr(cols_str);
+    if (rows <= 0 || cols <= 0) runtime_error("Matrix size must be positive");
+    store_matrix(name, matrix_result("MAT", name, rows, cols, 0), rows, cols);
+}
+
+// Tiled i-k-j product: each c element sums in k order, as the plain triple loop does
+void* matmul_rows(void* arg) {
+    const MatTask* t = (const MatTask*)arg;
+    int m = t->m, p = t->p;
+    for (int ii = t->row_begin; ii < t->row_end; ii += MAT_BLOCK) {
+        int i_end = ii + MAT_BLOCK < t->row_end ? ii + MAT_BLOCK : t->row_end;
+        for (int kk = 0; kk < m; kk += MAT_BLOCK) {
+            int k_end = kk + MAT_BLOCK < m ? kk + MAT_BLOCK : m;
+            for (int jj = 0; jj < p; jj += MAT_BLOCK) {
+                int j_end = jj + MAT_BLOCK < p ? jj + MAT_BLOCK : p;
+                for (int i = ii; i < i_end; i++) {
+                    double* c_row = t->c + (size_t)i * p;
+                    const double* a_row = t->a + (size_t)i * m;
+                    for (int k = kk; k < k_end; k++) {
+                        double aik = a_row[k];
+                        const double* b_row = t->b + (size_t)k * p;
+                        for (int j = jj; j < j_end; j++) c_row[j] += aik * b_row[j];
+                    }
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+void cmd_matmul(const char* args) {
+    // MATMUL c a b   (c = a x b; c is created or replaced)
+    require_main_thread("MATMUL");
+    char cn[MAX_NAME], an[MAX_NAME], bn[MAX_NAME];
+    if (sscanf(args, "%127s %127s %127s", cn, an, bn) < 3) runtime_error("MATMUL requires result, left and right matrices");
+    ECArray* a = get_matrix("MATMUL", an);
+    ECArray* b = get_matrix("MATMUL", bn);
+    if (a->cols != b->rows) {
+        runtime_error("MATMUL: cannot multiply %dx%d by %dx%d", a->rows, a->cols, b->rows, b->cols);
+    }
+    int n = a->rows, m = a->cols, p = b->cols;
+    int aliased = strcmp(cn, an) == 0 || strcmp(cn, bn) == 0;
+    double* c = matrix_result("MATMUL", cn, n, p, !aliased);
+    memset(c, 0, (size_t)n * p * sizeof(double));
+    
+    // Bands of whole row tiles, one per thread for large products
+    int tiles = (n + MAT_BLOCK - 1) / MAT_BLOCK;
+    int threads = (double)n * m * p >= MAT_PARALLEL_FLOPS ? cpu_count() : 1;
+    if (threads > tiles) threads = tiles;
+    if (threads > MAX_STACK) threads = MAX_STACK;
+    MatTask tasks[MAX_STACK];
+    for (int i = 0; i < threads; i++) {
+        tasks[i] = (MatTask){ a->num_data, b->num_data, c, m, p, 0, 0 };
+        int lo = (int)((long)tiles * i / threads) * MAT_BLOCK;
+        int hi = (int)((long)tiles * (i + 1) / threads) * MAT_BLOCK;
+        tasks[i].row_begin = lo;
+        tasks[i].row_end = hi < n ? hi : n;
+    }
+    run_parallel(matmul_rows, (char*)tasks, sizeof(MatTask), threads);
+    store_matrix(cn, c, n, p);
+}
+
+void cmd_transpose(const char* args) {
+    // TRANSPOSE b a   (b = transpose of a)
+    require_main_thread("TRANSPOSE");
+    char bn[MAX_NAME], an[MAX_NAME];
+    if (sscanf(args, "%127s %127s", bn, an) < 2) runtime_error("TRANSPOSE requires result and source matrices");
+    ECArray* a = get_matrix("TRANSPOSE", an);
+    int rows = a->rows, cols = a->cols;
+    double* t = matrix_result("TRANSPOSE", bn, cols, rows, strcmp(an, bn) != 0);
+    const double* src = a->num_data;
+    
+    for (int ii = 0; ii < rows; ii += MAT_BLOCK) {
+        int i_end = ii + MAT_BLOCK < rows ? ii + MAT_BLOCK : rows;
+        for (int jj = 0; jj < cols; jj += MAT_BLOCK) {
+            int j_end = jj + MAT_BLOCK < cols ? jj + MAT_BLOCK : cols;
+            for (int i = ii; i < i_end; i++) {
+                for (int j = jj; j < j_end; j++) t[(size_t)j * rows + i] = src[(size_t)i * cols + j];
+            }
+        }
+    }
+    store_matrix(bn, t, cols, rows);
+}
+
+void matrix_elementwise(const char* cmd, const char* args, char op) {
+    // MATADD c a b   (likewise MATSUB, MATEMUL, MATEDIV; b is a matrix of the
+    // same shape or a number applied to every element)
+    require_main_thread(cmd);
+    char cn[MAX_NAME], an[MAX_NAME], bn[MAX_NAME];
+    if (sscanf(args, "%127s %127s %127s", cn, an, bn) < 3) runtime_error("%s requires result, left and right operands", cmd);
+    ECArray* a = get_matrix(cmd, an);
+    ECVar* bv = find_var(bn);
+    const double* b = NULL;
+    double scalar = 0;
+    if (bv && bv->arr_id >= 0) {
+        ECArray* arr = get_matrix(cmd, bn);
+        if (arr->rows != a->rows || arr->cols != a->cols) {
+            runtime_error("%s: %dx%d and %dx%d matrices differ in shape", cmd, a->rows, a->cols, arr->rows, arr->cols);
+        }
+        b = arr->num_data;
+    } else {
+        scalar = evaluate_expr(bn);
+    }
+    
+    size_t n = (size_t)a->size;
+    if (op == '/') {
+        if (!b && scalar == 0) runtime_error("Division by zero.");
+        for (size_t i = 0; b && i < n; i++) {
+            if (b[i] == 0) runtime_error("Division by zero.");
+        }
+    }
+    // Element i only reads element i, so the result may overwrite an operand
+    double* c = matrix_result(cmd, cn, a->rows, a->cols, 1);
+    const double* x = a->num_data;
+    switch (op) {
+        case '+': for (size_t i = 0; i < n; i++) c[i] = x[i] + (b ? b[i] : scalar); break;
+        case '-': for (size_t i = 0; i < n; i++) c[i] = x[i] - (b ? b[i] : scalar); break;
+        case '*': for (size_t i = 0; i < n; i++) c[i] = x[i] * (b ? b[i] : scalar); break;
+        default: for (size_t i = 0; i < n; i++) c[i] = x[i] / (b ? b[i] : scalar); break;
+    }
+    store_matrix(cn, c, a->rows, a->cols);
+}
+
+// ============ Math Library ============
+
+// NAME(args) in any expression calls libm directly. Results are decimals,
+// except that FLOOR/CEIL/ROUND/TRUNC return integers and ABS/MIN/MAX keep
+// integer arguments exact. A finite argument that yields NaN or infinity is
+// a runtime error, as a zero divisor is. RAND draws from a xoshiro256**
+// generator per context; SEED makes it repeatable and each PARLOOP worker
+// gets a stream of its own. MAP and FILLRAND work on whole arrays.
+
+typedef enum {
+    MATH_REAL,
+    MATH_INTEGRAL,
+    MATH_ABS,
+    MATH_MIN,
+    MATH_MAX,
+    MATH_RAND
+} MathKind;
+
+typedef struct {
+    const char* name;
+    const char* c_name;         // libm function called by --emit-c output
+    int args;                   // RAND takes 0 or 1
+    MathKind kind;
+    double (*f1)(double);
+    double (*f2)(double, double);
+} MathFunc;
+
+static const MathFunc math_funcs[] = {
+    { "SQRT", "sqrt", 1, MATH_REAL, sqrt, NULL },
+    { "CBRT", "cbrt", 1, MATH_REAL, cbrt, NULL },
+    { "EXP", "exp", 1, MATH_REAL, exp, NULL },
+    { "LOG", "log", 1, MATH_REAL, log, NULL },
+    { "LOG10", "log10", 1, MATH_REAL, log10, NULL },
+    { "LOG2", "log2", 1, MATH_REAL, log2, NULL },
+    { "SIN", "sin", 1, MATH_REAL, sin, NULL },
+    { "COS", "cos", 1, MATH_REAL, cos, NULL },
+    { "TAN", "tan", 1, MATH_REAL, tan, NULL },
+    { "ASIN", "asin", 1, MATH_REAL, asin, NULL },
+    { "ACOS", "acos", 1, MATH_REAL, acos, NULL },
+    { "ATAN", "atan", 1, MATH_REAL, atan, NULL },
+    { "SINH", "sinh", 1, MATH_REAL, sinh, NULL },
+    { "COSH", "cosh", 1, MATH_REAL, cosh, NULL },
+    { "TANH", "tanh", 1, MATH_REAL, tanh, NULL },
+    { "POW", "pow", 2, MATH_REAL, NULL, pow },
+    { "ATAN2", "atan2", 2, MATH_REAL, NULL, atan2 },
+    { "HYPOT", "hypot", 2, MATH_REAL, NULL, hypot },
+    { "FLOOR", "floor", 1, MATH_INTEGRAL, floor, NULL },
+    { "CEIL", "ceil", 1, MATH_INTEGRAL, ceil, NULL },
+    { "ROUND", "round", 1, MATH_INTEGRAL, round, NULL },
+    { "TRUNC", "trunc", 1, MATH_INTEGRAL, trunc, NULL },
+    { "ABS", "fabs", 1, MATH_ABS, fabs, NULL },
+    { "MIN", "fmin", 2, MATH_MIN, NULL, fmin },
+    { "MAX", "fmax", 2, MATH_MAX, NULL, fmax },
+    { "RAND", NULL, 1, MATH_RAND, NULL, NULL },
+};
+
+#define MATH_FUNC_COUNT (int)(sizeof(math_funcs) / sizeof(math_funcs[0]))
+
+const MathFunc* math_find(const char* name, size_t len) {
+    for (int i = 0; i < MATH_FUNC_COUNT; i++) {
+        if (strlen(math_funcs[i].name) == len && strncasecmp(math_funcs[i].name, name, len) == 0) return &math_funcs[i];
+    }
+    return NULL;
+}
+
+// xoshiro256** (Blackman and Vigna); seeded through splitmix64
+uint64_t rng_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+uint64_t rng_next(uint64_t* s) {
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return result;
+}
+
+void rng_seed(uint64_t* s, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        s[i] = z ^ (z >> 31);
+    }
+}
+
+// The context's generator, seeded from the clock on first use
+uint64_t* rng_state(void) {
+    uint64_t* s = ctx->rng;
+    if (!(s[0] | s[1] | s[2] | s[3])) {
+        rng_seed(s, (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^ (uint64_t)(uintptr_t)ctx ^ (uint64_t)getpid());
+    }
+    return s;
+}
+
+// Advance by 2^128 draws: the streams before and after never overlap
+void rng_jump(uint64_t* s) {
+    static const uint64_t jump[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+    uint64_t t[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] & (1ULL << b)) for (int k = 0; k < 4; k++) t[k] ^= s[k];
+            rng_next(s);
+        }
+    }
+    memcpy(s, t, sizeof(t));
+}
+
+// Give a PARLOOP worker the current stream and move on to the next one
+void rng_fork(ECContext* child) {
+    uint64_t* s = rng_state();
+    memcpy(child->rng, s, sizeof(child->rng));
+    rng_jump(s);
+}
+
+double rng_unit(uint64_t* s) {
+    return (double)(rng_next(s) >> 11) * 0x1.0p-53;
+}
+
+// Uniform in [0, n) without modulo bias
+uint64_t rng_below(uint64_t* s, uint64_t n) {
+    uint64_t limit = UINT64_MAX - UINT64_MAX % n;
+    uint64_t x;
+    do x = rng_next(s); while (x >= limit);
+    return x % n;
+}
+
+// RAND(n): n must be a positive integer
+uint64_t rand_range(ECNum n) {
+    double d = num_value(n);
+    if (n.is_int ? n.i < 1 : !(d >= 1 && d < 9.2e18 && d == floor(d))) {
+        runtime_error("RAND range must be a positive integer");
+    }
+    return n.is_int ? (uint64_t)n.i : (uint64_t)d;
+}
+
+ECNum num_integral(double r) {
+    if (isfinite(r) && fabs(r) < 9.2e18) return num_int((int64_t)r);
+    return num_double(r);
+}
+
+ECNum math_apply(const MathFunc* f, const ECNum* a, int argc) {
+    switch (f->kind) {
+        case MATH_INTEGRAL:
+            return a[0].is_int ? a[0] : num_integral(f->f1(a[0].d));
+        case MATH_ABS:
+            if (a[0].is_int && a[0].i != INT64_MIN) return num_int(a[0].i < 0 ? -a[0].i : a[0].i);
+            return num_double(fabs(num_value(a[0])));
+        case MATH_MIN:
+        case MATH_MAX:
+            if (a[0].is_int && a[1].is_int) return (a[0].i < a[1].i) == (f->kind == MATH_MIN) ? a[0] : a[1];
+            break;
+        case MATH_RAND:
+            if (argc == 0) return num_double(rng_unit(rng_state()));
+            return num_int((int64_t)rng_below(rng_state(), rand_range(a[0])));
+        default:
+            break;
+    }
+    double x = num_value(a[0]), y = f->args == 2 ? num_value(a[1]) : 0;
+    double r = f->f1 ? f->f1(x) : f->f2(x, y);
+    if (!isfinite(r) && isfinite(x) && isfinite(y)) {
+        runtime_error(isnan(r) ? "%s: argument out of domain" : "%s: result out of range", f->name);
+    }
+    return num_double(r);
+}
+
+// Number of comma-separated arguments in `inner` (brackets nest); each is
+// NUL-terminated in place and its start stored in `starts`
+int math_split_args(char* inner, char** starts, int max) {
+    char* p = inner;
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '\0') return 0;
+    int count = 0, depth = 0;
+    starts[count++] = inner;
+    for (; *p; p++) {
+        if (*p == '(' || *p == '[') depth++;
+        else if (*p == ')' || *p == ']') depth--;
+        else if (*p == ',' && depth == 0) {
+            *p = '\0';
+            if (count < max) starts[count] = p + 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+// Check the call `tok` (NAME(...), `paren` at its '(') and split its
+// arguments; NULL with the message in `error` if it is malformed
+const MathFunc* math_parse(const char* tok, const char* paren, char* inner, char** starts, int* argc, char* error) {
+    const MathFunc* f = math_find(tok, paren - tok);
+    if (!f) {
+        snprintf(error, MAX_LINE, "Unknown function '%.*s'", (int)(paren - tok), tok);
+        return NULL;
+    }
+    size_t len = strlen(paren + 1) - 1;
+    memcpy(inner, paren + 1, len);
+    inner[len] = '\0';
+    *argc = math_split_args(inner, starts, 2);
+    if (f->kind == MATH_RAND ? *argc > 1 : *argc != f->args) {
+        if (f->kind == MATH_RAND) snprintf(error, MAX_LINE, "RAND takes 0 or 1 arguments");
+        else snprintf(error, MAX_LINE, "%s takes %d argument%s", f->name, f->args, f->args == 1 ? "" : "s");
+        return NULL;
+    }
+    for (int i = 0; i < *argc; i++) {
+        char* arg = starts[i];
+        while (isspace((unsigned char)*arg)) arg++;
+        if (*arg == '\0') {
+            snprintf(error, MAX_LINE, "Invalid expression syntax: '%.*s'", MAX_LINE - 32, tok);
+            return NULL;
+        }
+    }
+    return f;
+}
+
+ECNum math_call(const char* tok, const char* paren) {
+    char inner[MAX_LINE], error[MAX_LINE];
+    char* starts[2];
+    int argc;
+    const MathFunc* f = math_parse(tok, paren, inner, starts, &argc, error);
+    if (!f) runtime_error("%s", error);
+    ECNum values[2];
+    for (int i = 0; i < argc; i++) values[i] = evaluate_num(starts[i]);
+    return math_apply(f, values, argc);
+}
+
+void cmd_seed(const char* args) {
+    // SEED n   (RAND then repeats the same sequence)
+    if (args[0] == '\0') runtime_error("SEED requires a number");
+    ECNum n = evaluate_num(args);
+    uint64_t seed;
+    if (n.is_int) seed = (uint64_t)n.i;
+    else memcpy(&seed, &n.d, sizeof(seed));
+    rng_seed(ctx->rng, seed);
+}
+
+ECArray* numeric_array(const char* cmd, const char* name) {
+    ECVar* v = find_var(name);
+    if (!v) runtime_error("%s: undefined array '%s'", cmd, name);
+    if (v->arr_id < 0) runtime_error("%s: '%s' is not an array", cmd, name);
+    ECArray* arr = &ctx->arrays[v->arr_id];
+    if (arr->elem_type != TYPE_NUMBER) runtime_error("%s: '%s' is not a numeric array", cmd, name);
+    return arr;
+}
+
+void cmd_map(const char* args) {
+    // MAP dest FUNC src [operand]   (dest[i] = FUNC(src[i], operand); the
+    // operand of a two-argument function is an array of the same size or a
+    // number. dest is created or replaced with the shape of src.)
+    require_main_thread("MAP");
+    char dn[MAX_NAME], fname[MAX_NAME], sn[MAX_NAME], bn[MAX_LINE] = "";
+    int given = sscanf(args, "%127s %127s %127s %[^\n]", dn, fname, sn, bn);
+    if (given < 3) runtime_error("MAP requires result, function and source array");
+    const MathFunc* f = math_find(fname, strlen(fname));
+    if (!f || f->kind == MATH_RAND) runtime_error("MAP: unknown function '%s'", fname);
+    if ((given == 4) != (f->args == 2)) {
+        runtime_error("MAP: %s takes %d argument%s", f->name, f->args, f->args == 1 ? "" : "s");
+    }
+    ECArray* a = numeric_array("MAP", sn);
+    const double* b = NULL;
+    double scalar = 0;
+    if (f->args == 2) {
+        trim(bn);
+        ECVar* bv = find_var(bn);
+        if (bv && bv->arr_id >= 0) {
+            ECArray* arr = numeric_array("MAP", bn);
+            if (arr->size != a->size) runtime_error("MAP: '%s' and '%s' differ in size", sn, bn);
+            b = arr->num_data;
+        } else {
+            scalar = evaluate_expr(bn);
+        }
+    }
+    ECVar* dv = find_var(dn);
+    if ((!dv || dv->arr_id < 0) && ctx->array_count >= MAX_ARRAYS) runtime_error("Too many arrays");
+    
+    size_t n = (size_t)a->size;
+    const double* x = a->num_data;
+    double* out = (double*)malloc((n > 0 ? n : 1) * sizeof(double));
+    if (!out) runtime_error("Out of memory");
+    if (f->f1) for (size_t i = 0; i < n; i++) out[i] = f->f1(x[i]);
+    else if (b) for (size_t i = 0; i < n; i++) out[i] = f->f2(x[i], b[i]);
+    else for (size_t i = 0; i < n; i++) out[i] = f->f2(x[i], scalar);
+    
+    // Same domain errors as the scalar function, before anything is stored
+    for (size_t i = 0; i < n; i++) {
+        if (isfinite(out[i]) || !isfinite(x[i]) || !isfinite(b ? b[i] : scalar)) continue;
+        int nan = isnan(out[i]);
+        free(out);
+        runtime_error(nan ? "%s: argument out of domain at index %d" : "%s: result out of range at index %d", f->name, (int)i);
+    }
+    int rows = a->rows, cols = a->cols;
+    ECArray* arr = install_array(dn, out, (int)n);
+    arr->rows = rows;
+    arr->cols = cols;
+}
+
+void cmd_fillrand(const char* args) {
+    // FILLRAND arr [n]   (RAND() or RAND(n) into every element)
+    require_main_thread("FILLRAND");
+    char name[MAX_NAME], range[MAX_LINE] = "";
+    if (sscanf(args, "%127s %[^\n]", name, range) < 1) runtime_error("FILLRAND requires an array");
+    ECArray* arr = numeric_array("FILLRAND", name);
+    uint64_t* s = rng_state();
+    double* data = arr->num_data;
+    if (range[0]) {
+        uint64_t n = rand_range(evaluate_num(range));
+        for (int i = 0; i < arr->size; i++) data[i] = (double)rng_below(s, n);
+    } else {
+        for (int i = 0; i < arr->size; i++) data[i] = rng_unit(s);
+    }
+}
+
+// ============ Modules ============
+// IMPORT "file.ec" [AS name] is resolved when the program is loaded: the
+// module's lines are appended to the program and compiled on their own, and
+// its FN and CLASS names get a "name." prefix. The IMPORT line runs the
+// module's top-level code the first time it is reached. Compiled modules
+// are cached on disk by content hash; a later run maps the cached code
+// instead of parsing, checking and optimizing the source again.
+
+void add_line(const char* text, size_t len);
+void block_name(int op, const char* args, char* name);
+
+// Module whose code contains `line`, if any
+const ECModule* module_at(int line) {
+    for (int i = 0; i < ctx->module_count; i++) {
+        const ECModule* m = &ctx->modules[i];
+        if (m->path && line > m->header && line < m->tail) return m;
+    }
+    return NULL;
+}
+
+// Forget the modules loaded at line `from` or later (their lines are gone)
+void drop_modules(int from) {
+    while (ctx->module_count > 0 && ctx->modules[ctx->module_count - 1].header >= from) {
+        free(ctx->modules[--ctx->module_count].path);
+    }
+}
+
+// Prefix the module's own FN and CLASS names where they are defined and
+// where CALL, NEW and FOREACH ... IN name(args) use them
+void qualify_names(int from, int to, const char* prefix) {
+    int count = 0;
+    for (int i = from; i < to; i++) count += ctx->code[i].op == OP_FN || ctx->code[i].op == OP_CLASS;
+    if (count == 0) return;
+    char (*names)[MAX_NAME] = (char (*)[MAX_NAME])malloc(count * sizeof(*names));
+    if (!names) fatal_error("Error: Out of memory loading program\n");
+    count = 0;
+    for (int i = from; i < to; i++) {
+        const ECInstr* in = &ctx->code[i];
+        if (in->op == OP_FN || in->op == OP_CLASS) block_name(in->op, instr_args(in), names[count++]);
+    }
+    
+    for (int i = from; i < to; i++) {
+        ECInstr* in = &ctx->code[i];
+        const char* args = instr_args(in);
+        const char* name = NULL;
+        int memo, limit;
+        switch (in->op) {
+            case OP_FN: name = fn_attributes(args, &memo, &limit); break;
+            case OP_CLASS: case OP_CALL: name = args; break;
+            case OP_NEW:
+                name = args + strcspn(args, " \t");
+                name += strspn(name, " \t");
+                break;
+            case OP_FOREACH:
+                for (const char* p = args + strspn(args, " \t,"); *p; p += strspn(p, " \t,")) {
+                    size_t n = strcspn(p, " \t,");
+                    if (n == 2 && strncasecmp(p, "IN", 2) == 0) { name = p + 2 + strspn(p + 2, " \t"); break; }
+                    p += n;
+                }
+                if (name && (*name == '"' || name[strcspn(name, " \t(")] != '(')) name = NULL;
+                break;
+            default: break;
+        }
+        if (!name) continue;
+        
+        size_t len = strcspn(name, " \t(");
+        int local = 0;
+        for (int k = 0; k < count && !local; k++) local = strlen(names[k]) == len && strncmp(names[k], name, len) == 0;
+        char out[MAX_LINE];
+        if (!local || len == 0) continue;
+        if (snprintf(out, sizeof(out), "%.*s%s.%s", (int)(name - args), args, prefix, name) >= (int)sizeof(out)) continue;
+        set_instr_args(in, out);
+    }
+    free(names);
+}
+
+// Cache file of a module: EC_CACHE_DIR, else ec/ in the user's cache
+// directory (created on demand). Returns 0 if there is none; an empty
+// EC_CACHE_DIR turns the cache off.
+int module_cache_file(char* file, uint64_t key, const char* name) {
+    char dir[MAX_LINE];
+    const char* env = getenv("EC_CACHE_DIR");
+    if (env) {
+        if (!*env) return 0;
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+        snprintf(dir, sizeof(dir), "%s/ec", env);
+#ifdef _WIN32
+    } else if ((env = getenv("LOCALAPPDATA")) && *env) {
+        snprintf(dir, sizeof(dir), "%s/ec", env);
+#endif
+    } else if ((env = getenv("HOME")) && *env) {
+        snprintf(dir, sizeof(dir), "%s/.cache/ec", env);
+    } else {
+        return 0;
+    }
+    for (char* p = dir + 1; *p; p++) {
+        if (*p != '/' && *p != '\\') continue;
+        char c = *p;
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = c;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return 0;
+    return snprintf(file, MAX_LINE, "%s/%016llx-%s.ecm", dir, (unsigned long long)key, name) < MAX_LINE;
+}
+
+// Copy a cached module into lines [first, first + count) and its strings
+// onto the pool. Returns 0 if the file is missing, stale or damaged.
+int module_cache_load(const char* file, int first, int count) {
+    char* base = NULL;
+    size_t size = 0;
+    if (!map_file(file, &base, &size) || !base) return 0;
+    
+    const ECModuleHeader* h = (const ECModuleHeader*)base;
+    size_t code_size = (size_t)count * sizeof(ECInstr);
+    int valid = size >= sizeof(ECModuleHeader) &&
+        memcmp(h->magic, ECM_MAGIC, 4) == 0 && h->version == ECB_VERSION &&
+        h->instr_size == sizeof(ECInstr) && h->line_count == (uint32_t)count && h->pool_size > 0 &&
+        size == sizeof(ECModuleHeader) + code_size + h->pool_size && base[size - 1] == '\0';
+    const ECInstr* code = (const ECInstr*)(base + sizeof(ECModuleHeader));
+    for (int i = 0; valid && i < count; i++) {
+        valid = code[i].op >= 0 && code[i].op < OP_COUNT && code[i].args >= 0 &&
+            (uint32_t)code[i].args < h->pool_size && code[i].jump >= 0 && code[i].jump < count &&
+            code[i].end >= 0 && code[i].end < count;
+    }
+    if (valid) {
+        int pool_base = (int)ctx->pool_buffer.len;
+        buffer_append(&ctx->pool_buffer, base + sizeof(ECModuleHeader) + code_size, h->pool_size);
+        ctx->pool = ctx->pool_buffer.data;
+        for (int i = 0; i < count; i++) {
+            ECInstr* in = &ctx->code[first + i];
+            *in = code[i];
+            in->args += pool_base;
+            in->jump += first;
+            in->end += first;
+        }
+    }
+    unmap_file(base, size);
+    return valid;
+}
+
+// Write lines [first, first + count) and the pool from `pool_base` on. The
+// file is renamed into place so concurrent runs never map half of it.
+void module_cache_save(const char* file, int first, int count, int pool_base) {
+    char temp[MAX_LINE + 16];
+    snprintf(temp, sizeof(temp), "%s.%d", file, (int)getpid());
+    FILE* f = fopen(temp, "wb");
+    if (!f) return;
+    
+    ECModuleHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ECM_MAGIC, 4);
+    h.version = ECB_VERSION;
+    h.instr_size = sizeof(ECInstr);
+    h.line_count = count;
+    h.pool_size = (uint32_t)(ctx->pool_buffer.len - pool_base);
+    fwrite(&h, sizeof(h), 1, f);
+    for (int i = 0; i < count; i++) {
+        ECInstr in = ctx->code[first + i];
+        in.args = in.args >= pool_base ? in.args - pool_base : 0;
+        in.jump -= first;
+        in.end -= first;
+        in.base = in.op;
+        in.operands = -1;
+        in.ops = 0;
+        fwrite(&in, sizeof(in), 1, f);
+    }
+    fwrite(ctx->pool_buffer.data + pool_base, 1, h.pool_size, f);
+    int failed = ferror(f);
+    if (fclose(f) != 0) failed = 1;
+    if (failed || rename(temp, file) != 0) remove(temp);
+}
+
+void load_imports(int from, int to, const char* dir);
+
+// Load the module IMPORTed by `line` unless it already is, and return its
+// header line. Relative paths start from `dir`.
+int import_module(const char* args, const char* dir, int line) {
+    char path[MAX_LINE], name[MAX_NAME], full[MAX_LINE * 2], real[MAX_LINE];
+    const char* close = args[0] == '"' ? strchr(args + 1, '"') : NULL;
+    if (!close) fatal_error("Syntax Error: IMPORT requires a quoted file name at line %d\n", source_line(line));
+    snprintf(path, sizeof(path), "%.*s", (int)(close - args - 1), args + 1);
+    const char* rest = close + 1;
+    while (isspace((unsigned char)*rest)) rest++;
+    if (*rest) {
+        if (strncasecmp(rest, "AS", 2) != 0 || !isspace((unsigned char)rest[2]) ||
+            sscanf(rest + 2, " %127s", name) != 1 || !is_identifier(name)) {
+            fatal_error("Syntax Error: Expected IMPORT \"file\" [AS name] at line %d\n", source_line(line));
+        }
+    } else {
+        const char* base = path + strlen(path);
+        while (base > path && base[-1] != '/' && base[-1] != '\\') base--;
+        snprintf(name, sizeof(name), "%.*s", (int)strcspn(base, "."), base);
+        if (!is_identifier(name)) {
+            fatal_error("Syntax Error: '%s' is not a valid module name; use IMPORT \"%s\" AS name at line %d\n",
+                        name, path, source_line(line));
+        }
+    }
+    
+    int absolute = path[0] == '/' || path[0] == '\\' || (isalpha((unsigned char)path[0]) && path[1] == ':');
+    snprintf(full, sizeof(full), "%s%s%s", dir && !absolute ? dir : "", dir && !absolute ? "/" : "", path);
+    if (!realpath(full, real)) fatal_error("Error: Cannot open module '%s' (line %d)\n", path, source_line(line));
+    for (int i = 0; i < ctx->module_count; i++) {
+        const ECModule* m = &ctx->modules[i];
+        if (!m->path) continue;
+        int same = strcmp(m->path, real) == 0;
+        if (same && strcmp(m->name, name) == 0) return m->header;
+        if (same) fatal_error("Error: Module '%s' is already imported as '%s' (line %d)\n", path, m->name, source_line(line));
+        if (strcmp(m->name, name) == 0) fatal_error("Error: Two modules imported as '%s' (line %d)\n", name, source_line(line));
+    }
+    if (!ctx->modules && !(ctx->modules = (ECModule*)calloc(MAX_MODULES, sizeof(ECModule)))) {
+        fatal_error("Error: Out of memory loading program\n");
+    }
+    if (ctx->module_count >= MAX_MODULES) fatal_error("Error: Too many modules (Limit: %d)\n", MAX_MODULES);
+    
+    char* text = NULL;
+    size_t size = 0;
+    if (!map_file(real, &text, &size)) fatal_error("Error: Cannot open module '%s' (line %d)\n", path, source_line(line));
+    uint64_t key = memo_hash(text, size);
+    int first = ctx->line_count;
+    add_line("# IMPORT", 8);
+    for (const char* p = text, *end = text + size; p < end;) {
+        const char* nl = (const char*)memchr(p, '\n', end - p);
+        size_t len = (nl ? nl : end) - p;
+        add_line(p, len > 0 && p[len - 1] == '\r' ? len - 1 : len);
+        p += len + (nl != NULL);
+    }
+    unmap_file(text, size);
+    add_line("# END IMPORT", 12);
+    int tail = ctx->line_count - 1;
+    
+    int idx = ctx->module_count++;
+    ECModule* m = &ctx->modules[idx];
+    memset(m, 0, sizeof(*m));
+    if (!(m->path = strdup(real))) fatal_error("Error: Out of memory loading program\n");
+    strcpy(m->name, name);
+    m->header = first;
+    m->tail = tail;
+    
+    // Errors show the module's own line numbers (see runtime_error)
+    int* map = (int*)realloc(ctx->line_map, ctx->line_count * sizeof(int));
+    if (!map) fatal_error("Error: Out of memory loading program\n");
+    if (!ctx->line_map) for (int i = 0; i < first; i++) map[i] = i;
+    for (int i = first; i <= tail; i++) map[i] = i > first ? i - first - 1 : 0;
+    ctx->line_map = map;
+    ECInstr* code = (ECInstr*)realloc(ctx->code, ctx->line_count * sizeof(ECInstr));
+    if (!code) fatal_error("Error: Out of memory loading program\n");
+    ctx->code = code;
+    
+    jmp_buf jmp;
+    jmp_buf* prev = ctx->error_jmp;
+    ctx->error_jmp = &jmp;
+    if (setjmp(jmp)) {
+        ctx->error_jmp = prev;
+        ECBuffer report;
+        memset(&report, 0, sizeof(report));
+        buffer_printf(&report, "In module '%s':\n%s", ctx->modules[idx].path, ctx->error.data);
+        buffer_free(&ctx->error);
+        ctx->error = report;
+        raise_error();
+    }
+    char cache[MAX_LINE];
+    int cached = module_cache_file(cache, key, name);
+    if (!cached || !module_cache_load(cache, first, tail - first + 1)) {
+        // The cached slice of the pool must not refer to strings before it
+        pool_reset();
+        int pool_base = pool_add("", 0);
+        validate_syntax(first, NULL);
+        compile_program(first, NULL);
+        ctx->code[first].op = OP_JUMP;
+        ctx->code[first].jump = tail;
+        ctx->code[tail].op = OP_RET;
+        qualify_names(first, tail, name);
+        // Constants are not propagated: the result must not depend on
+        // the program that imports the module
+        optimize_program(first, tail + 1, 0);
+        if (cached) module_cache_save(cache, first, tail - first + 1, pool_base);
+    }
+    
+    char module_dir[MAX_LINE];
+    strcpy(module_dir, real);
+    char* slash = strrchr(module_dir, '/');
+#ifdef _WIN32
+    if (strrchr(module_dir, '\\') > slash) slash = strrchr(module_dir, '\\');
+#endif
+    if (slash) slash[slash == module_dir] = '\0';
+    load_imports(first + 1, tail, slash ? module_dir : NULL);
+    ctx->error_jmp = prev;
+    return first;
+}
+
+// Load the modules IMPORTed in lines [from, to) and point each IMPORT at
+// its module's header line
+void load_imports(int from, int to, const char* dir) {
+    for (int i = from; i < to; i++) {
+        if (ctx->code[i].op != OP_IMPORT) continue;
+        char args[MAX_LINE];
+        strcpy(args, instr_args(&ctx->code[i]));
+        int header = import_module(args, dir, i);
+        ctx->code[i].jump = header;
+    }
+}
+
+// Run the module's top-level code like a call, the first time only
+void cmd_import(const char* args) {
+    require_main_thread("IMPORT");
+    int header = ctx->code[ctx->current_line].jump;
+    if (ctx->code[header].op != OP_JUMP) runtime_error("Module '%s' was not loaded", args);
+    ECModule* m = NULL;
+    for (int i = 0; i < ctx->module_count && !m; i++) {
+        if (ctx->modules[i].header == header) m = &ctx->modules[i];
+    }
+    if (!m) {
+        // An image keeps the modules' code but not the module table
+        if (!ctx->modules && !(ctx->modules = (ECModule*)calloc(MAX_MODULES, sizeof(ECModule)))) {
+            runtime_error("Out of memory");
+        }
+        if (ctx->module_count >= MAX_MODULES) runtime_error("Too many modules (Limit: %d)", MAX_MODULES);
+        m = &ctx->modules[ctx->module_count++];
+        memset(m, 0, sizeof(*m));
+        m->header = header;
+        m->tail = ctx->code[header].jump;
+    }
+    if (m->ran) return;
+    if (ctx->call_stack_top >= MAX_STACK) {
+        runtime_error("Stack Overflow: Call depth exceeded (Limit: %d).", MAX_STACK);
+    }
+    m->ran = 1;
+    
+    int top = ctx->call_stack_top++;
+    ctx->call_stack[top] = ctx->current_line;
+    ctx->call_loop_depth[top] = ctx->loop_depth;
+    ctx->call_exec_top[top] = ctx->exec_stream_top;
+    ctx->call_foreach_top[top] = ctx->foreach_top;
+    ctx->call_memo[top] = -1;
+    ctx->call_result[top] = 0;
+    ctx->call_generator[top] = NULL;
+    ctx->debug_stack[top].line_num = ctx->current_line;
+    strncpy(ctx->debug_stack[top].func_name, "Global/Previous", MAX_NAME);
+    ctx->in_function++;
+    ctx->has_return = 0;
+    ctx->current_line = header;
+}
+
+// ============ Profiler ============
+
+void dispatch(const ECInstr* in);
+
+long long now_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER t;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (long long)((double)t.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+int profile_add_node(ECProfile* p, int parent, int func) {
+    if (p->node_count == p->node_cap) {
+        int cap = p->node_cap ? p->node_cap * 2 : 64;
+        ProfNode* grown = (ProfNode*)realloc(p->nodes, cap * sizeof(ProfNode));
+        if (!grown) fatal_error("Error: Out of memory in profiler\n");
+        p->nodes = grown;
+        p->node_cap = cap;
+    }
+    ProfNode* n = &p->nodes[p->node_count];
+    memset(n, 0, sizeof(ProfNode));
+    n->func = func;
+    n->parent = parent;
+    n->first_child = -1;
+    n->next_sibling = -1;
+    if (parent >= 0) {
+        n->next_sibling = p->nodes[parent].first_child;
+        p->nodes[parent].first_child = p->node_count;
+    }
+    return p->node_count++;
+}
+
+void profile_free(ECProfile* p) {
+    if (!p) return;
+    free(p->line_count);
+    free(p->line_ns);
+    free(p->nodes);
+    free(p);
+}
+
+ECProfile* profile_create(void) {
+    ECProfile* p = (ECProfile*)calloc(1, sizeof(ECProfile));
+    if (!p) fatal_error("Error: Out of memory in profiler\n");
+    p->path[0] = profile_add_node(p, -1, -1);
+    return p;
+}
+
+// Descend into FN `func` from the current call path (main thread only)
+void profile_call(int func) {
+    ECProfile* p = ctx->profile;
+    int parent = p->path[ctx->call_stack_top];
+    int node = p->nodes[parent].first_child;
+    while (node >= 0 && p->nodes[node].func != func) node = p->nodes[node].next_sibling;
+    if (node < 0) node = profile_add_node(p, parent, func);
+    p->nodes[node].calls++;
+    p->path[ctx->call_stack_top + 1] = node;
+}
+
+// Time one line. PARLOOP workers only update the per-line table; the
+// PARLOOP line itself carries the loop's wall time in the call tree.
+void profile_line(void) {
+    ECProfile* p = ctx->profile;
+    int line_num = ctx->current_line;
+    int worker = in_parallel_worker();
+    
+    if (!worker && p->line_cap < ctx->line_count) {
+        long long* counts = (long long*)realloc(p->line_count, ctx->line_count * sizeof(long long));
+        if (counts) p->line_count = counts;
+        long long* times = (long long*)realloc(p->line_ns, ctx->line_count * sizeof(long long));
+        if (times) p->line_ns = times;
+        if (!counts || !times) fatal_error("Error: Out of memory in profiler\n");
+        memset(counts + p->line_cap, 0, (ctx->line_count - p->line_cap) * sizeof(long long));
+        memset(times + p->line_cap, 0, (ctx->line_count - p->line_cap) * sizeof(long long));
+        p->line_cap = ctx->line_count;
+    }
+    int node = p->path[ctx->call_stack_top];
+    
+    // Superinstructions run as their plain lines so every line is counted
+    const ECInstr* in = &ctx->code[line_num];
+    ECInstr plain;
+    if (in->op != in->base) {
+        plain = *in;
+        plain.op = plain.base;
+        in = &plain;
+    }
+    
+    long long start = now_ns();
+    dispatch(in);
+    long long elapsed = now_ns() - start;
+    
+    if (line_num >= p->line_cap) return;
+    if (worker) {
+        __atomic_fetch_add(&p->line_count[line_num], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&p->line_ns[line_num], elapsed, __ATOMIC_RELAXED);
+    } else {
+        p->line_count[line_num]++;
+        p->line_ns[line_num] += elapsed;
+        p->nodes[node].self_ns += elapsed;
+    }
+}
+
+typedef struct {
+    int line;
+    long long ns;
+} ProfLine;
+
+int compare_prof_lines(const void* a, const void* b) {
+    long long x = ((const ProfLine*)a)->ns, y = ((const ProfLine*)b)->ns;
+    return (x < y) - (x > y);
+}
+
+const char* profile_func_name(int func) {
+    return func < 0 ? "main" : ctx->funcs[func].name;
+}
+
+void profile_report(FILE* out, int top) {
+    ECProfile* p = ctx->profile;
+    long long total = 0;
+    for (int i = 0; i < p->node_count; i++) total += p->nodes[i].self_ns;
+    double pct = total > 0 ? 100.0 / total : 0;
+    
+    fprintf(out, "\n==================== EC Profile ====================\n");
+    fprintf(out, "Profiled time: %.3f ms\n\n", total / 1e6);
+    
+    ProfLine* hot = (ProfLine*)malloc((p->line_cap + 1) * sizeof(ProfLine));
+    if (!hot) fatal_error("Error: Out of memory in profiler\n");
+    int hot_count = 0;
+    for (int i = 0; i < p->line_cap; i++) {
+        if (p->line_count[i] > 0) { hot[hot_count].line = i; hot[hot_count].ns = p->line_ns[i]; hot_count++; }
+    }
+    qsort(hot, hot_count, sizeof(ProfLine), compare_prof_lines);
+    
+    fprintf(out, "Hot lines:\n");
+    fprintf(out, "%6s %12s %12s %6s  %s\n", "Line", "Count", "Time(ms)", "%", "Source");
+    for (int i = 0; i < hot_count && i < top; i++) {
+        int n = hot[i].line;
+        char src[MAX_LINE];
+        strcpy(src, n < ctx->line_count ? ctx->lines[n] : "");
+        trim(src);
+        if (strlen(src) > 48) strcpy(src + 45, "...");
+        fprintf(out, "%6d %12lld %12.3f %6.1f  %s\n", source_line(n), p->line_count[n], hot[i].ns / 1e6, hot[i].ns * pct, src);
+    }
+    free(hot);
+    
+    // Per FN: calls and self time summed over its call paths; total time counts
+    // a path's whole subtree unless the FN is already on the path (recursion)
+    int funcs = ctx->func_count + 1;
+    long long* calls = (long long*)calloc(funcs, sizeof(long long));
+    long long* self = (long long*)calloc(funcs, sizeof(long long));
+    long long* incl = (long long*)calloc(funcs, sizeof(long long));
+    long long* subtree = (long long*)malloc(p->node_count * sizeof(long long));
+    if (!calls || !self || !incl || !subtree) fatal_error("Error: Out of memory in profiler\n");
+    
+    for (int i = 0; i < p->node_count; i++) subtree[i] = p->nodes[i].self_ns;
+    for (int i = p->node_count - 1; i > 0; i--) subtree[p->nodes[i].parent] += subtree[i];
+    for (int i = 0; i < p->node_count; i++) {
+        int f = p->nodes[i].func + 1;
+        calls[f] += p->nodes[i].calls;
+        self[f] += p->nodes[i].self_ns;
+        int a = p->nodes[i].parent;
+        while (a >= 0 && p->nodes[a].func + 1 != f) a = p->nodes[a].parent;
+        if (a < 0) incl[f] += subtree[i];
+    }
+    calls[0] = 1;
+    
+    fprintf(out, "\nFunctions:\n");
+    fprintf(out, "%-24s %12s %12s %12s %6s\n", "Name", "Calls", "Self(ms)", "Total(ms)", "%");
+    for (int done = 0; done < funcs; done++) {
+        int best = -1;
+        for (int f = 0; f < funcs; f++) {
+            if (calls[f] >= 0 && (best < 0 || incl[f] > incl[best])) best = f;
+        }
+        if (calls[best] > 0) {
+            fprintf(out, "%-24s %12lld %12.3f %12.3f %6.1f\n", profile_func_name(best - 1),
+                    calls[best], self[best] / 1e6, incl[best] / 1e6, incl[best] * pct);
+        }
+        calls[best] = -1;
+    }
+    fprintf(out, "====================================================\n");
+    
+    free(calls);
+    free(self);
+    free(incl);
+    free(subtree);
+}
+
+// Collapsed stacks ("main;outer;inner <microseconds>") for flame graph tools
+void profile_write_folded(FILE* out) {
+    ECProfile* p = ctx->profile;
+    int path[MAX_STACK + 1];
+    for (int i = 0; i < p->node_count; i++) {
+        long long us = p->nodes[i].self_ns / 1000;
+        if (us == 0) continue;
+        int depth = 0;
+        for (int n = i; n >= 0 && depth <= MAX_STACK; n = p->nodes[n].parent) path[depth++] = n;
+        for (int d = depth - 1; d >= 0; d--) {
+            fprintf(out, "%s%s", profile_func_name(p->nodes[path[d]].func), d > 0 ? ";" : "");
+        }
+        fprintf(out, " %lld\n", us);
+    }
+}
+
+// ============ Main Execution ============
+
+void execute_line(void) {
+    if (ctx->profile) profile_line();
+    else dispatch(&ctx->code[ctx->current_line]);
+}
+
+void dispatch(const ECInstr* in) {
+    const char* args = instr_args(in);
+    
+    switch (in->op) {
+        case OP_NOP: break;
+        case OP_EC: cmd_ec(args); break;
+        case OP_SET: cmd_set(args); break;
+        case OP_ARR: cmd_arr(args); break;
+        case OP_OUT: cmd_out(args); break;
+        case OP_IN: cmd_in(args); break;
+        case OP_IF: cmd_if(args); break;
+        case OP_ELIF: cmd_elif(args); break;
+        case OP_ELSE: cmd_else(args); break;
+        case OP_ENDIF: break;
+        case OP_LOOP: cmd_loop(args); break;
+        case OP_ENDLOOP: cmd_endloop(args); break;
+        case OP_BREAK: cmd_break(args); break;
+        case OP_CONTINUE: cmd_continue(args); break;
+        case OP_PARLOOP: cmd_parloop(args); break;
+        case OP_ENDPARLOOP: break;
+        case OP_FN: cmd_fn(args); break;
+        case OP_ENDFN:
+            if (ctx->call_stack_top > 0) return_from_call();
+            break;
+        case OP_CALL: cmd_call(args); break;
+        case OP_RET: cmd_ret(args); break;
+        case OP_CLASS: cmd_class(args); break;
+        case OP_ENDCLASS: break;
+        case OP_NEW: cmd_new(args); break;
+        case OP_ADD: cmd_add(args); break;
+        case OP_SUB: cmd_sub(args); break;
+        case OP_MUL: cmd_mul(args); break;
+        case OP_DIV: cmd_div(args); break;
+        case OP_MOD: cmd_mod(args); break;
+        case OP_EXEC: cmd_exec(args); break;
+        case OP_ENDEXEC: cmd_endexec(args); break;
+        case OP_PYRUN: cmd_pyrun(args); break;
+        case OP_CRUN: cmd_crun(args); break;
+        case OP_ASYNC: cmd_async(args); break;
+        case OP_WAIT: cmd_wait(args); break;
+        case OP_WAITALL: cmd_waitall(args); break;
+        case OP_JOBS: cmd_jobs(args); break;
+        case OP_OPEN: cmd_open(args); break;
+        case OP_READLINE: cmd_readline(args); break;
+        case OP_WRITE: cmd_write(args); break;
+        case OP_CLOSE: cmd_close(args); break;
+        case OP_FOREACH: cmd_foreach(args); break;
+        case OP_ENDFOREACH: cmd_endforeach(args); break;
+        case OP_LOADCSV: cmd_loadcsv(args); break;
+        case OP_SAVECSV: cmd_savecsv(args); break;
+        case OP_MAT: cmd_mat(args); break;
+        case OP_MATMUL: cmd_matmul(args); break;
+        case OP_TRANSPOSE: cmd_transpose(args); break;
+        case OP_MATADD: matrix_elementwise("MATADD", args, '+'); break;
+        case OP_MATSUB: matrix_elementwise("MATSUB", args, '-'); break;
+        case OP_MATEMUL: matrix_elementwise("MATEMUL", args, '*'); break;
+        case OP_MATEDIV: matrix_elementwise("MATEDIV", args, '/'); break;
+        case OP_YIELD: cmd_yield(args); break;
+        case OP_MATCH: cmd_match(args); break;
+        case OP_CASE: case OP_DEFAULT: cmd_case(args); break;
+        case OP_ENDMATCH: break;
+        case OP_IMPORT: cmd_import(args); break;
+        case OP_SEED: cmd_seed(args); break;
+        case OP_MAP: cmd_map(args); break;
+        case OP_FILLRAND: cmd_fillrand(args); break;
+        case OP_END: require_main_thread("END"); ctx->running = 0; break;
+        case OP_JUMP: ctx->current_line = in->jump; break;
+        case OP_LAZY:
+            compile_block(ctx->current_line);
+            dispatch(&ctx->code[ctx->current_line]);
+            break;
+        case OP_SET_FAST: op_set_fast(in); break;
+        case OP_ARITH_FAST: op_arith_fast(in); break;
+        case OP_ARITH_LOOP: op_arith_loop(in); break;
+        default: runtime_error("Unknown command '%s'", args);
+    }
+}
+
+// ============ Program Loading ============
+
+void drop_modules(int from);
+
+void free_program(void) {
+    jit_reset();
+    if (ctx->image) {
+        unmap_file(ctx->image, ctx->image_size);
+        ctx->image = NULL;
+    } else {
+        for (int i = 0; i < ctx->line_count; i++) free(ctx->lines[i]);
+        free(ctx->code);
+    }
+    free(ctx->lines);
+    free(ctx->line_map);
+    ctx->lines = NULL;
+    ctx->line_map = NULL;
+    ctx->code = NULL;
+    ctx->pool = NULL;
+    ctx->pool_size = 0;
+    ctx->operands = NULL;
+    ctx->operand_count = 0;
+    free((void*)ctx->operand_names);
+    ctx->operand_names = NULL;
+    ctx->line_count = 0;
+    ctx->func_count = 0;
+    ctx->class_count = 0;
+    memo_clear(-1);
+    drop_modules(0);
+    free(ctx->source_dir);
+    ctx->source_dir = NULL;
+}
+
+// Append a source line (lines longer than MAX_LINE - 1 are truncated)
+void add_line(const char* text, size_t len) {
+    if (len > MAX_LINE - 1) len = MAX_LINE - 1;
+    if ((ctx->line_count & (ctx->line_count - 1)) == 0) {
+        int cap = ctx->line_count ? ctx->line_count * 2 : 64;
+        char** grown = (char**)realloc(ctx->lines, cap * sizeof(char*));
+        if (!grown) fatal_error("Error: Out of memory loading program\n");
+        ctx->lines = grown;
+    }
+    char* copy = (char*)malloc(len + 1);
+    if (!copy) fatal_error("Error: Out of memory loading program\n");
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    ctx->lines[ctx->line_count++] = copy;
+}
+
+void load_image(const char* filename);
+
+void load_file(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) fatal_error("Error: Cannot open file '%s'\n", filename);
+    
+    char magic[4];
+    if (fread(magic, 1, 4, f) == 4 && memcmp(magic, ECB_MAGIC, 4) == 0) {
+        fclose(f);
+        load_image(filename);
+        return;
+    }
+    rewind(f);
+    
+    free_program();
+    const char* slash = strrchr(filename, '/');
+#ifdef _WIN32
+    if (strrchr(filename, '\\') > slash) slash = strrchr(filename, '\\');
+#endif
+    if (slash && (ctx->source_dir = (char*)malloc(slash - filename + 2))) {
+        size_t len = slash > filename ? (size_t)(slash - filename) : 1;
+        memcpy(ctx->source_dir, filename, len);
+        ctx->source_dir[len] = '\0';
+    }
+    while (read_line(f, &ctx->line_buffer)) add_line(ctx->line_buffer.data, ctx->line_buffer.len);
+    fclose(f);
+}
+
+void load_source(const char* source) {
+    free_program();
+    while (*source) {
+        size_t len = strcspn(source, "\n");
+        size_t text_len = len;
+        if (text_len > 0 && source[text_len - 1] == '\r') text_len--;
+        add_line(source, text_len);
+        source += len;
+        if (*source == '\n') source++;
+    }
+}
+
+// Compile the FN/CLASS body whose first line is `line` (OP_LAZY) in place.
+// Runs on the first call; lines and pool offsets of everything else stay.
+void compile_block(int line) {
+    int start = line - 1, end = ctx->code[line].jump;
+    compile_lines(start, end + 1, NULL);
+    optimize_program(start, end + 1, 1);
+    fuse_program(start, end + 1);
+    ctx->pool_size = ctx->pool_buffer.len;
+}
+
+// Before PARLOOP workers share the code, and before it is written out
+void compile_all_blocks(void) {
+    for (int i = 0; i < ctx->line_count; i++) {
+        if (ctx->code[i].op == OP_LAZY) compile_block(i);
+    }
+}
+
+// Phase 0 (static syntax analysis, lowering) and Phase 1 (register functions
+// and classes). A precompiled image already carries all of this.
+void prepare_program(void) {
+    int source_count = ctx->line_count;
+    if (!ctx->image) {
+        // FN/CLASS bodies are compiled when first run (see compile_block)
+        int* block_end = (int*)calloc(ctx->line_count > 0 ? ctx->line_count : 1, sizeof(int));
+        if (!block_end) fatal_error("Error: Out of memory loading program\n");
+        jmp_buf jmp;
+        jmp_buf* prev = ctx->error_jmp;
+        ctx->error_jmp = &jmp;
+        if (setjmp(jmp)) {
+            ctx->error_jmp = prev;
+            free(block_end);
+            raise_error();
+        }
+        validate_syntax(0, block_end);
+        compile_program(0, block_end);
+        ctx->error_jmp = prev;
+        free(block_end);
+        // Imported modules are appended first so that constants they assign
+        // are not folded into the program
+        load_imports(0, source_count, ctx->source_dir);
+        optimize_program(0, source_count, 1);
+        buffer_clear(&ctx->operand_buffer);
+        fuse_program(0, ctx->line_count);
+        ctx->pool_size = ctx->pool_buffer.len;
+        
+        for (ctx->current_line = 0; ctx->current_line < ctx->line_count && ctx->running; ctx->current_line++) {
+            const ECInstr* in = &ctx->code[ctx->current_line];
+            if (in->op == OP_FN || in->op == OP_CLASS) dispatch(in);
+        }
+    }
+    ctx->source_count = source_count;
+    ctx->running = 1;
+}
+
+void watch_poll(void);
+
+// Phase 2: Execute top-level code from line `from` on
+void run_program(int from) {
+    for (ctx->current_line = from; ctx->current_line < ctx->line_count && ctx->running; ctx->current_line++) {
+        if (ctx->watch && __atomic_load_n(&ctx->watch->changed, __ATOMIC_ACQUIRE)) watch_poll();
+        const ECInstr* in = &ctx->code[ctx->current_line];
+        // FN and CLASS bodies were registered in Phase 1
+        if (in->op == OP_FN || in->op == OP_CLASS) ctx->current_line = in->jump;
+        else execute_line();
+    }
+}
+
+// ============ Program Reload ============
+
+// Blocks of a running program can be replaced from an edited source file:
+// changed FN/CLASS blocks are compiled and appended after the existing lines
+// and their table entries are pointed at the new copy. Variables, arrays,
+// objects and the top-level code stay as they are; calls already running
+// finish in the old body.
+
+#define WATCH_INTERVAL_MS 250
+
+// A top-level FN or CLASS block of a source file
+typedef struct {
+    int op;
+    char name[MAX_NAME];
+    int start;          // FN/CLASS line and its end in the edited file
+    int end;
+    int first;          // Where the block was appended to the program
+} ReloadBlock;
+
+// Same name cmd_fn / cmd_class register the block under
+void block_name(int op, const char* args, char* name) {
+    int memo, limit;
+    if (op == OP_FN) args = fn_attributes(args, &memo, &limit);
+    const char* paren = op == OP_FN ? strchr(args, '(') : NULL;
+    name[0] = '\0';
+    if (!paren) { sscanf(args, "%127s", name); return; }
+    int name_len = paren - args;
+    if (name_len >= MAX_NAME) name_len = MAX_NAME - 1;
+    memcpy(name, args, name_len);
+    name[name_len] = '\0';
+    trim(name);
+}
+
+// Register the FN/CLASS at `line` under its name, replacing an older
+// definition (cmd_fn / cmd_class add at the end of the table, so the end is
+// moved to the old slot for the duration of the call)
+void define_block(int line) {
+    const ECInstr* in = &ctx->code[line];
+    char name[MAX_NAME];
+    block_name(in->op, instr_args(in), name);
+    int* count = in->op == OP_FN ? &ctx->func_count : &ctx->class_count;
+    int idx = in->op == OP_FN ? find_func(name) : find_class(name);
+    int total = *count;
+    
+    if (idx >= 0) *count = idx;
+    if (idx >= 0 && in->op == OP_FN) memo_clear(idx);
+    ctx->current_line = line;
+    dispatch(in);
+    if (idx >= 0) *count = total;
+}
+
+// Top-level FN/CLASS blocks of lines[0..count); the other lines are appended
+// to `top` so that changes to the top-level code can be noticed
+int scan_blocks(char** lines, int count, ReloadBlock* blocks, int max, ECBuffer* top) {
+    int n = 0, depth = 0;
+    for (int i = 0; i < count; i++) {
+        char buf[MAX_LINE], cmd[MAX_NAME] = "", args[MAX_LINE] = "";
+        strcpy(buf, lines[i]);
+        trim(buf);
+        sscanf(buf, "%127s %[^\n]", cmd, args);
+        trim(args);
+        int op = lookup_opcode(cmd);
+        
+        if (op == OP_FN || op == OP_CLASS) {
+            if (depth++ == 0 && n < max) {
+                blocks[n].op = op;
+                block_name(op, args, blocks[n].name);
+                blocks[n].start = i;
+                blocks[n].end = count - 1;
+            }
+            continue;
+        }
+        if ((op == OP_ENDFN || op == OP_ENDCLASS) && depth > 0) {
+            if (--depth == 0 && n < max) blocks[n++].end = i;
+            continue;
+        }
+        if (depth == 0 && top) buffer_printf(top, "%s\n", buf);
+    }
+    return depth > 0 && n < max ? n + 1 : n;
+}
+
+int block_unchanged(char** lines, const ReloadBlock* b, int start, int end) {
+    if (b->end - b->start != end - start) return 0;
+    for (int i = 0; i <= end - start; i++) {
+        if (strcmp(lines[b->start + i], ctx->lines[start + i]) != 0) return 0;
+    }
+    return 1;
+}
+
+// Is `name` read by top-level code after line `from`?
+int top_level_uses(int from, const char* name) {
+    for (int j = from + 1; j < ctx->source_count; j++) {
+        if (ctx->code[j].op == OP_FN || ctx->code[j].op == OP_CLASS) j = ctx->code[j].jump;
+        else if (contains_word(ctx->lines[j], name)) return 1;
+    }
+    return 0;
+}
+
+// A variable written by lines [from, line_count) that the optimizer may have
+// substituted as a constant into the top-level code of lines [0, from)
+int folded_write(int from, char* name) {
+    for (int i = 0; i < ctx->source_count; i++) {
+        const ECInstr* in = &ctx->code[i];
+        if (in->op == OP_FN || in->op == OP_CLASS) { i = in->jump; continue; }
+        char rest[MAX_LINE] = "";
+        if (in->op != OP_EC || sscanf(instr_args(in), "%127s %[^\n]", name, rest) < 2 || !is_number(rest)) continue;
+        
+        if (lines_may_write(from, ctx->line_count, -1, name) && !lines_may_write(0, from, i, name) &&
+            top_level_uses(i, name)) return 1;
+    }
+    return 0;
+}
+
+// Swap in the FN/CLASS blocks of `filename` that differ from the loaded
+// ones. `report` (may be NULL) gets a line per block; returns the number of
+// blocks replaced or added, or -1 if the top-level code changed as well.
+int reload_file(const char* filename, ECBuffer* report) {
+    if (ctx->image) fatal_error("Error: A precompiled image cannot be reloaded\n");
+    if (!ctx->code) fatal_error("Error: No program loaded\n");
+    require_main_thread("Reload");
+    
+    FILE* f = fopen(filename, "rb");
+    if (!f) fatal_error("Error: Cannot open file '%s'\n", filename);
+    char magic[4];
+    if (fread(magic, 1, 4, f) == 4 && memcmp(magic, ECB_MAGIC, 4) == 0) {
+        fclose(f);
+        fatal_error("Error: '%s' is a precompiled image; reload its source\n", filename);
+    }
+    rewind(f);
+    
+    // Read and check the new source with the program's own line table swapped out
+    char** old_lines = ctx->lines;
+    int old_count = ctx->line_count;
+    ctx->lines = NULL;
+    ctx->line_count = 0;
+    ECBuffer old_top, new_top;
+    memset(&old_top, 0, sizeof(old_top));
+    memset(&new_top, 0, sizeof(new_top));
+    
+    jmp_buf jmp;
+    jmp_buf* prev = ctx->error_jmp;
+    ctx->error_jmp = &jmp;
+    int failed = setjmp(jmp);
+    if (!failed) {
+        while (read_line(f, &ctx->line_buffer)) add_line(ctx->line_buffer.data, ctx->line_buffer.len);
+        validate_syntax(0, NULL);
+    }
+    ctx->error_jmp = prev;
+    fclose(f);
+    char** lines = ctx->lines;
+    int count = ctx->line_count;
+    ctx->lines = old_lines;
+    ctx->line_count = old_count;
+    if (failed) {
+        for (int i = 0; i < count; i++) free(lines[i]);
+        free(lines);
+        raise_error();
+    }
+    
+    ReloadBlock* blocks = (ReloadBlock*)malloc((count + 1) * sizeof(ReloadBlock));
+    if (!blocks) fatal_error("Error: Out of memory loading program\n");
+    int block_count = scan_blocks(lines, count, blocks, count + 1, &new_top);
+    scan_blocks(ctx->lines, ctx->source_count, NULL, 0, &old_top);
+    int top_changed = new_top.len != old_top.len || memcmp(new_top.data, old_top.data, new_top.len) != 0;
+    buffer_free(&new_top);
+    buffer_free(&old_top);
+    
+    // Append every changed block; only the first block of a name is registered
+    int from = ctx->line_count, changed = 0;
+    for (int b = 0; b < block_count; b++) {
+        ReloadBlock* blk = &blocks[b];
+        int dup = 0;
+        for (int k = 0; k < b && !dup; k++) dup = blocks[k].op == blk->op && strcmp(blocks[k].name, blk->name) == 0;
+        int idx = blk->op == OP_FN ? find_func(blk->name) : find_class(blk->name);
+        int start = idx < 0 ? 0 : blk->op == OP_FN ? ctx->funcs[idx].start_line : ctx->classes[idx].start_line;
+        int end = idx < 0 ? 0 : blk->op == OP_FN ? ctx->funcs[idx].end_line : ctx->classes[idx].end_line;
+        if (dup || (idx >= 0 && block_unchanged(lines, blk, start, end))) { blk->op = OP_NOP; continue; }
+        
+        blk->first = ctx->line_count;
+        for (int i = blk->start; i <= blk->end; i++) add_line(lines[i], strlen(lines[i]));
+        changed++;
+    }
+    for (int i = 0; i < count; i++) free(lines[i]);
+    free(lines);
+    
+    if (changed) {
+        // Error messages keep showing line numbers of the edited file
+        int* map = (int*)realloc(ctx->line_map, ctx->line_count * sizeof(int));
+        if (!map) fatal_error("Error: Out of memory loading program\n");
+        if (!ctx->line_map) for (int i = 0; i < from; i++) map[i] = i;
+        ctx->line_map = map;
+        for (int b = 0; b < block_count; b++) {
+            if (blocks[b].op == OP_NOP) continue;
+            for (int i = 0; i <= blocks[b].end - blocks[b].start; i++) map[blocks[b].first + i] = blocks[b].start + i;
+        }
+        
+        compile_program(from, NULL);
+        optimize_program(from, ctx->line_count, 1);
+        fuse_program(from, ctx->line_count);
+        ctx->pool_size = ctx->pool_buffer.len;
+        char folded[MAX_NAME];
+        if (folded_write(from, folded)) {
+            for (int i = from; i < ctx->line_count; i++) free(ctx->lines[i]);
+            ctx->line_count = from;
+            free(blocks);
+            fatal_error("Error: Reloaded code assigns '%s', which the running program uses as a constant; restart it\n", folded);
+        }
+        
+        int line = ctx->current_line;
+        for (int b = 0; b < block_count; b++) {
+            if (blocks[b].op == OP_NOP) continue;
+            define_block(blocks[b].first);
+            if (report) buffer_printf(report, "  %s %s\n", op_names[blocks[b].op], blocks[b].name);
+        }
+        ctx->current_line = line;
+        jit_reset();
+    }
+    free(blocks);
+    return top_changed ? -1 : changed;
+}
+
+// Compile `source` after the loaded program: syntax check, lowering and
+// FN/CLASS registration (replacing same-named ones) for the new lines only.
+// Returns the first new line; a program that does not compile is dropped.
+int append_source(const char* source) {
+    if (ctx->image) fatal_error("Error: Code cannot be added to a precompiled image\n");
+    int from = ctx->line_count;
+    
+    jmp_buf jmp;
+    jmp_buf* prev = ctx->error_jmp;
+    ctx->error_jmp = &jmp;
+    if (setjmp(jmp)) {
+        ctx->error_jmp = prev;
+        for (int i = from; i < ctx->line_count; i++) free(ctx->lines[i]);
+        ctx->line_count = from;
+        drop_modules(from);
+        raise_error();
+    }
+    while (*source) {
+        size_t len = strcspn(source, "\n");
+        size_t text_len = len;
+        if (text_len > 0 && source[text_len - 1] == '\r') text_len--;
+        add_line(source, text_len);
+        source += len;
+        if (*source == '\n') source++;
+    }
+    validate_syntax(from, NULL);
+    if (ctx->line_map) {
+        int* map = (int*)realloc(ctx->line_map, (ctx->line_count > 0 ? ctx->line_count : 1) * sizeof(int));
+        if (!map) fatal_error("Error: Out of memory loading program\n");
+        for (int i = from; i < ctx->line_count; i++) map[i] = i;
+        ctx->line_map = map;
+    }
+    compile_program(from, NULL);
+    int to = ctx->line_count;
+    load_imports(from, to, ctx->source_dir);
+    optimize_program(from, to, 1);
+    fuse_program(from, ctx->line_count);
+    ctx->pool_size = ctx->pool_buffer.len;
+    ctx->error_jmp = prev;
+    jit_reset();
+    
+    for (int i = from; i < ctx->line_count; i++) {
+        if (ctx->code[i].op != OP_FN && ctx->code[i].op != OP_CLASS) continue;
+        define_block(i);
+        i = ctx->code[i].jump;
+    }
+    return from;
+}
+
+int file_changed(const struct stat* a, const struct stat* b) {
+    if (a->st_mtime != b->st_mtime || a->st_size != b->st_size) return 1;
+#ifdef __linux__
+    if (a->st_mtim.tv_nsec != b->st_mtim.tv_nsec) return 1;
+#endif
+    return 0;
+}
+
+void* watch_thread(void* arg) {
+    ECWatch* w = (ECWatch*)arg;
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += WATCH_INTERVAL_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) { until.tv_sec++; until.tv_nsec -= 1000000000L; }
+        pthread_cond_timedwait(&w->wake, &w->lock, &until);
+        
+        struct stat st;
+        if (w->stop || stat(w->filename, &st) != 0 || !file_changed(&st, &w->last)) continue;
+        w->last = st;
+        __atomic_store_n(&w->changed, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+void watch_stop(void) {
+    ECWatch* w = ctx->watch;
+    if (!w) return;
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->wake);
+    free(w->filename);
+    free(w);
+    ctx->watch = NULL;
+}
+
+void watch_start(const char* filename) {
+    watch_stop();
+    ECWatch* w = (ECWatch*)calloc(1, sizeof(ECWatch));
+    if (!w || !(w->filename = strdup(filename))) { free(w); fatal_error("Error: Out of memory\n"); }
+    if (stat(filename, &w->last) != 0) memset(&w->last, 0, sizeof(w->last));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    if (pthread_create(&w->thread, NULL, watch_thread, w) != 0) {
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->wake);
+        free(w->filename);
+        free(w);
+        fatal_error("Error: Cannot start a thread to watch '%s'\n", filename);
+    }
+    ctx->watch = w;
+}
+
+// Reload the watched file after the watcher saw it change. Errors are
+// reported and the running code is kept.
+void watch_poll(void) {
+    ECWatch* w = ctx->watch;
+    __atomic_store_n(&w->changed, 0, __ATOMIC_RELAXED);
+    
+    ECBuffer report;
+    memset(&report, 0, sizeof(report));
+    jmp_buf jmp;
+    jmp_buf* prev = ctx->error_jmp;
+    int line = ctx->current_line;
+    ctx->error_jmp = &jmp;
+    if (setjmp(jmp) == 0) {
+        int changed = reload_file(w->filename, &report);
+        ctx->error_jmp = prev;
+        fflush(stdout);
+        if (report.len) fprintf(stderr, "Reloaded '%s':\n%s", w->filename, report.data);
+        if (changed < 0) fprintf(stderr, "Note: the top-level code of '%s' changed; restart to apply it\n", w->filename);
+    } else {
+        ctx->error_jmp = prev;
+        ctx->current_line = line;
+        fflush(stdout);
+        fprintf(stderr, "Reload of '%s' failed; keeping the running code\n%s", w->filename, ctx->error.data);
+        buffer_clear(&ctx->error);
+    }
+    buffer_free(&report);
+}
+
+// ============ Program Images ============
+
+void write_padding(FILE* f, long align) {
+    static const char zeros[8] = {0};
+    long pos = ftell(f);
+    if (pos % align) fwrite(zeros, 1, align - pos % align, f);
+}
+
+// Write the loaded program as an .ecb image (see ECImageHeader)
+void write_image(const char* filename) {
+    if (!ctx->code) fatal_error("Error: No program loaded\n");
+    compile_all_blocks();
+    
+    // Source lines follow the argument strings in the image's pool; a line
+    // repeating an earlier one (or a pool string) is stored once
+    int cap = 64;
+    while (cap < ctx->line_count * 2) cap *= 2;
+    uint32_t* line_offsets = (uint32_t*)malloc((ctx->line_count + 1) * sizeof(uint32_t));
+    int* unique = (int*)malloc(cap * sizeof(int));
+    if (!line_offsets || !unique) { free(line_offsets); free(unique); fatal_error("Error: Out of memory writing image\n"); }
+    memset(unique, 0xff, cap * sizeof(int));
+    uint32_t pool_size = (uint32_t)ctx->pool_size;
+    for (int i = 0; i < ctx->line_count; i++) {
+        const char* line = ctx->lines[i];
+        size_t len = strlen(line);
+        uint64_t hash = memo_hash(line, len);
+        if (ctx->pool_slots && !ctx->image) {
+            int offset = *pool_slot(line, len, hash);
+            if (offset >= 0 && (size_t)offset < ctx->pool_size) { line_offsets[i] = (uint32_t)offset; continue; }
+        }
+        int k = (int)(hash & (cap - 1));
+        while (unique[k] >= 0 && strcmp(ctx->lines[unique[k]], line) != 0) k = (k + 1) & (cap - 1);
+        if (unique[k] >= 0) { line_offsets[i] = line_offsets[unique[k]]; continue; }
+        unique[k] = i;
+        line_offsets[i] = pool_size;
+        pool_size += (uint32_t)len + 1;
+    }
+    free(unique);
+    
+    FILE* f = fopen(filename, "wb");
+    if (!f) { free(line_offsets); fatal_error("Error: Cannot write file '%s'\n", filename); }
+    
+    ECImageHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ECB_MAGIC, 4);
+    h.version = ECB_VERSION;
+    h.instr_size = sizeof(ECInstr);
+    h.func_size = sizeof(ECFunc);
+    h.class_size = sizeof(ECClass);
+    h.line_count = ctx->line_count;
+    h.func_count = ctx->func_count;
+    h.class_count = ctx->class_count;
+    h.pool_size = pool_size;
+    fwrite(&h, sizeof(h), 1, f);
+    
+    write_padding(f, 8);
+    h.code_offset = ftell(f);
+    fwrite(ctx->code, sizeof(ECInstr), ctx->line_count, f);
+    h.lines_offset = ftell(f);
+    fwrite(line_offsets, sizeof(uint32_t), ctx->line_count, f);
+    write_padding(f, 8);
+    h.funcs_offset = ftell(f);
+    fwrite(ctx->funcs, sizeof(ECFunc), ctx->func_count, f);
+    h.classes_offset = ftell(f);
+    fwrite(ctx->classes, sizeof(ECClass), ctx->class_count, f);
+    write_padding(f, 8);
+    h.operands_offset = ftell(f);
+    h.operand_count = ctx->operand_count;
+    fwrite(ctx->operands, sizeof(ECOperand), ctx->operand_count, f);
+    h.pool_offset = ftell(f);
+    fwrite(ctx->pool, 1, ctx->pool_size, f);
+    uint32_t next = (uint32_t)ctx->pool_size;
+    for (int i = 0; i < ctx->line_count; i++) {
+        if (line_offsets[i] != next) continue;
+        size_t len = strlen(ctx->lines[i]) + 1;
+        fwrite(ctx->lines[i], 1, len, f);
+        next += (uint32_t)len;
+    }
+    
+    rewind(f);
+    fwrite(&h, sizeof(h), 1, f);
+    int failed = ferror(f);
+    if (fclose(f) != 0) failed = 1;
+    free(line_offsets);
+    if (failed) fatal_error("Error: Cannot write file '%s'\n", filename);
+}
+
+int image_section_ok(uint64_t offset, uint64_t count, uint64_t size, size_t file_size) {
+    return offset <= file_size && count * size <= file_size - offset;
+}
+
+// Every name in a fixed table must be terminated inside its slot
+int image_names_ok(const char (*names)[MAX_NAME], int count) {
+    for (int i = 0; i < count; i++) {
+        if (!memchr(names[i], '\0', MAX_NAME)) return 0;
+    }
+    return 1;
+}
+
+// Map an .ecb image and execute it in place: no parsing, syntax check or
+// Phase 1. Everything is bounds-checked once here.
+void load_image(const char* filename) {
+    free_program();
+    
+    size_t size = 0;
+    char* base = NULL;
+    if (!map_file(filename, &base, &size) || !base) fatal_error("Error: Cannot open file '%s'\n", filename);
+    ctx->image = base;
+    ctx->image_size = size;
+    
+    const ECImageHeader* h = (const ECImageHeader*)base;
+    int valid = size >= sizeof(ECImageHeader) &&
+        memcmp(h->magic, ECB_MAGIC, 4) == 0 && h->version == ECB_VERSION &&
+        h->instr_size == sizeof(ECInstr) && h->func_size == sizeof(ECFunc) && h->class_size == sizeof(ECClass) &&
+        h->func_count <= MAX_FUNCS && h->class_count <= MAX_CLASSES && h->line_count < INT32_MAX &&
+        h->code_offset % 8 == 0 && h->funcs_offset % 8 == 0 && h->lines_offset % 4 == 0 && h->classes_offset % 4 == 0 &&
+        image_section_ok(h->code_offset, h->line_count, sizeof(ECInstr), size) &&
+        image_section_ok(h->lines_offset, h->line_count, sizeof(uint32_t), size) &&
+        image_section_ok(h->funcs_offset, h->func_count, sizeof(ECFunc), size) &&
+        image_section_ok(h->classes_offset, h->class_count, sizeof(ECClass), size) &&
+        h->operands_offset % 8 == 0 && h->operand_count < INT32_MAX &&
+        image_section_ok(h->operands_offset, h->operand_count, sizeof(ECOperand), size) &&
+        image_section_ok(h->pool_offset, h->pool_size, 1, size) &&
+        h->pool_size > 0 && base[h->pool_offset + h->pool_size - 1] == '\0';
+    if (!valid) fatal_error("Error: '%s' is not a compatible EC image (recompile it with --compile)\n", filename);
+    
+    int n = (int)h->line_count;
+    ECInstr* code = (ECInstr*)(base + h->code_offset);
+    const uint32_t* line_offsets = (const uint32_t*)(base + h->lines_offset);
+    const ECOperand* operands = (const ECOperand*)(base + h->operands_offset);
+    int operand_count = (int)h->operand_count;
+    for (int i = 0; i < operand_count; i++) {
+        if (operands[i].kind < OPND_NUMBER || operands[i].kind > OPND_CASE ||
+            (operands[i].name < 0 && (operands[i].kind != OPND_CASE || operands[i].name != -1)) ||
+            (operands[i].kind != OPND_TEST && operands[i].name >= 0 && (uint32_t)operands[i].name >= h->pool_size) ||
+            (operands[i].kind == OPND_ELEM && (i + 1 >= operand_count || operands[i + 1].kind >= OPND_ELEM))) {
+            fatal_error("Error: '%s' is corrupt (operand %d)\n", filename, i + 1);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (code[i].op < 0 || code[i].op >= OP_COUNT || code[i].base < 0 || code[i].base >= OP_COUNT ||
+            code[i].args < 0 || (uint32_t)code[i].args >= h->pool_size ||
+            code[i].jump < 0 || code[i].jump >= n || code[i].end < 0 || code[i].end >= n || line_offsets[i] >= h->pool_size ||
+            operand_span(operands, operand_count, &code[i]) < 0 ||
+            (code[i].op == OP_MATCH && code[i].operands >= 0 && !match_targets_ok(operands, &code[i], n))) {
+            fatal_error("Error: '%s' is corrupt (instruction %d)\n", filename, i + 1);
+        }
+    }
+    
+    const ECFunc* funcs = (const ECFunc*)(base + h->funcs_offset);
+    for (uint32_t i = 0; i < h->func_count; i++) {
+        const ECFunc* fn = &funcs[i];
+        if (fn->start_line < 0 || fn->start_line >= n || fn->end_line < fn->start_line || fn->end_line >= n ||
+            fn->param_count < 0 || fn->param_count > 16 || fn->memo_limit < 0 ||
+            !image_names_ok(&fn->name, 1) || !image_names_ok(fn->params, fn->param_count)) {
+            fatal_error("Error: '%s' is corrupt (function %u)\n", filename, i + 1);
+        }
+    }
+    const ECClass* classes = (const ECClass*)(base + h->classes_offset);
+    for (uint32_t i = 0; i < h->class_count; i++) {
+        const ECClass* cls = &classes[i];
+        if (cls->start_line < 0 || cls->start_line >= n || cls->end_line < cls->start_line || cls->end_line >= n ||
+            cls->member_count < 0 || cls->member_count > 32 || cls->method_count < 0 || cls->method_count > 32 ||
+            !image_names_ok(&cls->name, 1) || !image_names_ok(cls->members, cls->member_count) ||
+            !image_names_ok(cls->methods, cls->method_count)) {
+            fatal_error("Error: '%s' is corrupt (class %u)\n", filename, i + 1);
+        }
+    }
+    
+    ctx->lines = (char**)malloc((n > 0 ? n : 1) * sizeof(char*));
+    if (!ctx->lines) fatal_error("Error: Out of memory loading program\n");
+    for (int i = 0; i < n; i++) ctx->lines[i] = base + h->pool_offset + line_offsets[i];
+    ctx->line_count = n;
+    ctx->code = code;
+    ctx->pool = base + h->pool_offset;
+    ctx->pool_size = h->pool_size;
+    ctx->operands = operands;
+    ctx->operand_count = operand_count;
+    intern_operands(0);
+    
+    memcpy(ctx->funcs, funcs, h->func_count * sizeof(ECFunc));
+    memcpy(ctx->classes, classes, h->class_count * sizeof(ECClass));
+    ctx->func_count = h->func_count;
+    ctx->class_count = h->class_count;
+}
+
+// ============ C Emitter ============
+
+// EC --emit-c: the loaded program as one standalone C file. Every line is a
+// labelled block in main() and control flow follows the resolved jump
+// targets; CALL/RET use a stack of CALL lines. Expressions are unrolled into
+// the exact steps evaluate_num takes, so results, output and runtime errors
+// (text, line and stack trace) are those of the interpreter.
+
+#define EMIT_MAX_TEMPS 256
+
+// Printed before the source line table
+static const char* const emit_c_head[] = {
+    "#include <stdio.h>",
+    "#include <stdlib.h>",
+    "#include <string.h>",
+    "#include <stdint.h>",
+    "#include <stdarg.h>",
+    "#include <math.h>",
+    "",
+    "#if defined(__GNUC__)",
+    "#pragma GCC diagnostic ignored \"-Wunused-label\"",
+    "#endif",
+    "",
+    "typedef struct { union { int64_t i; double d; }; int is_int; } ECNum;",
+    "enum { T_UNDEF, T_NULL, T_NUMBER, T_STRING, T_ARRAY };",
+    "typedef struct { int type; ECNum num; char* str; int arr; } ECVar;",
+    "typedef struct { double* data; int size; } ECArray;",
+    "",
+    "static ECArray ec_arrays[256];",
+    "static int ec_array_count;",
+    "static int ec_line;",
+    "static int ec_stack[256];",
+    "static int ec_top;",
+    "static ECNum ec_return_value;",
+    NULL
+};
+
+// Printed after it: the interpreter's number semantics and error report
+static const char* const emit_c_runtime[] = {
+    "static void ec_fail(const char* format, ...) {",
+    "    va_list args;",
+    "    fflush(stdout);",
+    "    fprintf(stderr, \"\\n\\033[1;31m[RUNTIME ERROR]\\033[0m at line %d:\\n>> %s\\nDetails: \", ec_line + 1, ec_source[ec_line]);",
+    "    va_start(args, format);",
+    "    vfprintf(stderr, format, args);",
+    "    va_end(args);",
+    "    fputs(\"\\n\", stderr);",
+    "    if (ec_top > 0) {",
+    "        fputs(\"\\nStack Trace:\\n\", stderr);",
+    "        for (int i = ec_top - 1; i >= 0; i--) fprintf(stderr, \"  at line %d (in Global/Previous)\\n\", ec_stack[i] + 1);",
+    "    }",
+    "    exit(1);",
+    "}",
+    "",
+    "static inline ECNum num_int(int64_t i) { ECNum n; n.i = i; n.is_int = 1; return n; }",
+    "static inline ECNum num_double(double d) { ECNum n; n.d = d; n.is_int = 0; return n; }",
+    "static inline double num_value(ECNum n) { return n.is_int ? (double)n.i : n.d; }",
+    "",
+    "static inline int num_index(ECNum n) {",
+    "    if (n.is_int) return n.i >= INT32_MIN && n.i <= INT32_MAX ? (int)n.i : INT32_MIN;",
+    "    return (int)n.d;",
+    "}",
+    "",
+    "static inline double apply_op(double a, double b, char op) {",
+    "    switch (op) {",
+    "        case '+': return a + b;",
+    "        case '-': return a - b;",
+    "        case '*': return a * b;",
+    "        case '/': if (b == 0) ec_fail(\"Division by zero.\"); return a / b;",
+    "        case '%': if (b == 0) ec_fail(\"Modulo by zero.\"); return fmod(a, b);",
+    "        default: return 0;",
+    "    }",
+    "}",
+    "",
+    "static inline ECNum num_mod(ECNum a, ECNum b) {",
+    "    if (a.is_int && b.is_int && b.i != 0) return num_int(b.i == -1 ? 0 : a.i % b.i);",
+    "    return num_double(fmod(num_value(a), num_value(b)));",
+    "}",
+    "",
+    "static inline ECNum num_apply(ECNum a, ECNum b, char op) {",
+    "    if (a.is_int && b.is_int) {",
+    "        int64_t r;",
+    "        switch (op) {",
+    "            case '+': if (!__builtin_add_overflow(a.i, b.i, &r)) return num_int(r); break;",
+    "            case '-': if (!__builtin_sub_overflow(a.i, b.i, &r)) return num_int(r); break;",
+    "            case '*': if (!__builtin_mul_overflow(a.i, b.i, &r)) return num_int(r); break;",
+    "            case '/':",
+    "                if (b.i == 0) ec_fail(\"Division by zero.\");",
+    "                if (b.i != -1 && a.i % b.i == 0) return num_int(a.i / b.i);",
+    "                if (b.i == -1 && a.i != INT64_MIN) return num_int(-a.i);",
+    "                break;",
+    "            case '%':",
+    "                if (b.i == 0) ec_fail(\"Modulo by zero.\");",
+    "                return num_mod(a, b);",
+    "        }",
+    "    }",
+    "    return num_double(apply_op(num_value(a), num_value(b), op));",
+    "}",
+    "",
+    "static inline int num_compare(ECNum a, ECNum b, int cmp) {",
+    "    if (a.is_int && b.is_int) {",
+    "        switch (cmp) {",
+    "            case 0: return a.i == b.i;",
+    "            case 1: return a.i != b.i;",
+    "            case 2: return a.i >= b.i;",
+    "            case 3: return a.i <= b.i;",
+    "            case 4: return a.i > b.i;",
+    "            default: return a.i < b.i;",
+    "        }",
+    "    }",
+    "    double x = num_value(a), y = num_value(b);",
+    "    switch (cmp) {",
+    "        case 0: return x == y;",
+    "        case 1: return x != y;",
+    "        case 2: return x >= y;",
+    "        case 3: return x <= y;",
+    "        case 4: return x > y;",
+    "        default: return x < y;",
+    "    }",
+    "}",
+    "",
+    "static inline const char* ec_format(ECNum n, char* buf) {",
+    "    if (n.is_int) sprintf(buf, \"%lld\", (long long)n.i);",
+    "    else if (n.d == floor(n.d) && fabs(n.d) < 9.2e18) sprintf(buf, \"%lld\", (long long)n.d);",
+    "    else sprintf(buf, \"%g\", n.d);",
+    "    return buf;",
+    "}",
+    "",
+    "static inline void ec_out_num(ECNum n) {",
+    "    char buf[32];",
+    "    fputs(ec_format(n, buf), stdout);",
+    "}",
+    "",
+    "static inline ECVar* ec_create(ECVar* v) {",
+    "    if (v->type == T_UNDEF) { v->type = T_NULL; v->num = num_int(0); v->arr = -1; }",
+    "    return v;",
+    "}",
+    "",
+    "static inline ECVar* ec_checked(ECVar* v, const char* name) {",
+    "    if (v->type == T_UNDEF) ec_fail(\"Undefined variable '%s'. Please declare it with 'EC' first.\", name);",
+    "    return v;",
+    "}",
+    "",
+    "static inline ECNum ec_load(ECVar* v, const char* name) {",
+    "    ec_checked(v, name);",
+    "    return v->type == T_STRING ? num_double(atof(v->str)) : v->num;",
+    "}",
+    "",
+    "static inline void ec_set_num(ECVar* v, ECNum n) { v->type = T_NUMBER; v->num = n; }",
+    "",
+    "static inline void ec_set_string(ECVar* v, const char* s) {",
+    "    size_t len = strlen(s);",
+    "    v->str = (char*)realloc(v->str, len + 1);",
+    "    if (!v->str) { fputs(\"Out of memory\\n\", stderr); exit(1); }",
+    "    memcpy(v->str, s, len + 1);",
+    "    v->type = T_STRING;",
+    "}",
+    "",
+    "static inline void ec_arr(ECVar* v, int size) {",
+    "    if (ec_array_count >= 256) ec_fail(\"Too many arrays\");",
+    "    ECArray* a = &ec_arrays[ec_array_count];",
+    "    a->data = (double*)calloc(size, sizeof(double));",
+    "    if (!a->data) { fputs(\"Out of memory\\n\", stderr); exit(1); }",
+    "    a->size = size;",
+    "    ec_create(v)->type = T_ARRAY;",
+    "    v->arr = ec_array_count++;",
+    "}",
+    "",
+    "/* v is NULL when no variable has that name */",
+    "static inline double* ec_elem(ECVar* v, const char* name, ECNum index, int store) {",
+    "    int i = num_index(index);",
+    "    if (!v || v->type == T_UNDEF) ec_fail(store ? \"Undefined array '%s'\" : \"Undefined array '%s'.\", name);",
+    "    if (v->arr < 0) ec_fail(store ? \"Variable '%s' is not an array\" : \"Variable '%s' is not an array.\", name);",
+    "    ECArray* a = &ec_arrays[v->arr];",
+    "    if (i < 0 || i >= a->size) {",
+    "        if (store) ec_fail(\"Array assignment index out of bounds: %d\", i);",
+    "        ec_fail(\"Array Index Out of Bounds: Index %d, Size %d.\", i, a->size);",
+    "    }",
+    "    return &a->data[i];",
+    "}",
+    "",
+    "static inline ECNum ec_real(const char* name, double r, double a, double b) {",
+    "    if (!isfinite(r) && isfinite(a) && isfinite(b)) ec_fail(isnan(r) ? \"%s: argument out of domain\" : \"%s: result out of range\", name);",
+    "    return num_double(r);",
+    "}",
+    "",
+    "static inline ECNum ec_integral(ECNum a, double (*f)(double)) {",
+    "    if (a.is_int) return a;",
+    "    double r = f(a.d);",
+    "    return isfinite(r) && fabs(r) < 9.2e18 ? num_int((int64_t)r) : num_double(r);",
+    "}",
+    "",
+    "static inline ECNum ec_abs(ECNum a) {",
+    "    if (a.is_int && a.i != INT64_MIN) return num_int(a.i < 0 ? -a.i : a.i);",
+    "    return num_double(fabs(num_value(a)));",
+    "}",
+    "",
+    "static inline ECNum ec_minmax(ECNum a, ECNum b, int min) {",
+    "    if (a.is_int && b.is_int) return (a.i < b.i) == min ? a : b;",
+    "    return num_double(min ? fmin(num_value(a), num_value(b)) : fmax(num_value(a), num_value(b)));",
+    "}",
+    "",
+    NULL
+};
+
+typedef struct {
+    ECBuffer out;
+    char (*names)[MAX_NAME];    // Every variable name the program can create
+    int name_count;
+    int temps;                  // Size needed for t[]
+} CEmitter;
+
+void emit_lines(ECBuffer* out, const char* const* lines) {
+    for (; *lines; lines++) buffer_printf(out, "%s\n", *lines);
+}
+
+// `text` as a C string literal
+void emit_string(ECBuffer* out, const char* text, size_t len) {
+    buffer_append(out, "\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') buffer_printf(out, "\\%c", c);
+        else if (c < 32 || c >= 127 || c == '?') buffer_printf(out, "\\%03o", c);
+        else buffer_append(out, (const char*)&c, 1);
+    }
+    buffer_append(out, "\"", 1);
+}
+
+void emit_cstr(ECBuffer* out, const char* text) { emit_string(out, text, strlen(text)); }
+
+void emit_name(CEmitter* e, const char* name) {
+    char buf[MAX_NAME];
+    strncpy(buf, name, MAX_NAME - 1);
+    buf[MAX_NAME - 1] = '\0';
+    trim(buf);
+    if (!buf[0]) return;
+    for (int i = 0; i < e->name_count; i++) if (strcmp(e->names[i], buf) == 0) return;
+    if ((e->name_count & (e->name_count - 1)) == 0) {
+        e->names = realloc(e->names, (e->name_count ? e->name_count * 2 : 1) * sizeof(*e->names));
+        if (!e->names) fatal_error("Error: Out of memory emitting C\n");
+    }
+    strcpy(e->names[e->name_count++], buf);
+}
+
+int emit_find_name(CEmitter* e, const char* name) {
+    for (int i = 0; i < e->name_count; i++) if (strcmp(e->names[i], name) == 0) return i;
+    return -1;
+}
+
+// The variable `name` as an ECVar* expression (NULL if it can never exist)
+void emit_var_ref(CEmitter* e, const char* name) {
+    int k = emit_find_name(e, name);
+    if (k < 0) buffer_printf(&e->out, "NULL");
+    else buffer_printf(&e->out, "&ec_vars[%d]", k);
+}
+
+// ec_fail with a message fixed at translation time
+void emit_fail(CEmitter* e, const char* format, const char* arg) {
+    char message[MAX_LINE * 2];
+    snprintf(message, sizeof(message), format, arg);
+    buffer_printf(&e->out, "    ec_fail(\"%%s\", ");
+    emit_cstr(&e->out, message);
+    buffer_printf(&e->out, ");\n");
+}
+
+void emit_temp(CEmitter* e, int slot) {
+    if (slot >= EMIT_MAX_TEMPS) fatal_error("Error: --emit-c: expression too deep (line %d)\n", ctx->current_line + 1);
+    if (slot + 1 > e->temps) e->temps = slot + 1;
+}
+
+int emit_num(CEmitter* e, const char* expr, int slot);
+
+// math_call(tok, paren) into t[slot]; RAND is left to the interpreter
+int emit_math(CEmitter* e, const char* tok, const char* paren, int slot) {
+    char inner[MAX_LINE], error[MAX_LINE];
+    char* starts[2];
+    int argc;
+    const MathFunc* f = math_parse(tok, paren, inner, starts, &argc, error);
+    if (!f) {
+        emit_fail(e, "%s", error);
+        return 0;
+    }
+    if (f->kind == MATH_RAND) return -1;
+    for (int i = 0; i < argc; i++) {
+        if (emit_num(e, starts[i], slot + i) < 0) return -1;
+    }
+    switch (f->kind) {
+        case MATH_INTEGRAL:
+            buffer_printf(&e->out, "    t[%d] = ec_integral(t[%d], %s);\n", slot, slot, f->c_name);
+            break;
+        case MATH_ABS:
+            buffer_printf(&e->out, "    t[%d] = ec_abs(t[%d]);\n", slot, slot);
+            break;
+        case MATH_MIN:
+        case MATH_MAX:
+            buffer_printf(&e->out, "    t[%d] = ec_minmax(t[%d], t[%d], %d);\n", slot, slot, slot + 1, f->kind == MATH_MIN);
+            break;
+        default:
+            if (argc == 1) {
+                buffer_printf(&e->out, "    t[%d] = ec_real(\"%s\", %s(num_value(t[%d])), num_value(t[%d]), 0);\n",
+                              slot, f->name, f->c_name, slot, slot);
+            } else {
+                buffer_printf(&e->out, "    t[%d] = ec_real(\"%s\", %s(num_value(t[%d]), num_value(t[%d])), num_value(t[%d]), num_value(t[%d]));\n",
+                              slot, f->name, f->c_name, slot, slot + 1, slot, slot + 1);
             }
-        } else {
-            v->type = TYPE_NUMBER;
-            v->num_val = evaluate_expr(rest);
-        }
+            break;
     }
+    return 0;
 }
 
-void cmd_set(const char* args) {
-    char name[MAX_NAME], rest[MAX_LINE];
-    if (sscanf(args, "%127s %[^\n]", name, rest) < 2) {
-        runtime_error("SET requires variable and value");
+// parse_num(token) into t[slot]
+int emit_token(CEmitter* e, const char* token, int slot) {
+    char tok[MAX_LINE];
+    strncpy(tok, token, MAX_LINE - 1);
+    tok[MAX_LINE - 1] = '\0';
+    trim(tok);
+    emit_temp(e, slot);
+    
+    if (is_number(tok)) {
+        ECNum n = parse_number(tok);
+        if (n.is_int && n.i == INT64_MIN) buffer_printf(&e->out, "    t[%d] = num_int(INT64_MIN);\n", slot);
+        else if (n.is_int) buffer_printf(&e->out, "    t[%d] = num_int(INT64_C(%lld));\n", slot, (long long)n.i);
+        else if (isnan(n.d)) buffer_printf(&e->out, "    t[%d] = num_double(%sNAN);\n", slot, signbit(n.d) ? "-" : "");
+        else if (isinf(n.d)) buffer_printf(&e->out, "    t[%d] = num_double(%sHUGE_VAL);\n", slot, n.d < 0 ? "-" : "");
+        else buffer_printf(&e->out, "    t[%d] = num_double(%a);\n", slot, n.d);
+        return 0;
     }
     
-    char* bracket = strchr(name, '[');
+    char* paren = strchr(tok, '(');
+    if (paren && paren > tok && tok[strlen(tok) - 1] == ')') return emit_math(e, tok, paren, slot);
+    
+    char* bracket = strchr(tok, '[');
     if (bracket) {
-        char arr_name[MAX_NAME];
-        int name_len = bracket - name;
-        strncpy(arr_name, name, name_len);
-        arr_name[name_len] = '\0';
-        
+        char arr_name[MAX_NAME], idx_str[MAX_NAME];
+        int name_len = bracket - tok;
         char* end_bracket = strchr(bracket, ']');
-        if (end_bracket) {
-            char idx_str[MAX_NAME];
-            int idx_len = end_bracket - bracket - 1;
-            strncpy(idx_str, bracket + 1, idx_len);
-            idx_str[idx_len] = '\0';
-            
-            int arr_idx = (int)evaluate_expr(idx_str);
-            int var_idx = find_var(arr_name);
-            
-            if (var_idx < 0) runtime_error("Undefined array '%s'", arr_name);
-            if (vars[var_idx].arr_id < 0) runtime_error("Variable '%s' is not an array", arr_name);
-            
-            ECArray* arr = &arrays[vars[var_idx].arr_id];
-            if (arr_idx < 0 || arr_idx >= arr->size) {
-                 runtime_error("Array assignment index out of bounds: %d", arr_idx);
-            }
-            arr->num_data[arr_idx] = evaluate_expr(rest);
+        if (!end_bracket) {
+            emit_fail(e, "Missing closing bracket ']' in array access.", "");
+            return 0;
         }
-        return;
+        int idx_len = end_bracket - bracket - 1;
+        if (name_len >= MAX_NAME || idx_len >= MAX_NAME || end_bracket[1]) return -1;
+        memcpy(arr_name, tok, name_len);
+        arr_name[name_len] = '\0';
+        memcpy(idx_str, bracket + 1, idx_len);
+        idx_str[idx_len] = '\0';
+        if (emit_num(e, idx_str, slot) < 0) return -1;
+        buffer_printf(&e->out, "    t[%d] = num_double(*ec_elem(", slot);
+        emit_var_ref(e, arr_name);
+        buffer_printf(&e->out, ", ");
+        emit_cstr(&e->out, arr_name);
+        buffer_printf(&e->out, ", t[%d], 0));\n", slot);
+        return 0;
     }
     
-    ECVar* v = get_var_checked(name); // Must exist
-    trim(rest);
-    if (rest[0] == '"') {
-        v->type = TYPE_STRING;
-        char* end = strrchr(rest, '"');
-        if (end && end != rest) {
-            int len = end - rest - 1;
-            strncpy(v->str_val, rest + 1, len);
-            v->str_val[len] = '\0';
-        }
-    } else {
-        v->type = TYPE_NUMBER;
-        v->num_val = evaluate_expr(rest);
+    int k = emit_find_name(e, tok);
+    if (k < 0) {
+        emit_fail(e, "Undefined variable '%s'. Please declare it with 'EC' first.", tok);
+        return 0;
     }
+    buffer_printf(&e->out, "    t[%d] = ec_load(&ec_vars[%d], ", slot, k);
+    emit_cstr(&e->out, tok);
+    buffer_printf(&e->out, ");\n");
+    return 0;
 }
 
-void cmd_arr(const char* args) {
-    char name[MAX_NAME]; int size;
-    if (sscanf(args, "%127s %d", name, &size) < 2) {
-        runtime_error("ARR requires name and size");
+int emit_value(CEmitter* e, char* token, int slot) {
+    trim(token);
+    if (token[0] == '(') {
+        token[strlen(token) - 1] = '\0';
+        return emit_num(e, token + 1, slot);
     }
-    if (size <= 0) runtime_error("Array size must be positive");
-    if (array_count >= MAX_ARRAYS) runtime_error("Too many arrays");
-    
-    ECArray* arr = &arrays[array_count];
-    arr->num_data = (double*)calloc(size, sizeof(double));
-    arr->str_data = NULL;
-    arr->size = size;
-    arr->capacity = size;
-    arr->elem_type = TYPE_NUMBER;
-    
-    ECVar* v = get_or_create_var(name);
-    v->type = TYPE_ARRAY;
-    v->arr_id = array_count++;
+    return emit_token(e, token, slot);
 }
 
-void cmd_out(const char* args) {
+void emit_apply(CEmitter* e, int a, char op) {
+    buffer_printf(&e->out, "    t[%d] = num_apply(t[%d], t[%d], '%c');\n", a, a, a + 1, op);
+}
+
+// evaluate_num(expr) into t[slot], step for step; -1 if the interpreter's
+// own evaluation would be undefined
+int emit_num(CEmitter* e, const char* expr, int slot) {
     char buf[MAX_LINE];
-    strncpy(buf, args, MAX_LINE - 1);
+    strncpy(buf, expr, MAX_LINE - 1);
+    buf[MAX_LINE - 1] = '\0';
     trim(buf);
+    emit_temp(e, slot);
     
-    char output[MAX_LINE * 4] = "";
-    char* token = buf;
-    char* plus;
-    
-    while ((plus = strstr(token, " + ")) != NULL) {
-        char part[MAX_LINE];
-        int len = plus - token;
-        strncpy(part, token, len);
-        part[len] = '\0';
-        trim(part);
-        
-        char val[MAX_LINE];
-        get_string_value(part, val);
-        strcat(output, val);
-        
-        token = plus + 3;
+    if (strlen(buf) == 0) {
+        buffer_printf(&e->out, "    t[%d] = num_int(0);\n", slot);
+        return 0;
     }
     
-    char val[MAX_LINE];
-    get_string_value(token, val);
-    strcat(output, val);
+    char ops[64];
+    int val_top = 0, op_top = 0;
+    char token[MAX_LINE];
+    int token_pos = 0;
+    int paren_depth = 0;
     
-    printf("%s\n", output);
-}
-
-void cmd_in(const char* args) {
-    char name[MAX_NAME], prompt[MAX_LINE] = "";
-    if (sscanf(args, "%127s %[^\n]", name, prompt) < 1) {
-        runtime_error("IN requires variable name");
+    for (int i = 0; buf[i]; i++) {
+        char c = buf[i];
+        
+        if (c == '(') { paren_depth++; token[token_pos++] = c; }
+        else if (c == ')') { paren_depth--; token[token_pos++] = c; }
+        else if (paren_depth == 0 && strchr("+-*/%", c)) {
+            if (c == '-' && token_pos == 0 && val_top == 0) {
+                token[token_pos++] = c;
+                continue;
+            }
+            token[token_pos] = '\0';
+            trim(token);
+            if (token_pos > 0) {
+                if (val_top == 64 || emit_value(e, token, slot + val_top) < 0) return -1;
+                val_top++;
+            }
+            token_pos = 0;
+            
+            while (op_top > 0 && get_precedence(ops[op_top - 1]) >= get_precedence(c)) {
+                if (val_top < 2) return -1;
+                val_top--;
+                emit_apply(e, slot + val_top - 1, ops[--op_top]);
+            }
+            if (op_top == 64) return -1;
+            ops[op_top++] = c;
+        } else {
+            token[token_pos++] = c;
+        }
     }
     
-    if (strlen(prompt) > 0) {
-        trim(prompt);
-        if (prompt[0] == '"') {
-            prompt[strlen(prompt) - 1] = '\0';
-            printf("%s", prompt + 1);
-        }
+    token[token_pos] = '\0';
+    trim(token);
+    if (token_pos > 0) {
+        if (val_top == 64 || emit_value(e, token, slot + val_top) < 0) return -1;
+        val_top++;
     }
     
-    char input[MAX_LINE];
-    if (fgets(input, MAX_LINE, stdin)) {
-        input[strcspn(input, "\n")] = '\0';
-        ECVar* v = get_or_create_var(name);
-        if (is_number(input)) { v->type = TYPE_NUMBER; v->num_val = atof(input); }
-        else { v->type = TYPE_STRING; strcpy(v->str_val, input); }
+    while (op_top > 0) {
+        if (val_top < 2) {
+            emit_fail(e, "Invalid expression syntax: '%s'", expr);
+            return 0;
+        }
+        val_top--;
+        emit_apply(e, slot + val_top - 1, ops[--op_top]);
     }
+    if (val_top != 1) buffer_printf(&e->out, "    t[%d] = num_int(0);\n", slot);
+    return 0;
 }
 
-void cmd_if(const char* args) { if (!evaluate_condition(args)) skip_to_else_or_elif_or_endif(); }
-void cmd_elif(const char* args) { skip_to_endif(); }
-void cmd_else(const char* args) { skip_to_endif(); }
+// get_string_value(side) into ec_text[slot]
+int emit_text(CEmitter* e, const char* side, int slot) {
+    size_t len = strlen(side);
+    if (side[0] == '"') {
+        if (len < 2 || side[len - 1] != '"') return -1;
+        buffer_printf(&e->out, "    ec_text[%d] = ", slot);
+        emit_string(&e->out, side + 1, len - 2);
+        buffer_printf(&e->out, ";\n");
+        return 0;
+    }
+    int k = emit_find_name(e, side);
+    if (k >= 0) buffer_printf(&e->out, "    if (ec_vars[%d].type == T_STRING) ec_text[%d] = ec_vars[%d].str;\n    else {\n", k, slot, k);
+    if (emit_num(e, side, slot) < 0) return -1;
+    buffer_printf(&e->out, "    ec_text[%d] = ec_format(t[%d], ec_digits[%d]);\n", slot, slot, slot);
+    if (k >= 0) buffer_printf(&e->out, "    }\n");
+    return 0;
+}
 
-void cmd_loop(const char* args) {
-    loop_start[loop_depth] = current_line;
+// evaluate_comparison(cond) into ec_cond
+int emit_comparison(CEmitter* e, const char* cond) {
+    char buf[MAX_LINE];
+    strncpy(buf, cond, MAX_LINE - 1);
+    buf[MAX_LINE - 1] = '\0';
+    trim(buf);
     
-    int depth = 1, end = current_line + 1;
-    while (end < line_count && depth > 0) {
-        char temp[MAX_LINE]; strcpy(temp, lines[end]); trim(temp);
-        char cmd[MAX_NAME];
-        if (sscanf(temp, "%127s", cmd) == 1) {
-            if (strcasecmp(cmd, "LOOP") == 0) depth++;
-            else if (strcasecmp(cmd, "ENDLOOP") == 0) depth--;
-        }
-        end++;
+    int cmp;
+    char* pos = find_compare(buf, &cmp);
+    if (!pos) {
+        if (emit_num(e, buf, 0) < 0) return -1;
+        buffer_printf(&e->out, "    ec_cond = num_value(t[0]) != 0;\n");
+        return 0;
     }
-    if (depth > 0) runtime_error("Missing ENDLOOP for LOOP at line %d", current_line+1);
-    loop_end[loop_depth] = end - 1;
-    
-    if (strlen(args) > 0 && !evaluate_condition(args)) {
-        current_line = loop_end[loop_depth];
-        return;
+    char* right = pos + strlen(compare_names[cmp]);
+    *pos = '\0';
+    trim(buf);
+    trim(right);
+    if (buf[0] == '"' || right[0] == '"') {
+        if (emit_text(e, buf, 0) < 0 || emit_text(e, right, 1) < 0) return -1;
+        buffer_printf(&e->out, "    ec_cond = num_compare(num_int(strcmp(ec_text[0], ec_text[1])), num_int(0), %d);\n", cmp);
+        return 0;
     }
-    loop_depth++;
+    int a = emit_find_name(e, buf), b = emit_find_name(e, right);
+    if (a >= 0 && b >= 0) {
+        buffer_printf(&e->out, "    if (ec_vars[%d].type == T_STRING && ec_vars[%d].type == T_STRING) {\n", a, b);
+        buffer_printf(&e->out, "    ec_cond = num_compare(num_int(strcmp(ec_vars[%d].str, ec_vars[%d].str)), num_int(0), %d);\n    } else {\n", a, b, cmp);
+    }
+    if (emit_num(e, buf, 0) < 0 || emit_num(e, right, 1) < 0) return -1;
+    buffer_printf(&e->out, "    ec_cond = num_compare(t[0], t[1], %d);\n", cmp);
+    if (a >= 0 && b >= 0) buffer_printf(&e->out, "    }\n");
+    return 0;
 }
 
-void cmd_endloop(const char* args) {
-    if (loop_depth > 0) { loop_depth--; current_line = loop_start[loop_depth] - 1; }
+// evaluate_condition(cond) into ec_cond; the comparisons of a compound
+// condition are chained with gotos as in decode_program
+int emit_condition(CEmitter* e, const char* cond, int line) {
+    CondTree t;
+    int root = cond_parse(cond, &t);
+    if (t.nodes[root].kind == COND_LEAF) return emit_comparison(e, cond);
+    
+    int leaf_true[MAX_COND], leaf_false[MAX_COND];
+    cond_targets(&t, root, COND_TRUE, COND_FALSE, leaf_true, leaf_false);
+    for (int n = 0; n < t.count; n++) {
+        if (t.nodes[n].kind != COND_LEAF) continue;
+        char leaf[MAX_LINE];
+        cond_leaf_text(&t, n, leaf);
+        buffer_printf(&e->out, "Q%d_%d:;\n", line, n);
+        if (emit_comparison(e, leaf) < 0) return -1;
+        int targets[2] = {leaf_true[n], leaf_false[n]};
+        for (int k = 0; k < 2; k++) {
+            buffer_printf(&e->out, k ? "    goto " : "    if (ec_cond) goto ");
+            if (targets[k] >= 0) buffer_printf(&e->out, "Q%d_%d;\n", line, targets[k]);
+            else buffer_printf(&e->out, "Q%d_%c;\n", line, targets[k] == COND_TRUE ? 't' : 'f');
+        }
+    }
+    buffer_printf(&e->out, "Q%d_t:;\n    ec_cond = 1;\n    goto Q%d_e;\nQ%d_f:;\n    ec_cond = 0;\nQ%d_e:;\n", line, line, line, line);
+    return 0;
 }
 
-void cmd_break(const char* args) {
-    if (loop_depth > 0) { loop_depth--; current_line = loop_end[loop_depth]; }
+// The false edge of an IF/ELIF (see cmd_if)
+void emit_branch(CEmitter* e, const ECInstr* in) {
+    int next = in->jump;
+    if (ctx->code[next].op == OP_ELIF) buffer_printf(&e->out, "    if (!ec_cond) goto C%d;\n", next);
+    else buffer_printf(&e->out, "    if (!ec_cond) goto L%d;\n", next + 1);
 }
 
-void cmd_continue(const char* args) {
-    if (loop_depth > 0) current_line = loop_start[loop_depth - 1] - 1;
+// A quoted literal assigned by EC/SET: the text between the first and last quote
+void emit_assign(CEmitter* e, int k, char* rest, int set) {
+    trim(rest);
+    if (rest[0] == '"') {
+        char* end = strrchr(rest, '"');
+        buffer_printf(&e->out, "    ec_vars[%d].type = T_STRING;\n", k);
+        if (end && end != rest) {
+            buffer_printf(&e->out, "    ec_set_string(&ec_vars[%d], ", k);
+            emit_string(&e->out, rest + 1, end - rest - 1);
+            buffer_printf(&e->out, ");\n");
+        }
+        return;
+    }
+    if (!set && rest[0] == '\0') return;
+    buffer_printf(&e->out, "    ec_vars[%d].type = T_NUMBER;\n", k);
+    if (emit_num(e, rest, 0) < 0) fatal_error("Error: --emit-c cannot translate line %d\n", ctx->current_line + 1);
+    buffer_printf(&e->out, "    ec_set_num(&ec_vars[%d], t[0]);\n", k);
 }
 
-void cmd_fn(const char* args) {
-    char name[MAX_NAME], params[MAX_LINE] = "";
-    char* paren = strchr(args, '(');
-    if (paren) {
-        int name_len = paren - args;
-        strncpy(name, args, name_len);
-        name[name_len] = '\0'; trim(name);
-        char* end_paren = strchr(paren, ')');
-        if (end_paren) {
-            int param_len = end_paren - paren - 1;
-            strncpy(params, paren + 1, param_len);
-            params[param_len] = '\0';
-        }
-    } else sscanf(args, "%127s", name);
-    
-    ECFunc* fn = &funcs[func_count];
-    strncpy(fn->name, name, MAX_NAME - 1);
-    fn->start_line = current_line;
-    fn->param_count = 0;
-    
-    if (strlen(params) > 0) {
-        char* tok = strtok(params, ",");
-        while (tok && fn->param_count < 16) {
-            trim(tok);
-            strncpy(fn->params[fn->param_count++], tok, MAX_NAME - 1);
-            tok = strtok(NULL, ",");
-        }
+// get_string_value(part) written to stdout
+void emit_out_part(CEmitter* e, const char* part) {
+    char buf[MAX_LINE];
+    strncpy(buf, part, MAX_LINE - 1);
+    buf[MAX_LINE - 1] = '\0';
+    trim(buf);
+    size_t len = strlen(buf);
+    if (len >= 2 && buf[0] == '"' && buf[len - 1] == '"') {
+        buffer_printf(&e->out, "    fputs(");
+        emit_string(&e->out, buf + 1, len - 2);
+        buffer_printf(&e->out, ", stdout);\n");
+        return;
     }
+    if (buf[0] == '"' && len < 2) fatal_error("Error: --emit-c cannot translate line %d\n", ctx->current_line + 1);
     
-    int depth = 1, end = current_line + 1;
-    while (end < line_count && depth > 0) {
-        char temp[MAX_LINE]; strcpy(temp, lines[end]); trim(temp);
-        char cmd[MAX_NAME];
-        if (sscanf(temp, "%127s", cmd) == 1) {
-            if (strcasecmp(cmd, "FN") == 0) depth++;
-            else if (strcasecmp(cmd, "ENDFN") == 0) depth--;
-        }
-        end++;
+    int k = emit_find_name(e, buf);
+    if (k >= 0) buffer_printf(&e->out, "    if (ec_vars[%d].type == T_STRING) fputs(ec_vars[%d].str, stdout);\n    else {\n", k, k);
+    if (emit_num(e, buf, 0) < 0) fatal_error("Error: --emit-c cannot translate line %d\n", ctx->current_line + 1);
+    buffer_printf(&e->out, "    ec_out_num(t[0]);\n");
+    if (k >= 0) buffer_printf(&e->out, "    }\n");
+}
+
+// Split a FN/CALL argument like cmd_call: name(params) or name params
+void emit_split_call(const char* args, char* name, char* params) {
+    params[0] = '\0';
+    const char* paren = strchr(args, '(');
+    if (!paren) { sscanf(args, "%127s %[^\n]", name, params); return; }
+    int name_len = paren - args;
+    if (name_len >= MAX_NAME) name_len = MAX_NAME - 1;
+    memcpy(name, args, name_len);
+    name[name_len] = '\0';
+    trim(name);
+    const char* end_paren = strchr(paren, ')');
+    if (end_paren) {
+        memcpy(params, paren + 1, end_paren - paren - 1);
+        params[end_paren - paren - 1] = '\0';
     }
-    if (depth > 0) runtime_error("Missing ENDFN for FN %s", name);
-    fn->end_line = end - 1;
-    func_count++;
-    current_line = fn->end_line;
 }
 
-void cmd_call(const char* args) {
-    char name[MAX_NAME], params[MAX_LINE] = "";
-    char* paren = strchr(args, '(');
-    if (paren) {
-        int name_len = paren - args;
-        strncpy(name, args, name_len);
-        name[name_len] = '\0'; trim(name);
-        char* end_paren = strchr(paren, ')');
-        if (end_paren) {
-            int param_len = end_paren - paren - 1;
-            strncpy(params, paren + 1, param_len);
-            params[param_len] = '\0';
-        }
-    } else sscanf(args, "%127s %[^\n]", name, params);
-    
+void emit_call(CEmitter* e, const char* args, int line) {
+    char name[MAX_LINE], params[MAX_LINE];
+    emit_split_call(args, name, params);
     int fn_idx = find_func(name);
-    if (fn_idx < 0) {
-        runtime_error("Function '%s' not found", name);
-    }
+    if (fn_idx < 0) { emit_fail(e, "Function '%s' not found", name); return; }
+    ECFunc* fn = &ctx->funcs[fn_idx];
     
-    ECFunc* fn = &funcs[fn_idx];
+    buffer_printf(&e->out, "    if (ec_top >= %d) ec_fail(\"Stack Overflow: Call depth exceeded (Limit: %%d).\", %d);\n", MAX_STACK, MAX_STACK);
     if (strlen(params) > 0 && fn->param_count > 0) {
-        char params_copy[MAX_LINE]; strcpy(params_copy, params);
-        char* tok = strtok(params_copy, ",");
-        int i = 0;
-        while (tok && i < fn->param_count) {
+        char* save;
+        char* tok = strtok_r(params, ",", &save);
+        for (int i = 0; tok && i < fn->param_count; i++) {
             trim(tok);
-            ECVar* v = get_or_create_var(fn->params[i]);
+            int k = emit_find_name(e, fn->params[i]);
+            buffer_printf(&e->out, "    ec_create(&ec_vars[%d]);\n", k);
             if (tok[0] == '"') {
-                v->type = TYPE_STRING;
                 tok[strlen(tok) - 1] = '\0';
-                strcpy(v->str_val, tok + 1);
+                buffer_printf(&e->out, "    ec_set_string(&ec_vars[%d], ", k);
+                emit_cstr(&e->out, tok + 1);
+                buffer_printf(&e->out, ");\n");
             } else {
-                v->type = TYPE_NUMBER;
-                v->num_val = evaluate_expr(tok);
+                emit_assign(e, k, tok, 1);
             }
-            tok = strtok(NULL, ",");
-            i++;
+            tok = strtok_r(NULL, ",", &save);
+        }
+    }
+    buffer_printf(&e->out, "    ec_return_value = num_int(0);\n    ec_stack[ec_top++] = %d;\n    goto L%d;\n", line, fn->start_line + 1);
+}
+
+void emit_unsupported(const ECInstr* in, int line) {
+    fatal_error("Error: --emit-c does not support %s (line %d)\n", op_names[in->base], line + 1);
+}
+
+void emit_line(CEmitter* e, int line, int* loops, int* loop_top, int fn_loops) {
+    const ECInstr* in = &ctx->code[line];
+    char args[MAX_LINE], name[MAX_NAME], rest[MAX_LINE] = "";
+    strcpy(args, instr_args(in));
+    ctx->current_line = line;
+    int loop = *loop_top > fn_loops ? loops[*loop_top - 1] : -1;
+    int k, size;
+    
+    buffer_printf(&e->out, "L%d:;\n", line);
+    switch (in->base) {
+        case OP_NOP: case OP_ENDIF: case OP_ENDMATCH: return;
+        case OP_JUMP: buffer_printf(&e->out, "    goto L%d;\n", in->jump + 1); return;
+        case OP_ELSE: case OP_CASE: case OP_DEFAULT: buffer_printf(&e->out, "    goto L%d;\n", in->end + 1); return;
+        case OP_END: buffer_printf(&e->out, "    goto ec_end;\n"); return;
+        case OP_ENDFN: buffer_printf(&e->out, "    if (ec_top > 0) goto ec_return;\n"); return;
+        default: break;
+    }
+    
+    if (in->base == OP_ELIF) {
+        buffer_printf(&e->out, "    goto L%d;\nC%d:;\n", in->end + 1, line);
+    }
+    buffer_printf(&e->out, "    ec_line = %d;\n", line);
+    
+    switch (in->base) {
+        case OP_IF: case OP_ELIF:
+            if (emit_condition(e, args, line) < 0) emit_unsupported(in, line);
+            emit_branch(e, in);
+            break;
+        case OP_MATCH: {
+            // The CASE values in order, as match_scan compares them
+            if (emit_num(e, args, 0) < 0) emit_unsupported(in, line);
+            int b = in->jump;
+            for (; ctx->code[b].op == OP_CASE; b = ctx->code[b].jump) {
+                char value[MAX_LINE];
+                const char* p = instr_args(&ctx->code[b]);
+                while (next_case_value(&p, value)) {
+                    if (value[0] == '"') emit_unsupported(in, line);
+                    emit_token(e, value, 1);
+                    buffer_printf(&e->out, "    if (num_compare(t[0], t[1], 0)) goto L%d;\n", b + 1);
+                }
+            }
+            buffer_printf(&e->out, "    goto L%d;\n", b + 1);
+            break;
+        }
+        case OP_LOOP:
+            loops[(*loop_top)++] = line;
+            if (args[0] && emit_condition(e, args, line) < 0) emit_unsupported(in, line);
+            if (args[0]) buffer_printf(&e->out, "    if (!ec_cond) goto L%d;\n", in->jump + 1);
+            break;
+        case OP_ENDLOOP:
+            if (loop < 0) emit_unsupported(in, line);
+            (*loop_top)--;
+            buffer_printf(&e->out, "    goto L%d;\n", loop);
+            break;
+        case OP_BREAK: case OP_CONTINUE:
+            // Outside any loop the interpreter ignores them at top level; in a
+            // FN body they would leave the caller's loop
+            if (loop < 0 && fn_loops >= 0) emit_unsupported(in, line);
+            if (loop < 0) break;
+            if (in->base == OP_BREAK) buffer_printf(&e->out, "    goto L%d;\n", ctx->code[loop].jump + 1);
+            else buffer_printf(&e->out, "    goto L%d;\n", loop);
+            break;
+        case OP_FN: {
+            int memo, limit;
+            fn_attributes(args, &memo, &limit);
+            if (memo) emit_unsupported(in, line);
+            buffer_printf(&e->out, "    goto L%d;\n", in->jump + 1);
+            break;
+        }
+        case OP_CALL:
+            emit_call(e, args, line);
+            if (call_result_name(args, name)) {
+                k = emit_find_name(e, name);
+                buffer_printf(&e->out, "R%d:\n    ec_create(&ec_vars[%d]);\n    ec_set_num(&ec_vars[%d], ec_return_value);\n", line, k, k);
+            }
+            break;
+        case OP_RET:
+            if (strlen(args) > 0) {
+                if (emit_num(e, args, 0) < 0) emit_unsupported(in, line);
+                buffer_printf(&e->out, "    ec_return_value = t[0];\n");
+            }
+            buffer_printf(&e->out, "    if (ec_top > 0) goto ec_return;\n");
+            break;
+        case OP_EC:
+            if (sscanf(args, "%127s %[^\n]", name, rest) < 1) { emit_fail(e, "EC requires variable name", ""); break; }
+            k = emit_find_name(e, name);
+            buffer_printf(&e->out, "    ec_create(&ec_vars[%d]);\n", k);
+            emit_assign(e, k, rest, 0);
+            break;
+        case OP_ARR:
+            if (sscanf(args, "%127s %d", name, &size) < 2) { emit_fail(e, "ARR requires name and size", ""); break; }
+            if (size <= 0) { emit_fail(e, "Array size must be positive", ""); break; }
+            buffer_printf(&e->out, "    ec_arr(&ec_vars[%d], %d);\n", emit_find_name(e, name), size);
+            break;
+        case OP_SET: {
+            if (sscanf(args, "%127s %[^\n]", name, rest) < 2) { emit_fail(e, "SET requires variable and value", ""); break; }
+            char* bracket = strchr(name, '[');
+            if (!bracket) {
+                if ((k = emit_find_name(e, name)) < 0) {
+                    emit_fail(e, "Undefined variable '%s'. Please declare it with 'EC' first.", name);
+                    break;
+                }
+                buffer_printf(&e->out, "    ec_checked(&ec_vars[%d], ", k);
+                emit_cstr(&e->out, name);
+                buffer_printf(&e->out, ");\n");
+                emit_assign(e, k, rest, 1);
+                break;
+            }
+            char* end_bracket = strchr(bracket, ']');
+            if (!end_bracket) break;
+            if (end_bracket[1]) emit_unsupported(in, line);
+            *bracket = *end_bracket = '\0';
+            if (emit_num(e, bracket + 1, 0) < 0) emit_unsupported(in, line);
+            buffer_printf(&e->out, "    ec_slot = ec_elem(");
+            emit_var_ref(e, name);
+            buffer_printf(&e->out, ", ");
+            emit_cstr(&e->out, name);
+            buffer_printf(&e->out, ", t[0], 1);\n");
+            if (emit_num(e, rest, 0) < 0) emit_unsupported(in, line);
+            buffer_printf(&e->out, "    *ec_slot = num_value(t[0]);\n");
+            break;
+        }
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: {
+            const char* cmd = op_names[in->base];
+            if (sscanf(args, "%127s %[^\n]", name, rest) < 2) {
+                char message[MAX_LINE];
+                snprintf(message, sizeof(message), "%s requires variable and value", cmd);
+                emit_fail(e, "%s", message);
+                break;
+            }
+            k = emit_find_name(e, name);
+            if (in->base == OP_DIV) {
+                if (emit_num(e, rest, 1) < 0) emit_unsupported(in, line);
+                buffer_printf(&e->out, "    if (num_value(t[1]) == 0) ec_fail(\"Division by zero\");\n");
+            }
+            if (k < 0) {
+                emit_fail(e, "Undefined variable '%s'. Please declare it with 'EC' first.", name);
+                break;
+            }
+            buffer_printf(&e->out, "    ec_checked(&ec_vars[%d], ", k);
+            emit_cstr(&e->out, name);
+            buffer_printf(&e->out, ");\n");
+            if (in->base != OP_DIV && emit_num(e, rest, 1) < 0) emit_unsupported(in, line);
+            if (in->base == OP_MOD) buffer_printf(&e->out, "    ec_set_num(&ec_vars[%d], num_mod(ec_vars[%d].num, t[1]));\n", k, k);
+            else buffer_printf(&e->out, "    ec_set_num(&ec_vars[%d], num_apply(ec_vars[%d].num, t[1], '%c'));\n", k, k, "+-*/"[in->base - OP_ADD]);
+            break;
+        }
+        case OP_OUT: {
+            char buf[MAX_LINE];
+            strncpy(buf, args, MAX_LINE - 1);
+            buf[MAX_LINE - 1] = '\0';
+            trim(buf);
+            char* token = buf;
+            char* plus;
+            while ((plus = strstr(token, " + ")) != NULL) {
+                *plus = '\0';
+                emit_out_part(e, token);
+                token = plus + 3;
+            }
+            emit_out_part(e, token);
+            buffer_printf(&e->out, "    putchar('\\n');\n");
+            break;
         }
+        default:
+            emit_unsupported(in, line);
     }
-    
-    call_stack[call_stack_top] = current_line;
-    
-    // Debug stack info
-    debug_stack[call_stack_top].line_num = current_line;
-    strncpy(debug_stack[call_stack_top].func_name, "Global/Previous", MAX_NAME);
-    
-    call_stack_top++;
-    in_function++;
-    has_return = 0;
-    current_line = fn->start_line;
 }
 
-void cmd_ret(const char* args) {
-    if (strlen(args) > 0) { return_value = evaluate_expr(args); has_return = 1; }
-    if (call_stack_top > 0) { current_line = call_stack[--call_stack_top]; in_function--; }
-}
-
-void cmd_class(const char* args) {
-    char name[MAX_NAME];
-    sscanf(args, "%127s", name);
-    
-    ECClass* cls = &classes[class_count];
-    strncpy(cls->name, name, MAX_NAME - 1);
-    cls->start_line = current_line;
-    cls->member_count = 0;
-    cls->method_count = 0;
+void emit_program(CEmitter* e, int* loops) {
+    // Names EC, ARR, CALL results and FN parameters can create
+    for (int i = 0; i < ctx->line_count; i++) {
+        char name[MAX_NAME];
+        ECOpcode op = (ECOpcode)ctx->code[i].base;
+        if ((op == OP_EC || op == OP_ARR) && sscanf(instr_args(&ctx->code[i]), "%127s", name) == 1) emit_name(e, name);
+        if (op == OP_CALL && call_result_name(instr_args(&ctx->code[i]), name)) emit_name(e, name);
+        if (op == OP_FN && ctx->code[i].jump < i) fatal_error("Error: --emit-c: malformed FN (line %d)\n", i + 1);
+    }
+    for (int f = 0; f < ctx->func_count; f++) {
+        for (int p = 0; p < ctx->funcs[f].param_count; p++) emit_name(e, ctx->funcs[f].params[p]);
+    }
     
-    int depth = 1, end = current_line + 1;
-    while (end < line_count && depth > 0) {
-        char temp[MAX_LINE]; strcpy(temp, lines[end]); trim(temp);
-        char cmd[MAX_NAME];
-        if (sscanf(temp, "%127s", cmd) == 1) {
-            if (strcasecmp(cmd, "CLASS") == 0) depth++;
-            else if (strcasecmp(cmd, "ENDCLASS") == 0) depth--;
+    int loop_top = 0, fn_loops = -1, fn_end = -1;
+    for (int i = 0; i < ctx->line_count; i++) {
+        if (ctx->code[i].base == OP_FN) {
+            // Loops of the caller are not visible in a FN body
+            if (fn_end >= 0) fatal_error("Error: --emit-c does not support FN inside FN (line %d)\n", i + 1);
+            fn_end = ctx->code[i].jump;
+            fn_loops = loop_top;
         }
-        end++;
+        emit_line(e, i, loops, &loop_top, fn_loops < 0 ? 0 : fn_loops);
+        if (i == fn_end) { fn_end = -1; fn_loops = -1; }
     }
-    if (depth > 0) runtime_error("Missing ENDCLASS for CLASS %s", name);
-    cls->end_line = end - 1;
-    class_count++;
-    current_line = cls->end_line;
 }
 
-void cmd_new(const char* args) {
-    char var_name[MAX_NAME], class_name[MAX_NAME];
-    if (sscanf(args, "%127s %127s", var_name, class_name) < 2) {
-        runtime_error("NEW requires variable and class name");
+// Write the loaded program as C source (see the section comment)
+void emit_c(const char* filename) {
+    if (!ctx->code) fatal_error("Error: No program loaded\n");
+    compile_all_blocks();
+    CEmitter e;
+    memset(&e, 0, sizeof(e));
+    int* loops = (int*)malloc((ctx->line_count + 1) * sizeof(int));
+    if (!loops) fatal_error("Error: Out of memory emitting C\n");
+    
+    // A rejected line frees the partial output before the error propagates
+    jmp_buf jmp;
+    jmp_buf* prev = ctx->error_jmp;
+    ctx->error_jmp = &jmp;
+    int failed = setjmp(jmp);
+    if (!failed) emit_program(&e, loops);
+    ctx->error_jmp = prev;
+    free(loops);
+    if (failed) {
+        buffer_free(&e.out);
+        free(e.names);
+        raise_error();
     }
-    int cls_idx = find_class(class_name);
-    if (cls_idx < 0) {
-        runtime_error("Class '%s' not found", class_name);
+    
+    ECBuffer file;
+    memset(&file, 0, sizeof(file));
+    buffer_printf(&file, "/* Generated by EC --emit-c. Build: gcc -O2 -o program program.c -lm */\n\n");
+    emit_lines(&file, emit_c_head);
+    buffer_printf(&file, "\nstatic const char* const ec_source[] = {\n");
+    for (int i = 0; i < ctx->line_count; i++) {
+        char temp[MAX_LINE];
+        strcpy(temp, ctx->lines[i]);
+        trim(temp);
+        buffer_printf(&file, "    ");
+        emit_cstr(&file, temp);
+        buffer_printf(&file, ",\n");
     }
-    ECVar* v = get_or_create_var(var_name);
-    v->type = TYPE_OBJECT;
-    v->obj_class_id = cls_idx;
+    buffer_printf(&file, "    \"\"\n};\n\n");
+    emit_lines(&file, emit_c_runtime);
+    if (e.name_count) buffer_printf(&file, "static ECVar ec_vars[%d];\n\n", e.name_count);
+    buffer_printf(&file, "int main(void) {\n    ECNum t[%d];\n    int ec_cond;\n    double* ec_slot;\n", e.temps ? e.temps : 1);
+    buffer_printf(&file, "    const char* ec_text[2];\n    char ec_digits[2][32];\n");
+    buffer_printf(&file, "    (void)t; (void)ec_cond; (void)ec_slot; (void)ec_text; (void)ec_digits; (void)ec_return_value;\n\n");
+    buffer_append(&file, e.out.data, e.out.len);
+    buffer_printf(&file, "L%d:;\n    goto ec_end;\n\nec_return:\n    switch (ec_stack[--ec_top]) {\n", ctx->line_count);
+    for (int i = 0; i < ctx->line_count; i++) {
+        if (ctx->code[i].base != OP_CALL) continue;
+        char result[MAX_NAME];
+        if (call_result_name(instr_args(&ctx->code[i]), result)) buffer_printf(&file, "        case %d: goto R%d;\n", i, i);
+        else buffer_printf(&file, "        case %d: goto L%d;\n", i, i + 1);
+    }
+    buffer_printf(&file, "    }\nec_end:\n    fflush(stdout);\n    return 0;\n}\n");
+    buffer_free(&e.out);
+    free(e.names);
+    
+    FILE* f = fopen(filename, "wb");
+    if (!f) { buffer_free(&file); fatal_error("Error: Cannot write '%s'\n", filename); }
+    int ok = fwrite(file.data, 1, file.len, f) == file.len;
+    ok = (fclose(f) == 0) && ok;
+    buffer_free(&file);
+    if (!ok) fatal_error("Error: Cannot write '%s'\n", filename);
 }
 
-void cmd_add(const char* args) {
-    char dest[MAX_NAME], rest[MAX_LINE];
-    if (sscanf(args, "%127s %[^\n]", dest, rest) < 2) runtime_error("ADD requires variable and value");
-    ECVar* v = get_var_checked(dest);
-    v->num_val += evaluate_expr(rest);
-    v->type = TYPE_NUMBER;
-}
+// ============ Embedding API ============
 
-void cmd_sub(const char* args) {
-    char dest[MAX_NAME], rest[MAX_LINE];
-    if (sscanf(args, "%127s %[^\n]", dest, rest) < 2) runtime_error("SUB requires variable and value");
-    ECVar* v = get_var_checked(dest);
-    v->num_val -= evaluate_expr(rest);
-    v->type = TYPE_NUMBER;
+// Bind `c` to the calling thread for the duration of an API call
+ECContext* enter_context(ECContext* c, jmp_buf* jmp) {
+    ECContext* prev = ctx;
+    ctx = c;
+    c->error_jmp = jmp;
+    buffer_clear(&c->error);
+    return prev;
 }
 
-void cmd_mul(const char* args) {
-    char dest[MAX_NAME], rest[MAX_LINE];
-    if (sscanf(args, "%127s %[^\n]", dest, rest) < 2) runtime_error("MUL requires variable and value");
-    ECVar* v = get_var_checked(dest);
-    v->num_val *= evaluate_expr(rest);
-    v->type = TYPE_NUMBER;
+void leave_context(ECContext* c, ECContext* prev) {
+    c->error_jmp = NULL;
+    ctx = prev;
 }
 
-void cmd_div(const char* args) {
-    char dest[MAX_NAME], rest[MAX_LINE];
-    if (sscanf(args, "%127s %[^\n]", dest, rest) < 2) runtime_error("DIV requires variable and value");
-    double divisor = evaluate_expr(rest);
-    if (divisor == 0) runtime_error("Division by zero");
-    ECVar* v = get_var_checked(dest);
-    v->num_val /= divisor;
-    v->type = TYPE_NUMBER;
-}
+// Every entry point catches runtime errors here and returns EC_ERROR
+#define EC_API_ENTER(c) \
+    jmp_buf jmp; \
+    ECContext* prev = enter_context((c), &jmp); \
+    if (setjmp(jmp)) { leave_context((c), prev); return EC_ERROR; }
 
-void cmd_mod(const char* args) {
-    char dest[MAX_NAME], rest[MAX_LINE];
-    if (sscanf(args, "%127s %[^\n]", dest, rest) < 2) runtime_error("MOD requires variable and value");
-    ECVar* v = get_var_checked(dest);
-    v->num_val = fmod(v->num_val, evaluate_expr(rest));
-    v->type = TYPE_NUMBER;
+#define EC_API_LEAVE(c) leave_context((c), prev)
+
+// Drop any stacks left behind by a call that ended in an error
+void reset_execution(void) {
+    while (ctx->exec_stream_top > 0) exec_stream_close();
+    while (ctx->foreach_top > 0) foreach_close();
+    ctx->call_stack_top = 0;
+    ctx->loop_depth = 0;
+    ctx->in_function = 0;
+    ctx->running = 1;
 }
 
-// ============ External Execution ============
+ECContext* ec_new(void) {
+    return context_create(NULL);
+}
 
-void cmd_exec(const char* args) {
-    // EXEC "command" [result_var]
-    char command[MAX_LINE] = "", result_var[MAX_NAME] = "";
+void ec_free(ECContext* c) {
+    if (!c) return;
+    jmp_buf jmp;
+    ECContext* prev = enter_context(c, &jmp);
     
-    if (args[0] == '"') {
-        char* end = strchr(args + 1, '"');
-        if (end) {
-            int len = end - args - 1;
-            strncpy(command, args + 1, len);
-            command[len] = '\0';
-            
-            char* rest = end + 1;
-            while (*rest && isspace(*rest)) rest++;
-            if (*rest) sscanf(rest, "%127s", result_var);
+    if (c->jobs && setjmp(jmp) == 0) {
+        for (int i = 0; i < c->job_count; i++) {
+            if (c->jobs[i].state == JOB_FREE) continue;
+            job_wait(&c->jobs[i]);
+            if (c->jobs[i].temp_exe[0]) remove(c->jobs[i].temp_exe);
         }
-    } else {
-        sscanf(args, "%[^\n]", command);
     }
-    
-    last_exec_output[0] = '\0';
-    FILE* fp = popen(command, "r");
-    if (fp) {
-        char line[MAX_LINE];
-        while (fgets(line, MAX_LINE, fp)) {
-            if (strlen(last_exec_output) + strlen(line) < sizeof(last_exec_output) - 1)
-                strcat(last_exec_output, line);
+    if (c->jobs) {
+        for (int i = 0; i < c->job_count; i++) {
+            buffer_free(&c->jobs[i].output);
+            free(c->jobs[i].command);
         }
-        pclose(fp);
-        
-        // Remove trailing newline
-        int len = strlen(last_exec_output);
-        if (len > 0 && last_exec_output[len-1] == '\n') last_exec_output[len-1] = '\0';
+        free(c->jobs);
     }
-    
-    if (strlen(result_var) > 0) {
-        ECVar* v = get_or_create_var(result_var);
-        v->type = TYPE_STRING;
-        strcpy(v->str_val, last_exec_output);
-    }
-}
-
-void cmd_pyrun(const char* args) {
-    // PYRUN "script.py" [func_name] [args...] [result_var]
-    char script[MAX_LINE] = "", func[MAX_NAME] = "", py_args[MAX_LINE] = "", result_var[MAX_NAME] = "";
-    
-    char* ptr = (char*)args;
-    while (*ptr && isspace(*ptr)) ptr++;
-    
-    if (*ptr == '"') {
-        char* end = strchr(ptr + 1, '"');
-        if (end) {
-            int len = end - ptr - 1;
-            strncpy(script, ptr + 1, len);
-            script[len] = '\0';
-            ptr = end + 1;
+    while (c->exec_stream_top > 0) exec_stream_close();
+    while (c->foreach_top > 0) foreach_close();
+    if (c->files) {
+        for (int i = 0; i < MAX_FILES; i++) {
+            if (c->files[i].io.fp) reader_close(&c->files[i].io);
         }
+        free(c->files);
     }
     
-    while (*ptr && isspace(*ptr)) ptr++;
-    
-    // Parse remaining: func(args) result_var  OR just result_var
-    char* paren = strchr(ptr, '(');
-    if (paren) {
-        int len = paren - ptr;
-        strncpy(func, ptr, len);
-        func[len] = '\0';
-        trim(func);
-        
-        char* end_paren = strchr(paren, ')');
-        if (end_paren) {
-            int arg_len = end_paren - paren - 1;
-            strncpy(py_args, paren + 1, arg_len);
-            py_args[arg_len] = '\0';
-            
-            ptr = end_paren + 1;
-            while (*ptr && isspace(*ptr)) ptr++;
-            if (*ptr) sscanf(ptr, "%127s", result_var);
+    free_program();
+    free(c->modules);
+    for (int i = 0; i < c->array_count; i++) {
+        free(c->arrays[i].num_data);
+        if (c->arrays[i].str_data) {
+            for (int j = 0; j < c->arrays[i].size; j++) free(c->arrays[i].str_data[j]);
+            free(c->arrays[i].str_data);
         }
-    } else if (*ptr) {
-        sscanf(ptr, "%127s", result_var);
-    }
-    
-    char command[MAX_LINE * 2];
-    if (strlen(func) > 0) {
-        sprintf(command, "python -c \"import sys; sys.path.insert(0, '.'); from %.*s import %s; print(%s(%s))\"",
-                (int)(strrchr(script, '.') ? strrchr(script, '.') - script : strlen(script)),
-                script, func, func, py_args);
-    } else {
-        sprintf(command, "python \"%s\"", script);
     }
-    
-    last_exec_output[0] = '\0';
-    FILE* fp = popen(command, "r");
-    if (fp) {
-        char line[MAX_LINE];
-        while (fgets(line, MAX_LINE, fp)) {
-            if (strlen(last_exec_output) + strlen(line) < sizeof(last_exec_output) - 1)
-                strcat(last_exec_output, line);
-        }
-        pclose(fp);
-        int len = strlen(last_exec_output);
-        if (len > 0 && last_exec_output[len-1] == '\n') last_exec_output[len-1] = '\0';
+    free(c->arrays);
+    free(c->funcs);
+    free(c->classes);
+    free(c->memos);
+    if (c->memo_keys) {
+        for (int i = 0; i < MAX_STACK; i++) buffer_free(&c->memo_keys[i]);
+        free(c->memo_keys);
     }
+    profile_free(c->profile);
+    watch_stop();
     
-    if (strlen(result_var) > 0) {
-        ECVar* v = get_or_create_var(result_var);
-        if (is_number(last_exec_output)) {
-            v->type = TYPE_NUMBER;
-            v->num_val = atof(last_exec_output);
-        } else {
-            v->type = TYPE_STRING;
-            strcpy(v->str_val, last_exec_output);
-        }
-    }
+    leave_context(c, prev);
+    context_free_locals(c);
+    free(c);
 }
 
-void cmd_crun(const char* args) {
-    // CRUN "source.c" [result_var]
-    // Compiles and runs C source, captures output
-    char source[MAX_LINE] = "", result_var[MAX_NAME] = "";
+int ec_load(ECContext* c, const char* filename) {
+    EC_API_ENTER(c);
+    load_file(filename);
+    prepare_program();
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_load_string(ECContext* c, const char* source) {
+    EC_API_ENTER(c);
+    load_source(source);
+    prepare_program();
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_compile(ECContext* c, const char* filename) {
+    EC_API_ENTER(c);
+    write_image(filename);
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_reload(ECContext* c, const char* filename) {
+    EC_API_ENTER(c);
+    reload_file(filename, NULL);
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_watch(ECContext* c, const char* filename) {
+    EC_API_ENTER(c);
+    if (filename) watch_start(filename);
+    else watch_stop();
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_emit_c(ECContext* c, const char* filename) {
+    EC_API_ENTER(c);
+    emit_c(filename);
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_eval(ECContext* c, const char* source) {
+    EC_API_ENTER(c);
+    int from = append_source(source);
+    reset_execution();
+    run_program(from);
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_run(ECContext* c) {
+    EC_API_ENTER(c);
+    reset_execution();
+    run_program(0);
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_call(ECContext* c, const char* name, const char* args, double* result) {
+    EC_API_ENTER(c);
+    reset_execution();
     
-    char* ptr = (char*)args;
-    while (*ptr && isspace(*ptr)) ptr++;
+    if (c->watch && __atomic_load_n(&c->watch->changed, __ATOMIC_ACQUIRE)) watch_poll();
+    int fn_idx = find_func(name);
+    if (fn_idx < 0) fatal_error("Error: Function '%s' not found\n", name);
     
-    if (*ptr == '"') {
-        char* end = strchr(ptr + 1, '"');
-        if (end) {
-            int len = end - ptr - 1;
-            strncpy(source, ptr + 1, len);
-            source[len] = '\0';
-            ptr = end + 1;
-        }
+    // Run the body until the call returns (RET or ENDFN pops back to the FN line)
+    ECFunc* fn = &c->funcs[fn_idx];
+    c->current_line = fn->start_line;
+    c->return_value = num_int(0);
+    call_function(fn, args ? args : "");
+    for (c->current_line++; c->running && c->call_stack_top > 0 && c->current_line < c->line_count; c->current_line++) {
+        execute_line();
     }
+    if (result) *result = c->has_return ? num_value(c->return_value) : 0;
     
-    while (*ptr && isspace(*ptr)) ptr++;
-    if (*ptr) sscanf(ptr, "%127s", result_var);
-    
-    char command[MAX_LINE * 2];
-    #ifdef _WIN32
-        char temp_exe[] = "__ec_temp.exe";
-        sprintf(command, "gcc -o %s \"%s\" -lm 2>&1 && %s", temp_exe, source, temp_exe);
-    #else
-        char temp_exe[] = "./__ec_temp";
-        sprintf(command, "gcc -o %s \"%s\" -lm 2>&1 && %s", temp_exe, source, temp_exe);
-    #endif
-    
-    last_exec_output[0] = '\0';
-    FILE* fp = popen(command, "r");
-    if (fp) {
-        char line[MAX_LINE];
-        while (fgets(line, MAX_LINE, fp)) {
-            if (strlen(last_exec_output) + strlen(line) < sizeof(last_exec_output) - 1)
-                strcat(last_exec_output, line);
-        }
-        pclose(fp);
-        int len = strlen(last_exec_output);
-        if (len > 0 && last_exec_output[len-1] == '\n') last_exec_output[len-1] = '\0';
-    }
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_set_number(ECContext* c, const char* name, double value) {
+    EC_API_ENTER(c);
+    ECVar* v = get_or_create_var(name);
+    var_set_num(v, num_double(value));
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_set_string(ECContext* c, const char* name, const char* value) {
+    EC_API_ENTER(c);
+    set_var_string(get_or_create_var(name), value, strlen(value));
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_get_number(ECContext* c, const char* name, double* value) {
+    EC_API_ENTER(c);
+    ECVar* v = find_var(name);
+    if (!v) fatal_error("Error: Undefined variable '%s'\n", name);
+    *value = v->type == TYPE_STRING ? atof(v->str_val) : num_value(v->num);
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+// The returned string stays valid until the next API call on this context
+int ec_get_string(ECContext* c, const char* name, const char** value) {
+    EC_API_ENTER(c);
+    if (!find_var(name)) fatal_error("Error: Undefined variable '%s'\n", name);
+    char buf[MAX_LINE];
+    const char* str = get_string_value(name, buf);
+    buffer_clear(&c->scratch);
+    buffer_append(&c->scratch, str, strlen(str));
+    *value = c->scratch.data;
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+const char* ec_error(ECContext* c) {
+    return c->error.data ? c->error.data : "";
+}
+
+int ec_jit(ECContext* c, int enable) {
+    EC_API_ENTER(c);
+    jit_reset();
+    c->jit_disabled = !enable;
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_profile(ECContext* c, int enable) {
+    EC_API_ENTER(c);
+    profile_free(c->profile);
+    c->profile = NULL;
+    if (enable) c->profile = profile_create();
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+int ec_profile_write(ECContext* c, const char* report_path, const char* folded_path) {
+    EC_API_ENTER(c);
+    if (!c->profile) fatal_error("Error: Profiling is not enabled\n");
     
-    // Cleanup temp file
-    #ifdef _WIN32
-        remove("__ec_temp.exe");
-    #else
-        remove("./__ec_temp");
-    #endif
+    FILE* report = report_path ? fopen(report_path, "w") : stderr;
+    if (!report) fatal_error("Error: Cannot write profile '%s'\n", report_path);
+    profile_report(report, 20);
+    if (report != stderr) fclose(report);
     
-    if (strlen(result_var) > 0) {
-        ECVar* v = get_or_create_var(result_var);
-        if (is_number(last_exec_output)) {
-            v->type = TYPE_NUMBER;
-            v->num_val = atof(last_exec_output);
-        } else {
-            v->type = TYPE_STRING;
-            strcpy(v->str_val, last_exec_output);
-        }
+    if (folded_path) {
+        FILE* folded = fopen(folded_path, "w");
+        if (!folded) fatal_error("Error: Cannot write profile '%s'\n", folded_path);
+        profile_write_folded(folded);
+        fclose(folded);
     }
+    EC_API_LEAVE(c);
+    return EC_OK;
 }
 
-// ============ Control Flow Helpers ============
+// ============ REPL ============
 
-void skip_to_endif(void) {
-    int depth = 1;
-    while (current_line < line_count - 1 && depth > 0) {
-        current_line++;
-        char temp[MAX_LINE]; strcpy(temp, lines[current_line]); trim(temp);
-        char cmd[MAX_NAME];
-        if (sscanf(temp, "%127s", cmd) == 1) {
-            if (strcasecmp(cmd, "IF") == 0) depth++;
-            else if (strcasecmp(cmd, "ENDIF") == 0) depth--;
-        }
-    }
-}
-
-void skip_to_else_or_elif_or_endif(void) {
-    int depth = 1;
-    while (current_line < line_count - 1 && depth > 0) {
-        current_line++;
-        char temp[MAX_LINE]; strcpy(temp, lines[current_line]); trim(temp);
-        char cmd[MAX_NAME], rest[MAX_LINE] = "";
-        if (sscanf(temp, "%127s %[^\n]", cmd, rest) >= 1) {
-            if (strcasecmp(cmd, "IF") == 0) depth++;
-            else if (strcasecmp(cmd, "ENDIF") == 0) depth--;
-            else if (depth == 1) {
-                if (strcasecmp(cmd, "ELSE") == 0) return;
-                else if (strcasecmp(cmd, "ELIF") == 0) {
-                    if (evaluate_condition(rest)) return;
-                }
-            }
-        }
-    }
-}
+// Interactive prompt. Each entry (a line, or a whole block once it is
+// closed) is compiled after everything entered so far and run at once, so
+// variables, arrays, functions and classes carry over between entries.
 
-// ============ Main Execution ============
+#define TIME_MIN_NS 200000000LL     // :time grows its batch until one takes this long
 
-void execute_line(const char* line) {
-    char buf[MAX_LINE];
+// How much a line opens (+1) or closes (-1) blocks, counted like validate_syntax
+int block_change(const char* line) {
+    char buf[MAX_LINE], cmd[MAX_NAME] = "", args[MAX_LINE] = "";
+    char command[MAX_LINE], var_name[MAX_NAME];
     strncpy(buf, line, MAX_LINE - 1);
     buf[MAX_LINE - 1] = '\0';
     trim(buf);
-    
-    if (strlen(buf) == 0 || buf[0] == '#' || (buf[0] == '/' && buf[1] == '/')) return;
-    
-    char cmd[MAX_NAME], args[MAX_LINE] = "";
     sscanf(buf, "%127s %[^\n]", cmd, args);
-    trim(args);
-    
-    if (strcasecmp(cmd, "EC") == 0) cmd_ec(args);
-    else if (strcasecmp(cmd, "SET") == 0) cmd_set(args);
-    else if (strcasecmp(cmd, "ARR") == 0) cmd_arr(args);
-    else if (strcasecmp(cmd, "OUT") == 0) cmd_out(args);
-    else if (strcasecmp(cmd, "IN") == 0) cmd_in(args);
-    else if (strcasecmp(cmd, "IF") == 0) cmd_if(args);
-    else if (strcasecmp(cmd, "ELIF") == 0) cmd_elif(args);
-    else if (strcasecmp(cmd, "ELSE") == 0) cmd_else(args);
-    else if (strcasecmp(cmd, "ENDIF") == 0) { }
-    else if (strcasecmp(cmd, "LOOP") == 0) cmd_loop(args);
-    else if (strcasecmp(cmd, "ENDLOOP") == 0) cmd_endloop(args);
-    else if (strcasecmp(cmd, "BREAK") == 0) cmd_break(args);
-    else if (strcasecmp(cmd, "CONTINUE") == 0) cmd_continue(args);
-    else if (strcasecmp(cmd, "FN") == 0) cmd_fn(args);
-    else if (strcasecmp(cmd, "ENDFN") == 0) {
-        if (call_stack_top > 0) { current_line = call_stack[--call_stack_top]; in_function--; }
-    }
-    else if (strcasecmp(cmd, "CALL") == 0) cmd_call(args);
-    else if (strcasecmp(cmd, "RET") == 0) cmd_ret(args);
-    else if (strcasecmp(cmd, "CLASS") == 0) cmd_class(args);
-    else if (strcasecmp(cmd, "ENDCLASS") == 0) { }
-    else if (strcasecmp(cmd, "NEW") == 0) cmd_new(args);
-    else if (strcasecmp(cmd, "ADD") == 0) cmd_add(args);
-    else if (strcasecmp(cmd, "SUB") == 0) cmd_sub(args);
-    else if (strcasecmp(cmd, "MUL") == 0) cmd_mul(args);
-    else if (strcasecmp(cmd, "DIV") == 0) cmd_div(args);
-    else if (strcasecmp(cmd, "MOD") == 0) cmd_mod(args);
-    else if (strcasecmp(cmd, "EXEC") == 0) cmd_exec(args);
-    else if (strcasecmp(cmd, "PYRUN") == 0) cmd_pyrun(args);
-    else if (strcasecmp(cmd, "CRUN") == 0) cmd_crun(args);
-    else if (strcasecmp(cmd, "END") == 0) running = 0;
-    else runtime_error("Unknown command '%s'", cmd);
-}
-
-int load_file(const char* filename) {
-    FILE* f = fopen(filename, "r");
-    if (!f) { fprintf(stderr, "Error: Cannot open file '%s'\n", filename); return 0; }
-    
-    char buf[MAX_LINE];
-    int count = 0;
-    while (fgets(buf, MAX_LINE, f)) count++;
-    rewind(f);
-    
-    lines = (char**)malloc(count * sizeof(char*));
-    line_count = 0;
-    
-    while (fgets(buf, MAX_LINE, f)) {
-        buf[strcspn(buf, "\r\n")] = '\0';
-        lines[line_count] = (char*)malloc(strlen(buf) + 1);
-        strcpy(lines[line_count], buf);
-        line_count++;
+    switch (lookup_opcode(cmd)) {
+        case OP_IF: case OP_LOOP: case OP_FN: case OP_CLASS: case OP_PARLOOP: case OP_FOREACH: case OP_MATCH:
+            return 1;
+        case OP_ENDIF: case OP_ENDLOOP: case OP_ENDFN: case OP_ENDCLASS: case OP_ENDPARLOOP: case OP_ENDEXEC:
+        case OP_ENDFOREACH: case OP_ENDMATCH:
+            return -1;
+        case OP_EXEC:
+            trim(args);
+            return parse_exec_args(args, command, var_name) ? 1 : 0;
+        default:
+            return 0;
     }
-    fclose(f);
-    return 1;
 }
 
-void cleanup(void) {
-    for (int i = 0; i < line_count; i++) free(lines[i]);
-    free(lines);
-    for (int i = 0; i < array_count; i++) {
-        free(arrays[i].num_data);
-        if (arrays[i].str_data) {
-            for (int j = 0; j < arrays[i].size; j++) free(arrays[i].str_data[j]);
-            free(arrays[i].str_data);
+void print_duration(double ns) {
+    if (ns < 1e3) printf("%.1f ns", ns);
+    else if (ns < 1e6) printf("%.3f us", ns / 1e3);
+    else if (ns < 1e9) printf("%.3f ms", ns / 1e6);
+    else printf("%.3f s", ns / 1e9);
+}
+
+// :time [runs] statement: compile once, then run it `runs` times, or in
+// batches of 1, 10, 100, ... until a batch takes TIME_MIN_NS
+int repl_time(ECContext* c, const char* source, long runs) {
+    EC_API_ENTER(c);
+    int from = append_source(source);
+    long count = runs > 0 ? runs : 1;
+    long long elapsed;
+    for (;;) {
+        long long start = now_ns();
+        for (long i = 0; i < count; i++) {
+            reset_execution();
+            run_program(from);
+        }
+        elapsed = now_ns() - start;
+        if (runs > 0 || elapsed >= TIME_MIN_NS || count >= 1000000000L) break;
+        count *= 10;
+    }
+    fflush(stdout);
+    printf("%ld run%s, ", count, count == 1 ? "" : "s");
+    print_duration((double)elapsed / count);
+    printf(" per run\n");
+    EC_API_LEAVE(c);
+    return EC_OK;
+}
+
+void print_repl_help(void) {
+    printf("Enter EC statements; blocks run once their END line is entered.\n");
+    printf("  :time [runs] <statement>  Run a statement (or block) repeatedly and report the time per run\n");
+    printf("  :help                     Show this help\n");
+    printf("  :quit                     Leave (end of input works too)\n");
+}
+
+// Read-eval-print loop on stdin; returns the process exit status
+int repl(ECContext* c) {
+    int interactive = isatty(fileno(stdin));
+    if (interactive) printf("EC Language Interpreter v1.2.0 (:help for commands)\n");
+    
+    ECBuffer line, entry;
+    memset(&line, 0, sizeof(line));
+    memset(&entry, 0, sizeof(entry));
+    int depth = 0, timing = 0;
+    long runs = 0;
+    
+    for (;;) {
+        if (interactive) { printf(depth > 0 ? "...  " : "ec> "); fflush(stdout); }
+        if (!read_line(stdin, &line)) break;
+        const char* text = line.data ? line.data : "";
+        char buf[MAX_LINE];
+        
+        if (depth == 0) {
+            strncpy(buf, text, MAX_LINE - 1);
+            buf[MAX_LINE - 1] = '\0';
+            trim(buf);
+            if (buf[0] == '\0') continue;
+            if (buf[0] == ':') {
+                char cmd[MAX_NAME] = "";
+                int used = 0;
+                sscanf(buf, "%127s%n", cmd, &used);
+                if (strcmp(cmd, ":quit") == 0 || strcmp(cmd, ":q") == 0) break;
+                if (strcmp(cmd, ":help") == 0) { print_repl_help(); continue; }
+                if (strcmp(cmd, ":time") != 0) { printf("Unknown command '%s' (:help lists them)\n", cmd); continue; }
+                
+                const char* rest = buf + used;
+                char* end;
+                runs = strtol(rest, &end, 10);
+                if (end != rest && runs > 0 && (*end == ' ' || *end == '\t')) rest = end;
+                else runs = 0;
+                while (*rest == ' ' || *rest == '\t') rest++;
+                if (!*rest) { printf("Usage: :time [runs] <statement>\n"); continue; }
+                timing = 1;
+                text = rest;
+            }
         }
+        
+        buffer_append(&entry, text, strlen(text));
+        buffer_append(&entry, "\n", 1);
+        depth += block_change(text);
+        if (depth > 0) continue;
+        
+        int status = timing ? repl_time(c, entry.data, runs) : ec_eval(c, entry.data);
+        if (status != EC_OK) { fflush(stdout); fputs(ec_error(c), stderr); }
+        buffer_clear(&entry);
+        depth = timing = 0;
     }
+    if (interactive) printf("\n");
+    buffer_free(&line);
+    buffer_free(&entry);
+    return 0;
 }
 
+// ============ Command Line ============
+
 void print_help(void) {
     printf("EC Language Interpreter v1.2.0\n");
-    printf("Usage: EC <filename.ec>\n\n");
+    printf("Usage: EC [options] <filename.ec>\n");
+    printf("       EC [-i]  (interactive prompt)\n\n");
     printf("Options:\n");
     printf("  -h, --help     Show this help message\n");
     printf("  -v, --version  Show version information\n");
+    printf("  -i             Continue at the interactive prompt after running\n");
+    printf("  --compile      Write a precompiled image instead of running\n");
+    printf("                 (EC --compile app.ec [-o app.ecb]; run it with EC app.ecb)\n");
+    printf("  --emit-c       Translate to a standalone C file instead of running\n");
+    printf("                 (EC --emit-c app.ec [-o app.c]; -o app also builds it with gcc)\n");
+    printf("  --profile      Report per-line and per-FN time on stderr and\n");
+    printf("                 write collapsed stacks to <filename.ec>.folded\n");
+    printf("  --watch        Reload changed FN/CLASS blocks while the program runs,\n");
+    printf("                 keeping its variables\n");
+    printf("  --no-jit       Interpret hot loops instead of compiling them to\n");
+    printf("                 native code (x86-64 Linux)\n");
 }
 
 void print_version(void) {
@@ -1135,69 +8839,93 @@ void print_version(void) {
     printf("Features: OOP, Arrays, External Exec, Syntax Validation, Stack Trace\n");
 }
 
+#ifndef EC_LIBRARY
+
 int main(int argc, char* argv[]) {
-    if (argc < 2) { print_help(); return 1; }
-    if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) { print_help(); return 0; }
-    if (strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-v") == 0) { print_version(); return 0; }
+    const char* filename = NULL;
+    const char* output = NULL;
+    int profile = 0, compile = 0, emit = 0, watch = 0, interactive = 0, jit = 1;
     
-    if (!load_file(argv[1])) return 1;
-
-    // Phase 0: Static Syntax Analysis
-    validate_syntax();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+        if (strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "-v") == 0) { print_version(); return 0; }
+        if (strcmp(argv[i], "--profile") == 0) profile = 1;
+        else if (strcmp(argv[i], "--compile") == 0) compile = 1;
+        else if (strcmp(argv[i], "--emit-c") == 0) emit = 1;
+        else if (strcmp(argv[i], "--watch") == 0) watch = 1;
+        else if (strcmp(argv[i], "-i") == 0) interactive = 1;
+        else if (strcmp(argv[i], "--no-jit") == 0) jit = 0;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+        else if (argv[i][0] == '-' && argv[i][1]) { fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]); return 1; }
+        else if (!filename) filename = argv[i];
+    }
+    if (!filename && (compile || emit)) { print_help(); return 1; }
     
-    // Phase 1: Register functions and classes
-    for (current_line = 0; current_line < line_count && running; current_line++) {
-        char buf[MAX_LINE]; strcpy(buf, lines[current_line]); trim(buf);
-        char cmd[MAX_NAME];
-        if (sscanf(buf, "%127s", cmd) == 1) {
-            if (strcasecmp(cmd, "FN") == 0 || strcasecmp(cmd, "CLASS") == 0)
-                execute_line(lines[current_line]);
-        }
+    ECContext* ec = ec_new();
+    if (!ec) { fprintf(stderr, "Fatal: Out of memory\n"); return 1; }
+    
+    if (!filename) {
+        int status = jit ? EC_OK : ec_jit(ec, 0);
+        if (status == EC_OK) status = repl(ec);
+        ec_free(ec);
+        return status;
     }
     
-    running = 1;
+    if (compile) {
+        char image[MAX_LINE];
+        if (!output) {
+            // app.ec -> app.ecb
+            size_t len = strlen(filename);
+            if (len > 3 && strcasecmp(filename + len - 3, ".ec") == 0) snprintf(image, sizeof(image), "%sb", filename);
+            else snprintf(image, sizeof(image), "%s.ecb", filename);
+            output = image;
+        }
+        int status = ec_load(ec, filename);
+        if (status == EC_OK) status = ec_compile(ec, output);
+        if (status != EC_OK) fputs(ec_error(ec), stderr);
+        ec_free(ec);
+        return status == EC_OK ? 0 : 1;
+    }
     
-    // Phase 2: Execute
-    for (current_line = 0; current_line < line_count && running; current_line++) {
-        char buf[MAX_LINE]; strcpy(buf, lines[current_line]); trim(buf);
-        char cmd[MAX_NAME];
-        if (sscanf(buf, "%127s", cmd) == 1) {
-            if (strcasecmp(cmd, "FN") == 0) {
-                // Skip function definition manually
-                int depth = 1;
-                int end = current_line + 1;
-                while (end < line_count && depth > 0) {
-                    char temp[MAX_LINE]; strcpy(temp, lines[end]); trim(temp);
-                    char c[MAX_NAME];
-                    if (sscanf(temp, "%127s", c) == 1) {
-                        if (strcasecmp(c, "FN") == 0) depth++;
-                        else if (strcasecmp(c, "ENDFN") == 0) depth--;
-                    }
-                    end++;
-                }
-                current_line = end - 1;
-            } 
-            else if (strcasecmp(cmd, "CLASS") == 0) {
-                // Skip class definition manually
-                int depth = 1;
-                int end = current_line + 1;
-                while (end < line_count && depth > 0) {
-                    char temp[MAX_LINE]; strcpy(temp, lines[end]); trim(temp);
-                    char c[MAX_NAME];
-                    if (sscanf(temp, "%127s", c) == 1) {
-                        if (strcasecmp(c, "CLASS") == 0) depth++;
-                        else if (strcasecmp(c, "ENDCLASS") == 0) depth--;
-                    }
-                    end++;
-                }
-                current_line = end - 1;
-            } 
-            else {
-                execute_line(lines[current_line]);
-            }
+    if (emit) {
+        // app.ec -> app.c; -o app writes app.c and builds app from it
+        char source[MAX_LINE];
+        const char* exe = NULL;
+        size_t len = strlen(output ? output : filename);
+        if (output && len > 2 && strcasecmp(output + len - 2, ".c") == 0) snprintf(source, sizeof(source), "%s", output);
+        else if (output) { snprintf(source, sizeof(source), "%s.c", output); exe = output; }
+        else if (len > 3 && strcasecmp(filename + len - 3, ".ec") == 0) snprintf(source, sizeof(source), "%.*sc", (int)len - 2, filename);
+        else snprintf(source, sizeof(source), "%s.c", filename);
+        
+        int status = ec_load(ec, filename);
+        if (status == EC_OK) status = ec_emit_c(ec, source);
+        if (status != EC_OK) fputs(ec_error(ec), stderr);
+        ec_free(ec);
+        if (status == EC_OK && exe) {
+            char command[MAX_LINE * 3];
+            snprintf(command, sizeof(command), "gcc -O2 -o \"%s\" \"%s\" -lm", exe, source);
+            if (system(command) != 0) { fprintf(stderr, "Error: Compiling '%s' failed\n", source); return 1; }
         }
+        return status == EC_OK ? 0 : 1;
     }
     
-    cleanup();
-    return 0;
+    int status = profile ? ec_profile(ec, 1) : EC_OK;
+    if (status == EC_OK && !jit) status = ec_jit(ec, 0);
+    if (status == EC_OK) status = ec_load(ec, filename);
+    if (status == EC_OK && watch) status = ec_watch(ec, filename);
+    if (status == EC_OK) status = ec_run(ec);
+    if (status != EC_OK) { fflush(stdout); fputs(ec_error(ec), stderr); }
+    
+    if (profile) {
+        char folded[MAX_LINE];
+        snprintf(folded, sizeof(folded), "%s.folded", filename);
+        fflush(stdout);
+        if (ec_profile_write(ec, NULL, folded) != EC_OK) fputs(ec_error(ec), stderr);
+    }
+    if (interactive) status = repl(ec);
+    
+    ec_free(ec);
+    return status == EC_OK ? 0 : 1;
 }
+
+#endif
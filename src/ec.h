@@ -0,0 +1,95 @@
+/*
+ * EC Language Interpreter - Embedding API
+ *
+ * Link against libec.a or libec.so (see `make lib`). Each ECContext holds a
+ * complete interpreter; different contexts may run concurrently on different
+ * threads. A single context must not be used from two threads at once.
+ *
+ * Every function returning int yields EC_OK or EC_ERROR. After EC_ERROR the
+ * report (the same text the EC binary prints) is available from ec_error().
+ *
+ * Copyright (c) 2026
+ */
+
+#ifndef EC_H
+#define EC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+    #define EC_API __attribute__((visibility("default")))
+#else
+    #define EC_API
+#endif
+
+#define EC_OK 0
+#define EC_ERROR 1
+
+typedef struct ECContext ECContext;
+
+// Create and destroy an interpreter context
+EC_API ECContext* ec_new(void);
+EC_API void ec_free(ECContext* ctx);
+
+// Load a program (syntax check + FN/CLASS registration). Replaces any
+// previously loaded program; variables are kept.
+EC_API int ec_load(ECContext* ctx, const char* filename);
+EC_API int ec_load_string(ECContext* ctx, const char* source);
+
+// Re-read the source file and swap in the FN and CLASS blocks that changed
+// (new ones are added). Variables, arrays, objects and the top-level code
+// are kept; calls in progress finish in the old body.
+EC_API int ec_reload(ECContext* ctx, const char* filename);
+
+// Reload `filename` whenever it changes while ec_run or ec_call execute
+// (checked every 250 ms at most; a failed reload keeps the running code).
+// NULL stops watching.
+EC_API int ec_watch(ECContext* ctx, const char* filename);
+
+// Write the loaded program as a precompiled .ecb image. ec_load() accepts
+// images as well as source and runs them without parsing.
+EC_API int ec_compile(ECContext* ctx, const char* filename);
+
+// Translate the loaded program (variables, arrays, IF, LOOP, FN, OUT) into a
+// standalone C file with the same output and runtime errors
+EC_API int ec_emit_c(ECContext* ctx, const char* filename);
+
+// Run the top-level code of the loaded program
+EC_API int ec_run(ECContext* ctx);
+
+// Compile `source` after the loaded program (or an empty one) and run its
+// top-level statements. FN and CLASS definitions join the tables, replacing
+// ones of the same name; variables carry over between calls.
+EC_API int ec_eval(ECContext* ctx, const char* source);
+
+// Call FN `name` with a comma-separated argument list, e.g. "10, \"x\"".
+// `result` (may be NULL) receives the value passed to RET, or 0.
+EC_API int ec_call(ECContext* ctx, const char* name, const char* args, double* result);
+
+// Read and write global variables
+EC_API int ec_set_number(ECContext* ctx, const char* name, double value);
+EC_API int ec_set_string(ECContext* ctx, const char* name, const char* value);
+EC_API int ec_get_number(ECContext* ctx, const char* name, double* value);
+EC_API int ec_get_string(ECContext* ctx, const char* name, const char** value);
+
+// Report for the last EC_ERROR ("" if none)
+EC_API const char* ec_error(ECContext* ctx);
+
+// Compile hot numeric loops to native code (enable = 1, the default, on
+// x86-64 Linux; elsewhere a no-op) or always interpret them (enable = 0)
+EC_API int ec_jit(ECContext* ctx, int enable);
+
+// Start collecting a fresh profile (enable = 1) or discard it (enable = 0)
+EC_API int ec_profile(ECContext* ctx, int enable);
+
+// Write the hot line / function report (report_path NULL = stderr) and, if
+// folded_path is not NULL, collapsed stacks for flame graph tools
+EC_API int ec_profile_write(ECContext* ctx, const char* report_path, const char* folded_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif